@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <llama.h>
+
+#include "int_types.hpp"
+
+struct BenchResult {
+    std::string name;
+    u64 iterations;
+    double ns_per_op;
+    // named values measured alongside the timing, e.g. token counts
+    std::vector<std::pair<std::string, double>> metrics {};
+};
+
+// Runs `fn` `iterations` times and reports the mean wall time per call
+template <typename F>
+[[nodiscard]] BenchResult run_bench(std::string name, u64 iterations, F&& fn) noexcept {
+    const auto start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < iterations; i++) {
+        fn();
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return BenchResult {
+        .name = std::move(name),
+        .iterations = iterations,
+        .ns_per_op = ns / static_cast<double>(iterations)
+    };
+}
+
+// Keeps the optimizer from discarding a computed value
+template <typename T>
+inline void do_not_optimize(const T& value) noexcept {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Loads only the vocabulary of a model, which is all tokenization needs
+[[nodiscard]] llama_model* load_vocab_model(const std::string& model_path) noexcept;
+
+std::vector<BenchResult> bench_history(const llama_vocab* vocab) noexcept;
+std::vector<BenchResult> bench_prompt(const llama_vocab* vocab) noexcept;
+std::vector<BenchResult> bench_result_encoding(const llama_vocab* vocab) noexcept;
+std::vector<BenchResult> bench_window_table() noexcept;
+std::vector<BenchResult> bench_providers() noexcept;
+// Starts its own mock compositor, so it needs neither a session nor a model
+std::vector<BenchResult> bench_compositor() noexcept;
+std::vector<BenchResult> bench_pipeline(const std::string& model_path) noexcept;
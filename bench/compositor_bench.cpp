@@ -0,0 +1,140 @@
+#include "bench.hpp"
+#include "mock_compositor.hpp"
+#include "synthetic_windows.hpp"
+#include "window_state_provider.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <thread>
+
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr auto STORM_DURATION = std::chrono::seconds(2);
+// how long the provider may take to apply a storm before the run counts as failed
+constexpr auto CATCH_UP_TIMEOUT = std::chrono::seconds(30);
+
+// Resident set of the whole process, the compositor's share included
+double rss_kib() {
+    std::ifstream statm("/proc/self/statm");
+    u64 size = 0;
+    u64 resident = 0;
+    statm >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024.0);
+}
+
+// wl_display_add_socket needs a runtime directory, which headless machines may not have
+bool ensure_runtime_dir() {
+    if (const char* dir = std::getenv("XDG_RUNTIME_DIR"); dir && *dir) {
+        return true;
+    }
+
+    std::string dir = (std::filesystem::temp_directory_path() / "autosktop-bench-XXXXXX").string();
+    if (mkdtemp(dir.data()) == nullptr) {
+        spdlog::error("Could not create a runtime directory for the mock compositor");
+        return false;
+    }
+    return setenv("XDG_RUNTIME_DIR", dir.c_str(), 1) == 0;
+}
+
+}
+
+// WindowStateProvider against the mock compositor: the initial sync of `n_windows`, then a
+// storm of opens, title changes and closes while queries keep coming, reporting how fast the
+// provider applies events, how long it lags behind and how its memory grows
+std::vector<BenchResult> bench_compositor() noexcept {
+    std::vector<BenchResult> results;
+    if (!ensure_runtime_dir()) {
+        return results;
+    }
+
+    for (u32 n_windows : {100u, 10'000u}) {
+        MockCompositor compositor;
+        if (!compositor.start()) {
+            continue;
+        }
+        const std::vector<WindowInfo> windows = make_synthetic_windows(n_windows);
+        compositor.open_windows(windows);
+        compositor.sync();
+
+        setenv("WAYLAND_DISPLAY", compositor.socket_name().c_str(), 1);
+        WindowStateProvider provider;
+        BenchResult init = run_bench(std::format("compositor/initial_sync/{}", n_windows), 1, [&] {
+            if (!provider.init()) {
+                spdlog::error("Provider failed to connect to the mock compositor");
+            }
+        });
+        init.metrics = { { "windows", static_cast<double>(provider.snapshot().size()) } };
+        results.push_back(std::move(init));
+
+        const double rss_before = rss_kib();
+        const MockCompositor::Stats before = compositor.stats();
+        const u64 generation_before = provider.generation();
+
+        compositor.start_storm(MockCompositor::StormOptions {
+            .open_rate = 2'000,
+            .title_rate = 20'000,
+            .close_rate = 2'000,
+            .max_windows = n_windows * 2,
+        });
+
+        // queries keep hitting the cache while the event thread applies the storm
+        const auto storm_start = std::chrono::steady_clock::now();
+        u64 n_queries = 0;
+        BenchResult queries = run_bench(std::format("compositor/query_during_storm/{}", n_windows), 1, [&] {
+            while (std::chrono::steady_clock::now() - storm_start < STORM_DURATION) {
+                const StateRequest request = StateRequest {
+                    .kind = StateProviderKind::WINDOW,
+                    .args = {
+                        { "action", "get_window_state" },
+                        { "params", { { "window_id", windows[n_queries % windows.size()].window_id } } },
+                    },
+                };
+                do_not_optimize(provider.processRequest(request));
+                n_queries++;
+            }
+        });
+        queries.iterations = n_queries;
+        queries.ns_per_op /= std::max<u64>(n_queries, 1);
+        results.push_back(std::move(queries));
+
+        compositor.stop_storm();
+        compositor.sync();
+        const auto storm_end = std::chrono::steady_clock::now();
+
+        // every open and title change ends in a done event, every close in a closed event,
+        // and each of them bumps the provider's generation once
+        const MockCompositor::Stats after = compositor.stats();
+        const u64 n_events = (after.opened - before.opened) + (after.retitled - before.retitled)
+            + (after.closed - before.closed);
+        while (provider.generation() - generation_before < n_events
+            && std::chrono::steady_clock::now() - storm_end < CATCH_UP_TIMEOUT) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        const auto caught_up = std::chrono::steady_clock::now();
+        const u64 n_applied = provider.generation() - generation_before;
+
+        const double seconds = std::chrono::duration<double>(caught_up - storm_start).count();
+        BenchResult storm = BenchResult {
+            .name = std::format("compositor/storm/{}", n_windows),
+            .iterations = n_applied,
+            .ns_per_op = seconds * 1e9 / std::max<u64>(n_applied, 1),
+        };
+        storm.metrics = {
+            { "events_sent", static_cast<double>(n_events) },
+            { "events_applied", static_cast<double>(n_applied) },
+            { "events_per_s", n_applied / seconds },
+            { "lag_ms", std::chrono::duration<double, std::milli>(caught_up - storm_end).count() },
+            { "rss_growth_kib", rss_kib() - rss_before },
+            { "windows", static_cast<double>(provider.snapshot().size()) },
+        };
+        results.push_back(std::move(storm));
+    }
+
+    return results;
+}
@@ -0,0 +1,398 @@
+#include "eval_providers.hpp"
+#include "orchestrator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+// Offline evaluation of the orchestrator model: answers a JSONL corpus of prompts against canned
+// providers and reports how often its commands parse and ask for the expected action, how long
+// turns take and how many tokens are generated per second across every conversation.
+
+namespace {
+
+// counter the orchestrator keeps per emitted command, labelled parsed or invalid
+constexpr std::string_view METRIC_COMMANDS = "autosktop_commands_total";
+
+struct Expectation {
+    StateProviderKind kind;
+    std::string action;
+};
+
+struct CorpusEntry {
+    // 1-based line in the corpus file
+    size_t line;
+    std::string prompt;
+    // replaces the windows of the conversation before this turn
+    std::optional<std::vector<WindowInfo>> windows;
+    // whether the entry says what the turn should do
+    bool scored;
+    // the request the turn must send, nullopt if it must answer in text without any
+    std::optional<Expectation> expect;
+};
+
+struct Conversation {
+    std::string name;
+    std::vector<CorpusEntry> turns;
+};
+
+struct TurnRecord {
+    size_t line;
+    double latency_ms;
+    Orchestrator::TurnOutcome outcome;
+    bool scored;
+    bool correct;
+    // requests the turn sent, as kind/action
+    std::vector<std::string> requests;
+};
+
+struct JobTotals {
+    double n_parsed { 0.0 };
+    double n_invalid { 0.0 };
+    LLMStats llm {};
+};
+
+std::string describe(StateProviderKind kind, std::string_view action) {
+    return std::format("{}/{}", state_provider_kind_to_string(kind), action);
+}
+
+std::optional<std::vector<WindowInfo>> parse_windows(const nlohmann::json& arr) {
+    if (!arr.is_array()) {
+        return std::nullopt;
+    }
+
+    std::vector<WindowInfo> windows;
+    for (const nlohmann::json& window : arr) {
+        windows.push_back(WindowInfo {
+            .window_id = window.value("window_id", std::format("toplevel-{}", windows.size() + 1)),
+            .title = window.value("title", ""),
+            .app_id = window.value("app_id", ""),
+        });
+    }
+    return windows;
+}
+
+// Conversations in the order they first appear, each with its turns in file order. Entries
+// without a "conversation" are conversations of their own.
+std::optional<std::vector<Conversation>> load_corpus(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        spdlog::error("Unable to open corpus {}", path);
+        return std::nullopt;
+    }
+
+    std::vector<Conversation> conversations;
+    std::unordered_map<std::string, size_t> by_name;
+    std::string text;
+    for (size_t line = 1; std::getline(in, text); line++) {
+        if (text.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+
+        try {
+            const nlohmann::json obj = nlohmann::json::parse(text);
+            CorpusEntry entry {
+                .line = line,
+                .prompt = obj.at("prompt").get<std::string>(),
+                .windows = std::nullopt,
+                .scored = obj.contains("expect"),
+                .expect = std::nullopt,
+            };
+            if (obj.contains("windows")) {
+                entry.windows = parse_windows(obj["windows"]);
+                if (!entry.windows) {
+                    spdlog::error("{}:{}: windows must be an array", path, line);
+                    return std::nullopt;
+                }
+            }
+            if (entry.scored && !obj["expect"].is_null()) {
+                const nlohmann::json& expect = obj["expect"];
+                const std::optional<StateProviderKind> kind =
+                    state_provider_kind_from_string(expect.at("request_kind").get<std::string>());
+                if (!kind) {
+                    spdlog::error("{}:{}: unknown request_kind", path, line);
+                    return std::nullopt;
+                }
+                entry.expect = Expectation { .kind = *kind, .action = expect.at("action").get<std::string>() };
+            }
+
+            const std::string name = obj.value("conversation", std::format("line-{}", line));
+            const auto [it, inserted] = by_name.try_emplace(name, conversations.size());
+            if (inserted) {
+                conversations.push_back(Conversation { .name = name, .turns = {} });
+            }
+            conversations[it->second].turns.push_back(std::move(entry));
+        }
+        catch (const nlohmann::json::exception& e) {
+            spdlog::error("{}:{}: {}", path, line, e.what());
+            return std::nullopt;
+        }
+    }
+
+    return conversations;
+}
+
+// One orchestrator with its own context and canned providers, answering whole conversations; the
+// model itself is shared by every job
+struct EvalJob {
+    RequestLog log {};
+    CannedWindowProvider* windows { nullptr };
+    Orchestrator orchestrator {};
+    std::vector<TurnRecord> records {};
+};
+
+[[nodiscard]] bool init_job(EvalJob& job, const OrchestratorOptions& options) {
+    auto windows = std::make_unique<CannedWindowProvider>(job.log);
+    auto workspaces = std::make_unique<CannedWorkspaceProvider>(job.log, *windows);
+    job.windows = windows.get();
+
+    StateProviders providers;
+    providers.insert({StateProviderKind::WINDOW, std::move(windows)});
+    providers.insert({StateProviderKind::WORKSPACE, std::move(workspaces)});
+
+    job.orchestrator.set_output([](std::string_view) {});
+    if (!job.orchestrator.init(options, std::move(providers))) {
+        return false;
+    }
+    // the system prompt is not part of any turn
+    job.orchestrator.warm_up();
+    return true;
+}
+
+double commands(const Orchestrator& orchestrator, std::string_view result) {
+    return orchestrator.metrics().value(METRIC_COMMANDS, {{"result", std::string(result)}});
+}
+
+void run_conversation(EvalJob& job, const Conversation& conversation) {
+    job.orchestrator.new_conversation();
+    job.windows->replace_windows(default_eval_windows());
+
+    for (const CorpusEntry& entry : conversation.turns) {
+        if (entry.windows) {
+            job.windows->replace_windows(*entry.windows);
+        }
+        [[maybe_unused]] std::vector<StateRequest> stale = job.log.take();
+
+        const auto t_start = std::chrono::steady_clock::now();
+        const Orchestrator::TurnOutcome outcome = job.orchestrator.answer(entry.prompt);
+        const double latency_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+
+        // the expected request may come after others the model needed first, e.g. the windows
+        // before closing one of them
+        const std::vector<StateRequest> requests = job.log.take();
+        TurnRecord record {
+            .line = entry.line,
+            .latency_ms = latency_ms,
+            .outcome = outcome,
+            .scored = entry.scored,
+            .correct = false,
+            .requests = {},
+        };
+        for (const StateRequest& req : requests) {
+            record.requests.push_back(describe(req.kind, req.action()));
+            if (entry.expect && req.kind == entry.expect->kind && req.action() == entry.expect->action) {
+                record.correct = true;
+            }
+        }
+        if (entry.scored && !entry.expect) {
+            record.correct = requests.empty();
+        }
+        record.correct = record.correct && outcome == Orchestrator::TurnOutcome::COMPLETED;
+
+        if (entry.scored && !record.correct) {
+            spdlog::info("line {}: expected {}, got {}", entry.line,
+                entry.expect ? describe(entry.expect->kind, entry.expect->action) : "a text answer",
+                requests.empty() ? "a text answer" : nlohmann::json(record.requests).dump());
+        }
+        job.records.push_back(std::move(record));
+    }
+}
+
+// Nearest-rank percentile of sorted `values`
+double percentile(const std::vector<double>& values, double q) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    const size_t rank = static_cast<size_t>(std::ceil(q * values.size()));
+    return values[std::clamp<size_t>(rank, 1, values.size()) - 1];
+}
+
+void usage(const char* argv0) {
+    std::println(stderr, "usage: {} CORPUS.jsonl [--jobs N] [--json] [--min-accuracy F] [--min-validity F]", argv0);
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::string corpus_path;
+    u32 n_jobs = 2;
+    bool json = false;
+    std::optional<double> min_accuracy;
+    std::optional<double> min_validity;
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--json") {
+            json = true;
+        }
+        else if (arg == "--jobs" && has_value) {
+            n_jobs = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--min-accuracy" && has_value) {
+            min_accuracy = std::atof(argv[++i]);
+        }
+        else if (arg == "--min-validity" && has_value) {
+            min_validity = std::atof(argv[++i]);
+        }
+        else if (corpus_path.empty() && !arg.starts_with("--")) {
+            corpus_path = arg;
+        }
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (corpus_path.empty()) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // stdout only carries results
+    spdlog::set_default_logger(spdlog::stderr_color_mt("autosktop_eval"));
+
+    const std::optional<std::vector<Conversation>> conversations = load_corpus(corpus_path);
+    if (!conversations) {
+        return 1;
+    }
+    n_jobs = std::min<u32>(n_jobs, std::max<size_t>(conversations->size(), 1));
+
+    OrchestratorOptions options = orchestrator_options_from_env();
+    // every job would serve metrics on the same socket
+    options.metrics_socket.clear();
+
+    // one copy of the weights for every job, each job only adds its own context
+    options.shared_model = std::shared_ptr<llama_model>(load_orchestrator_model(options), llama_model_free);
+    if (!options.shared_model) {
+        return 1;
+    }
+    // each job plans its context against the weights and its share of what they leave of the budget
+    if (options.memory.max_rss_bytes > 0 && n_jobs > 1) {
+        const i32 n_gpu_layers = options.cpu_only ? 0 : options.n_gpu_layers;
+        const ModelShape shape = model_shape(options.shared_model.get(), n_gpu_layers, options.cpu_only);
+        const u64 weights_bytes = shape.n_layer > 0 ? shape.weights_bytes * shape.n_layer_host / shape.n_layer : 0;
+        if (options.memory.max_rss_bytes > weights_bytes) {
+            options.memory.max_rss_bytes = weights_bytes + (options.memory.max_rss_bytes - weights_bytes) / n_jobs;
+        }
+    }
+
+    // one after the other, so a CPU profile or prefix cache written by the first is read by the rest
+    std::vector<std::unique_ptr<EvalJob>> jobs;
+    for (u32 i = 0; i < n_jobs; i++) {
+        auto job = std::make_unique<EvalJob>();
+        if (!init_job(*job, options)) {
+            spdlog::error("Failed to initialize the orchestrator with {}", options.model_path);
+            return 1;
+        }
+        jobs.push_back(std::move(job));
+    }
+
+    const auto t_start = std::chrono::steady_clock::now();
+    std::atomic<size_t> next { 0 };
+    {
+        std::vector<std::jthread> threads;
+        for (const std::unique_ptr<EvalJob>& job : jobs) {
+            threads.emplace_back([&, job = job.get()] {
+                for (size_t i = next.fetch_add(1); i < conversations->size(); i = next.fetch_add(1)) {
+                    run_conversation(*job, (*conversations)[i]);
+                }
+            });
+        }
+    }
+    const double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    JobTotals totals;
+    std::vector<double> latencies;
+    u64 n_turns = 0, n_failed = 0, n_scored = 0, n_correct = 0;
+    for (const std::unique_ptr<EvalJob>& job : jobs) {
+        totals.n_parsed += commands(job->orchestrator, "parsed");
+        totals.n_invalid += commands(job->orchestrator, "invalid");
+        const LLMStats& llm = job->orchestrator.llm_stats();
+        totals.llm.n_prefill += llm.n_prefill;
+        totals.llm.n_decode += llm.n_decode;
+
+        for (const TurnRecord& record : job->records) {
+            n_turns++;
+            n_failed += record.outcome != Orchestrator::TurnOutcome::COMPLETED;
+            n_scored += record.scored;
+            n_correct += record.scored && record.correct;
+            if (record.outcome == Orchestrator::TurnOutcome::COMPLETED) {
+                latencies.push_back(record.latency_ms);
+            }
+        }
+    }
+    std::ranges::sort(latencies);
+
+    const double n_commands = totals.n_parsed + totals.n_invalid;
+    // a corpus the model answered only in text had no command to get wrong
+    const double validity = n_commands > 0 ? totals.n_parsed / n_commands : 1.0;
+    const double accuracy = n_scored > 0 ? static_cast<double>(n_correct) / n_scored : 1.0;
+    const double decode_tps = totals.llm.n_decode / wall_s;
+    const double prefill_tps = totals.llm.n_prefill / wall_s;
+
+    if (json) {
+        const nlohmann::json out = {
+            {"git_rev", AUTOSKTOP_GIT_REV},
+            {"model", options.model_path},
+            {"corpus", corpus_path},
+            {"jobs", n_jobs},
+            {"conversations", conversations->size()},
+            {"turns", n_turns},
+            {"failed_turns", n_failed},
+            {"commands", n_commands},
+            {"json_validity", validity},
+            {"scored_turns", n_scored},
+            {"action_accuracy", accuracy},
+            {"latency_ms", {
+                {"p50", percentile(latencies, 0.50)},
+                {"p95", percentile(latencies, 0.95)},
+                {"p99", percentile(latencies, 0.99)},
+            }},
+            {"prefill_tokens_per_s", prefill_tps},
+            {"decode_tokens_per_s", decode_tps},
+            {"wall_s", wall_s},
+        };
+        std::println("{}", out.dump(2));
+    }
+    else {
+        std::println("{} turns in {} conversations on {} jobs, {} failed, {:.1f} s",
+            n_turns, conversations->size(), n_jobs, n_failed, wall_s);
+        std::println("json validity    {:>7.1f}%  ({:.0f} commands)", validity * 100.0, n_commands);
+        std::println("action accuracy  {:>7.1f}%  ({} of {} scored turns)", accuracy * 100.0, n_correct, n_scored);
+        std::println("turn latency     p50 {:.0f} ms  p95 {:.0f} ms  p99 {:.0f} ms",
+            percentile(latencies, 0.50), percentile(latencies, 0.95), percentile(latencies, 0.99));
+        std::println("throughput       prefill {:.0f} tok/s  decode {:.0f} tok/s", prefill_tps, decode_tps);
+    }
+
+    // used as a gate, e.g. before changing the model, the prompt or the sampler
+    if ((min_accuracy && accuracy < *min_accuracy) || (min_validity && validity < *min_validity)) {
+        spdlog::error("Below the required accuracy or validity");
+        return 1;
+    }
+    return 0;
+}
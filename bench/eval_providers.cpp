@@ -0,0 +1,209 @@
+#include "eval_providers.hpp"
+#include "window_action.hpp"
+
+#include <algorithm>
+
+namespace {
+
+constexpr std::string_view EVAL_WORKSPACE_ID = "1";
+
+nlohmann::json windows_to_json(const std::vector<WindowInfo>& windows) {
+    nlohmann::json arr = nlohmann::json::array();
+    for (const WindowInfo& window : windows) {
+        arr.push_back(window_info_to_json(window));
+    }
+    return arr;
+}
+
+nlohmann::json request_params(const StateRequest& req) {
+    const auto it = req.args.find("params");
+    return it != req.args.end() && it->is_object() ? *it : nlohmann::json::object();
+}
+
+nlohmann::json error_result(std::string_view action, std::string_view error) {
+    return {{"ok", false}, {"action", action}, {"error", error}};
+}
+
+}
+
+void RequestLog::record(const StateRequest& req) {
+    std::lock_guard lock(m_mutex);
+    m_requests.push_back(req);
+}
+
+std::vector<StateRequest> RequestLog::take() {
+    std::lock_guard lock(m_mutex);
+    return std::exchange(m_requests, {});
+}
+
+nlohmann::json CannedWindowProvider::processRequest(StateRequest req) noexcept {
+    m_log.record(req);
+
+    try {
+        const std::string action(req.action());
+        const nlohmann::json params = request_params(req);
+
+        if (action == "get_open_windows") {
+            return {{"ok", true}, {"action", action}, {"windows", windows_to_json(windows())}};
+        }
+
+        if (action == "get_window_state") {
+            if (!params.contains("window_id") || !params["window_id"].is_string()) {
+                return error_result(action, "missing_or_invalid_window_id");
+            }
+            const std::string window_id = params["window_id"].get<std::string>();
+
+            std::lock_guard lock(m_mutex);
+            const auto it = std::ranges::find(m_windows, window_id, &WindowInfo::window_id);
+            if (it == m_windows.end()) {
+                nlohmann::json out = error_result(action, "not_found");
+                out["window_id"] = window_id;
+                return out;
+            }
+            return {{"ok", true}, {"action", action}, {"window", window_info_to_json(*it)}};
+        }
+
+        const std::optional<WindowActionKind> kind = window_action_from_command(action);
+        if (!kind) {
+            return error_result(action, "unknown_action");
+        }
+
+        std::vector<std::string> window_ids;
+        if (*kind == WindowActionKind::ACTIVATE) {
+            if (!params.contains("window_id") || !params["window_id"].is_string()) {
+                return error_result(action, "missing_or_invalid_window_id");
+            }
+            window_ids.push_back(params["window_id"].get<std::string>());
+        }
+        else {
+            if (!params.contains("window_ids") || !params["window_ids"].is_array()) {
+                return error_result(action, "missing_or_invalid_window_ids");
+            }
+            window_ids = params["window_ids"].get<std::vector<std::string>>();
+        }
+        if (*kind == WindowActionKind::MOVE_TO_WORKSPACE
+            && params.value("workspace_id", "") != EVAL_WORKSPACE_ID) {
+            return error_result(action, "workspace_not_found");
+        }
+
+        // statuses as the compositor would confirm them, applied to the set at once
+        nlohmann::json results = nlohmann::json::array();
+        bool all_done = true;
+        {
+            std::lock_guard lock(m_mutex);
+            for (const std::string& window_id : window_ids) {
+                const auto it = std::ranges::find(m_windows, window_id, &WindowInfo::window_id);
+                const WindowActionStatus status = it == m_windows.end() ? WindowActionStatus::NOT_FOUND : WindowActionStatus::DONE;
+                if (status == WindowActionStatus::DONE && *kind == WindowActionKind::CLOSE) {
+                    m_windows.erase(it);
+                }
+                all_done = all_done && status == WindowActionStatus::DONE;
+                results.push_back({{"window_id", window_id}, {"status", window_action_status_to_string(status)}});
+            }
+        }
+
+        return {{"ok", all_done}, {"action", action}, {"results", std::move(results)}};
+    }
+    catch (const std::exception& e) {
+        return error_result(req.action(), "internal_error");
+    }
+}
+
+std::vector<ActionSchema> CannedWindowProvider::actions() const noexcept {
+    std::vector<ActionSchema> actions = {
+        ActionSchema { .name = "get_open_windows", .params = {} },
+        ActionSchema { .name = "get_window_state", .params = { "window_id" } },
+    };
+
+    // everything a compositor with cosmic-toplevel-management could offer
+    for (const WindowActionCommand& command : WINDOW_ACTION_COMMANDS) {
+        if (command.kind == WindowActionKind::ACTIVATE) {
+            actions.push_back(ActionSchema { .name = std::string(command.name), .params = { "window_id" } });
+        }
+        else if (command.kind == WindowActionKind::MOVE_TO_WORKSPACE) {
+            actions.push_back(ActionSchema {
+                .name = std::string(command.name), .params = { "workspace_id" }, .list_params = { "window_ids" } });
+        }
+        else {
+            actions.push_back(ActionSchema { .name = std::string(command.name), .params = {}, .list_params = { "window_ids" } });
+        }
+    }
+
+    return actions;
+}
+
+void CannedWindowProvider::replace_windows(std::vector<WindowInfo> windows) {
+    std::lock_guard lock(m_mutex);
+    m_windows = std::move(windows);
+}
+
+std::vector<WindowInfo> CannedWindowProvider::windows() const {
+    std::lock_guard lock(m_mutex);
+    return m_windows;
+}
+
+nlohmann::json CannedWorkspaceProvider::processRequest(StateRequest req) noexcept {
+    m_log.record(req);
+
+    try {
+        const std::string action(req.action());
+        const std::vector<WindowInfo> windows = m_windows.windows();
+
+        if (action == "get_workspaces") {
+            const nlohmann::json workspace = {
+                {"workspace_id", EVAL_WORKSPACE_ID},
+                {"name",         EVAL_WORKSPACE_ID},
+                {"active",       true},
+                {"n_windows",    windows.size()},
+            };
+            return {{"ok", true}, {"action", action}, {"workspaces", nlohmann::json::array({ workspace })}};
+        }
+
+        if (action == "get_active_workspace_windows") {
+            return {
+                {"ok", true},
+                {"action", action},
+                {"workspaces", nlohmann::json::array({ EVAL_WORKSPACE_ID })},
+                {"windows", windows_to_json(windows)},
+            };
+        }
+
+        if (action == "get_workspace_windows") {
+            if (request_params(req).value("workspace_id", "") != EVAL_WORKSPACE_ID) {
+                return error_result(action, "not_found");
+            }
+            return {
+                {"ok", true},
+                {"action", action},
+                {"workspace_id", EVAL_WORKSPACE_ID},
+                {"windows", windows_to_json(windows)},
+            };
+        }
+
+        return error_result(action, "unknown_action");
+    }
+    catch (const std::exception& e) {
+        return error_result(req.action(), "internal_error");
+    }
+}
+
+std::vector<ActionSchema> CannedWorkspaceProvider::actions() const noexcept {
+    return {
+        ActionSchema { .name = "get_workspaces", .params = {} },
+        ActionSchema { .name = "get_workspace_windows", .params = { "workspace_id" } },
+        ActionSchema { .name = "get_active_workspace_windows", .params = {} },
+    };
+}
+
+std::vector<WindowInfo> default_eval_windows() {
+    return {
+        { "toplevel-1", "Mozilla Firefox — Pull requests · autosktop", "org.mozilla.firefox" },
+        { "toplevel-2", "~/src/autosktop: cmake --build build", "org.gnome.Terminal" },
+        { "toplevel-3", "orchestrator.cpp — autosktop — Visual Studio Code", "code" },
+        { "toplevel-4", "#general — Slack", "Slack" },
+        { "toplevel-5", "Inbox (3) — Thunderbird", "org.mozilla.Thunderbird" },
+        { "toplevel-6", "Spotify Premium", "spotify" },
+        { "toplevel-7", "Files — Downloads", "org.gnome.Nautilus" },
+        { "toplevel-8", "htop", "org.gnome.Terminal" },
+    };
+}
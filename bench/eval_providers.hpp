@@ -0,0 +1,62 @@
+#pragma once
+
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "int_types.hpp"
+#include "state_provider.hpp"
+#include "window_state_provider.hpp"
+
+// Every request the providers of one conversation were asked, in the order they arrived. The
+// canned providers report no generation, so the response cache never answers in their place and
+// every request the model sends is logged.
+class RequestLog {
+public:
+    void record(const StateRequest& req);
+    // The requests recorded since the previous call
+    [[nodiscard]] std::vector<StateRequest> take();
+
+private:
+    std::mutex m_mutex;
+    std::vector<StateRequest> m_requests;
+};
+
+// Window provider over a fixed window set that accepts every window action the real one can
+// offer. Actions succeed on the windows of the set and closing one removes it, so a conversation
+// sees the effect of its own commands.
+class CannedWindowProvider : public StateProvider {
+public:
+    explicit CannedWindowProvider(RequestLog& log) noexcept : m_log(log) {}
+
+    std::expected<void, StateProviderError> init() noexcept { return {}; }
+    nlohmann::json processRequest(StateRequest req) noexcept;
+    [[nodiscard]] std::vector<ActionSchema> actions() const noexcept;
+
+    void replace_windows(std::vector<WindowInfo> windows);
+    [[nodiscard]] std::vector<WindowInfo> windows() const;
+
+private:
+    RequestLog& m_log;
+    mutable std::mutex m_mutex;
+    std::vector<WindowInfo> m_windows;
+};
+
+// Workspace provider with a single active workspace holding every window of `windows`
+class CannedWorkspaceProvider : public StateProvider {
+public:
+    CannedWorkspaceProvider(RequestLog& log, const CannedWindowProvider& windows) noexcept
+        : m_log(log), m_windows(windows) {}
+
+    std::expected<void, StateProviderError> init() noexcept { return {}; }
+    nlohmann::json processRequest(StateRequest req) noexcept;
+    [[nodiscard]] std::vector<ActionSchema> actions() const noexcept;
+
+private:
+    RequestLog& m_log;
+    const CannedWindowProvider& m_windows;
+};
+
+// Windows of a typical desktop session, used by corpus entries that bring none
+[[nodiscard]] std::vector<WindowInfo> default_eval_windows();
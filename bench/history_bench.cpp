@@ -0,0 +1,79 @@
+#include "bench.hpp"
+#include "conversation_history.hpp"
+#include "orchestrator.hpp"
+
+#include <format>
+
+static const Message USER_TURN = Message {
+    .role = MessagerRole::User,
+    .content = "close the terminal window that is running the build"
+};
+
+static const Message ASSISTANT_TURN = Message {
+    .role = MessagerRole::Assistant,
+    .content = R"({ "request_kind": "window", "args": { "action": "get_open_windows", "params": {} } })"
+};
+
+static std::vector<Message> make_conversation(u32 n_turns) {
+    std::vector<Message> messages;
+    messages.reserve(n_turns * 2);
+    for (u32 i = 0; i < n_turns; i++) {
+        messages.push_back(USER_TURN);
+        messages.push_back(ASSISTANT_TURN);
+    }
+    return messages;
+}
+
+// What run_llm() did before the token-level store: rebuild the prompt string from every
+// message and tokenize it twice, once to count and once to fill
+static std::vector<llama_token> legacy_prompt(const llama_vocab* vocab, const std::vector<Message>& messages) {
+    std::string out;
+    out += BEGIN_OF_TEXT;
+    out += '\n';
+    out += IDENTITY_MESSAGE.to_string();
+    for (Message message : messages) {
+        out += message.to_string();
+    }
+    out += message_header(MessagerRole::Assistant);
+
+    const i32 n_prompt = -llama_tokenize(vocab, out.c_str(), out.size(), nullptr, 0, false, true);
+    std::vector<llama_token> tokens(n_prompt);
+    llama_tokenize(vocab, out.c_str(), out.size(), tokens.data(), tokens.size(), false, true);
+    return tokens;
+}
+
+std::vector<BenchResult> bench_history(const llama_vocab* vocab) noexcept {
+    std::vector<BenchResult> results;
+
+    for (u32 n_turns : {10u, 100u, 1000u}) {
+        std::vector<Message> messages = make_conversation(n_turns);
+
+        const u64 legacy_iterations = n_turns >= 1000 ? 10 : 100;
+        results.push_back(run_bench(std::format("history/legacy_turn/{}", n_turns), legacy_iterations, [&] {
+            messages.push_back(USER_TURN);
+            do_not_optimize(legacy_prompt(vocab, messages));
+            messages.pop_back();
+        }));
+
+        ConversationHistory history;
+        if (!history.init(vocab, IDENTITY_MESSAGE)) {
+            continue;
+        }
+        for (const Message& message : messages) {
+            if (!history.append(message)) {
+                break;
+            }
+        }
+
+        // back to the same length after every turn, so each case measures the history it names
+        const size_t n_entries = history.entries().size();
+        results.push_back(run_bench(std::format("history/store_turn/{}", n_turns), 1000, [&] {
+            if (history.append(USER_TURN)) {
+                do_not_optimize(history.prompt().size());
+            }
+            history.truncate(n_entries);
+        }));
+    }
+
+    return results;
+}
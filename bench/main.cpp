@@ -0,0 +1,116 @@
+#include "bench.hpp"
+#include "stand_in_model.hpp"
+
+#include <cstdlib>
+#include <print>
+#include <string>
+#include <string_view>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+static void llama_log_callback(enum ggml_log_level level, const char* text, [[maybe_unused]] void* user_data) {
+    if (level >= GGML_LOG_LEVEL_WARN) {
+        spdlog::debug("{}", text);
+    }
+}
+
+llama_model* load_vocab_model(const std::string& model_path) noexcept {
+    llama_model_params model_params = llama_model_default_params();
+    model_params.vocab_only = true;
+    llama_model* model = llama_model_load_from_file(model_path.c_str(), model_params);
+    if (model == nullptr) {
+        spdlog::error("Error: unable to load model {}", model_path);
+    }
+
+    return model;
+}
+
+static void print_results(const std::vector<BenchResult>& results) {
+    for (const BenchResult& r : results) {
+        std::print("{:<48} {:>10} iters {:>14.1f} ns/op", r.name, r.iterations, r.ns_per_op);
+        for (const auto& [metric, value] : r.metrics) {
+            std::print("  {}={:.0f}", metric, value);
+        }
+        std::println("");
+    }
+}
+
+// One document per run, so results can be stored per commit and compared
+static void print_json(const std::vector<BenchResult>& results, const std::string& model_path) {
+    nlohmann::json out;
+    out["git_rev"] = AUTOSKTOP_GIT_REV;
+    out["model"] = model_path;
+
+    nlohmann::json arr = nlohmann::json::array();
+    for (const BenchResult& r : results) {
+        nlohmann::json metrics = nlohmann::json::object();
+        for (const auto& [metric, value] : r.metrics) {
+            metrics[metric] = value;
+        }
+        arr.push_back({
+            {"name",       r.name},
+            {"iterations", r.iterations},
+            {"ns_per_op",  r.ns_per_op},
+            {"metrics",    std::move(metrics)},
+        });
+    }
+    out["results"] = std::move(arr);
+
+    std::println("{}", out.dump(2));
+}
+
+int main(int argc, char** argv) {
+    bool json = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::string_view(argv[i]) == "--json") {
+            json = true;
+        }
+        else {
+            std::println(stderr, "usage: {} [--json]", argv[0]);
+            return 2;
+        }
+    }
+
+    // stdout only carries results
+    spdlog::set_default_logger(spdlog::stderr_color_mt("autosktop_bench"));
+
+    llama_log_set(llama_log_callback, nullptr);
+    ggml_backend_load_all();
+
+    const char* model_path_env = std::getenv("ORCHESTRATOR_MODEL_PATH");
+    const std::string source_path = model_path_env ? model_path_env : DEFAULT_ORCHESTRATOR_PATH;
+    const std::optional<std::string> model_path = stand_in_model(source_path);
+    if (!model_path) {
+        return 1;
+    }
+
+    llama_model* model = load_vocab_model(*model_path);
+    if (model == nullptr) {
+        return 1;
+    }
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+
+    std::vector<BenchResult> results;
+    auto append = [&](std::vector<BenchResult> stage) {
+        results.insert(results.end(), std::make_move_iterator(stage.begin()), std::make_move_iterator(stage.end()));
+    };
+    append(bench_prompt(vocab));
+    append(bench_history(vocab));
+    append(bench_result_encoding(vocab));
+    append(bench_window_table());
+    append(bench_providers());
+    append(bench_compositor());
+    append(bench_pipeline(*model_path));
+
+    llama_model_free(model);
+
+    if (json) {
+        print_json(results, *model_path);
+    }
+    else {
+        print_results(results);
+    }
+    return 0;
+}
@@ -0,0 +1,300 @@
+#include "mock_compositor.hpp"
+#include "synthetic_windows.hpp"
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <format>
+#include <future>
+
+#include <spdlog/spdlog.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// granularity of storms, events that fall due within one tick are sent together
+constexpr int STORM_TICK_MS = 1;
+
+MockCompositor::~MockCompositor() noexcept {
+    stop();
+}
+
+bool MockCompositor::start(const std::string& socket_name) noexcept {
+    m_display = wl_display_create();
+    if (m_display == nullptr) {
+        spdlog::error("Could not create the mock Wayland display");
+        return false;
+    }
+    m_loop = wl_display_get_event_loop(m_display);
+
+    if (socket_name.empty()) {
+        const char* name = wl_display_add_socket_auto(m_display);
+        if (name == nullptr) {
+            spdlog::error("Could not open a Wayland socket, is XDG_RUNTIME_DIR set?");
+            return false;
+        }
+        m_socket_name = name;
+    }
+    else {
+        if (wl_display_add_socket(m_display, socket_name.c_str()) != 0) {
+            spdlog::error("Could not open the Wayland socket {}", socket_name);
+            return false;
+        }
+        m_socket_name = socket_name;
+    }
+
+    m_list_global = wl_global_create(m_display, &ext_foreign_toplevel_list_v1_interface, 1, this, bind_list);
+
+    m_command_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_list_global == nullptr || m_command_fd < 0
+        || wl_event_loop_add_fd(m_loop, m_command_fd, WL_EVENT_READABLE, on_command_fd, this) == nullptr) {
+        spdlog::error("Could not set up the mock compositor");
+        return false;
+    }
+    m_storm_timer = wl_event_loop_add_timer(m_loop, on_storm_timer, this);
+
+    m_running = true;
+    m_thread = std::jthread([this] { run(); });
+    return true;
+}
+
+void MockCompositor::stop() noexcept {
+    if (m_thread.joinable()) {
+        post([this] { m_running = false; });
+        m_thread.join();
+    }
+
+    if (m_display) {
+        wl_display_destroy_clients(m_display);
+        wl_display_destroy(m_display);
+        m_display = nullptr;
+    }
+    if (m_command_fd >= 0) {
+        close(m_command_fd);
+        m_command_fd = -1;
+    }
+}
+
+void MockCompositor::post(std::function<void()> command) {
+    {
+        std::lock_guard lock(m_commands_mutex);
+        m_commands.push_back(std::move(command));
+    }
+    const u64 one = 1;
+    [[maybe_unused]] ssize_t n = write(m_command_fd, &one, sizeof(one));
+}
+
+void MockCompositor::sync() {
+    std::promise<void> done;
+    std::future<void> future = done.get_future();
+    post([this, &done] {
+        wl_display_flush_clients(m_display);
+        done.set_value();
+    });
+    future.wait();
+}
+
+void MockCompositor::run() noexcept {
+    while (m_running) {
+        if (wl_event_loop_dispatch(m_loop, -1) < 0 && errno != EINTR) {
+            spdlog::error("Mock compositor event loop failed: {}", std::strerror(errno));
+            return;
+        }
+        wl_display_flush_clients(m_display);
+    }
+}
+
+int MockCompositor::on_command_fd(int fd, u32 /*mask*/, void* data) {
+    u64 count;
+    [[maybe_unused]] ssize_t n = read(fd, &count, sizeof(count));
+    static_cast<MockCompositor*>(data)->run_commands();
+    return 0;
+}
+
+void MockCompositor::run_commands() noexcept {
+    std::vector<std::function<void()>> commands;
+    {
+        std::lock_guard lock(m_commands_mutex);
+        commands.swap(m_commands);
+    }
+
+    for (std::function<void()>& command : commands) {
+        command();
+    }
+}
+
+void MockCompositor::open_windows(std::span<const WindowInfo> windows) {
+    std::vector<WindowInfo> copy(windows.begin(), windows.end());
+    post([this, windows = std::move(copy)] mutable {
+        for (WindowInfo& info : windows) {
+            open_window(std::move(info));
+        }
+    });
+}
+
+void MockCompositor::start_storm(const StormOptions& options) {
+    post([this, options] {
+        m_storm = options;
+        m_storm_running = true;
+        m_storm_start = std::chrono::steady_clock::now();
+        m_storm_opens = 0;
+        m_storm_titles = 0;
+        m_storm_closes = 0;
+        m_rng.seed(options.seed);
+        m_storm_pool = make_synthetic_windows(256, options.seed);
+        wl_event_source_timer_update(m_storm_timer, STORM_TICK_MS);
+    });
+}
+
+void MockCompositor::stop_storm() {
+    post([this] {
+        m_storm_running = false;
+        wl_event_source_timer_update(m_storm_timer, 0);
+    });
+}
+
+int MockCompositor::on_storm_timer(void* data) {
+    auto* self = static_cast<MockCompositor*>(data);
+    if (self->m_storm_running) {
+        self->storm_tick();
+        wl_event_source_timer_update(self->m_storm_timer, STORM_TICK_MS);
+    }
+    return 0;
+}
+
+void MockCompositor::storm_tick() {
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_storm_start).count();
+    auto due = [elapsed](double rate, u64 done) -> u64 {
+        const u64 total = static_cast<u64>(std::floor(elapsed * rate));
+        return total > done ? total - done : 0;
+    };
+
+    const u64 n_open = due(m_storm.open_rate, m_storm_opens);
+    const u64 n_title = due(m_storm.title_rate, m_storm_titles);
+    const u64 n_close = due(m_storm.close_rate, m_storm_closes);
+    m_storm_opens += n_open;
+    m_storm_titles += n_title;
+    m_storm_closes += n_close;
+
+    std::uniform_int_distribution<size_t> pool_dist(0, m_storm_pool.size() - 1);
+    for (u64 i = 0; i < n_open && m_open_ids.size() < m_storm.max_windows; i++) {
+        WindowInfo info = m_storm_pool[pool_dist(m_rng)];
+        info.window_id.clear();
+        open_window(std::move(info));
+    }
+
+    for (u64 i = 0; i < n_title && !m_open_ids.empty(); i++) {
+        const u64 id = m_open_ids[std::uniform_int_distribution<size_t>(0, m_open_ids.size() - 1)(m_rng)];
+        set_title(id, m_storm_pool[pool_dist(m_rng)].title);
+    }
+
+    for (u64 i = 0; i < n_close && !m_open_ids.empty(); i++) {
+        close_window(m_open_ids[std::uniform_int_distribution<size_t>(0, m_open_ids.size() - 1)(m_rng)]);
+    }
+}
+
+void MockCompositor::open_window(WindowInfo info) {
+    const u64 id = m_next_id++;
+    if (info.window_id.empty()) {
+        info.window_id = std::format("mock-{:016x}", id);
+    }
+
+    auto [it, _] = m_windows.emplace(id, MockWindow { .info = std::move(info), .index = m_open_ids.size() });
+    m_open_ids.push_back(id);
+
+    for (wl_resource* list : m_lists) {
+        announce(list, id, it->second);
+    }
+    m_opened.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MockCompositor::set_title(u64 id, std::string title) {
+    auto it = m_windows.find(id);
+    if (it == m_windows.end()) {
+        return;
+    }
+
+    it->second.info.title = std::move(title);
+    for (wl_resource* handle : it->second.handles) {
+        ext_foreign_toplevel_handle_v1_send_title(handle, it->second.info.title.c_str());
+        ext_foreign_toplevel_handle_v1_send_done(handle);
+    }
+    m_retitled.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MockCompositor::close_window(u64 id) {
+    auto it = m_windows.find(id);
+    if (it == m_windows.end()) {
+        return;
+    }
+
+    // the handles stay alive until their clients destroy them
+    for (wl_resource* handle : it->second.handles) {
+        ext_foreign_toplevel_handle_v1_send_closed(handle);
+    }
+
+    const size_t index = it->second.index;
+    if (index + 1 != m_open_ids.size()) {
+        m_open_ids[index] = m_open_ids.back();
+        m_windows.at(m_open_ids[index]).index = index;
+    }
+    m_open_ids.pop_back();
+    m_windows.erase(it);
+    m_closed.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MockCompositor::announce(wl_resource* list, u64 id, MockWindow& window) {
+    wl_resource* handle = wl_resource_create(
+        wl_resource_get_client(list), &ext_foreign_toplevel_handle_v1_interface, wl_resource_get_version(list), 0);
+    if (handle == nullptr) {
+        wl_client_post_no_memory(wl_resource_get_client(list));
+        return;
+    }
+    wl_resource_set_implementation(handle, &HANDLE_IMPL, new HandleData { .self = this, .window_id = id }, on_handle_destroyed);
+
+    ext_foreign_toplevel_list_v1_send_toplevel(list, handle);
+    ext_foreign_toplevel_handle_v1_send_identifier(handle, window.info.window_id.c_str());
+    ext_foreign_toplevel_handle_v1_send_title(handle, window.info.title.c_str());
+    ext_foreign_toplevel_handle_v1_send_app_id(handle, window.info.app_id.c_str());
+    ext_foreign_toplevel_handle_v1_send_done(handle);
+
+    window.handles.push_back(handle);
+}
+
+void MockCompositor::bind_list(wl_client* client, void* data, u32 version, u32 id) {
+    auto* self = static_cast<MockCompositor*>(data);
+
+    wl_resource* list = wl_resource_create(client, &ext_foreign_toplevel_list_v1_interface, version, id);
+    if (list == nullptr) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+    wl_resource_set_implementation(list, &LIST_IMPL, self, on_list_destroyed);
+    self->m_lists.push_back(list);
+
+    for (auto& [window_id, window] : self->m_windows) {
+        self->announce(list, window_id, window);
+    }
+}
+
+void MockCompositor::on_list_stop(wl_client* /*client*/, wl_resource* resource) {
+    auto* self = static_cast<MockCompositor*>(wl_resource_get_user_data(resource));
+    std::erase(self->m_lists, resource);
+    ext_foreign_toplevel_list_v1_send_finished(resource);
+}
+
+void MockCompositor::on_resource_destroy_request(wl_client* /*client*/, wl_resource* resource) {
+    wl_resource_destroy(resource);
+}
+
+void MockCompositor::on_list_destroyed(wl_resource* resource) {
+    auto* self = static_cast<MockCompositor*>(wl_resource_get_user_data(resource));
+    std::erase(self->m_lists, resource);
+}
+
+void MockCompositor::on_handle_destroyed(wl_resource* resource) {
+    auto* data = static_cast<HandleData*>(wl_resource_get_user_data(resource));
+    if (auto it = data->self->m_windows.find(data->window_id); it != data->self->m_windows.end()) {
+        std::erase(it->second.handles, resource);
+    }
+    delete data;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <wayland-server.h>
+#include <ext-foreign-toplevel-list-v1-server-protocol.h>
+
+#include "int_types.hpp"
+#include "window_table.hpp"
+
+// In-process Wayland server advertising ext_foreign_toplevel_list_v1, so the providers can be
+// exercised and profiled without a real compositor. Windows are scripted from any thread and
+// storms of toplevel events are generated at fixed rates; all Wayland work happens on the
+// compositor's own thread. Further protocols are added as globals next to the toplevel list.
+class MockCompositor {
+public:
+    struct StormOptions {
+        // events per second
+        double open_rate { 0.0 };
+        double title_rate { 0.0 };
+        double close_rate { 0.0 };
+        // opening pauses while this many windows are open
+        u32 max_windows { 1000 };
+        u32 seed { 42 };
+    };
+
+    // Events generated since start, each one announced to every bound client
+    struct Stats {
+        u64 opened;
+        u64 retitled;
+        u64 closed;
+    };
+
+    ~MockCompositor() noexcept;
+
+    // Listens on `socket_name` in $XDG_RUNTIME_DIR, or on the first free wayland-N if empty
+    [[nodiscard]] bool start(const std::string& socket_name = "") noexcept;
+    void stop() noexcept;
+    [[nodiscard]] const std::string& socket_name() const noexcept { return m_socket_name; }
+
+    // Windows keep the identifier they are given, an empty one gets a generated identifier
+    void open_windows(std::span<const WindowInfo> windows);
+    void start_storm(const StormOptions& options);
+    void stop_storm();
+    // Blocks until every call made before it has been applied and flushed to the clients
+    void sync();
+
+    [[nodiscard]] Stats stats() const noexcept {
+        return Stats { m_opened.load(), m_retitled.load(), m_closed.load() };
+    }
+
+private:
+    // user data of a toplevel handle resource, which can outlive its window
+    struct HandleData {
+        MockCompositor* self;
+        u64 window_id;
+    };
+
+    struct MockWindow {
+        WindowInfo info;
+        // one ext_foreign_toplevel_handle_v1 per bound list
+        std::vector<wl_resource*> handles {};
+        // position in m_open_ids
+        size_t index;
+    };
+
+    // Runs `command` on the compositor thread
+    void post(std::function<void()> command);
+    void run() noexcept;
+    void run_commands() noexcept;
+
+    void open_window(WindowInfo info);
+    void set_title(u64 id, std::string title);
+    void close_window(u64 id);
+    // Sends a window and its current state to one bound list
+    void announce(wl_resource* list, u64 id, MockWindow& window);
+    void storm_tick();
+
+    static void bind_list(wl_client* client, void* data, u32 version, u32 id);
+    static void on_list_stop(wl_client* client, wl_resource* resource);
+    static void on_resource_destroy_request(wl_client* client, wl_resource* resource);
+    static void on_list_destroyed(wl_resource* resource);
+    static void on_handle_destroyed(wl_resource* resource);
+    static int on_command_fd(int fd, u32 mask, void* data);
+    static int on_storm_timer(void* data);
+
+    static constexpr struct ext_foreign_toplevel_list_v1_interface LIST_IMPL = {
+        .stop = on_list_stop,
+        .destroy = on_resource_destroy_request,
+    };
+
+    static constexpr struct ext_foreign_toplevel_handle_v1_interface HANDLE_IMPL = {
+        .destroy = on_resource_destroy_request,
+    };
+
+    wl_display* m_display { nullptr };
+    wl_event_loop* m_loop { nullptr };
+    wl_global* m_list_global { nullptr };
+    wl_event_source* m_storm_timer { nullptr };
+    std::string m_socket_name {};
+    std::jthread m_thread {};
+    int m_command_fd { -1 };
+
+    std::mutex m_commands_mutex;
+    std::vector<std::function<void()>> m_commands;
+
+    // compositor thread only
+    bool m_running { false };
+    std::unordered_map<u64, MockWindow> m_windows;
+    std::vector<u64> m_open_ids;
+    std::vector<wl_resource*> m_lists;
+    u64 m_next_id { 1 };
+
+    StormOptions m_storm {};
+    bool m_storm_running { false };
+    std::chrono::steady_clock::time_point m_storm_start {};
+    // events of each kind generated since the storm started
+    u64 m_storm_opens { 0 };
+    u64 m_storm_titles { 0 };
+    u64 m_storm_closes { 0 };
+    std::mt19937 m_rng {};
+    std::vector<WindowInfo> m_storm_pool {};
+
+    std::atomic<u64> m_opened { 0 };
+    std::atomic<u64> m_retitled { 0 };
+    std::atomic<u64> m_closed { 0 };
+};
@@ -0,0 +1,78 @@
+#include "console_input.hpp"
+#include "mock_compositor.hpp"
+#include "synthetic_windows.hpp"
+
+#include <charconv>
+#include <csignal>
+#include <print>
+#include <string>
+#include <string_view>
+
+#include <spdlog/cfg/env.h>
+#include <spdlog/spdlog.h>
+
+// Standalone mock compositor: run it, point WAYLAND_DISPLAY at the socket it prints and start
+// autosktop (or anything else speaking ext_foreign_toplevel_list_v1) against it.
+static void usage(const char* argv0) {
+    std::println(stderr,
+        "usage: {} [--socket NAME] [--windows N] [--open-rate N] [--title-rate N] [--close-rate N] [--max-windows N]\n"
+        "rates are events per second, a storm runs until SIGINT or SIGTERM",
+        argv0);
+}
+
+template <typename T>
+static bool parse_number(std::string_view str, T& out) {
+    const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), out);
+    return ec == std::errc() && ptr == str.data() + str.size();
+}
+
+int main(int argc, char** argv) {
+    block_termination_signals();
+    spdlog::cfg::load_env_levels();
+
+    std::string socket_name;
+    u32 n_windows = 20;
+    MockCompositor::StormOptions storm;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        const std::string_view value = i + 1 < argc ? argv[i + 1] : "";
+        bool ok = !value.empty();
+
+        if (arg == "--socket") socket_name = value;
+        else if (arg == "--windows") ok = ok && parse_number(value, n_windows);
+        else if (arg == "--open-rate") ok = ok && parse_number(value, storm.open_rate);
+        else if (arg == "--title-rate") ok = ok && parse_number(value, storm.title_rate);
+        else if (arg == "--close-rate") ok = ok && parse_number(value, storm.close_rate);
+        else if (arg == "--max-windows") ok = ok && parse_number(value, storm.max_windows);
+        else ok = false;
+
+        if (!ok) {
+            usage(argv[0]);
+            return 2;
+        }
+        i++;
+    }
+
+    MockCompositor compositor;
+    if (!compositor.start(socket_name)) {
+        return 1;
+    }
+    compositor.open_windows(make_synthetic_windows(n_windows));
+    if (storm.open_rate > 0 || storm.title_rate > 0 || storm.close_rate > 0) {
+        compositor.start_storm(storm);
+    }
+    std::println("WAYLAND_DISPLAY={}", compositor.socket_name());
+    std::fflush(stdout);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    int signal;
+    sigwait(&mask, &signal);
+
+    const MockCompositor::Stats stats = compositor.stats();
+    spdlog::info("Sent {} opens, {} title changes, {} closes", stats.opened, stats.retitled, stats.closed);
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include "bench.hpp"
+#include "orchestrator.hpp"
+#include "result_encoding.hpp"
+#include "synthetic_windows.hpp"
+#include "window_state_provider.hpp"
+
+#include <format>
+
+#include <spdlog/spdlog.h>
+
+// Whole turns through Orchestrator::process_prompt on the CPU, reported as prefill and decode
+// throughput of run_llm. The speculative run drafts with the model itself, so every draft is
+// accepted and it shows the best case of the verification path.
+std::vector<BenchResult> bench_pipeline(const std::string& model_path) noexcept {
+    constexpr u64 N_TURNS = 16;
+
+    const std::vector<WindowInfo> windows = make_synthetic_windows(20);
+    const std::string listing = encode_result(open_windows_result(windows), ResultEncoding::MINIFIED);
+    const std::string prompts[] = {
+        "what is your name?",
+        std::format("These are my windows: {}\nWhich one is running the build?", listing),
+        "close the terminal window that is running the build",
+        std::format("Given {}\nfocus the browser and tell me what it is showing.", listing),
+    };
+
+    std::vector<BenchResult> results;
+    for (const bool speculative : {false, true}) {
+        auto provider = std::make_unique<WindowStateProvider>();
+        provider->replace_windows(windows);
+        StateProviders providers;
+        providers.insert({StateProviderKind::WINDOW, std::move(provider)});
+
+        Orchestrator orchestrator;
+        orchestrator.set_output([](std::string_view) {});
+        const OrchestratorOptions options = {
+            .model_path = model_path,
+            .draft_model_path = speculative ? model_path : "",
+            .cpu_only = true,
+            .prefix_cache = false,
+        };
+        if (!orchestrator.init(options, std::move(providers))) {
+            spdlog::error("Failed to initialize the orchestrator with {}", model_path);
+            continue;
+        }
+        // the system prompt is not part of any turn
+        orchestrator.warm_up();
+
+        u64 i = 0;
+        BenchResult r = run_bench(std::format("pipeline/turn/{}", speculative ? "speculative" : "greedy"), N_TURNS, [&] {
+            orchestrator.process_prompt(prompts[i++ % std::size(prompts)]);
+        });
+
+        const LLMStats& stats = orchestrator.llm_stats();
+        r.metrics = {
+            { "prefill_tokens", static_cast<double>(stats.n_prefill) },
+            { "prefill_tokens_per_s", stats.n_prefill / (stats.t_prefill_us / 1e6) },
+            { "decode_tokens", static_cast<double>(stats.n_decode) },
+            { "decode_tokens_per_s", stats.n_decode / (stats.t_decode_us / 1e6) },
+        };
+        results.push_back(std::move(r));
+    }
+
+    return results;
+}
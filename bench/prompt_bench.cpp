@@ -0,0 +1,50 @@
+#include "bench.hpp"
+#include "conversation_history.hpp"
+#include "orchestrator.hpp"
+#include "result_encoding.hpp"
+#include "synthetic_windows.hpp"
+
+#include <format>
+
+// Cost of turning messages into prompt text and prompt text into tokens, which every message
+// pays once when it enters the history
+std::vector<BenchResult> bench_prompt(const llama_vocab* vocab) noexcept {
+    std::vector<BenchResult> results;
+
+    const Message user_turn = Message {
+        .role = MessagerRole::User,
+        .content = "move the terminal running the build to the second workspace and focus the browser"
+    };
+    const Message window_result = Message {
+        .role = MessagerRole::System,
+        .content = encode_result(open_windows_result(make_synthetic_windows(20)), ResultEncoding::MINIFIED)
+    };
+
+    results.push_back(run_bench("message/to_string/user_turn", 100'000, [&] {
+        do_not_optimize(user_turn.to_string());
+    }));
+    results.push_back(run_bench("message/to_string/window_result/20", 100'000, [&] {
+        do_not_optimize(window_result.to_string());
+    }));
+
+    const std::pair<std::string_view, std::string> texts[] = {
+        { "system_prompt", IDENTITY_MESSAGE.to_string() },
+        { "user_turn", user_turn.to_string() },
+        { "window_result/20", window_result.to_string() },
+    };
+    for (const auto& [name, text] : texts) {
+        std::vector<llama_token> tokens;
+        const u64 iterations = text.size() > 4096 ? 100 : 10'000;
+        BenchResult r = run_bench(std::format("tokenize/{}", name), iterations, [&] {
+            tokens.clear();
+            do_not_optimize(tokenize_append(vocab, text, tokens));
+        });
+        r.metrics = {
+            { "tokens", static_cast<double>(tokens.size()) },
+            { "tokens_per_s", tokens.size() / (r.ns_per_op / 1e9) },
+        };
+        results.push_back(std::move(r));
+    }
+
+    return results;
+}
@@ -0,0 +1,51 @@
+#include "bench.hpp"
+#include "state_request.hpp"
+#include "synthetic_windows.hpp"
+#include "window_state_provider.hpp"
+
+#include <format>
+
+// Parsing the model's command and answering it, the host-side work of a state request
+std::vector<BenchResult> bench_providers() noexcept {
+    std::vector<BenchResult> results;
+
+    const std::pair<std::string_view, std::string_view> outputs[] = {
+        { "command", R"({ "request_kind": "window", "args": { "action": "get_window_state", "params": { "window_id": "4f2a" } } })" },
+        { "unknown_kind", R"({ "request_kind": "audio", "args": { "action": "get_volume" } })" },
+        { "text", "The terminal running the build is on the second workspace." },
+    };
+    for (const auto& [name, output] : outputs) {
+        results.push_back(run_bench(std::format("state_request/from_json/{}", name), 100'000, [&] {
+            do_not_optimize(StateRequest::from_json(output).has_value());
+        }));
+    }
+
+    for (u32 n_windows : {10u, 100u, 1'000u}) {
+        const std::vector<WindowInfo> windows = make_synthetic_windows(n_windows);
+        WindowStateProvider provider;
+        provider.replace_windows(windows);
+
+        const u64 iterations = std::max<u64>(10, 100'000 / n_windows);
+        const StateRequest list_request = StateRequest {
+            .kind = StateProviderKind::WINDOW,
+            .args = { { "action", "get_open_windows" }, { "params", nlohmann::json::object() } },
+        };
+        results.push_back(run_bench(std::format("provider/window/get_open_windows/{}", n_windows), iterations, [&] {
+            do_not_optimize(provider.processRequest(list_request));
+        }));
+
+        u64 i = 0;
+        results.push_back(run_bench(std::format("provider/window/get_window_state/{}", n_windows), 100'000, [&] {
+            const StateRequest request = StateRequest {
+                .kind = StateProviderKind::WINDOW,
+                .args = {
+                    { "action", "get_window_state" },
+                    { "params", { { "window_id", windows[i++ % windows.size()].window_id } } },
+                },
+            };
+            do_not_optimize(provider.processRequest(request));
+        }));
+    }
+
+    return results;
+}
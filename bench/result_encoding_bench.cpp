@@ -0,0 +1,40 @@
+#include "bench.hpp"
+#include "conversation_history.hpp"
+#include "result_encoding.hpp"
+#include "synthetic_windows.hpp"
+
+#include <array>
+#include <format>
+
+// Token count is what each encoding costs in prefill, the timing is the encoder itself
+std::vector<BenchResult> bench_result_encoding(const llama_vocab* vocab) noexcept {
+    constexpr std::array<ResultEncoding, 3> encodings = {
+        ResultEncoding::PRETTY, ResultEncoding::MINIFIED, ResultEncoding::TABLE
+    };
+
+    std::vector<BenchResult> results;
+    for (u32 n_windows : {5u, 20u, 100u}) {
+        const nlohmann::json result = open_windows_result(make_synthetic_windows(n_windows));
+        const u64 iterations = 100'000 / n_windows;
+
+        for (ResultEncoding encoding : encodings) {
+            const std::string encoded = encode_result(result, encoding);
+            std::vector<llama_token> tokens;
+            if (!tokenize_append(vocab, encoded, tokens)) {
+                continue;
+            }
+
+            BenchResult r = run_bench(
+                std::format("encode_result/{}/{}", result_encoding_to_string(encoding), n_windows),
+                iterations,
+                [&] { do_not_optimize(encode_result(result, encoding)); });
+            r.metrics = {
+                { "tokens", static_cast<double>(tokens.size()) },
+                { "bytes", static_cast<double>(encoded.size()) },
+            };
+            results.push_back(std::move(r));
+        }
+    }
+
+    return results;
+}
@@ -0,0 +1,163 @@
+#include "stand_in_model.hpp"
+#include "int_types.hpp"
+#include "prefix_cache.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <random>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <ggml.h>
+#include <gguf.h>
+#include <spdlog/spdlog.h>
+#include <unistd.h>
+
+namespace {
+
+// Small enough to decode thousands of tokens per second on any CPU, with the context of the
+// orchestrator so the same turns fit
+constexpr u32 N_EMBD = 64;
+constexpr u32 N_LAYER = 2;
+constexpr u32 N_HEAD = 4;
+constexpr u32 N_FF = 128;
+constexpr u32 N_CTX_TRAIN = 8192;
+
+bool write_stand_in(const gguf_context* source, const std::filesystem::path& path) {
+    const i64 tokens_key = gguf_find_key(source, "tokenizer.ggml.tokens");
+    if (tokens_key < 0) {
+        spdlog::error("Source model has no tokenizer");
+        return false;
+    }
+    const i64 n_vocab = gguf_get_arr_n(source, tokens_key);
+
+    gguf_context* meta = gguf_init_empty();
+
+    // keep the tokenizer, nothing describing the source architecture
+    gguf_set_kv(meta, source);
+    std::vector<std::string> foreign_keys;
+    for (i64 i = 0; i < gguf_get_n_kv(meta); i++) {
+        const std::string_view key = gguf_get_key(meta, i);
+        if (!key.starts_with("tokenizer.")) {
+            foreign_keys.emplace_back(key);
+        }
+    }
+    for (const std::string& key : foreign_keys) {
+        gguf_remove_key(meta, key.c_str());
+    }
+
+    gguf_set_val_str(meta, "general.architecture", "llama");
+    gguf_set_val_str(meta, "general.name", "autosktop bench stand-in");
+    gguf_set_val_u32(meta, "llama.context_length", N_CTX_TRAIN);
+    gguf_set_val_u32(meta, "llama.embedding_length", N_EMBD);
+    gguf_set_val_u32(meta, "llama.block_count", N_LAYER);
+    gguf_set_val_u32(meta, "llama.feed_forward_length", N_FF);
+    gguf_set_val_u32(meta, "llama.attention.head_count", N_HEAD);
+    gguf_set_val_u32(meta, "llama.attention.head_count_kv", N_HEAD);
+    gguf_set_val_u32(meta, "llama.rope.dimension_count", N_EMBD / N_HEAD);
+    gguf_set_val_f32(meta, "llama.rope.freq_base", 10000.0f);
+    gguf_set_val_f32(meta, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+    struct TensorShape {
+        std::string name;
+        i64 ne0;
+        i64 ne1;
+    };
+
+    // the output projection is left out, llama.cpp then ties it to the token embeddings
+    std::vector<TensorShape> shapes = {
+        { "token_embd.weight", N_EMBD, n_vocab },
+        { "output_norm.weight", N_EMBD, 1 },
+    };
+    for (u32 il = 0; il < N_LAYER; il++) {
+        shapes.push_back({ std::format("blk.{}.attn_norm.weight", il), N_EMBD, 1 });
+        shapes.push_back({ std::format("blk.{}.attn_q.weight", il), N_EMBD, N_EMBD });
+        shapes.push_back({ std::format("blk.{}.attn_k.weight", il), N_EMBD, N_EMBD });
+        shapes.push_back({ std::format("blk.{}.attn_v.weight", il), N_EMBD, N_EMBD });
+        shapes.push_back({ std::format("blk.{}.attn_output.weight", il), N_EMBD, N_EMBD });
+        shapes.push_back({ std::format("blk.{}.ffn_norm.weight", il), N_EMBD, 1 });
+        shapes.push_back({ std::format("blk.{}.ffn_gate.weight", il), N_EMBD, N_FF });
+        shapes.push_back({ std::format("blk.{}.ffn_up.weight", il), N_EMBD, N_FF });
+        shapes.push_back({ std::format("blk.{}.ffn_down.weight", il), N_FF, N_EMBD });
+    }
+
+    size_t mem_size = 0;
+    for (const TensorShape& shape : shapes) {
+        mem_size += ggml_tensor_overhead() + shape.ne0 * shape.ne1 * sizeof(float) + 64;
+    }
+    ggml_context* tensors = ggml_init(ggml_init_params { .mem_size = mem_size, .mem_buffer = nullptr, .no_alloc = false });
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> weight_dist(0.0f, 0.02f);
+    for (const TensorShape& shape : shapes) {
+        ggml_tensor* tensor = shape.ne1 == 1
+            ? ggml_new_tensor_1d(tensors, GGML_TYPE_F32, shape.ne0)
+            : ggml_new_tensor_2d(tensors, GGML_TYPE_F32, shape.ne0, shape.ne1);
+        ggml_set_name(tensor, shape.name.c_str());
+
+        float* data = static_cast<float*>(tensor->data);
+        const bool is_norm = shape.name.ends_with("norm.weight");
+        for (i64 i = 0; i < ggml_nelements(tensor); i++) {
+            data[i] = is_norm ? 1.0f : weight_dist(rng);
+        }
+        gguf_add_tensor(meta, tensor);
+    }
+
+    // written next to its final path and renamed, a concurrent run never sees half a model
+    std::filesystem::path tmp_path = path;
+    tmp_path += std::format(".tmp{}", getpid());
+    const bool written = gguf_write_to_file(meta, tmp_path.c_str(), false);
+
+    ggml_free(tensors);
+    gguf_free(meta);
+
+    std::error_code ec;
+    if (written) {
+        std::filesystem::rename(tmp_path, path, ec);
+    }
+    if (!written || ec) {
+        std::filesystem::remove(tmp_path, ec);
+        spdlog::error("Failed to write the stand-in model {}", path.string());
+        return false;
+    }
+
+    return true;
+}
+
+}
+
+std::optional<std::string> stand_in_model(const std::string& source_path) noexcept {
+    if (const char* model_env = std::getenv("AUTOSKTOP_BENCH_MODEL"); model_env && *model_env) {
+        return std::string(model_env);
+    }
+
+    const std::string_view known_sha256 = source_path == DEFAULT_ORCHESTRATOR_PATH ? DEFAULT_ORCHESTRATOR_SHA256 : "";
+    std::error_code ec;
+    const std::filesystem::path path = std::filesystem::temp_directory_path(ec)
+        / std::format("autosktop-bench-{}.gguf", model_cache_key(source_path, known_sha256));
+    if (ec) {
+        spdlog::error("No temporary directory for the stand-in model: {}", ec.message());
+        return std::nullopt;
+    }
+
+    if (std::filesystem::exists(path, ec)) {
+        return path.string();
+    }
+
+    gguf_context* source = gguf_init_from_file(source_path.c_str(), gguf_init_params { .no_alloc = true, .ctx = nullptr });
+    if (source == nullptr) {
+        spdlog::error("Error: unable to read the tokenizer of {}", source_path);
+        return std::nullopt;
+    }
+
+    spdlog::info("Generating the stand-in model {} from the tokenizer of {}", path.string(), source_path);
+    const bool ok = write_stand_in(source, path);
+    gguf_free(source);
+
+    if (!ok) {
+        return std::nullopt;
+    }
+    return path.string();
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <optional>
+#include <string>
+
+// Path of a tiny llama-architecture model with random weights that shares the tokenizer of
+// `source_path`, so every stage runs CPU-only in milliseconds while tokenizing exactly like the
+// orchestrator model. It is generated on first use and reused afterwards, so only that first
+// run needs the source model. AUTOSKTOP_BENCH_MODEL overrides it with a ready-made model.
+[[nodiscard]] std::optional<std::string> stand_in_model(const std::string& source_path) noexcept;
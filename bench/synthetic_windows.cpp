@@ -0,0 +1,69 @@
+#include "synthetic_windows.hpp"
+
+#include <array>
+#include <format>
+#include <random>
+#include <string_view>
+
+namespace {
+
+struct AppTemplate {
+    std::string_view app_id;
+    // the title is prefix + subject + suffix
+    std::string_view title_prefix;
+    std::string_view title_suffix;
+};
+
+constexpr std::array<AppTemplate, 10> APPS = {{
+    { "firefox", "", " — Mozilla Firefox" },
+    { "org.gnome.Terminal", "user@workstation: ~/src/", "" },
+    { "code", "", ".cpp - autosktop - Visual Studio Code" },
+    { "com.system76.CosmicFiles", "", " — Files" },
+    { "org.mozilla.Thunderbird", "Inbox - ", " - Mozilla Thunderbird" },
+    { "Slack", "", " | Slack" },
+    { "org.gnome.Evince", "", ".pdf" },
+    { "spotify", "", " - Spotify" },
+    { "com.system76.CosmicEdit", "", ".md — COSMIC Text Editor" },
+    { "org.libreoffice.LibreOffice.Calc", "", ".ods - LibreOffice Calc" },
+}};
+
+constexpr std::array<std::string_view, 12> SUBJECTS = {
+    "quarterly-report", "orchestrator", "Pull Request #412: Fix KV eviction", "build logs",
+    "design notes", "release checklist", "llama.cpp", "wayland protocols", "meeting agenda",
+    "invoice 2024-03", "kernel", "team standup",
+};
+
+}
+
+std::vector<WindowInfo> make_synthetic_windows(u32 n_windows, u32 seed) noexcept {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> app_dist(0, APPS.size() - 1);
+    std::uniform_int_distribution<size_t> subject_dist(0, SUBJECTS.size() - 1);
+    std::uniform_int_distribution<u64> id_dist;
+
+    std::vector<WindowInfo> windows;
+    windows.reserve(n_windows);
+    for (u32 i = 0; i < n_windows; i++) {
+        const AppTemplate& app = APPS[app_dist(rng)];
+        windows.push_back(WindowInfo {
+            .window_id = std::format("{:016x}{:016x}", id_dist(rng), id_dist(rng)),
+            .title = std::format("{}{}{}", app.title_prefix, SUBJECTS[subject_dist(rng)], app.title_suffix),
+            .app_id = std::string(app.app_id),
+        });
+    }
+
+    return windows;
+}
+
+nlohmann::json open_windows_result(const std::vector<WindowInfo>& windows) {
+    nlohmann::json arr = nlohmann::json::array();
+    for (const WindowInfo& w : windows) {
+        arr.push_back(window_info_to_json(w));
+    }
+
+    nlohmann::json out;
+    out["ok"] = true;
+    out["action"] = "get_open_windows";
+    out["windows"] = std::move(arr);
+    return out;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <vector>
+
+#include "int_types.hpp"
+#include "window_state_provider.hpp"
+
+// Deterministic window set resembling a desktop session: common applications, titles with
+// documents, paths and URLs, and opaque identifiers like the ones compositors hand out
+[[nodiscard]] std::vector<WindowInfo> make_synthetic_windows(u32 n_windows, u32 seed = 42) noexcept;
+
+// Result of get_open_windows over `windows`, as WindowStateProvider reports it
+[[nodiscard]] nlohmann::json open_windows_result(const std::vector<WindowInfo>& windows);
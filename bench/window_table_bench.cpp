@@ -0,0 +1,106 @@
+#include "bench.hpp"
+#include "synthetic_windows.hpp"
+#include "window_table.hpp"
+
+#include <deque>
+#include <format>
+#include <unordered_map>
+
+namespace {
+
+// The window cache before WindowTable: twin maps keyed by handle and by heap std::string,
+// queried by copying
+struct LegacyCache {
+    std::unordered_map<u64, WindowInfo> by_handle;
+    std::unordered_map<std::string, u64> handle_by_id;
+
+    void insert(u64 handle, const WindowInfo& info) {
+        by_handle[handle] = info;
+        handle_by_id[info.window_id] = handle;
+    }
+
+    void erase(u64 handle) {
+        auto it = by_handle.find(handle);
+        handle_by_id.erase(it->second.window_id);
+        by_handle.erase(it);
+    }
+
+    std::vector<WindowInfo> get_open_windows() const {
+        std::vector<WindowInfo> out;
+        out.reserve(by_handle.size());
+        for (const auto& [_, info] : by_handle) {
+            out.push_back(info);
+        }
+        return out;
+    }
+
+    std::optional<WindowInfo> get_window_state(std::string_view window_id) const {
+        auto it_handle = handle_by_id.find(std::string(window_id));
+        if (it_handle == handle_by_id.end()) return std::nullopt;
+        return by_handle.at(it_handle->second);
+    }
+};
+
+}
+
+// Lookups, full listings and churn (a window closing and another opening) against a cache
+// holding `n_windows` toplevels
+std::vector<BenchResult> bench_window_table() noexcept {
+    std::vector<BenchResult> results;
+
+    for (u32 n_windows : {10u, 1'000u, 50'000u}) {
+        // the churn benchmarks cycle through the second half
+        const std::vector<WindowInfo> windows = make_synthetic_windows(n_windows * 2);
+        const u64 lookups = 1'000'000;
+        const u64 listings = std::max<u64>(10, 1'000'000 / n_windows);
+        const u64 churns = 200'000;
+
+        LegacyCache legacy;
+        for (u32 i = 0; i < n_windows; i++) {
+            legacy.insert(i, windows[i]);
+        }
+
+        WindowTable table;
+        std::deque<WindowKey> keys;
+        for (u32 i = 0; i < n_windows; i++) {
+            keys.push_back(table.insert(windows[i]));
+        }
+
+        u64 i = 0;
+        results.push_back(run_bench(std::format("window_table/legacy/lookup/{}", n_windows), lookups, [&] {
+            do_not_optimize(legacy.get_window_state(windows[i++ % n_windows].window_id));
+        }));
+        i = 0;
+        results.push_back(run_bench(std::format("window_table/table/lookup/{}", n_windows), lookups, [&] {
+            do_not_optimize(table.find(windows[i++ % n_windows].window_id));
+        }));
+
+        results.push_back(run_bench(std::format("window_table/legacy/list/{}", n_windows), listings, [&] {
+            do_not_optimize(legacy.get_open_windows());
+        }));
+        results.push_back(run_bench(std::format("window_table/table/list/{}", n_windows), listings, [&] {
+            size_t n_bytes = 0;
+            for (size_t row = 0; row < table.size(); row++) {
+                n_bytes += table[row].title.size();
+            }
+            do_not_optimize(n_bytes);
+        }));
+
+        u64 oldest = 0;
+        u64 next = n_windows;
+        results.push_back(run_bench(std::format("window_table/legacy/churn/{}", n_windows), churns, [&] {
+            legacy.erase(oldest++);
+            legacy.insert(next, windows[next % windows.size()]);
+            next++;
+        }));
+        next = n_windows;
+        results.push_back(run_bench(std::format("window_table/table/churn/{}", n_windows), churns, [&] {
+            table.erase(keys.front());
+            keys.pop_front();
+            keys.push_back(table.insert(windows[next++ % windows.size()]));
+        }));
+        results.back().metrics = { { "interned", static_cast<double>(table.n_interned()) } };
+    }
+
+    return results;
+}
@@ -1,12 +1,28 @@
 #pragma once
 
-#include "orchestrator.hpp"
+#include <memory>
+
+#include "assistant.hpp"
+#include "daemon.hpp"
+
+enum class AppMode {
+    // one conversation on the console
+    INTERACTIVE,
+    // sessions for many clients on a Unix socket
+    DAEMON,
+};
 
 class Application {
 public:
-    Application() noexcept;
+    explicit Application(AppMode mode = AppMode::INTERACTIVE) noexcept;
     ~Application() noexcept;
 
 private:
-    Orchestrator orchestrator;
+    // Console session on top of an Assistant until end of input, SIGTERM or Ctrl-C while idle.
+    // A new prompt or Ctrl-C cancels the answer being generated.
+    void run_interactive() noexcept;
+    void run_daemon() noexcept;
+
+    Assistant assistant;
+    std::unique_ptr<Daemon> daemon;
 };
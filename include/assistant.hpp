@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <expected>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "blocking_queue.hpp"
+#include "int_types.hpp"
+#include "orchestrator.hpp"
+
+struct AssistantCallbacks {
+    // a piece of the answer to `turn` as soon as it is generated, on the inference thread
+    std::function<void(u64 turn, std::string_view piece)> on_output {};
+    // once per submitted prompt, after the last piece of its answer, on the inference thread
+    std::function<void(u64 turn, Orchestrator::TurnOutcome outcome)> on_turn_end {};
+    // once the system prompt is warm, on the inference thread
+    std::function<void()> on_ready {};
+};
+
+// An Orchestrator on its own inference thread, for embedding in another program. Prompts are
+// submitted without waiting and answered one at a time in order; answers are streamed to the
+// callbacks rather than printed.
+class Assistant {
+public:
+    Assistant() noexcept = default;
+    // Cancels the turn being answered and drops the queued ones
+    ~Assistant() noexcept;
+    Assistant(const Assistant&) = delete;
+    Assistant& operator=(const Assistant&) = delete;
+
+    // Loads the model named by the environment while the providers of the running compositor connect
+    [[nodiscard]] std::expected<void, OrchestratorError> init(AssistantCallbacks callbacks) noexcept;
+    // Loads the model of `options` and starts the inference thread, which warms the system prompt
+    // first. Prompts submitted meanwhile wait for it.
+    [[nodiscard]] std::expected<void, OrchestratorError> init(
+        const OrchestratorOptions& options, PendingStateProviders providers, AssistantCallbacks callbacks) noexcept;
+
+    // Queues `prompt` and returns its turn, counted from 1, or 0 once the assistant is finishing.
+    // Prompts may be queued before init(); they are answered once the model is ready.
+    u64 submit(std::string prompt) noexcept;
+    // Stops the turn being answered, if any; queued prompts are still answered
+    void cancel() noexcept;
+    // Answers the prompts queued so far, then stops the inference thread
+    void finish() noexcept;
+    // Whether a prompt is queued or being answered
+    [[nodiscard]] bool busy() const noexcept { return m_n_pending.load() > 0; }
+
+private:
+    struct Turn {
+        u64 id;
+        std::string prompt;
+    };
+
+    void run() noexcept;
+
+    Orchestrator m_orchestrator {};
+    AssistantCallbacks m_callbacks {};
+    BlockingQueue<Turn> m_turns {};
+    std::atomic<u64> m_next_turn { 1 };
+    // submitted and not answered yet
+    std::atomic<u64> m_n_pending { 0 };
+    // set while the queue is dropped, so turns left in it end cancelled
+    std::atomic<bool> m_dropping { false };
+
+    // a cancel() lands on the turn that is running when it is called, never on the next one
+    std::mutex m_turn_mutex {};
+    u64 m_current_turn { 0 };
+
+    std::jthread m_worker {};
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// C interface of the Assistant in assistant.hpp
+
+typedef struct autosktop autosktop;
+
+enum autosktop_turn_outcome {
+    AUTOSKTOP_TURN_COMPLETED,
+    AUTOSKTOP_TURN_CANCELLED,
+    AUTOSKTOP_TURN_FAILED,
+};
+
+// Called on the inference thread. Either function may be NULL.
+struct autosktop_callbacks {
+    // a piece of the answer to `turn`, `len` bytes of UTF-8 that are not NUL-terminated
+    void (*on_output)(void* user_data, uint64_t turn, const char* piece, size_t len);
+    // once per submitted prompt, after the last piece of its answer
+    void (*on_turn_end)(void* user_data, uint64_t turn, enum autosktop_turn_outcome outcome);
+    void* user_data;
+};
+
+// Loads the model at `model_path`, or the one named by the environment if it is NULL, and
+// connects to the running compositor. Blocks until the model is loaded; NULL on failure.
+autosktop* autosktop_new(const char* model_path, const struct autosktop_callbacks* callbacks);
+// Queues `prompt` without waiting for it to be answered. Returns its turn, counted from 1.
+uint64_t autosktop_submit(autosktop* assistant, const char* prompt);
+// Stops the turn being answered; queued prompts are still answered
+void autosktop_cancel(autosktop* assistant);
+// 1 while a prompt is queued or being answered, 0 otherwise
+int autosktop_busy(const autosktop* assistant);
+// Cancels the turn being answered, drops the queued ones and unloads the model
+void autosktop_free(autosktop* assistant);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Unbounded multi-producer multi-consumer queue. Once closed, pop() drains what is left
+// and then returns nothing.
+template <typename T>
+class BlockingQueue {
+public:
+    // Returns false if the queue is closed
+    bool push(T value) noexcept {
+        {
+            std::lock_guard lock(m_mutex);
+            if (m_closed) {
+                return false;
+            }
+            m_items.push_back(std::move(value));
+        }
+        m_cv.notify_one();
+        return true;
+    }
+
+    // Blocks until an item is available or the queue is closed and empty
+    [[nodiscard]] std::optional<T> pop() noexcept {
+        std::unique_lock lock(m_mutex);
+        m_cv.wait(lock, [this] { return !m_items.empty() || m_closed; });
+        if (m_items.empty()) {
+            return std::nullopt;
+        }
+
+        T value = std::move(m_items.front());
+        m_items.pop_front();
+        return value;
+    }
+
+    [[nodiscard]] std::optional<T> try_pop() noexcept {
+        std::lock_guard lock(m_mutex);
+        if (m_items.empty()) {
+            return std::nullopt;
+        }
+
+        T value = std::move(m_items.front());
+        m_items.pop_front();
+        return value;
+    }
+
+    void close() noexcept {
+        {
+            std::lock_guard lock(m_mutex);
+            m_closed = true;
+        }
+        m_cv.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<T> m_items;
+    bool m_closed { false };
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <thread>
+
+// Reads prompt lines from stdin and catches Ctrl-C on its own thread, so neither waits
+// for a generation to finish. SIGINT and SIGTERM must be blocked in every thread before
+// start() is called (see block_termination_signals()).
+class ConsoleInput {
+public:
+    struct Callbacks {
+        std::function<void(std::string line)> on_line;
+        std::function<void()> on_interrupt;
+        // end of input or SIGTERM, nothing more will be delivered
+        std::function<void()> on_close;
+    };
+
+    ~ConsoleInput() noexcept;
+
+    [[nodiscard]] bool start(Callbacks callbacks) noexcept;
+    void stop() noexcept;
+
+private:
+    void run() noexcept;
+
+    Callbacks m_callbacks {};
+    int m_signal_fd { -1 };
+    int m_wake_fd { -1 };
+    std::jthread m_thread {};
+};
+
+// Blocks SIGINT and SIGTERM in the calling thread and the threads it creates afterwards,
+// so they are only delivered through ConsoleInput
+void block_termination_signals() noexcept;
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <expected>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <llama.h>
+
+#include "int_types.hpp"
+#include "message.hpp"
+
+enum class ConversationHistoryError {
+    TOKENIZE_FAILED
+};
+
+// Tokenizes `text` (parsing special tokens) and appends the result to `out`
+[[nodiscard]] bool tokenize_append(const llama_vocab* vocab, std::string_view text, std::vector<llama_token>& out) noexcept;
+
+// Conversation store that keeps the whole prompt as one contiguous token buffer.
+// Every message is tokenized exactly once, when it is appended, so assembling the
+// prompt for a turn costs the same no matter how long the conversation is.
+class ConversationHistory {
+public:
+    struct Entry {
+        Message message;
+        // span of the message (header, content and end of turn) in the token buffer
+        u32 offset;
+        u32 n_tokens;
+        // order of the append, never reused, so an entry can be told apart from the ones that
+        // took its place after an eviction or truncation
+        u64 id;
+        // earlier entries this one points back to, e.g. the results an unchanged result stands for
+        std::vector<u64> refers_to;
+    };
+
+    // Tokenizes the fixed prefix of every prompt: the beginning of text and the system message
+    [[nodiscard]] std::expected<void, ConversationHistoryError> init(const llama_vocab* vocab, const Message& system) noexcept;
+
+    // `refers_to` are the ids of entries the message points back to; they are kept for as long as it is
+    [[nodiscard]] std::expected<void, ConversationHistoryError> append(
+        Message message, std::vector<u64> refers_to = {}) noexcept;
+    // Appends an assistant message using the tokens that were sampled for it, which keeps
+    // the buffer identical to what is already in the KV cache
+    void append_generated(std::string content, std::span<const llama_token> generated) noexcept;
+
+    // Drops every message from entry `n_entries` on, e.g. the rest of a cancelled turn
+    void truncate(size_t n_entries) noexcept;
+
+    // The prompt for the next assistant turn: every message followed by an open assistant header.
+    // The span stays valid until the history is modified.
+    [[nodiscard]] std::span<const llama_token> prompt() noexcept;
+    // Size of prompt() in tokens
+    [[nodiscard]] size_t n_prompt_tokens() const noexcept {
+        return m_tokens.size() + (m_turn_open ? 0 : m_assistant_header.size());
+    }
+
+    struct TokenRange {
+        u32 offset;
+        u32 n_tokens;
+    };
+
+    // Removes the least useful messages before the current turn and returns the tokens they
+    // occupied, or nothing when only the system prompt and the current turn are left.
+    // Provider results of earlier turns go first, together with the command that requested
+    // them, then whole turns from the oldest on. An entry another one refers to is only removed
+    // after it, so a reference never outlives its target.
+    [[nodiscard]] std::optional<TokenRange> evict_oldest() noexcept;
+
+    [[nodiscard]] const std::vector<Entry>& entries() const noexcept { return m_entries; }
+    // Whether the entry with `id` is still in the history
+    [[nodiscard]] bool contains(u64 id) const noexcept;
+    // The fixed prefix shared by every prompt (beginning of text and system message)
+    [[nodiscard]] std::span<const llama_token> prefix() const noexcept {
+        return std::span(m_tokens).first(m_n_prefix);
+    }
+
+private:
+    void close_turn() noexcept;
+    // Removes entries [first, last) and their tokens
+    [[nodiscard]] TokenRange erase(size_t first, size_t last) noexcept;
+    // Whether an entry after `last` refers to one of the entries [first, last)
+    [[nodiscard]] bool referenced(size_t first, size_t last) const noexcept;
+
+    const llama_vocab* m_vocab { nullptr };
+
+    std::vector<llama_token> m_tokens {};
+    std::vector<Entry> m_entries {};
+    u32 m_n_prefix { 0 };
+    u64 m_next_id { 0 };
+
+    // pre-tokenized chat template pieces
+    std::vector<llama_token> m_assistant_header {};
+    std::vector<llama_token> m_eot {};
+    // whether m_tokens currently ends with m_assistant_header
+    bool m_turn_open { false };
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <expected>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <llama.h>
+
+#include "int_types.hpp"
+#include "memory_budget.hpp"
+
+enum class CpuTuningError {
+    NO_CACHE_DIR,
+    NOT_FOUND,
+    IO_ERROR,
+    MISMATCH,
+    NO_THREADPOOL,
+    CONTEXT_CREATION_FAILED,
+    DECODE_FAILED,
+};
+
+// When a model running on the CPU gets its thread and batch configuration benchmarked
+enum class CpuTuning {
+    // llama.cpp's defaults
+    OFF,
+    // the stored profile, tuned on the first run without one
+    AUTO,
+    // tuned again on every start, replacing the stored profile
+    FORCE
+};
+
+[[nodiscard]] std::optional<CpuTuning> cpu_tuning_from_string(std::string_view str) noexcept;
+[[nodiscard]] std::string_view cpu_tuning_to_string(CpuTuning tuning) noexcept;
+
+// Execution settings that were fastest for one CPU, model and KV cache type
+struct CpuProfile {
+    // threads generating one token at a time
+    i32 n_threads { 0 };
+    // threads evaluating prompts
+    i32 n_threads_batch { 0 };
+    i32 n_batch { 0 };
+    i32 n_ubatch { 0 };
+    bool flash_attn { false };
+    // threads run on a ggml threadpool bound to one logical CPU per physical core
+    bool pin_threads { false };
+    // measured throughput, in tokens per second
+    double prefill_tps { 0.0 };
+    double decode_tps { 0.0 };
+};
+
+// The "model name" of /proc/cpuinfo, "unknown" if there is none
+[[nodiscard]] std::string cpu_model_name() noexcept;
+// The logical CPUs this process may run on, one per physical core first, then their siblings
+[[nodiscard]] std::vector<i32> cpu_order(size_t* n_physical = nullptr) noexcept;
+// Names the stored profile of this CPU for `model_key` (see model_cache_key) and `kv_type`
+[[nodiscard]] std::string cpu_profile_key(std::string_view model_key, KvCacheType kv_type) noexcept;
+
+[[nodiscard]] std::expected<CpuProfile, CpuTuningError> load_cpu_profile(std::string_view key) noexcept;
+[[nodiscard]] std::expected<void, CpuTuningError> store_cpu_profile(std::string_view key, const CpuProfile& profile) noexcept;
+// Benchmarks prompt and generation throughput across thread counts, pinning, ubatch and batch
+// sizes and flash attention, within what `plan` allows, on short-lived contexts of `model`
+[[nodiscard]] std::expected<CpuProfile, CpuTuningError> tune_cpu(llama_model* model, const MemoryPlan& plan) noexcept;
+// The stored profile, tuned and stored first according to `tuning`. nullopt with OFF or if
+// tuning fails, in which case llama.cpp's defaults apply.
+[[nodiscard]] std::optional<CpuProfile> cpu_profile(
+    llama_model* model, std::string_view model_key, const MemoryPlan& plan, CpuTuning tuning) noexcept;
+// Thread counts, batch sizes and flash attention of `profile`, on top of the memory plan:
+// the ubatch never grows past the one the plan sized the compute buffers for
+void apply_cpu_profile(const CpuProfile& profile, llama_context_params& params) noexcept;
+
+// Threadpools pinned to one logical CPU per physical core, used by a context for as long as
+// they are attached. Must outlive the context they are attached to.
+class CpuThreadpools {
+public:
+    CpuThreadpools() noexcept = default;
+    ~CpuThreadpools() noexcept;
+    CpuThreadpools(const CpuThreadpools&) = delete;
+    CpuThreadpools& operator=(const CpuThreadpools&) = delete;
+
+    // Sets the thread counts of `profile` on `ctx`, through pinned threadpools if it pins them
+    [[nodiscard]] std::expected<void, CpuTuningError> attach(llama_context* ctx, const CpuProfile& profile) noexcept;
+    // Returns `ctx` to llama.cpp's own threads and frees the threadpools
+    void detach(llama_context* ctx) noexcept;
+
+private:
+    void free() noexcept;
+
+    // looked up with the threadpools, the CPU backend may be a loaded module
+    void (*m_free)(struct ggml_threadpool*) { nullptr };
+    struct ggml_threadpool* m_decode { nullptr };
+    struct ggml_threadpool* m_batch { nullptr };
+};
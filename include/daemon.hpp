@@ -0,0 +1,212 @@
+#pragma once
+
+#include <expected>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <llama.h>
+#include <nlohmann/json.hpp>
+
+#include "blocking_queue.hpp"
+#include "conversation_history.hpp"
+#include "cpu_tuning.hpp"
+#include "int_types.hpp"
+#include "kv_sequence.hpp"
+#include "metrics.hpp"
+#include "metrics_server.hpp"
+#include "orchestrator.hpp"
+#include "output_classifier.hpp"
+#include "response_cache.hpp"
+#include "thread_pool.hpp"
+#include "unix_socket.hpp"
+
+// Upper bound for DaemonOptions::max_sessions, well below the sequences llama.cpp supports
+const u32 MAX_DAEMON_SESSIONS = 64;
+
+struct DaemonOptions {
+    std::filesystem::path socket_path;
+    // clients served at once, each with its own conversation and KV sequence
+    u32 max_sessions { 4 };
+    // empty to serve no metrics
+    std::filesystem::path metrics_socket {};
+};
+
+// Options as configured by the environment (AUTOSKTOP_SOCKET, AUTOSKTOP_MAX_SESSIONS,
+// AUTOSKTOP_METRICS_SOCKET)
+[[nodiscard]] DaemonOptions daemon_options_from_env() noexcept;
+// $XDG_RUNTIME_DIR/autosktop/autosktop.sock, or nothing without a runtime directory
+[[nodiscard]] std::filesystem::path default_daemon_socket_path() noexcept;
+// $XDG_RUNTIME_DIR/autosktop/daemon-metrics.sock, apart from the interactive mode's socket so
+// both can run at once
+[[nodiscard]] std::filesystem::path default_daemon_metrics_socket_path() noexcept;
+
+// Serves many clients from one loaded model over a local Unix socket. Every connection is a
+// session with its own conversation, mapped to its own sequence of one shared llama_context.
+// Sequence 0 holds the system prompt, which new sessions copy instead of prefilling it.
+//
+// A single engine thread owns the context. Each step it packs the next token of every
+// generating session and as much pending prompt as fits into one llama_decode call, so sessions
+// share every forward pass instead of taking turns.
+//
+// Clients send one prompt per line and get JSON lines back: {"text": "..."} for every piece of
+// the answer, then {"done": "completed" | "cancelled" | "failed"}. A prompt sent while the
+// previous answer is generated cancels it, like a new prompt in the interactive session.
+class Daemon {
+public:
+    // Loads the model while `providers` finish connecting, then starts listening. The system
+    // prompt is warmed by run(), clients connecting meanwhile wait in the listen backlog.
+    [[nodiscard]] std::expected<void, OrchestratorError> init(
+        const OrchestratorOptions& options, const DaemonOptions& daemon_options, PendingStateProviders providers) noexcept;
+    ~Daemon() noexcept;
+
+    // Serves clients until SIGINT or SIGTERM, which must be blocked (see block_termination_signals())
+    int run() noexcept;
+
+private:
+    enum class SessionState {
+        // waiting for a prompt
+        IDLE,
+        // prompt tokens left to decode
+        PREFILL,
+        // one sampled token to decode per step
+        DECODE,
+        // waiting for a provider call to return
+        PROVIDER,
+    };
+
+    enum class TurnOutcome {
+        COMPLETED,
+        CANCELLED,
+        FAILED
+    };
+
+    struct Session {
+        u64 id { 0 };
+        // -1 once closed
+        int fd { -1 };
+        KvSequence kv {};
+        ConversationHistory history {};
+        // grammar state is per session, the plain greedy sampler is shared
+        llama_sampler* json_smpl { nullptr };
+        SessionState state { SessionState::IDLE };
+
+        std::string in_buffer {};
+        std::string out_buffer {};
+        // the client shut down its end, the session closes once its answer is sent
+        bool input_closed { false };
+
+        // provider results in history that unchanged state can refer back to
+        ResponseCache responses {};
+
+        // current turn; provider results of an older turn are dropped
+        u64 turn { 0 };
+        size_t n_turn_entries { 0 };
+        // commands run in the current turn
+        u32 n_commands { 0 };
+        i64 t_turn_start_us { 0 };
+        bool first_token { false };
+
+        // current generation
+        std::span<const llama_token> prompt {};
+        llama_token next_token { LLAMA_TOKEN_NULL };
+        i32 n_decode { 0 };
+        llama_sampler* active_smpl { nullptr };
+        OutputClassifier classifier {};
+        std::string text {};
+        std::vector<llama_token> generated {};
+    };
+
+    // The results of one command, complete once every request of it returned
+    struct ProviderResult {
+        u64 session_id;
+        u64 turn;
+        std::vector<StateRequest> requests;
+        // of each provider's state, read before its request ran; nullopt for results that
+        // are not to be referred back to
+        std::vector<std::optional<u64>> generations;
+        std::vector<nlohmann::json> results;
+        // history entries of the earlier results the unchanged ones stand for
+        std::vector<u64> refers_to;
+    };
+
+    // what a session put in the current batch
+    struct BatchPart {
+        Session* session;
+        std::span<const llama_token> tokens;
+        // batch index of the logits to sample from, -1 for a partial prefill
+        i32 logits_index;
+    };
+
+    void accept_client() noexcept;
+    // Reads prompts from the client, false once it hung up
+    [[nodiscard]] bool read_client(Session& session) noexcept;
+    // Sends as much of the session's pending output as the socket takes, false on error
+    [[nodiscard]] bool flush_client(Session& session) noexcept;
+    void close_session(Session& session) noexcept;
+    void send(Session& session, const nlohmann::json& message) noexcept;
+
+    void on_prompt(Session& session, std::string prompt) noexcept;
+    void begin_generation(Session& session) noexcept;
+    // Records a sampled token, then either queues it for decoding or ends the generation
+    void on_token(Session& session, llama_token id) noexcept;
+    void end_generation(Session& session) noexcept;
+    void on_provider_result(ProviderResult result) noexcept;
+    void finish_turn(Session& session, TurnOutcome outcome) noexcept;
+
+    // Evicts old messages until the session's prompt and a full generation fit in its share of the context
+    [[nodiscard]] bool fit_context(Session& session) noexcept;
+    // Decodes one batch for every session with work, false if there was nothing to do
+    bool step() noexcept;
+
+    void init_metrics(const std::filesystem::path& socket_path) noexcept;
+    [[nodiscard]] std::string metrics_summary(double& n_tokens_seen) const noexcept;
+
+    llama_model* m_model { nullptr };
+    llama_context* m_ctx { nullptr };
+    llama_sampler* m_smpl { nullptr };
+    // cloned into every session, nullptr if JSON output is not constrained
+    llama_sampler* m_json_smpl { nullptr };
+    const llama_vocab* m_vocab { nullptr };
+    llama_batch m_batch {};
+    std::vector<BatchPart> m_batch_parts {};
+
+    // sequence 0, the system prompt every session starts from
+    KvSequence m_prefix_kv {};
+    // history with only the system prompt, copied into new sessions
+    ConversationHistory m_history {};
+    StateProviders m_state_providers {};
+    ResultEncoding m_result_encoding { ResultEncoding::MINIFIED };
+    // what run() needs to warm the system prompt
+    std::string m_model_path {};
+    KvCacheType m_kv_type { KvCacheType::F16 };
+    llama_flash_attn_type m_flash_attn { LLAMA_FLASH_ATTN_TYPE_AUTO };
+    bool m_prefix_cache { true };
+    // pages of the model read ahead while it loads
+    std::future<void> m_prefetch {};
+    // resident memory the memory plan projected, reported against the actual one after warm-up
+    u64 m_projected_rss { 0 };
+    // pinned threads of m_ctx, if its CPU profile pins them
+    CpuThreadpools m_threadpools {};
+    // context tokens each session may use
+    u32 m_n_ctx_seq { 0 };
+
+    std::vector<std::unique_ptr<Session>> m_sessions {};
+    std::vector<llama_seq_id> m_free_seq_ids {};
+    u64 m_next_session_id { 1 };
+    // first session offered prefill room in the next batch, rotated for fairness
+    size_t m_next_prefill { 0 };
+
+    UnixListener m_listener {};
+    int m_signal_fd { -1 };
+    // filled by the provider pool, drained by the engine thread
+    BlockingQueue<ProviderResult> m_provider_results {};
+
+    Metrics m_metrics {};
+    ThreadPool m_provider_pool { N_PROVIDER_THREADS };
+    // declared last so it stops before anything it reads is destroyed
+    MetricsServer m_metrics_server {};
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <expected>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <llama.h>
+
+#include "cpu_tuning.hpp"
+#include "int_types.hpp"
+#include "kv_sequence.hpp"
+#include "memory_budget.hpp"
+
+enum class DraftModelError {
+    MODEL_LOAD_FAILED,
+    CONTEXT_CREATION_FAILED,
+    INCOMPATIBLE_VOCAB,
+    EVALUATION_FAILED,
+};
+
+// Small model of the same family as the orchestrator model that greedily proposes the next
+// few tokens, which the orchestrator model then verifies in a single batched decode
+class DraftModel {
+public:
+    // Loads the weights, placed like the orchestrator model's, before the memory plan that counts them
+    [[nodiscard]] std::expected<void, DraftModelError> load(
+        const std::string& path, const llama_vocab* target_vocab, i32 n_gpu_layers, bool cpu_only) noexcept;
+    // Creates the context with the size, KV cache type and threads of the orchestrator context
+    [[nodiscard]] std::expected<void, DraftModelError> init(
+        const MemoryPlan& plan, const std::optional<CpuProfile>& cpu_profile) noexcept;
+    ~DraftModel() noexcept;
+
+    [[nodiscard]] const llama_model* model() const noexcept { return m_model; }
+
+    // Proposes up to `n_draft` tokens that follow `context` and then `last`, into `out`
+    [[nodiscard]] std::expected<void, DraftModelError> propose(
+        std::span<const llama_token> context, llama_token last, i32 n_draft, std::vector<llama_token>& out) noexcept;
+    // Mirrors an eviction from the orchestrator context, see KvSequence::erase
+    void erase(size_t p0, size_t n) noexcept { m_kv.erase(p0, n); }
+
+private:
+    llama_model* m_model { nullptr };
+    llama_context* m_ctx { nullptr };
+    llama_sampler* m_smpl { nullptr };
+    const llama_vocab* m_vocab { nullptr };
+
+    KvSequence m_kv {};
+};
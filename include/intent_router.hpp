@@ -0,0 +1,84 @@
+#pragma once
+
+#include <expected>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <llama.h>
+#include <nlohmann/json.hpp>
+
+#include "int_types.hpp"
+#include "state_request.hpp"
+
+enum class IntentRouterError {
+    MODEL_LOAD_FAILED,
+    CONTEXT_CREATION_FAILED,
+    EMBEDDING_FAILED,
+    NO_INTENTS,
+};
+
+// Prompts answered straight from one provider request, without the orchestrator model
+enum class Intent {
+    LIST_WINDOWS,
+    LIST_WORKSPACES,
+    LIST_ACTIVE_WORKSPACE_WINDOWS,
+};
+
+struct IntentMatch {
+    Intent intent;
+    // cosine similarity of the prompt to the closest example of the intent
+    float similarity;
+};
+
+// Similarity a prompt needs to an example before it skips the orchestrator model
+const float DEFAULT_ROUTER_THRESHOLD = 0.85f;
+// Prompts longer than this many tokens usually ask for more than one intent covers
+const i32 ROUTER_MAX_TOKENS = 24;
+
+// The request that answers `intent`
+[[nodiscard]] StateRequest intent_request(Intent intent);
+// The answer to `intent` given the result of its request
+[[nodiscard]] std::string render_intent_answer(Intent intent, const nlohmann::json& result);
+
+// Matches prompts against example phrasings of each intent with a small embedding model.
+// The examples are embedded once per model and kept in the on-disk cache, so a lookup costs
+// one short embedding pass.
+class IntentRouter {
+public:
+    IntentRouter() noexcept = default;
+    ~IntentRouter() noexcept;
+    IntentRouter(const IntentRouter&) = delete;
+    IntentRouter& operator=(const IntentRouter&) = delete;
+
+    // Loads the embedding model at `model_path` and the examples of the intents whose request
+    // `available` accepts, e.g. the ones a registered provider serves
+    [[nodiscard]] std::expected<void, IntentRouterError> init(const std::string& model_path, i32 n_gpu_layers,
+        float threshold, const std::function<bool(const StateRequest&)>& available) noexcept;
+
+    // The intent `prompt` asks for, nullopt unless an example is at least as similar as the
+    // threshold and no other intent comes close
+    [[nodiscard]] std::optional<IntentMatch> match(std::string_view prompt) noexcept;
+
+private:
+    // Normalized embedding of `text` into `out`, which holds m_n_embd floats
+    [[nodiscard]] bool embed(std::string_view text, std::span<float> out, i32 max_tokens = 0) noexcept;
+    // Reads the example embeddings from the cache, or embeds and stores them
+    [[nodiscard]] std::expected<void, IntentRouterError> load_examples(const std::string& model_path) noexcept;
+
+    llama_model* m_model { nullptr };
+    llama_context* m_ctx { nullptr };
+    const llama_vocab* m_vocab { nullptr };
+    i32 m_n_embd { 0 };
+    float m_threshold { DEFAULT_ROUTER_THRESHOLD };
+
+    // one row of m_n_embd floats per example, every example of every intent
+    std::vector<float> m_embeddings {};
+    std::vector<Intent> m_example_intents {};
+    // examples of intents no provider serves are skipped at match time
+    std::vector<bool> m_available {};
+    std::vector<llama_token> m_tokens {};
+};
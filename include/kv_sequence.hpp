@@ -0,0 +1,54 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include <llama.h>
+
+#include "int_types.hpp"
+
+// Mirror of the tokens held by one sequence of a llama_context's KV cache, used to decode
+// only what is not cached yet. Positions are the indices into tokens().
+class KvSequence {
+public:
+    KvSequence() noexcept = default;
+    ~KvSequence() noexcept;
+    KvSequence(const KvSequence&) = delete;
+    KvSequence& operator=(const KvSequence&) = delete;
+
+    void init(llama_context* ctx, llama_seq_id seq_id, i32 n_batch) noexcept;
+
+    // Keeps the longest cached prefix of `prompt`, drops the rest and decodes the missing tokens.
+    // With `need_logits` the last prompt token is always decoded, so it can be sampled from.
+    [[nodiscard]] bool sync(std::span<const llama_token> prompt, bool need_logits = true) noexcept;
+    // The first half of sync(): keeps the longest cached prefix of `prompt`, drops the rest and
+    // returns the number of tokens kept, leaving the decoding of the remainder to the caller
+    [[nodiscard]] size_t reuse(std::span<const llama_token> prompt, bool need_logits = true) noexcept;
+    // Appends `tokens` at the end of the sequence. Logits are kept for the last token, or for
+    // every token with `all_logits` (batch index i holds the logits after tokens[i]).
+    [[nodiscard]] bool decode(std::span<const llama_token> tokens, bool all_logits = false) noexcept;
+    // Drops every token from position `n_keep` on
+    void truncate(size_t n_keep) noexcept;
+    // Removes the tokens at positions [p0, p0 + n) and shifts everything after them back by n,
+    // so the remaining cache stays valid without decoding it again
+    void erase(size_t p0, size_t n) noexcept;
+    // Records that `tokens` were loaded into the sequence from outside, e.g. a saved state
+    void assign(std::span<const llama_token> tokens) noexcept;
+    // Records that `tokens` were decoded at the end of the sequence by a batch built outside,
+    // e.g. one shared with other sequences
+    void append(std::span<const llama_token> tokens) noexcept;
+    void clear() noexcept;
+
+    [[nodiscard]] const std::vector<llama_token>& tokens() const noexcept { return m_tokens; }
+    [[nodiscard]] llama_seq_id seq_id() const noexcept { return m_seq_id; }
+    // Tokens evaluated by llama_decode since init, including ones truncated since
+    [[nodiscard]] u64 n_decoded() const noexcept { return m_n_decoded; }
+
+private:
+    llama_context* m_ctx { nullptr };
+    llama_seq_id m_seq_id { 0 };
+    i32 m_n_batch { 0 };
+    llama_batch m_batch {};
+    std::vector<llama_token> m_tokens {};
+    u64 m_n_decoded { 0 };
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <llama.h>
+
+#include "int_types.hpp"
+
+// Precision of the KV cache. The quantized types roughly halve and quarter its size; they
+// need flash attention, which the plan turns on with them.
+enum class KvCacheType {
+    F16,
+    Q8_0,
+    Q4_0
+};
+
+[[nodiscard]] std::optional<KvCacheType> kv_cache_type_from_string(std::string_view str) noexcept;
+[[nodiscard]] std::string_view kv_cache_type_to_string(KvCacheType type) noexcept;
+// Parses a byte count with an optional K, M or G suffix (powers of 1024), e.g. "6G"
+[[nodiscard]] std::optional<u64> parse_byte_size(std::string_view str) noexcept;
+
+struct MemoryBudget {
+    // resident bytes the process should stay under, 0 for no budget
+    u64 max_rss_bytes { 0 };
+    // forces the KV cache type instead of letting the budget pick it
+    std::optional<KvCacheType> kv_type {};
+    // upper bound on the context of a sequence, 0 for none
+    i32 max_ctx { 0 };
+};
+
+// What the plan is sized from, read off the loaded model
+struct ModelShape {
+    u64 weights_bytes { 0 };
+    i32 n_layer { 0 };
+    i32 n_head { 0 };
+    i32 n_head_kv { 0 };
+    i32 n_embd { 0 };
+    i32 n_vocab { 0 };
+    i32 n_ctx_train { 0 };
+    // layers whose weights and KV cache live in host memory
+    i32 n_layer_host { 0 };
+};
+
+// A context configuration and the resident memory it is projected to take
+struct MemoryPlan {
+    KvCacheType kv_type { KvCacheType::F16 };
+    // context of each sequence
+    i32 n_ctx { 0 };
+    i32 n_ubatch { 0 };
+    u64 weights_bytes { 0 };
+    u64 kv_bytes { 0 };
+    u64 compute_bytes { 0 };
+    // false if not even the smallest usable configuration fits the budget, which is unusable
+    bool fits { true };
+
+    [[nodiscard]] u64 total_bytes() const noexcept;
+};
+
+// Layers of a model with `n_layer` layers kept in host memory when `n_gpu_layers` are offloaded
+[[nodiscard]] i32 host_layers(i32 n_layer, i32 n_gpu_layers, bool cpu_only) noexcept;
+[[nodiscard]] ModelShape model_shape(const llama_model* model, i32 n_gpu_layers, bool cpu_only) noexcept;
+
+// Whether to lock the weights in memory, decided before loading from the size of the model
+// file: only if they fit the budget, otherwise the kernel must be free to evict their pages.
+// The weights stay memory-mapped either way; locked mapped pages are as resident as a copy.
+[[nodiscard]] bool plan_mlock(const MemoryBudget& budget, u64 file_bytes, bool weights_on_host) noexcept;
+// The largest configuration, up to `n_ctx_max` per sequence, whose projected footprint for
+// `n_seq` sequences fits the budget. The KV cache is quantized before the context shrinks,
+// and q4_0 is only used once q8_0 does not fit at any context. The context never goes below
+// `n_ctx_min`, what a sequence needs to be usable at all, whatever the caps. A `draft` model gets
+// a context of the same configuration, its weights, KV cache and compute are counted in the plan.
+[[nodiscard]] MemoryPlan plan_memory(const MemoryBudget& budget, const ModelShape& shape, i32 n_ctx_max,
+    i32 n_ctx_min, i32 n_batch, u32 n_seq = 1, const std::optional<ModelShape>& draft = std::nullopt) noexcept;
+// Sets the context size, ubatch, KV cache type and flash attention of `params` from `plan`
+void apply_memory_plan(const MemoryPlan& plan, u32 n_seq, llama_context_params& params) noexcept;
+// Logs the plan next to the budget
+void log_memory_plan(const MemoryPlan& plan, const MemoryBudget& budget) noexcept;
+
+// Resident set size of the process, 0 if it cannot be read
+[[nodiscard]] u64 resident_bytes() noexcept;
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+enum class MessagerRole {
+    System, User, Assistant,
+};
+
+[[nodiscard]] std::string_view messager_role_to_string(MessagerRole role) noexcept;
+
+// Llama 3 chat template markers
+constexpr std::string_view MESSAGE_HEADER_START = "<|start_header_id|>";
+constexpr std::string_view MESSAGE_HEADER_END = "<|end_header_id|>";
+constexpr std::string_view MESSAGE_EOT = "<|eot_id|>";
+constexpr std::string_view BEGIN_OF_TEXT = "<|begin_of_text|>";
+
+// The header that opens a turn of `role`, up to and including the newline before the content
+[[nodiscard]] std::string message_header(MessagerRole role) noexcept;
+
+struct Message {
+    MessagerRole role;
+    std::string content;
+
+    [[nodiscard]] std::string to_string() const noexcept;
+};
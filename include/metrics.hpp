@@ -0,0 +1,63 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "int_types.hpp"
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+enum class MetricType {
+    COUNTER,
+    GAUGE,
+    HISTOGRAM,
+};
+
+// Thread-safe registry of metric families, rendered in the Prometheus text exposition format.
+// Families are declared once and then fed by name; each distinct label set is its own series.
+class Metrics {
+public:
+    void add_counter(std::string name, std::string help) noexcept;
+    void add_gauge(std::string name, std::string help) noexcept;
+    // `bounds` are the upper bounds of the buckets, in increasing order
+    void add_histogram(std::string name, std::string help, std::vector<double> bounds) noexcept;
+
+    void increment(std::string_view name, const MetricLabels& labels = {}, double n = 1.0) noexcept;
+    void set(std::string_view name, double value, const MetricLabels& labels = {}) noexcept;
+    void observe(std::string_view name, double value, const MetricLabels& labels = {}) noexcept;
+
+    // Estimate of quantile `q` over every series of a histogram, interpolated within its bucket
+    [[nodiscard]] double quantile(std::string_view name, double q) const noexcept;
+    // Number of observations or the value summed over every series
+    [[nodiscard]] double total(std::string_view name) const noexcept;
+    // Value of one counter or gauge series, 0 if it has not been written yet
+    [[nodiscard]] double value(std::string_view name, const MetricLabels& labels = {}) const noexcept;
+
+    [[nodiscard]] std::string render() const;
+
+private:
+    struct Series {
+        // counter or gauge value, or the sum of the observations
+        double value { 0.0 };
+        u64 count { 0 };
+        // observations per bucket, not cumulative; the last one is +Inf
+        std::vector<u64> buckets {};
+    };
+
+    struct Family {
+        MetricType type;
+        std::string help;
+        std::vector<double> bounds {};
+        // keyed by the rendered label set, e.g. kind="window",action="get_open_windows"
+        std::map<std::string, Series> series {};
+    };
+
+    [[nodiscard]] Series* series(std::string_view name, MetricType type, const MetricLabels& labels) noexcept;
+
+    mutable std::mutex m_mutex;
+    std::map<std::string, Family, std::less<>> m_families;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "metrics.hpp"
+#include "unix_socket.hpp"
+
+// Serves Metrics::render() on a local Unix socket and logs a periodic summary, on its own
+// thread. Both a bare connection (socat) and an HTTP GET (curl --unix-socket) get the metrics.
+class MetricsServer {
+public:
+    // `summary` is called every `interval` and logged unless it returns an empty string
+    struct Options {
+        std::filesystem::path socket_path;
+        std::chrono::seconds interval { 60 };
+        std::function<std::string()> summary {};
+    };
+
+    ~MetricsServer() noexcept;
+
+    [[nodiscard]] bool start(const Metrics& metrics, Options options) noexcept;
+    void stop() noexcept;
+
+private:
+    void run() noexcept;
+    void serve(int client_fd) const noexcept;
+
+    const Metrics* m_metrics { nullptr };
+    Options m_options {};
+    UnixListener m_listener {};
+    int m_wake_fd { -1 };
+    std::jthread m_thread {};
+};
+
+// $XDG_RUNTIME_DIR/autosktop/metrics.sock, or nothing without a runtime directory
+[[nodiscard]] std::filesystem::path default_metrics_socket_path() noexcept;
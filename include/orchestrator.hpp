@@ -1,15 +1,34 @@
 #pragma once
 
+#include <atomic>
 #include <expected>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 #include <llama.h>
 
+#include "conversation_history.hpp"
+#include "cpu_tuning.hpp"
+#include "draft_model.hpp"
+#include "intent_router.hpp"
 #include "int_types.hpp"
+#include "kv_sequence.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "metrics_server.hpp"
+#include "response_cache.hpp"
+#include "result_encoding.hpp"
 #include "state_provider.hpp"
 #include "state_request.hpp"
+#include "thread_pool.hpp"
 
 const std::string SYSTEM_PROMPT = R"(
 You are a desktop assistant that can (1) reply to the user in plain text and (2) operate the desktop by emitting JSON commands executed by a host program.
@@ -19,10 +38,10 @@ CRITICAL OUTPUT RULE: SINGLE MODE ONLY
 For every user turn, you must choose exactly one of these two output modes:
 
 MODE TEXT: Reply in normal plain text.
-MODE JSON: Output exactly one JSON object and nothing else.
+MODE JSON: Output exactly one JSON command and nothing else.
 
 You must NEVER output both text and JSON in the same message.
-If you output JSON, your entire message must be only the JSON object (no extra words, no code fences, no explanation, no leading/trailing text).
+If you output JSON, your entire message must be only the JSON command (no extra words, no code fences, no explanation, no leading/trailing text).
 
 WHEN TO USE TEXT
 
@@ -80,10 +99,14 @@ args is a required JSON object containing provider-specific data.
 
 If either field is missing or wrong, the host will treat it as invalid.
 
+When you need several things that do not depend on each other's results, send them together as a JSON array of up to 8 such objects. They run at the same time and their results come back together as { "results": [ ... ] }, in the same order.
+
 Valid request_kind values
 
 "window" — window management and window state queries
 
+"workspace" — workspaces and the windows on each of them
+
 (Other kinds may exist, but only use kinds you have been told are supported.)
 
 WINDOW REQUEST SCHEMA (request_kind: "window")
@@ -108,15 +131,45 @@ params: optional/empty
 
 params: { "window_id": "<string>" }
 
-"close_window"
+"activate_window"
 
 params: { "window_id": "<string>" }
 
+"close_windows", "minimize_windows", "unminimize_windows", "maximize_windows", "unmaximize_windows", "fullscreen_windows", "unfullscreen_windows", "stick_windows", "unstick_windows"
+
+params: { "window_ids": ["<string>", ...] }
+
+"move_windows_to_workspace"
+
+params: { "window_ids": ["<string>", ...], "workspace_id": "<string>" }
+
+Actions take every window they apply to at once: to close three windows, send one "close_windows" with all three ids, not three commands. The host answers with a status per window.
+
 If you do not know required params (e.g., window_id), request the minimal state first (e.g., open windows or focused window), then issue the action.
 
+WORKSPACE REQUEST SCHEMA (request_kind: "workspace")
+
+Same shape as window requests, with these actions:
+
+"get_workspaces"
+
+params: optional/empty. Lists workspaces with their id, name, whether they are active and how many windows they hold.
+
+"get_active_workspace_windows"
+
+params: optional/empty. The windows on the workspaces currently shown, usually what "my windows" or "this workspace" means.
+
+"get_workspace_windows"
+
+params: { "workspace_id": "<string>" }
+
+Prefer these over "get_open_windows" when the user refers to a workspace; they return only the windows asked about.
+
 HOST RESPONSES
 
-The host replies with JSON describing results. Use the returned data to decide the next step. If you need more information, request it using another JSON command (still exactly one JSON object in your message).
+The host replies with JSON describing results. Use the returned data to decide the next step. If you need more information, request it using another JSON command (still exactly one JSON command in your message).
+
+A result may carry a "result_id". A reply of { "ok": true, "unchanged_since_result": N } means nothing changed since the result with "result_id": N above: that earlier result still holds.
 
 EXAMPLES
 
@@ -132,65 +185,248 @@ Assistant (MODE JSON):
 { "request_kind": "window", "args": { "action": "get_open_windows", "params": {} } }
 
 
+User: what's on my current workspace?
+Assistant (MODE JSON):
+
+{ "request_kind": "workspace", "args": { "action": "get_active_workspace_windows", "params": {} } }
+
+
 User: close the window
 Assistant (MODE JSON):
 
-{ "request_kind": "window", "args": { "action": "close_window", "params": { "window_id": "<focused_window_id>" } } }
+{ "request_kind": "window", "args": { "action": "close_windows", "params": { "window_ids": ["<focused_window_id>"] } } }
 
 
 (If you do not know the focused window id yet, request the minimal state needed first.)
 
+User: which workspaces do I have, and what is open?
+Assistant (MODE JSON):
+
+[{ "request_kind": "workspace", "args": { "action": "get_workspaces", "params": {} } }, { "request_kind": "window", "args": { "action": "get_open_windows", "params": {} } }]
+
+User: close all terminals
+Assistant (MODE JSON):
+
+{ "request_kind": "window", "args": { "action": "close_windows", "params": { "window_ids": ["<terminal_id_1>", "<terminal_id_2>"] } } }
+
 FINAL RULE
 
 If you choose MODE TEXT, do not output JSON.
-If you choose MODE JSON, output only one JSON object matching the schema above.
+If you choose MODE JSON, output only one JSON command matching the schema above: one object, or an array of them.
 )";
 
+extern const Message IDENTITY_MESSAGE;
+
 const i32 N_GPU_LAYERS = 99;
 // Number of tokens to predict
 const i32 N_PREDICT = 128;
-
-enum class MessagerRole {
-    System, User, Assistant,
-};
-
-struct Message {
-    MessagerRole role;
-    std::string content;
-
-    [[nodiscard]] std::string to_string() const noexcept;
-};
+// Capacity of the persistent context, shared by the prompt and the generated tokens
+const i32 N_CTX = 8192;
+// Maximum number of tokens submitted in a single call to llama_decode
+const i32 N_BATCH = 512;
+// Number of tokens proposed by the draft model per verification step
+const i32 N_DRAFT = 8;
+// Conversation a context holds at the least, on top of the system prompt and one generation;
+// the memory plan does not shrink the context below that
+const i32 MIN_HISTORY_TOKENS = 512;
+// Threads the requests of one command run on at once
+const u32 N_PROVIDER_THREADS = 4;
+// Commands run per turn before the model's output is taken as the answer, whatever it is
+const u32 MAX_COMMAND_ROUNDS = 4;
 
 enum class OrchestratorError {
     MODEL_BAD_PATH,
     MODEL_LOAD_FAILED,
+    CONTEXT_CREATION_FAILED,
+    // not even the smallest usable context fits AUTOSKTOP_MEMORY_BUDGET
+    MEMORY_BUDGET_EXCEEDED,
+    TOKENIZE_FAILED,
     STATE_PROVIDER_ERROR,
+    LISTEN_FAILED,
 };
 
+struct OrchestratorOptions {
+    std::string model_path;
+    // the model at model_path, already loaded and shared with other orchestrators; only the
+    // context is this orchestrator's own. Loaded by init() when empty.
+    std::shared_ptr<llama_model> shared_model {};
+    // small model of the same family used for speculative decoding, empty to disable it
+    std::string draft_model_path {};
+    // embedding model that answers common prompts without the orchestrator model, empty to disable it
+    std::string router_model_path {};
+    // similarity a prompt needs to one of the router's examples
+    float router_threshold { DEFAULT_ROUTER_THRESHOLD };
+    // keep the weights and the KV cache off every GPU
+    bool cpu_only { false };
+    // layers offloaded to the GPU when there is one
+    i32 n_gpu_layers { N_GPU_LAYERS };
+    // sizes the context and KV cache, and decides whether the weights are locked in memory
+    MemoryBudget memory {};
+    // thread and batch settings of a model running on the CPU, tuned once per CPU and model
+    CpuTuning cpu_tuning { CpuTuning::AUTO };
+    // restore and store the system prompt state through the on-disk prefix cache
+    bool prefix_cache { true };
+    // Unix socket the metrics are served on, empty to not serve them
+    std::filesystem::path metrics_socket {};
+    // how provider results are written into the history
+    ResultEncoding result_encoding { ResultEncoding::MINIFIED };
+};
+
+// Totals over every run_llm call since init
+struct LLMStats {
+    // prompt tokens that were not cached yet
+    u64 n_prefill { 0 };
+    u64 t_prefill_us { 0 };
+    u64 n_decode { 0 };
+    u64 t_decode_us { 0 };
+};
+
+using StateProviders = std::unordered_map<StateProviderKind, std::unique_ptr<StateProvider>>;
+
+// State providers being connected on another thread, e.g. while the model loads
+using PendingStateProviders = std::future<std::expected<StateProviders, OrchestratorError>>;
+
+// Options as configured by the environment (ORCHESTRATOR_MODEL_PATH and friends)
+[[nodiscard]] OrchestratorOptions orchestrator_options_from_env() noexcept;
+// The providers of the running compositor
+[[nodiscard]] std::expected<StateProviders, OrchestratorError> init_state_providers() noexcept;
+// init_state_providers() on its own thread
+[[nodiscard]] PendingStateProviders init_state_providers_async() noexcept;
+// Loads the model of `options`, kept off the GPU with cpu_only. Returns nullptr on failure.
+[[nodiscard]] llama_model* load_orchestrator_model(const OrchestratorOptions& options) noexcept;
+// Identifies the model at `model_path` in the on-disk caches
+[[nodiscard]] std::string orchestrator_model_key(const std::string& model_path) noexcept;
+// The CPU profile of `model` as options.cpu_tuning asks for it, nullopt if any layer is offloaded
+[[nodiscard]] std::optional<CpuProfile> orchestrator_cpu_profile(
+    llama_model* model, const OrchestratorOptions& options, const MemoryPlan& plan) noexcept;
+// Result sent to the model for a request no registered provider serves
+[[nodiscard]] nlohmann::json missing_provider_result(StateProviderKind kind);
+// The results of one command as a single message: one result as it is, several as
+// {"results": [...]} in the order of their requests
+[[nodiscard]] nlohmann::json merge_results(std::vector<nlohmann::json> results);
+// Greedy sampler constrained to the JSON commands of `providers`, nullptr if the grammar does not parse
+[[nodiscard]] llama_sampler* make_json_sampler(const llama_vocab* vocab, const StateProviders& providers) noexcept;
+// Resets `json_smpl` and replays the tokens sampled unconstrained so far into its grammar.
+// Returns false if they already break the grammar.
+[[nodiscard]] bool enter_json_mode(llama_sampler* json_smpl, std::span<const llama_token> generated) noexcept;
+// Restores the KV state of `prefix` into sequence 0 (`kv`) from the prefix cache, or prefills and caches it.
+// Either way at least one decode runs, so the first turn does not pay for the first graph.
+// `kv_type` and `flash_attn` are those `ctx` was created with, the cache is kept per layout.
+[[nodiscard]] bool warm_system_prompt(llama_context* ctx, KvSequence& kv, std::span<const llama_token> prefix,
+    const std::string& model_path, KvCacheType kv_type, llama_flash_attn_type flash_attn, bool use_cache) noexcept;
+
 class Orchestrator {
 public:
+    // Loads the model named by the environment while the providers of the running compositor connect
     [[nodiscard]] std::expected<void, OrchestratorError> init() noexcept;
+    // Loads the model described by `options` with `providers` as the only state providers,
+    // e.g. to run without a compositor
+    [[nodiscard]] std::expected<void, OrchestratorError> init(const OrchestratorOptions& options, StateProviders providers) noexcept;
+    // Loads the model while `providers` finish connecting, waiting for them only once the
+    // model is ready. The system prompt is warmed later, by warm_up() or on the first turn.
+    [[nodiscard]] std::expected<void, OrchestratorError> init(const OrchestratorOptions& options, PendingStateProviders providers) noexcept;
     ~Orchestrator() noexcept;
 
+    enum class TurnOutcome {
+        COMPLETED,
+        CANCELLED,
+        FAILED
+    };
+
+    // Prefills or restores the system prompt, once. An Assistant does it on its inference thread
+    // so prompts can be submitted meanwhile; answer() does it first if nobody did.
+    void warm_up() noexcept;
+    // Answers one prompt on the calling thread, writing the answer to the output as it is generated
+    [[nodiscard]] TurnOutcome answer(const std::string& user_prompt);
+    // answer(), 1 if the turn failed and 0 otherwise
     int process_prompt(const std::string& user_prompt);
+    // Asks the running generation to stop, checked between and during llama_decode calls
+    void cancel() noexcept { m_cancel.store(true, std::memory_order_relaxed); }
+    // Lets the next turn run after a cancel()
+    void reset_cancel() noexcept { m_cancel.store(false, std::memory_order_relaxed); }
+    // Forgets every turn so far. The system prompt stays in the KV cache for the next one.
+    void new_conversation() noexcept;
+    // Where generated text is written, stdout by default
+    void set_output(std::function<void(std::string_view)> output) noexcept { m_output = std::move(output); }
+    [[nodiscard]] const LLMStats& llm_stats() const noexcept { return m_llm_stats; }
+    // Per-turn latency and throughput, also served on OrchestratorOptions::metrics_socket
+    [[nodiscard]] const Metrics& metrics() const noexcept { return m_metrics; }
 
 private:
-    [[nodiscard]] std::string build_history() noexcept;
-
     enum class LLMError {
-        TOKENIZE_FAILED,
-        CONTEXT_CREATION_FAILED,
+        CANCELLED,
+        CONTEXT_OVERFLOW,
         TOKEN_TO_PIECE_CONVERSION_FAILED,
         EVALUATION_FAILED
     };
 
+    // Answers one prompt, calling a provider and generating again if the model asks for state
+    [[nodiscard]] TurnOutcome run_turn(const std::string& user_prompt);
+    // Answers the prompt just appended to the history from a provider if the router is confident
+    // of its intent. Returns false, leaving the history as it was, if the model has to answer it.
+    [[nodiscard]] bool run_routed(const std::string& user_prompt);
+    // Runs the requests of one command at once and appends their merged results to the history.
+    // Requests whose state did not change since an earlier result get a reference to it instead.
+    [[nodiscard]] bool run_command(std::span<const StateRequest> requests);
     [[nodiscard]] std::expected<std::string, LLMError> run_llm() noexcept;
+    // A failed decode is either an abort requested through cancel() or a real failure
+    [[nodiscard]] LLMError decode_error() const noexcept {
+        return m_cancel.load(std::memory_order_relaxed) ? LLMError::CANCELLED : LLMError::EVALUATION_FAILED;
+    }
+    // Evicts old messages until the prompt and a full generation fit in the context,
+    // removing them from the KV cache and shifting what follows instead of prefilling again
+    [[nodiscard]] std::expected<void, LLMError> fit_context() noexcept;
+    // Declares the metric families and starts serving them if a socket is configured
+    void init_metrics(const std::filesystem::path& socket_path) noexcept;
+    // One line summary of the metrics, empty if no turn completed since the previous one
+    [[nodiscard]] std::string metrics_summary(double& n_turns_seen) const noexcept;
 
-    std::vector<Message> m_history {};
-    std::unordered_map<StateProviderKind, std::unique_ptr<StateProvider>> m_state_providers {};
+    ConversationHistory m_history {};
+    StateProviders m_state_providers {};
 
     llama_model* model = nullptr;
+    // keeps a model from OrchestratorOptions::shared_model alive, which is then not freed here
+    std::shared_ptr<llama_model> m_shared_model {};
     llama_context* ctx = nullptr;
     llama_sampler* smpl = nullptr;
+    // greedy sampler constrained to the JSON commands of the registered providers,
+    // used once the model commits to MODE JSON
+    llama_sampler* m_json_smpl = nullptr;
     const llama_vocab* vocab = nullptr;
+
+    // Tokens whose keys/values currently live in the KV cache of sequence 0
+    KvSequence m_kv {};
+    // optional, enables speculative decoding
+    std::unique_ptr<DraftModel> m_draft {};
+    // optional, answers common prompts without generating
+    std::unique_ptr<IntentRouter> m_router {};
+    // how provider results are written into the history
+    ResultEncoding m_result_encoding { ResultEncoding::MINIFIED };
+    // what warm_up() needs from the options and the context parameters
+    std::string m_model_path {};
+    KvCacheType m_kv_type { KvCacheType::F16 };
+    llama_flash_attn_type m_flash_attn { LLAMA_FLASH_ATTN_TYPE_AUTO };
+    // resident memory the memory plan projected, reported against the actual one after warm-up
+    u64 m_projected_rss { 0 };
+    bool m_prefix_cache { true };
+    bool m_warm { false };
+    // pages of the model read ahead while it loads
+    std::future<void> m_prefetch {};
+    // pinned threads of ctx, if its CPU profile pins them
+    CpuThreadpools m_threadpools {};
+
+    std::function<void(std::string_view)> m_output {};
+    LLMStats m_llm_stats {};
+    Metrics m_metrics {};
+    // start of the turn being answered and whether its first token was timed yet
+    i64 m_turn_start_us { 0 };
+    bool m_turn_first_token { false };
+    // provider results in m_history that unchanged state can refer back to
+    ResponseCache m_responses {};
+
+    std::atomic<bool> m_cancel { false };
+    // provider calls run off the inference worker
+    ThreadPool m_provider_pool { N_PROVIDER_THREADS };
+    // declared last so it stops before anything it reads is destroyed
+    MetricsServer m_metrics_server {};
 };
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string_view>
+
+#include "int_types.hpp"
+
+enum class OutputMode {
+    UNDECIDED, TEXT, JSON,
+};
+
+// Incremental classifier for the assistant output, fed one token piece at a time.
+// The first non-whitespace character decides the mode; in MODE JSON it follows bracket depth
+// and string state so generation can stop as soon as the top-level object or array closes.
+class OutputClassifier {
+public:
+    // Returns how many bytes of `piece` belong to the output: all of them, except for the piece
+    // that closes the top-level JSON value, which is cut after the closing bracket
+    [[nodiscard]] size_t feed(std::string_view piece) noexcept;
+
+    [[nodiscard]] OutputMode mode() const noexcept { return m_mode; }
+    // Whether the top-level JSON object or array has been closed
+    [[nodiscard]] bool complete() const noexcept { return m_complete; }
+
+private:
+    OutputMode m_mode { OutputMode::UNDECIDED };
+    u32 m_depth { 0 };
+    bool m_in_string { false };
+    bool m_escape { false };
+    bool m_complete { false };
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <expected>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include <llama.h>
+
+#include "int_types.hpp"
+#include "memory_budget.hpp"
+
+enum class PrefixCacheError {
+    NO_CACHE_DIR,
+    NOT_FOUND,
+    IO_ERROR,
+    MISMATCH,
+    STATE_REJECTED,
+};
+
+// On-disk cache of the KV state of a fixed prompt prefix (beginning of text and the system
+// message), so startup restores it instead of prefilling it. Files are keyed by the model
+// identity, the KV cache layout (its type and flash attention) and a hash of the prefix tokens;
+// a changed model, cache configuration or system prompt misses the cache.
+class PrefixCache {
+public:
+    [[nodiscard]] std::expected<void, PrefixCacheError> init(std::string_view model_key, KvCacheType kv_type,
+        llama_flash_attn_type flash_attn, std::span<const llama_token> prefix) noexcept;
+
+    // Maps the cache file and loads it into sequence 0 of `ctx`
+    [[nodiscard]] std::expected<void, PrefixCacheError> restore(
+        llama_context* ctx, std::span<const llama_token> prefix) const noexcept;
+    // Saves sequence 0 of `ctx`, which must hold exactly `prefix`
+    [[nodiscard]] std::expected<void, PrefixCacheError> store(
+        llama_context* ctx, std::span<const llama_token> prefix) const noexcept;
+
+    [[nodiscard]] const std::filesystem::path& path() const noexcept { return m_path; }
+
+private:
+    std::filesystem::path m_path {};
+};
+
+// 64-bit FNV-1a of `data`, continuing from `hash`
+[[nodiscard]] u64 fnv1a(const void* data, size_t size, u64 hash = 0xcbf29ce484222325ull) noexcept;
+// $XDG_CACHE_HOME/autosktop or ~/.cache/autosktop, empty if neither variable is set
+[[nodiscard]] std::filesystem::path cache_dir() noexcept;
+
+// Identifies a model file without hashing its contents: the known SHA256 when available,
+// otherwise its path, size and modification time
+[[nodiscard]] std::string model_cache_key(const std::string& model_path, std::string_view known_sha256) noexcept;
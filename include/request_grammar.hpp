@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "state_provider.hpp"
+#include "state_request.hpp"
+
+struct ProviderSchema {
+    StateProviderKind kind;
+    std::vector<ActionSchema> actions;
+};
+
+// Builds a GBNF grammar (root rule "root") that only accepts a JSON command: one request, or
+// an array of up to MAX_STATE_REQUESTS of them, each addressed to one of `providers` with one
+// of its actions and that action's parameters
+[[nodiscard]] std::string build_request_grammar(const std::vector<ProviderSchema>& providers) noexcept;
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <nlohmann/json.hpp>
+
+#include "conversation_history.hpp"
+#include "int_types.hpp"
+#include "state_request.hpp"
+
+// Provider results already in a conversation. Asking again for state that has not changed since
+// is answered with a reference to the earlier result, instead of another copy of it that would
+// have to be prefilled. The reference names the "result_id" written into that result, so it
+// means the same to the model whatever turns were cancelled or evicted in between. A result stays
+// reusable while the provider's generation for the request is unchanged and the result is still
+// in the history.
+class ResponseCache {
+public:
+    // An earlier result that still holds
+    struct Hit {
+        u64 result_id;
+        // the history entry holding it, which the message standing in for it has to refer to
+        u64 entry_id;
+    };
+
+    // The earlier answer to the same request, if that result still holds and is in `history`
+    [[nodiscard]] std::optional<Hit> lookup(
+        const StateRequest& req, std::optional<u64> generation, const ConversationHistory& history) noexcept;
+    // Writes the next result id into `result` if it can be referred back to, i.e. it is an object
+    // read at a known `generation`, and returns the id
+    [[nodiscard]] std::optional<u64> number(nlohmann::json& result, std::optional<u64> generation);
+    // Records that result `result_id` of `req`, read at `generation`, is in history entry `entry_id`
+    void store(const StateRequest& req, u64 generation, u64 result_id, u64 entry_id);
+    void clear() noexcept { m_results.clear(); }
+
+private:
+    struct CachedResult {
+        u64 generation;
+        u64 result_id;
+        u64 entry_id;
+    };
+
+    // requests that only differ in the order of their object keys share an entry
+    [[nodiscard]] static std::string key(const StateRequest& req);
+
+    std::unordered_map<std::string, CachedResult> m_results;
+    // never reused within a conversation, so an id never names two results
+    u64 m_next_result_id { 1 };
+};
+
+// What the model is given instead of a result that is the same as result `result_id`
+[[nodiscard]] nlohmann::json unchanged_result(u64 result_id);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <nlohmann/json.hpp>
+
+// How provider results are written into the history. Every token of a result has to be
+// prefilled, so the compact forms directly cut per-turn latency.
+enum class ResultEncoding {
+    // indented JSON
+    PRETTY,
+    // JSON without whitespace
+    MINIFIED,
+    // scalars as key=value, arrays of flat objects as a header plus one |-separated row per element
+    TABLE,
+};
+
+std::optional<ResultEncoding> result_encoding_from_string(std::string_view str) noexcept;
+std::string_view result_encoding_to_string(ResultEncoding encoding) noexcept;
+
+[[nodiscard]] std::string encode_result(const nlohmann::json& result, ResultEncoding encoding) noexcept;
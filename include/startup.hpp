@@ -0,0 +1,28 @@
+#pragma once
+
+#include <filesystem>
+#include <future>
+#include <string_view>
+
+// Milliseconds since the process started
+[[nodiscard]] double startup_elapsed_ms() noexcept;
+
+// Times one phase of startup for as long as it lives. Phases run on several threads at once,
+// so the log records when each one began and ended relative to the process start, not just
+// how long it took.
+class StartupPhase {
+public:
+    explicit StartupPhase(std::string_view name) noexcept : m_name(name), m_t_begin_ms(startup_elapsed_ms()) {}
+    ~StartupPhase() noexcept;
+    StartupPhase(const StartupPhase&) = delete;
+    StartupPhase& operator=(const StartupPhase&) = delete;
+
+private:
+    std::string_view m_name;
+    double m_t_begin_ms;
+};
+
+// Reads `path` into the page cache on another thread, so the pages of a memory-mapped model
+// are resident before the first decode faults them in. The future is ready once the reads
+// are issued.
+[[nodiscard]] std::future<void> prefetch_file(const std::filesystem::path& path) noexcept;
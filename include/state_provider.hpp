@@ -1,20 +1,42 @@
 #pragma once
 
 #include <expected>
+#include <optional>
+#include <string>
 #include <variant>
+#include <vector>
 
+#include "int_types.hpp"
 #include "state_request.hpp"
 
 enum class WindowStateProviderError {
     WL_DISPLAY_CONNECT_ERROR,
+    WL_UNSUPPORTED_COMPOSITOR,
+    EVENT_LOOP_ERROR
+};
+
+enum class WorkspaceStateProviderError {
     WL_UNSUPPORTED_COMPOSITOR
 };
 
-using StateProviderError = std::variant<WindowStateProviderError>;
+using StateProviderError = std::variant<WindowStateProviderError, WorkspaceStateProviderError>;
+
+// One action accepted by a provider, used to constrain the JSON commands the model can emit
+struct ActionSchema {
+    std::string name;
+    // required string parameters of the action
+    std::vector<std::string> params;
+    // required parameters holding a list of strings, e.g. the windows an action applies to
+    std::vector<std::string> list_params {};
+};
 
 class StateProvider {
 public:
     virtual std::expected<void, StateProviderError> init() noexcept = 0;
     virtual ~StateProvider() noexcept = default;
     virtual nlohmann::json processRequest(StateRequest req) noexcept = 0;
+    [[nodiscard]] virtual std::vector<ActionSchema> actions() const noexcept = 0;
+    // Version of the state `req` reads: while it stays the same, so does the response. nullopt
+    // if the response may not be reused, e.g. because the request changes state.
+    [[nodiscard]] virtual std::optional<u64> generation(const StateRequest& /*req*/) const noexcept { return std::nullopt; }
 };
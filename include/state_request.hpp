@@ -1,6 +1,7 @@
 #pragma once
 
 #include <expected>
+#include <vector>
 
 #include <nlohmann/json.hpp>
 
@@ -9,13 +10,24 @@ enum class StateRequestError {
 };
 
 enum class StateProviderKind {
-    WINDOW
+    WINDOW,
+    WORKSPACE
 };
 
 std::optional<StateProviderKind> state_provider_kind_from_string(std::string_view str) noexcept;
+std::string_view state_provider_kind_to_string(StateProviderKind kind) noexcept;
+
+// Most requests one command may bundle
+constexpr size_t MAX_STATE_REQUESTS = 8;
 
 struct StateRequest {
-    [[nodiscard]] static std::expected<StateRequest, StateRequestError> from_json(std::string_view str) noexcept;
+    // Parses a command: a single request object, or an array of up to MAX_STATE_REQUESTS of them
+    [[nodiscard]] static std::expected<std::vector<StateRequest>, StateRequestError> from_json(std::string_view str) noexcept;
     StateProviderKind kind;
     nlohmann::json args;
+
+    // args.action, empty if there is none
+    [[nodiscard]] std::string_view action() const noexcept;
+    // The request as the model would have written it
+    [[nodiscard]] nlohmann::json to_json() const;
 };
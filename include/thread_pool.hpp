@@ -0,0 +1,31 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "blocking_queue.hpp"
+#include "int_types.hpp"
+
+// Fixed set of worker threads running submitted tasks in submission order
+class ThreadPool {
+public:
+    explicit ThreadPool(u32 n_threads) noexcept;
+    ~ThreadPool() noexcept;
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    template <typename F>
+    [[nodiscard]] std::future<std::invoke_result_t<F>> submit(F&& fn) noexcept {
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(fn));
+        std::future<std::invoke_result_t<F>> result = task->get_future();
+        m_tasks.push([task] { (*task)(); });
+        return result;
+    }
+
+private:
+    BlockingQueue<std::function<void()>> m_tasks;
+    std::vector<std::jthread> m_workers;
+};
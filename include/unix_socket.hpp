@@ -0,0 +1,29 @@
+#pragma once
+
+#include <filesystem>
+#include <string_view>
+
+#include <sys/types.h>
+
+// $XDG_RUNTIME_DIR/autosktop/<name>, or nothing without a runtime directory
+[[nodiscard]] std::filesystem::path runtime_socket_path(std::string_view name) noexcept;
+
+// Whether another process accepts connections on the socket at `path`
+[[nodiscard]] bool unix_socket_in_use(const std::filesystem::path& path) noexcept;
+
+// A listening socket and the file it is bound to. The file is identified by its inode, so it is
+// only removed while it is still the one this process bound.
+struct UnixListener {
+    int fd { -1 };
+    std::filesystem::path path {};
+    dev_t dev { 0 };
+    ino_t ino { 0 };
+};
+
+// Creates a Unix stream socket listening on `path`, readable by the current user only.
+// Missing parent directories are created and a stale socket left behind by a previous run is
+// replaced, but a socket another process still accepts on is not. Returns a listener with
+// fd -1 after logging the error.
+[[nodiscard]] UnixListener listen_unix_socket(const std::filesystem::path& path, int backlog) noexcept;
+// Closes the socket and removes its file, unless another process has replaced it since
+void close_unix_listener(UnixListener& listener) noexcept;
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <optional>
+#include <string>
+#include <string_view>
+
+enum class WindowActionKind {
+    CLOSE,
+    ACTIVATE,
+    MINIMIZE,
+    UNMINIMIZE,
+    MAXIMIZE,
+    UNMAXIMIZE,
+    FULLSCREEN,
+    UNFULLSCREEN,
+    STICK,
+    UNSTICK,
+    MOVE_TO_WORKSPACE,
+};
+
+struct WindowAction {
+    WindowActionKind kind;
+    std::string window_id;
+    // id or name of the target workspace, MOVE_TO_WORKSPACE only
+    std::string workspace {};
+};
+
+enum class WindowActionStatus {
+    // sent, not confirmed yet; never returned
+    PENDING,
+    // confirmed by the compositor, or already in effect
+    DONE,
+    NOT_FOUND,
+    WORKSPACE_NOT_FOUND,
+    // the compositor does not offer the request
+    UNSUPPORTED,
+    // the window closed before the action was confirmed
+    WINDOW_CLOSED,
+    TIMED_OUT,
+};
+
+// Provider action that applies one kind of action to the windows in its "window_ids" parameter,
+// or to the one in "window_id" for ACTIVATE
+struct WindowActionCommand {
+    std::string_view name;
+    WindowActionKind kind;
+};
+
+inline constexpr std::array WINDOW_ACTION_COMMANDS = {
+    WindowActionCommand { "close_windows", WindowActionKind::CLOSE },
+    WindowActionCommand { "activate_window", WindowActionKind::ACTIVATE },
+    WindowActionCommand { "minimize_windows", WindowActionKind::MINIMIZE },
+    WindowActionCommand { "unminimize_windows", WindowActionKind::UNMINIMIZE },
+    WindowActionCommand { "maximize_windows", WindowActionKind::MAXIMIZE },
+    WindowActionCommand { "unmaximize_windows", WindowActionKind::UNMAXIMIZE },
+    WindowActionCommand { "fullscreen_windows", WindowActionKind::FULLSCREEN },
+    WindowActionCommand { "unfullscreen_windows", WindowActionKind::UNFULLSCREEN },
+    WindowActionCommand { "stick_windows", WindowActionKind::STICK },
+    WindowActionCommand { "unstick_windows", WindowActionKind::UNSTICK },
+    WindowActionCommand { "move_windows_to_workspace", WindowActionKind::MOVE_TO_WORKSPACE },
+};
+
+[[nodiscard]] std::optional<WindowActionKind> window_action_from_command(std::string_view name) noexcept;
+[[nodiscard]] std::string_view window_action_status_to_string(WindowActionStatus status) noexcept;
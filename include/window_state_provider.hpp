@@ -1,23 +1,63 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
 #include <optional>
+#include <span>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <string_view>
-#include <unordered_map>
 #include <vector>
 #include <expected>
 
 #include <wayland-client-protocol.h>
 #include <wayland-client.h>
+#include <cosmic-toplevel-info-unstable-v1-client-protocol.h>
+#include <cosmic-toplevel-management-unstable-v1-client-protocol.h>
 #include <ext-foreign-toplevel-list-v1-client-protocol.h>
+#include <ext-workspace-v1-client-protocol.h>
 
+#include "blocking_queue.hpp"
+#include "int_types.hpp"
 #include "state_provider.hpp"
 #include "state_request.hpp"
+#include "window_action.hpp"
+#include "window_table.hpp"
+#include "workspace_index.hpp"
 
-struct WindowInfo {
-    std::string window_id;
-    std::string title;
-    std::string app_id;
+// How long apply() waits for the compositor to confirm a batch of actions
+constexpr std::chrono::milliseconds WINDOW_ACTION_TIMEOUT { 1000 };
+
+// The object a window is reported as in provider results
+[[nodiscard]] nlohmann::json window_info_to_json(const WindowView& window);
+[[nodiscard]] inline nlohmann::json window_info_to_json(const WindowInfo& info) {
+    return window_info_to_json(WindowView { info.window_id, info.title, info.app_id });
+}
+
+// Read-only view of the window cache. It holds the cache's read lock for its lifetime so the
+// views it hands out stay valid; keep it short-lived, the event thread waits for it to apply
+// window changes.
+class WindowSnapshot {
+public:
+    WindowSnapshot(const WindowTable& table, const WorkspaceIndex& workspaces, std::shared_mutex& mutex) noexcept
+        : m_lock(mutex), m_table(table), m_workspaces(workspaces) {}
+
+    [[nodiscard]] size_t size() const noexcept { return m_table.size(); }
+    [[nodiscard]] WindowView operator[](size_t i) const noexcept { return m_table[i]; }
+    [[nodiscard]] std::optional<WindowView> find(std::string_view window_id) const noexcept {
+        return m_table.find(window_id);
+    }
+    [[nodiscard]] std::optional<WindowView> get(WindowKey key) const noexcept { return m_table.get(key); }
+    // Workspaces and the windows on each, consistent with the windows of this snapshot
+    [[nodiscard]] const WorkspaceIndex& workspaces() const noexcept { return m_workspaces; }
+
+private:
+    std::shared_lock<std::shared_mutex> m_lock;
+    const WindowTable& m_table;
+    const WorkspaceIndex& m_workspaces;
 };
 
 class WindowStateProvider : public StateProvider {
@@ -25,26 +65,148 @@ public:
     ~WindowStateProvider() noexcept;
     std::expected<void, StateProviderError> init() noexcept;
     nlohmann::json processRequest(StateRequest req) noexcept;
+    [[nodiscard]] std::vector<ActionSchema> actions() const noexcept;
+    // generation() for the queries, nothing for the window actions
+    [[nodiscard]] std::optional<u64> generation(const StateRequest& req) const noexcept;
+
+    // Windows as of their last done event, served from the cache kept current by the event
+    // thread without compositor round-trips
+    [[nodiscard]] WindowSnapshot snapshot() const noexcept {
+        return WindowSnapshot(m_windows, m_workspace_index, m_mutex);
+    }
+    // Whether the compositor announced ext-workspace-v1 and has not finished it since, so
+    // snapshots carry current workspaces
+    [[nodiscard]] bool tracks_workspaces() const noexcept {
+        return m_tracks_workspaces.load(std::memory_order_acquire);
+    }
+    // Replaces the cached windows, so the provider can serve requests without a compositor
+    // (benchmarks). Not meant to be mixed with init().
+    void replace_windows(std::span<const WindowInfo> windows);
+
+    // Incremented every time a window change is applied to the cache
+    [[nodiscard]] u64 generation() const noexcept { return m_generation.load(std::memory_order_acquire); }
 
-    [[nodiscard]] std::vector<WindowInfo> get_open_windows() noexcept;
-    [[nodiscard]] std::optional<WindowInfo> get_window_state(std::string_view window_id) noexcept;
+    // Sends every action through cosmic-toplevel-management in a single flush, then waits until
+    // each one is confirmed by its window's done or closed events, or `timeout` passes.
+    // Returns one status per action, in order.
+    [[nodiscard]] std::vector<WindowActionStatus> apply(
+        std::vector<WindowAction> actions, std::chrono::milliseconds timeout = WINDOW_ACTION_TIMEOUT) noexcept;
 
 private:
     wl_display* m_display { nullptr };
     wl_registry* m_registry { nullptr };
-    void pump_events() noexcept;
+
+    // Reads and dispatches Wayland events as they arrive until m_stop_fd is signalled
+    void event_loop() noexcept;
+    std::jthread m_event_thread {};
+    int m_epoll_fd { -1 };
+    int m_stop_fd { -1 };
 
     ext_foreign_toplevel_list_v1* m_ext_list { nullptr };
     bool m_initial_done { false };
 
-    struct CachedWindow {
-        WindowInfo info {};
-        ext_foreign_toplevel_handle_v1* ext_handle { nullptr };
-        bool seen_done { false };
+    // optional globals, window actions are unsupported without the cosmic ones
+    zcosmic_toplevel_info_v1* m_cosmic_info { nullptr };
+    zcosmic_toplevel_manager_v1* m_cosmic_manager { nullptr };
+    // bit n set for every zcosmic_toplelevel_management_capabilities_v1 value n
+    std::atomic<u32> m_cosmic_capabilities { 0 };
+    // only touched by init() and the event thread, other threads read m_tracks_workspaces
+    ext_workspace_manager_v1* m_workspace_manager { nullptr };
+    std::atomic<bool> m_tracks_workspaces { false };
+    wl_seat* m_seat { nullptr };
+    // bound so the outputs in toplevel events resolve to objects
+    std::vector<wl_output*> m_outputs;
+
+    // What cosmic-toplevel-info reports about a toplevel, applied with its done event
+    struct CosmicState {
+        // bit n set for every zcosmic_toplevel_handle_v1_state value n
+        u32 states { 0 };
+        wl_output* output { nullptr };
+        std::vector<ext_workspace_handle_v1*> workspaces {};
     };
 
-    std::unordered_map<ext_foreign_toplevel_handle_v1*, CachedWindow> m_by_handle;
-    std::unordered_map<std::string, ext_foreign_toplevel_handle_v1*> m_handle_by_id;
+    // Per-handle state, passed as the handle's listener data so events need no lookup.
+    // Only touched while dispatching, so it needs no lock.
+    struct Toplevel {
+        WindowStateProvider* self;
+        ext_foreign_toplevel_handle_v1* handle;
+        // state received since the last done event
+        WindowInfo pending {};
+        // row in m_windows, set by the first done event
+        std::optional<WindowKey> key {};
+        // position in m_toplevels
+        size_t index;
+        // nullptr without cosmic-toplevel-info
+        zcosmic_toplevel_handle_v1* cosmic { nullptr };
+        CosmicState cosmic_state {};
+        // workspaces as of the last done event, the ones recorded in m_workspace_index
+        std::vector<ext_workspace_handle_v1*> indexed_workspaces {};
+    };
+    std::vector<std::unique_ptr<Toplevel>> m_toplevels;
+
+    // Per-handle state of a workspace, applied with the manager's done event
+    struct Workspace {
+        WindowStateProvider* self;
+        ext_workspace_handle_v1* handle;
+        // state received since the last done event
+        WorkspaceInfo pending {};
+        WorkspaceSlot slot;
+        bool changed { false };
+        // destroyed with the next done event
+        bool removed { false };
+        // position in m_workspaces
+        size_t index;
+    };
+    std::vector<std::unique_ptr<Workspace>> m_workspaces;
+
+    struct WorkspaceGroup {
+        WindowStateProvider* self;
+        ext_workspace_group_handle_v1* handle;
+        // handed out in announcement order, shared by the group's workspaces
+        u32 id;
+    };
+    std::vector<std::unique_ptr<WorkspaceGroup>> m_workspace_groups;
+    u32 m_next_group_id { 0 };
+
+    // Actions submitted by one apply() call, owned by the event thread once queued
+    struct ActionBatch {
+        std::vector<WindowAction> actions;
+        std::vector<WindowActionStatus> status {};
+        // window and workspace each action targets, resolved when the batch is sent
+        std::vector<Toplevel*> targets {};
+        std::vector<ext_workspace_handle_v1*> workspaces {};
+        size_t n_pending { 0 };
+        std::chrono::steady_clock::time_point deadline;
+        std::promise<std::vector<WindowActionStatus>> done {};
+    };
+    BlockingQueue<std::unique_ptr<ActionBatch>> m_action_queue;
+    // signalled when a batch is queued
+    int m_action_fd { -1 };
+    // batches waiting for confirmations, only touched by the event thread
+    std::vector<std::unique_ptr<ActionBatch>> m_action_batches;
+
+    // Resolves the targets of a batch and sends its requests in one flush
+    void send_batch(std::unique_ptr<ActionBatch> batch) noexcept;
+    // Settles the pending actions on `toplevel` after its done or closed event
+    void settle_actions(const Toplevel& toplevel, bool closed) noexcept;
+    // Times out the pending actions of expired batches, or of every batch with `all`
+    void expire_batches(std::chrono::steady_clock::time_point now, bool all) noexcept;
+    // Hands the result of every settled batch back to its apply() call
+    void finish_batches() noexcept;
+    [[nodiscard]] bool supports(WindowActionKind kind) const noexcept;
+
+    // Records the workspaces `toplevel` entered and left since its previous done event, with
+    // m_mutex held
+    void index_workspaces(Toplevel& toplevel);
+    // Applies the workspace changes received since the previous done event of the manager
+    void apply_workspaces();
+
+    // guards m_windows and m_workspace_index, written by the event thread and read by queries
+    mutable std::shared_mutex m_mutex;
+    std::atomic<u64> m_generation { 0 };
+    // state of every toplevel as of its last done event, the only one queries see
+    WindowTable m_windows;
+    WorkspaceIndex m_workspace_index;
 
     // Wayland registry callbacks
     static void on_registry_global(
@@ -87,4 +249,131 @@ private:
         .app_id = on_handle_app_id,
         .identifier = on_handle_identifier,
     };
+
+    // zcosmic_toplevel_manager_v1 callbacks
+    static void on_manager_capabilities(
+        void* data, zcosmic_toplevel_manager_v1* manager, wl_array* capabilities);
+
+    static constexpr zcosmic_toplevel_manager_v1_listener COSMIC_MANAGER_LISTENER = {
+        .capabilities = on_manager_capabilities,
+    };
+
+    // zcosmic_toplevel_info_v1 callbacks, only the done event is sent to version 2 and later
+    static void on_cosmic_info_toplevel(
+        void* data, zcosmic_toplevel_info_v1* info, zcosmic_toplevel_handle_v1* toplevel);
+    static void on_cosmic_info_finished(
+        void* data, zcosmic_toplevel_info_v1* info);
+    static void on_cosmic_info_done(
+        void* data, zcosmic_toplevel_info_v1* info);
+
+    static constexpr zcosmic_toplevel_info_v1_listener COSMIC_INFO_LISTENER = {
+        .toplevel = on_cosmic_info_toplevel,
+        .finished = on_cosmic_info_finished,
+        .done = on_cosmic_info_done,
+    };
+
+    // zcosmic_toplevel_handle_v1 callbacks, data is the handle's Toplevel. The deprecated
+    // events are not sent for handles from get_cosmic_toplevel and are ignored.
+    static void on_cosmic_closed(
+        void* data, zcosmic_toplevel_handle_v1* handle);
+    static void on_cosmic_done(
+        void* data, zcosmic_toplevel_handle_v1* handle);
+    static void on_cosmic_title(
+        void* data, zcosmic_toplevel_handle_v1* handle, const char* title);
+    static void on_cosmic_app_id(
+        void* data, zcosmic_toplevel_handle_v1* handle, const char* app_id);
+    static void on_cosmic_output_enter(
+        void* data, zcosmic_toplevel_handle_v1* handle, wl_output* output);
+    static void on_cosmic_output_leave(
+        void* data, zcosmic_toplevel_handle_v1* handle, wl_output* output);
+    static void on_cosmic_workspace_enter(
+        void* data, zcosmic_toplevel_handle_v1* handle, zcosmic_workspace_handle_v1* workspace);
+    static void on_cosmic_workspace_leave(
+        void* data, zcosmic_toplevel_handle_v1* handle, zcosmic_workspace_handle_v1* workspace);
+    static void on_cosmic_state(
+        void* data, zcosmic_toplevel_handle_v1* handle, wl_array* state);
+    static void on_cosmic_geometry(
+        void* data, zcosmic_toplevel_handle_v1* handle, wl_output* output, i32 x, i32 y, i32 width, i32 height);
+    static void on_cosmic_ext_workspace_enter(
+        void* data, zcosmic_toplevel_handle_v1* handle, ext_workspace_handle_v1* workspace);
+    static void on_cosmic_ext_workspace_leave(
+        void* data, zcosmic_toplevel_handle_v1* handle, ext_workspace_handle_v1* workspace);
+
+    static constexpr zcosmic_toplevel_handle_v1_listener COSMIC_HANDLE_LISTENER = {
+        .closed = on_cosmic_closed,
+        .done = on_cosmic_done,
+        .title = on_cosmic_title,
+        .app_id = on_cosmic_app_id,
+        .output_enter = on_cosmic_output_enter,
+        .output_leave = on_cosmic_output_leave,
+        .workspace_enter = on_cosmic_workspace_enter,
+        .workspace_leave = on_cosmic_workspace_leave,
+        .state = on_cosmic_state,
+        .geometry = on_cosmic_geometry,
+        .ext_workspace_enter = on_cosmic_ext_workspace_enter,
+        .ext_workspace_leave = on_cosmic_ext_workspace_leave,
+    };
+
+    // ext_workspace_manager_v1 callbacks
+    static void on_workspace_manager_group(
+        void* data, ext_workspace_manager_v1* manager, ext_workspace_group_handle_v1* group);
+    static void on_workspace_manager_workspace(
+        void* data, ext_workspace_manager_v1* manager, ext_workspace_handle_v1* workspace);
+    static void on_workspace_manager_done(
+        void* data, ext_workspace_manager_v1* manager);
+    static void on_workspace_manager_finished(
+        void* data, ext_workspace_manager_v1* manager);
+
+    static constexpr ext_workspace_manager_v1_listener WORKSPACE_MANAGER_LISTENER = {
+        .workspace_group = on_workspace_manager_group,
+        .workspace = on_workspace_manager_workspace,
+        .done = on_workspace_manager_done,
+        .finished = on_workspace_manager_finished,
+    };
+
+    // ext_workspace_group_handle_v1 callbacks, data is the handle's WorkspaceGroup
+    static void on_group_capabilities(
+        void* data, ext_workspace_group_handle_v1* group, u32 capabilities);
+    static void on_group_output_enter(
+        void* data, ext_workspace_group_handle_v1* group, wl_output* output);
+    static void on_group_output_leave(
+        void* data, ext_workspace_group_handle_v1* group, wl_output* output);
+    static void on_group_workspace_enter(
+        void* data, ext_workspace_group_handle_v1* group, ext_workspace_handle_v1* workspace);
+    static void on_group_workspace_leave(
+        void* data, ext_workspace_group_handle_v1* group, ext_workspace_handle_v1* workspace);
+    static void on_group_removed(
+        void* data, ext_workspace_group_handle_v1* group);
+
+    static constexpr ext_workspace_group_handle_v1_listener WORKSPACE_GROUP_LISTENER = {
+        .capabilities = on_group_capabilities,
+        .output_enter = on_group_output_enter,
+        .output_leave = on_group_output_leave,
+        .workspace_enter = on_group_workspace_enter,
+        .workspace_leave = on_group_workspace_leave,
+        .removed = on_group_removed,
+    };
+
+    // ext_workspace_handle_v1 callbacks, data is the handle's Workspace
+    static void on_workspace_id(
+        void* data, ext_workspace_handle_v1* handle, const char* id);
+    static void on_workspace_name(
+        void* data, ext_workspace_handle_v1* handle, const char* name);
+    static void on_workspace_coordinates(
+        void* data, ext_workspace_handle_v1* handle, wl_array* coordinates);
+    static void on_workspace_state(
+        void* data, ext_workspace_handle_v1* handle, u32 state);
+    static void on_workspace_capabilities(
+        void* data, ext_workspace_handle_v1* handle, u32 capabilities);
+    static void on_workspace_removed(
+        void* data, ext_workspace_handle_v1* handle);
+
+    static constexpr ext_workspace_handle_v1_listener WORKSPACE_LISTENER = {
+        .id = on_workspace_id,
+        .name = on_workspace_name,
+        .coordinates = on_workspace_coordinates,
+        .state = on_workspace_state,
+        .capabilities = on_workspace_capabilities,
+        .removed = on_workspace_removed,
+    };
 };
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "int_types.hpp"
+
+struct WindowInfo {
+    std::string window_id;
+    std::string title;
+    std::string app_id;
+};
+
+// Borrowed view of a window in a WindowTable, valid until the table is next modified
+struct WindowView {
+    std::string_view window_id;
+    std::string_view title;
+    std::string_view app_id;
+
+    [[nodiscard]] WindowInfo to_info() const {
+        return WindowInfo { std::string(window_id), std::string(title), std::string(app_id) };
+    }
+};
+
+// Reference counted string pool. Windows of the same application share their app_id and
+// often their title, so each distinct string is stored once.
+class StringInterner {
+public:
+    // Returns the id of `str`, adding a reference to it
+    [[nodiscard]] u32 intern(std::string_view str);
+    // Drops a reference, the string is freed with its last one
+    void release(u32 id) noexcept;
+    [[nodiscard]] std::string_view get(u32 id) const noexcept { return m_entries[id].str; }
+    // Number of distinct strings currently stored
+    [[nodiscard]] size_t size() const noexcept { return m_ids.size(); }
+
+private:
+    struct Entry {
+        std::string str;
+        u32 refs { 0 };
+    };
+
+    // deque so the views used as keys of m_ids stay valid while entries are added
+    std::deque<Entry> m_entries;
+    std::vector<u32> m_free;
+    std::unordered_map<std::string_view, u32> m_ids;
+};
+
+// Stable handle to a window in a WindowTable, stale once that window is erased
+struct WindowKey {
+    u32 slot;
+    u32 generation;
+};
+
+// Slot map of windows. Rows are kept contiguous, erasing moves the last row into the hole,
+// and keys go through a slot array so they survive that move. Identifiers live in the slots,
+// whose storage is reused as windows come and go, and the index by window_id is keyed by
+// views of them, so neither inserting nor looking up a window builds a std::string.
+class WindowTable {
+public:
+    [[nodiscard]] WindowKey insert(const WindowInfo& info);
+    // Returns false if `key` is stale
+    bool update(WindowKey key, const WindowInfo& info);
+    // Returns false if `key` is stale
+    bool erase(WindowKey key) noexcept;
+    void clear() noexcept;
+
+    [[nodiscard]] std::optional<WindowView> find(std::string_view window_id) const noexcept;
+    [[nodiscard]] std::optional<WindowView> get(WindowKey key) const noexcept;
+
+    [[nodiscard]] size_t size() const noexcept { return m_rows.size(); }
+    [[nodiscard]] bool empty() const noexcept { return m_rows.empty(); }
+    // Rows are in no particular order, erasing reorders them
+    [[nodiscard]] WindowView operator[](size_t i) const noexcept { return view(m_rows[i]); }
+    // Distinct titles and app ids currently stored
+    [[nodiscard]] size_t n_interned() const noexcept { return m_strings.size(); }
+
+private:
+    struct Row {
+        u32 title;
+        u32 app_id;
+        // index into m_slots of the key pointing at this row
+        u32 slot;
+    };
+
+    struct Slot {
+        std::string window_id;
+        // index into m_rows, meaningless while the slot is free
+        u32 row;
+        u32 generation;
+    };
+
+    [[nodiscard]] WindowView view(const Row& row) const noexcept {
+        return WindowView { m_slots[row.slot].window_id, m_strings.get(row.title), m_strings.get(row.app_id) };
+    }
+    // Points the index at `slot`, whose window_id has just been set
+    void index_id(u32 slot);
+    // Removes `slot` from the index, before its window_id changes
+    void unindex_id(u32 slot) noexcept;
+    [[nodiscard]] bool valid(WindowKey key) const noexcept {
+        return key.slot < m_slots.size() && m_slots[key.slot].generation == key.generation;
+    }
+
+    std::vector<Row> m_rows;
+    // deque so the views used as keys of m_slot_by_id stay valid while slots are added
+    std::deque<Slot> m_slots;
+    std::vector<u32> m_free_slots;
+    std::unordered_map<std::string_view, u32> m_slot_by_id;
+    StringInterner m_strings;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "int_types.hpp"
+#include "window_table.hpp"
+
+struct WorkspaceInfo {
+    // the compositor's stable id if it sends one, the name otherwise
+    std::string workspace_id;
+    std::string name;
+    std::vector<u32> coordinates;
+    // ext_workspace_handle_v1_state bits
+    u32 state { 0 };
+    // workspaces of a group share its outputs, one of them is active per group
+    u32 group { 0 };
+};
+
+// Stable handle to a workspace in a WorkspaceIndex, reused once that workspace is removed
+using WorkspaceSlot = u32;
+
+// Workspaces and the windows on each of them. Membership is updated one enter or leave at a
+// time as the compositor reports it, so listing the windows of a workspace costs as much as
+// the result and never a pass over every window.
+class WorkspaceIndex {
+public:
+    // Reserves a slot for a new workspace, hidden from queries until its first update
+    [[nodiscard]] WorkspaceSlot add();
+    void update(WorkspaceSlot slot, const WorkspaceInfo& info);
+    // Frees the slot along with the workspace's memberships
+    void remove(WorkspaceSlot slot) noexcept;
+    void enter(WorkspaceSlot slot, WindowKey window);
+    void leave(WorkspaceSlot slot, WindowKey window) noexcept;
+    void clear() noexcept;
+
+    // Every workspace announced so far, in no particular order
+    [[nodiscard]] std::vector<WorkspaceSlot> workspaces() const;
+    // Matches the workspace_id first, then the name
+    [[nodiscard]] std::optional<WorkspaceSlot> find(std::string_view workspace) const noexcept;
+    [[nodiscard]] const WorkspaceInfo& info(WorkspaceSlot slot) const noexcept { return m_entries[slot].info; }
+    [[nodiscard]] std::span<const WindowKey> windows(WorkspaceSlot slot) const noexcept { return m_entries[slot].windows; }
+    [[nodiscard]] bool active(WorkspaceSlot slot) const noexcept;
+
+private:
+    struct Entry {
+        WorkspaceInfo info {};
+        std::vector<WindowKey> windows {};
+        bool announced { false };
+    };
+
+    [[nodiscard]] static u64 membership(WorkspaceSlot slot, WindowKey window) noexcept {
+        return (static_cast<u64>(slot) << 32) | window.slot;
+    }
+
+    std::vector<Entry> m_entries;
+    std::vector<WorkspaceSlot> m_free;
+    // position of each window in its workspace's list, so leaving is a swap-remove
+    std::unordered_map<u64, u32> m_positions;
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <expected>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "state_provider.hpp"
+#include "state_request.hpp"
+#include "window_state_provider.hpp"
+
+// Workspaces and the windows on them. The window provider tracks them over its Wayland
+// connection, where the windows' workspace memberships arrive, so this provider only reads
+// its snapshots and must not outlive it.
+class WorkspaceStateProvider : public StateProvider {
+public:
+    explicit WorkspaceStateProvider(const WindowStateProvider& windows) noexcept : m_windows(windows) {}
+
+    // Fails unless the compositor announced ext-workspace-v1 to the initialized window provider
+    std::expected<void, StateProviderError> init() noexcept;
+    nlohmann::json processRequest(StateRequest req) noexcept;
+    [[nodiscard]] std::vector<ActionSchema> actions() const noexcept;
+    // Every request is a query over the window provider's state
+    [[nodiscard]] std::optional<u64> generation(const StateRequest& req) const noexcept;
+
+private:
+    const WindowStateProvider& m_windows;
+};
@@ -1,10 +1,119 @@
 #include "application.hpp"
+#include "console_input.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <latch>
 #include <print>
 
-Application::Application() noexcept {
-    if (!orchestrator.init()) {
-        std::println("Failed to initialize orchestrator");
+namespace {
+
+// Pieces are flushed at most this often, not once per token
+constexpr std::chrono::milliseconds OUTPUT_FLUSH_INTERVAL { 33 };
+
+// Buffers the streamed answer on stdout, flushing it often enough to look live
+class ConsoleOutput {
+public:
+    void write(std::string_view piece) noexcept {
+        std::fwrite(piece.data(), 1, piece.size(), stdout);
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - m_last_flush >= OUTPUT_FLUSH_INTERVAL) {
+            flush();
+        }
+    }
+
+    void flush() noexcept {
+        std::fflush(stdout);
+        m_last_flush = std::chrono::steady_clock::now();
     }
+
+private:
+    std::chrono::steady_clock::time_point m_last_flush {};
+};
+
+}
+
+Application::Application(AppMode mode) noexcept {
+    if (mode == AppMode::DAEMON) {
+        run_daemon();
+        return;
+    }
+
+    run_interactive();
 }
 
 Application::~Application() noexcept {}
+
+void Application::run_interactive() noexcept {
+    // written from the inference thread, except for the first prompt printed before any input
+    ConsoleOutput output;
+    const auto print_prompt = [&] {
+        output.write("> ");
+        output.flush();
+    };
+
+    std::latch closed(1);
+    std::atomic<bool> closing { false };
+    const auto close = [&] {
+        if (!closing.exchange(true)) {
+            closed.count_down();
+        }
+    };
+
+    // input starts before the model loads; prompts typed meanwhile wait in the assistant's
+    // queue until the model is loaded and the system prompt is warm
+    print_prompt();
+
+    ConsoleInput input;
+    const bool input_started = input.start(ConsoleInput::Callbacks {
+        .on_line = [&](std::string line) {
+            // a new prompt supersedes the answer that is being generated
+            assistant.cancel();
+            assistant.submit(std::move(line));
+        },
+        .on_interrupt = [&] {
+            if (assistant.busy()) {
+                assistant.cancel();
+            }
+            else {
+                close();
+            }
+        },
+        .on_close = close,
+    });
+    if (!input_started) {
+        return;
+    }
+
+    const bool initialized = assistant.init(AssistantCallbacks {
+        .on_output = [&](u64, std::string_view piece) {
+            output.write(piece);
+        },
+        .on_turn_end = [&](u64, Orchestrator::TurnOutcome) {
+            print_prompt();
+        },
+    }).has_value();
+    if (!initialized) {
+        input.stop();
+        std::println();
+        std::println("Failed to initialize orchestrator");
+        return;
+    }
+
+    closed.wait();
+    assistant.finish();
+    input.stop();
+    std::println();
+}
+
+void Application::run_daemon() noexcept {
+    daemon = std::make_unique<Daemon>();
+    if (!daemon->init(orchestrator_options_from_env(), daemon_options_from_env(), init_state_providers_async())) {
+        std::println("Failed to initialize daemon");
+        return;
+    }
+
+    daemon->run();
+}
@@ -0,0 +1,87 @@
+#include "assistant.hpp"
+#include "startup.hpp"
+
+#include <spdlog/spdlog.h>
+
+Assistant::~Assistant() noexcept {
+    m_dropping.store(true);
+    cancel();
+    finish();
+}
+
+std::expected<void, OrchestratorError> Assistant::init(AssistantCallbacks callbacks) noexcept {
+    return init(orchestrator_options_from_env(), init_state_providers_async(), std::move(callbacks));
+}
+
+std::expected<void, OrchestratorError> Assistant::init(
+    const OrchestratorOptions& options, PendingStateProviders providers, AssistantCallbacks callbacks) noexcept
+{
+    m_callbacks = std::move(callbacks);
+
+    // pieces go to the embedder as they are, nothing is written to stdout
+    m_orchestrator.set_output([this](std::string_view piece) {
+        if (m_callbacks.on_output) {
+            m_callbacks.on_output(m_current_turn, piece);
+        }
+    });
+
+    if (auto res = m_orchestrator.init(options, std::move(providers)); !res) {
+        return res;
+    }
+
+    m_worker = std::jthread([this] { run(); });
+    return {};
+}
+
+u64 Assistant::submit(std::string prompt) noexcept {
+    const u64 id = m_next_turn.fetch_add(1);
+    m_n_pending.fetch_add(1);
+    if (!m_turns.push(Turn { .id = id, .prompt = std::move(prompt) })) {
+        m_n_pending.fetch_sub(1);
+        return 0;
+    }
+    return id;
+}
+
+void Assistant::cancel() noexcept {
+    std::lock_guard lock(m_turn_mutex);
+    if (m_current_turn != 0) {
+        m_orchestrator.cancel();
+    }
+}
+
+void Assistant::finish() noexcept {
+    m_turns.close();
+    if (m_worker.joinable()) {
+        m_worker.join();
+    }
+}
+
+void Assistant::run() noexcept {
+    m_orchestrator.warm_up();
+    spdlog::info("Ready {:.0f} ms after start", startup_elapsed_ms());
+    if (m_callbacks.on_ready) {
+        m_callbacks.on_ready();
+    }
+
+    while (std::optional<Turn> turn = m_turns.pop()) {
+        Orchestrator::TurnOutcome outcome = Orchestrator::TurnOutcome::CANCELLED;
+        if (!m_dropping.load()) {
+            {
+                std::lock_guard lock(m_turn_mutex);
+                m_current_turn = turn->id;
+                m_orchestrator.reset_cancel();
+            }
+
+            outcome = m_orchestrator.answer(turn->prompt);
+
+            std::lock_guard lock(m_turn_mutex);
+            m_current_turn = 0;
+        }
+
+        m_n_pending.fetch_sub(1);
+        if (m_callbacks.on_turn_end) {
+            m_callbacks.on_turn_end(turn->id, outcome);
+        }
+    }
+}
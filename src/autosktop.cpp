@@ -0,0 +1,79 @@
+#include "autosktop.h"
+#include "assistant.hpp"
+
+#include <new>
+
+struct autosktop {
+    Assistant assistant;
+};
+
+namespace {
+
+autosktop_turn_outcome to_c_outcome(Orchestrator::TurnOutcome outcome) noexcept {
+    switch (outcome) {
+        case Orchestrator::TurnOutcome::COMPLETED: return AUTOSKTOP_TURN_COMPLETED;
+        case Orchestrator::TurnOutcome::CANCELLED: return AUTOSKTOP_TURN_CANCELLED;
+        case Orchestrator::TurnOutcome::FAILED: return AUTOSKTOP_TURN_FAILED;
+    };
+
+    return AUTOSKTOP_TURN_FAILED;
+}
+
+}
+
+extern "C" {
+
+autosktop* autosktop_new(const char* model_path, const autosktop_callbacks* callbacks) {
+    OrchestratorOptions options = orchestrator_options_from_env();
+    if (model_path != nullptr) {
+        options.model_path = model_path;
+    }
+
+    AssistantCallbacks cpp_callbacks;
+    if (callbacks != nullptr) {
+        const autosktop_callbacks c = *callbacks;
+        if (c.on_output) {
+            cpp_callbacks.on_output = [c](u64 turn, std::string_view piece) {
+                c.on_output(c.user_data, turn, piece.data(), piece.size());
+            };
+        }
+        if (c.on_turn_end) {
+            cpp_callbacks.on_turn_end = [c](u64 turn, Orchestrator::TurnOutcome outcome) {
+                c.on_turn_end(c.user_data, turn, to_c_outcome(outcome));
+            };
+        }
+    }
+
+    autosktop* assistant = new (std::nothrow) autosktop {};
+    if (assistant == nullptr) {
+        return nullptr;
+    }
+    if (!assistant->assistant.init(options, init_state_providers_async(), std::move(cpp_callbacks))) {
+        delete assistant;
+        return nullptr;
+    }
+    return assistant;
+}
+
+uint64_t autosktop_submit(autosktop* assistant, const char* prompt) {
+    if (assistant == nullptr || prompt == nullptr) {
+        return 0;
+    }
+    return assistant->assistant.submit(prompt);
+}
+
+void autosktop_cancel(autosktop* assistant) {
+    if (assistant != nullptr) {
+        assistant->assistant.cancel();
+    }
+}
+
+int autosktop_busy(const autosktop* assistant) {
+    return assistant != nullptr && assistant->assistant.busy() ? 1 : 0;
+}
+
+void autosktop_free(autosktop* assistant) {
+    delete assistant;
+}
+
+}
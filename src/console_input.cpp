@@ -0,0 +1,115 @@
+#include "console_input.hpp"
+#include "int_types.hpp"
+
+#include <array>
+#include <cerrno>
+#include <csignal>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+static sigset_t termination_signals() noexcept {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    return mask;
+}
+
+void block_termination_signals() noexcept {
+    const sigset_t mask = termination_signals();
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+}
+
+ConsoleInput::~ConsoleInput() noexcept {
+    stop();
+    if (m_signal_fd >= 0) close(m_signal_fd);
+    if (m_wake_fd >= 0) close(m_wake_fd);
+}
+
+bool ConsoleInput::start(Callbacks callbacks) noexcept {
+    m_callbacks = std::move(callbacks);
+
+    const sigset_t mask = termination_signals();
+    m_signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    m_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_signal_fd < 0 || m_wake_fd < 0) {
+        spdlog::error("Failed to set up console input");
+        return false;
+    }
+
+    m_thread = std::jthread([this] { run(); });
+    return true;
+}
+
+void ConsoleInput::stop() noexcept {
+    if (!m_thread.joinable()) {
+        return;
+    }
+
+    const u64 one = 1;
+    [[maybe_unused]] ssize_t n = write(m_wake_fd, &one, sizeof(one));
+    m_thread.join();
+}
+
+void ConsoleInput::run() noexcept {
+    std::string pending;
+    std::array<char, 4096> buf;
+
+    while (true) {
+        std::array<pollfd, 3> fds {{
+            { .fd = STDIN_FILENO, .events = POLLIN, .revents = 0 },
+            { .fd = m_signal_fd, .events = POLLIN, .revents = 0 },
+            { .fd = m_wake_fd, .events = POLLIN, .revents = 0 },
+        }};
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            spdlog::error("Failed to poll console input");
+            m_callbacks.on_close();
+            return;
+        }
+
+        if (fds[2].revents & POLLIN) {
+            return;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            signalfd_siginfo info {};
+            if (read(m_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGINT) {
+                    m_callbacks.on_interrupt();
+                }
+                else {
+                    m_callbacks.on_close();
+                    return;
+                }
+            }
+        }
+
+        // an errored or invalid stdin reads as end of input
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+            const ssize_t n = read(STDIN_FILENO, buf.data(), buf.size());
+            if (n <= 0) {
+                if (!pending.empty()) {
+                    m_callbacks.on_line(std::move(pending));
+                }
+                m_callbacks.on_close();
+                return;
+            }
+
+            pending.append(buf.data(), n);
+            size_t newline;
+            while ((newline = pending.find('\n')) != std::string::npos) {
+                m_callbacks.on_line(pending.substr(0, newline));
+                pending.erase(0, newline + 1);
+            }
+        }
+    }
+}
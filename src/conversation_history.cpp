@@ -0,0 +1,194 @@
+#include "conversation_history.hpp"
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+bool tokenize_append(const llama_vocab* vocab, std::string_view text, std::vector<llama_token>& out) noexcept {
+    const size_t n_old = out.size();
+
+    // a token always covers at least one byte, so this is almost always enough for a single pass
+    out.resize(n_old + text.size() + 1);
+    i32 n = llama_tokenize(vocab, text.data(), text.size(), out.data() + n_old, out.size() - n_old, false, true);
+    if (n < 0) {
+        out.resize(n_old - n);
+        n = llama_tokenize(vocab, text.data(), text.size(), out.data() + n_old, out.size() - n_old, false, true);
+    }
+
+    if (n < 0) {
+        out.resize(n_old);
+        return false;
+    }
+
+    out.resize(n_old + n);
+    return true;
+}
+
+std::expected<void, ConversationHistoryError> ConversationHistory::init(const llama_vocab* vocab, const Message& system) noexcept {
+    m_vocab = vocab;
+    m_tokens.clear();
+    m_entries.clear();
+    m_turn_open = false;
+
+    std::string prefix;
+    prefix += BEGIN_OF_TEXT;
+    prefix += '\n';
+    prefix += system.to_string();
+
+    m_assistant_header.clear();
+    m_eot.clear();
+    if (!tokenize_append(m_vocab, prefix, m_tokens)
+        || !tokenize_append(m_vocab, message_header(MessagerRole::Assistant), m_assistant_header)
+        || !tokenize_append(m_vocab, MESSAGE_EOT, m_eot)) {
+        spdlog::error("Failed to tokenize the system prompt");
+        return std::unexpected(ConversationHistoryError::TOKENIZE_FAILED);
+    }
+
+    m_n_prefix = m_tokens.size();
+
+    return {};
+}
+
+void ConversationHistory::close_turn() noexcept {
+    if (m_turn_open) {
+        m_tokens.resize(m_tokens.size() - m_assistant_header.size());
+        m_turn_open = false;
+    }
+}
+
+std::expected<void, ConversationHistoryError> ConversationHistory::append(
+    Message message, std::vector<u64> refers_to) noexcept
+{
+    close_turn();
+
+    const u32 offset = m_tokens.size();
+    if (!tokenize_append(m_vocab, message.to_string(), m_tokens)) {
+        spdlog::error("Failed to tokenize message - {}", message.content);
+        return std::unexpected(ConversationHistoryError::TOKENIZE_FAILED);
+    }
+
+    m_entries.push_back(Entry {
+        .message = std::move(message),
+        .offset = offset,
+        .n_tokens = static_cast<u32>(m_tokens.size() - offset),
+        .id = m_next_id++,
+        .refers_to = std::move(refers_to),
+    });
+
+    return {};
+}
+
+void ConversationHistory::append_generated(std::string content, std::span<const llama_token> generated) noexcept {
+    close_turn();
+
+    const u32 offset = m_tokens.size();
+    m_tokens.insert(m_tokens.end(), m_assistant_header.begin(), m_assistant_header.end());
+    m_tokens.insert(m_tokens.end(), generated.begin(), generated.end());
+    m_tokens.insert(m_tokens.end(), m_eot.begin(), m_eot.end());
+
+    m_entries.push_back(Entry {
+        .message = Message {
+            .role = MessagerRole::Assistant,
+            .content = std::move(content)
+        },
+        .offset = offset,
+        .n_tokens = static_cast<u32>(m_tokens.size() - offset),
+        .id = m_next_id++,
+        .refers_to = {},
+    });
+}
+
+bool ConversationHistory::contains(u64 id) const noexcept {
+    // ids only grow along the entries
+    const auto it = std::ranges::lower_bound(m_entries, id, {}, &Entry::id);
+    return it != m_entries.end() && it->id == id;
+}
+
+void ConversationHistory::truncate(size_t n_entries) noexcept {
+    if (n_entries >= m_entries.size()) {
+        return;
+    }
+
+    close_turn();
+    m_tokens.resize(m_entries[n_entries].offset);
+    m_entries.erase(m_entries.begin() + n_entries, m_entries.end());
+}
+
+std::span<const llama_token> ConversationHistory::prompt() noexcept {
+    if (!m_turn_open) {
+        m_tokens.insert(m_tokens.end(), m_assistant_header.begin(), m_assistant_header.end());
+        m_turn_open = true;
+    }
+
+    return m_tokens;
+}
+
+ConversationHistory::TokenRange ConversationHistory::erase(size_t first, size_t last) noexcept {
+    const u32 offset = m_entries[first].offset;
+    const u32 end = m_entries[last - 1].offset + m_entries[last - 1].n_tokens;
+    const u32 n_tokens = end - offset;
+
+    m_tokens.erase(m_tokens.begin() + offset, m_tokens.begin() + end);
+    m_entries.erase(m_entries.begin() + first, m_entries.begin() + last);
+    for (size_t i = first; i < m_entries.size(); i++) {
+        m_entries[i].offset -= n_tokens;
+    }
+
+    return TokenRange { .offset = offset, .n_tokens = n_tokens };
+}
+
+bool ConversationHistory::referenced(size_t first, size_t last) const noexcept {
+    if (first == last) {
+        return false;
+    }
+
+    // references only point back, and ids only grow along the entries
+    const u64 first_id = m_entries[first].id;
+    const u64 last_id = m_entries[last - 1].id;
+    for (size_t i = last; i < m_entries.size(); i++) {
+        for (u64 id : m_entries[i].refers_to) {
+            if (id >= first_id && id <= last_id) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+std::optional<ConversationHistory::TokenRange> ConversationHistory::evict_oldest() noexcept {
+    // the current turn starts at the last user message and is never evicted
+    size_t current_turn = m_entries.size();
+    for (size_t i = m_entries.size(); i-- > 0; ) {
+        if (m_entries[i].message.role == MessagerRole::User) {
+            current_turn = i;
+            break;
+        }
+    }
+
+    // provider results are system messages, they go stale as soon as their turn is over. One that
+    // a later result still refers to waits for that one to go first.
+    for (size_t i = 0; i < current_turn; i++) {
+        if (m_entries[i].message.role != MessagerRole::System || referenced(i, i + 1)) {
+            continue;
+        }
+
+        const bool has_command = i > 0 && m_entries[i - 1].message.role == MessagerRole::Assistant;
+        return erase(has_command ? i - 1 : i, i + 1);
+    }
+
+    // otherwise drop the oldest complete turn nothing after it refers to
+    size_t turn_start = 0;
+    while (turn_start < current_turn) {
+        size_t turn_end = turn_start + 1;
+        while (turn_end < current_turn && m_entries[turn_end].message.role != MessagerRole::User) {
+            turn_end++;
+        }
+
+        if (!referenced(turn_start, turn_end)) {
+            return erase(turn_start, turn_end);
+        }
+        turn_start = turn_end;
+    }
+
+    return std::nullopt;
+}
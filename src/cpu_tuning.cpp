@@ -0,0 +1,531 @@
+#include "cpu_tuning.hpp"
+#include "prefix_cache.hpp"
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <set>
+#include <span>
+#include <thread>
+#include <utility>
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <ggml-backend.h>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+namespace {
+
+constexpr u32 PROFILE_VERSION = 1;
+
+// prompt tokens and generated tokens of one measurement
+constexpr i32 TUNE_PREFILL = 1024;
+constexpr i32 TUNE_DECODE = 32;
+// the turn a configuration is scored on: the user message and a provider result are
+// prefilled, then a short answer or command is generated
+constexpr double TURN_PREFILL = 512.0;
+constexpr double TURN_DECODE = 64.0;
+
+constexpr std::array<i32, 3> UBATCH_CANDIDATES = { 512, 256, 128 };
+constexpr std::array<i32, 2> BATCH_CANDIDATES = { 512, 1024 };
+
+using ThreadpoolNew = ggml_threadpool* (*)(ggml_threadpool_params*);
+using ThreadpoolFree = void (*)(ggml_threadpool*);
+
+struct ThreadpoolApi {
+    ThreadpoolNew create { nullptr };
+    ThreadpoolFree destroy { nullptr };
+};
+
+// The CPU backend may be a module loaded by ggml_backend_load_all(), so its threadpool
+// functions are looked up through the registry rather than linked
+ThreadpoolApi threadpool_api() noexcept {
+    ggml_backend_dev_t cpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (cpu == nullptr) {
+        return {};
+    }
+
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(cpu);
+    return ThreadpoolApi {
+        .create = reinterpret_cast<ThreadpoolNew>(ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new")),
+        .destroy = reinterpret_cast<ThreadpoolFree>(ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free")),
+    };
+}
+
+i32 read_int(const std::filesystem::path& path, i32 fallback) noexcept {
+    std::ifstream in(path);
+    i32 value = 0;
+    return in >> value ? value : fallback;
+}
+
+std::filesystem::path profile_path(std::string_view key) noexcept {
+    const std::filesystem::path dir = cache_dir();
+    return dir.empty() ? dir : dir / std::format("cpu-{}.json", key);
+}
+
+struct Throughput {
+    double prefill_tps { 0.0 };
+    double decode_tps { 0.0 };
+};
+
+// Seconds the turn the configurations are compared on would take
+double turn_seconds(double prefill_tps, double decode_tps) noexcept {
+    if (prefill_tps <= 0.0 || decode_tps <= 0.0) {
+        return std::numeric_limits<double>::infinity();
+    }
+    return TURN_PREFILL / prefill_tps + TURN_DECODE / decode_tps;
+}
+
+// Prefills `tokens` into an empty cache, a batch at a time, then generates TUNE_DECODE tokens
+// one at a time after them
+std::expected<Throughput, CpuTuningError> measure(llama_context* ctx, std::span<llama_token> tokens) noexcept {
+    llama_memory_t mem = llama_get_memory(ctx);
+    llama_memory_clear(mem, true);
+    const size_t n_batch = llama_n_batch(ctx);
+
+    const i64 t_prefill = ggml_time_us();
+    for (size_t i = 0; i < tokens.size(); i += n_batch) {
+        const i32 n = static_cast<i32>(std::min(n_batch, tokens.size() - i));
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data() + i, n)) != 0) {
+            return std::unexpected(CpuTuningError::DECODE_FAILED);
+        }
+    }
+    llama_synchronize(ctx);
+
+    const i64 t_decode = ggml_time_us();
+    for (i32 i = 0; i < TUNE_DECODE; i++) {
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data() + i, 1)) != 0) {
+            return std::unexpected(CpuTuningError::DECODE_FAILED);
+        }
+    }
+    llama_synchronize(ctx);
+    const i64 t_end = ggml_time_us();
+
+    llama_memory_clear(mem, true);
+    return Throughput {
+        .prefill_tps = tokens.size() * 1e6 / std::max<i64>(1, t_decode - t_prefill),
+        .decode_tps = TUNE_DECODE * 1e6 / std::max<i64>(1, t_end - t_decode),
+    };
+}
+
+// Context just large enough for one measurement, its KV cache typed like the plan's
+class TrialContext {
+public:
+    TrialContext(llama_model* model, const MemoryPlan& plan, i32 n_batch, i32 n_ubatch, bool flash_attn) noexcept {
+        llama_context_params params = llama_context_default_params();
+        apply_memory_plan(plan, 1, params);
+        params.n_ctx = TUNE_PREFILL + TUNE_DECODE;
+        params.n_batch = n_batch;
+        params.n_ubatch = n_ubatch;
+        params.flash_attn_type = flash_attn ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        m_ctx = llama_init_from_model(model, params);
+        if (m_ctx == nullptr) {
+            return;
+        }
+
+        // the first decode allocates the compute buffers and faults in the weights, which
+        // is not what is being measured
+        llama_token token = 0;
+        if (llama_decode(m_ctx, llama_batch_get_one(&token, 1)) != 0) {
+            llama_free(m_ctx);
+            m_ctx = nullptr;
+            return;
+        }
+        llama_memory_clear(llama_get_memory(m_ctx), true);
+    }
+
+    ~TrialContext() noexcept {
+        // the threadpools are freed before the context they were attached to
+        if (m_ctx) {
+            m_threadpools.detach(m_ctx);
+            llama_free(m_ctx);
+        }
+    }
+
+    TrialContext(const TrialContext&) = delete;
+    TrialContext& operator=(const TrialContext&) = delete;
+
+    [[nodiscard]] llama_context* get() const noexcept { return m_ctx; }
+
+    [[nodiscard]] std::expected<Throughput, CpuTuningError> run(const CpuProfile& threads, std::span<llama_token> tokens) noexcept {
+        if (auto res = m_threadpools.attach(m_ctx, threads); !res) {
+            return std::unexpected(res.error());
+        }
+        return measure(m_ctx, tokens);
+    }
+
+private:
+    llama_context* m_ctx { nullptr };
+    CpuThreadpools m_threadpools {};
+};
+
+} // namespace
+
+std::optional<CpuTuning> cpu_tuning_from_string(std::string_view str) noexcept {
+    if (str == "off") return CpuTuning::OFF;
+    if (str == "auto") return CpuTuning::AUTO;
+    if (str == "force") return CpuTuning::FORCE;
+    return std::nullopt;
+}
+
+std::string_view cpu_tuning_to_string(CpuTuning tuning) noexcept {
+    switch (tuning) {
+        case CpuTuning::OFF: return "off";
+        case CpuTuning::AUTO: return "auto";
+        case CpuTuning::FORCE: return "force";
+    }
+
+    return "INVALID_CPU_TUNING";
+}
+
+std::string cpu_model_name() noexcept {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (!line.starts_with("model name")) continue;
+
+        const size_t colon = line.find(':');
+        if (colon != std::string::npos && colon + 2 <= line.size()) {
+            return line.substr(colon + 2);
+        }
+    }
+    return "unknown";
+}
+
+std::vector<i32> cpu_order(size_t* n_physical) noexcept {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        for (u32 cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++) {
+            CPU_SET(cpu, &allowed);
+        }
+    }
+
+    std::vector<i32> order;
+    std::vector<i32> siblings;
+    std::set<std::pair<i32, i32>> cores;
+    for (i32 cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+
+        // without topology every CPU counts as a core of its own
+        const std::filesystem::path topology = std::format("/sys/devices/system/cpu/cpu{}/topology", cpu);
+        const i32 package = read_int(topology / "physical_package_id", 0);
+        const i32 core = read_int(topology / "core_id", -1 - cpu);
+        (cores.emplace(package, core).second ? order : siblings).push_back(cpu);
+    }
+
+    if (n_physical) {
+        *n_physical = order.size();
+    }
+    order.insert(order.end(), siblings.begin(), siblings.end());
+    return order;
+}
+
+std::string cpu_profile_key(std::string_view model_key, KvCacheType kv_type) noexcept {
+    const std::string cpu = std::format("{}/{}", cpu_model_name(), cpu_order().size());
+    return std::format("{}-{:016x}-{}", model_key, fnv1a(cpu.data(), cpu.size()), kv_cache_type_to_string(kv_type));
+}
+
+std::expected<CpuProfile, CpuTuningError> load_cpu_profile(std::string_view key) noexcept {
+    const std::filesystem::path path = profile_path(key);
+    if (path.empty()) {
+        return std::unexpected(CpuTuningError::NO_CACHE_DIR);
+    }
+
+    std::ifstream in(path);
+    if (!in) {
+        return std::unexpected(CpuTuningError::NOT_FOUND);
+    }
+
+    try {
+        const nlohmann::json obj = nlohmann::json::parse(in);
+        if (obj["version"].get<u32>() != PROFILE_VERSION) {
+            return std::unexpected(CpuTuningError::MISMATCH);
+        }
+
+        CpuProfile profile {
+            .n_threads = obj["n_threads"].get<i32>(),
+            .n_threads_batch = obj["n_threads_batch"].get<i32>(),
+            .n_batch = obj["n_batch"].get<i32>(),
+            .n_ubatch = obj["n_ubatch"].get<i32>(),
+            .flash_attn = obj["flash_attn"].get<bool>(),
+            .pin_threads = obj["pin_threads"].get<bool>(),
+            .prefill_tps = obj["prefill_tps"].get<double>(),
+            .decode_tps = obj["decode_tps"].get<double>(),
+        };
+        if (profile.n_threads <= 0 || profile.n_threads_batch <= 0 || profile.n_ubatch <= 0 || profile.n_batch < profile.n_ubatch) {
+            return std::unexpected(CpuTuningError::MISMATCH);
+        }
+        return profile;
+    }
+    catch (const nlohmann::json::exception& err) {
+        return std::unexpected(CpuTuningError::MISMATCH);
+    }
+}
+
+std::expected<void, CpuTuningError> store_cpu_profile(std::string_view key, const CpuProfile& profile) noexcept {
+    const std::filesystem::path path = profile_path(key);
+    if (path.empty()) {
+        return std::unexpected(CpuTuningError::NO_CACHE_DIR);
+    }
+
+    const nlohmann::json obj = {
+        { "version", PROFILE_VERSION },
+        { "cpu", cpu_model_name() },
+        { "n_threads", profile.n_threads },
+        { "n_threads_batch", profile.n_threads_batch },
+        { "n_batch", profile.n_batch },
+        { "n_ubatch", profile.n_ubatch },
+        { "flash_attn", profile.flash_attn },
+        { "pin_threads", profile.pin_threads },
+        { "prefill_tps", profile.prefill_tps },
+        { "decode_tps", profile.decode_tps },
+    };
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+
+    // written next to the profile and renamed over it, so a concurrent start never reads half of it
+    std::filesystem::path tmp_path = path;
+    tmp_path += std::format(".{}.tmp", getpid());
+    {
+        std::ofstream out(tmp_path, std::ios::trunc);
+        out << obj.dump(4) << '\n';
+        if (!out) {
+            std::filesystem::remove(tmp_path, ec);
+            return std::unexpected(CpuTuningError::IO_ERROR);
+        }
+    }
+
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_path, ec);
+        return std::unexpected(CpuTuningError::IO_ERROR);
+    }
+
+    return {};
+}
+
+std::expected<CpuProfile, CpuTuningError> tune_cpu(llama_model* model, const MemoryPlan& plan) noexcept {
+    // the content does not change the cost of a decode, any valid token will do
+    const i32 n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    std::vector<llama_token> tokens(TUNE_PREFILL);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        tokens[i] = static_cast<llama_token>((i * 7919 + 13) % n_vocab);
+    }
+
+    size_t n_physical = 0;
+    const size_t n_logical = cpu_order(&n_physical).size();
+    std::vector<i32> thread_counts = {
+        static_cast<i32>(std::max<size_t>(1, n_physical / 2)),
+        static_cast<i32>(n_physical),
+        static_cast<i32>(n_logical),
+    };
+    std::ranges::sort(thread_counts);
+    thread_counts.erase(std::ranges::unique(thread_counts).begin(), thread_counts.end());
+
+    // a quantized V cache is only supported by the flash attention kernels
+    const bool needs_flash_attn = plan.kv_type != KvCacheType::F16;
+    const i32 max_ubatch = std::max(UBATCH_CANDIDATES.back(), plan.n_ubatch);
+
+    CpuProfile best {
+        .n_batch = BATCH_CANDIDATES.front(),
+        .n_ubatch = std::min(UBATCH_CANDIDATES.front(), max_ubatch),
+        .flash_attn = needs_flash_attn,
+    };
+
+    // thread counts and pinning first: generation and prompts each get the count that is
+    // fastest for them, and pinning is kept if the turn as a whole gets faster
+    {
+        TrialContext trial(model, plan, best.n_batch, best.n_ubatch, best.flash_attn);
+        if (!trial.get()) {
+            return std::unexpected(CpuTuningError::CONTEXT_CREATION_FAILED);
+        }
+
+        double best_seconds = std::numeric_limits<double>::infinity();
+        for (const bool pin : { false, true }) {
+            CpuProfile candidate = best;
+            candidate.pin_threads = pin;
+            for (const i32 n_threads : thread_counts) {
+                const CpuProfile threads { .n_threads = n_threads, .n_threads_batch = n_threads, .pin_threads = pin };
+                const std::expected<Throughput, CpuTuningError> res = trial.run(threads, tokens);
+                if (!res) {
+                    // no threadpool support only rules out pinning
+                    if (res.error() == CpuTuningError::NO_THREADPOOL) break;
+                    return std::unexpected(res.error());
+                }
+                spdlog::debug("CPU tuning: {} threads{}: {:.0f} prompt / {:.1f} generated tokens/s",
+                    n_threads, pin ? " (pinned)" : "", res->prefill_tps, res->decode_tps);
+
+                if (res->decode_tps > candidate.decode_tps) {
+                    candidate.n_threads = n_threads;
+                    candidate.decode_tps = res->decode_tps;
+                }
+                if (res->prefill_tps > candidate.prefill_tps) {
+                    candidate.n_threads_batch = n_threads;
+                    candidate.prefill_tps = res->prefill_tps;
+                }
+            }
+
+            const double seconds = turn_seconds(candidate.prefill_tps, candidate.decode_tps);
+            if (seconds < best_seconds) {
+                best_seconds = seconds;
+                best = candidate;
+            }
+        }
+        if (best.n_threads == 0) {
+            return std::unexpected(CpuTuningError::DECODE_FAILED);
+        }
+    }
+
+    // then the ubatch, which bounds the compute buffers the memory plan was sized for, and
+    // flash attention, then a larger batch with the best of them
+    auto try_config = [&](i32 n_batch, i32 n_ubatch, bool flash_attn) {
+        TrialContext trial(model, plan, n_batch, n_ubatch, flash_attn);
+        if (!trial.get()) return;
+
+        const std::expected<Throughput, CpuTuningError> res = trial.run(best, tokens);
+        if (!res) return;
+        spdlog::debug("CPU tuning: batch {}, ubatch {}, flash attention {}: {:.0f} prompt / {:.1f} generated tokens/s",
+            n_batch, n_ubatch, flash_attn ? "on" : "off", res->prefill_tps, res->decode_tps);
+
+        if (turn_seconds(res->prefill_tps, res->decode_tps) < turn_seconds(best.prefill_tps, best.decode_tps)) {
+            best.n_batch = n_batch;
+            best.n_ubatch = n_ubatch;
+            best.flash_attn = flash_attn;
+            best.prefill_tps = res->prefill_tps;
+            best.decode_tps = res->decode_tps;
+        }
+    };
+
+    const CpuProfile threads_only = best;
+    for (const i32 n_ubatch : UBATCH_CANDIDATES) {
+        if (n_ubatch > max_ubatch) continue;
+        for (const bool flash_attn : { false, true }) {
+            if (needs_flash_attn && !flash_attn) continue;
+            if (n_ubatch == threads_only.n_ubatch && flash_attn == threads_only.flash_attn) continue;
+            try_config(threads_only.n_batch, n_ubatch, flash_attn);
+        }
+    }
+    for (const i32 n_batch : BATCH_CANDIDATES) {
+        if (n_batch != best.n_batch) {
+            try_config(n_batch, best.n_ubatch, best.flash_attn);
+        }
+    }
+
+    return best;
+}
+
+std::optional<CpuProfile> cpu_profile(
+    llama_model* model, std::string_view model_key, const MemoryPlan& plan, CpuTuning tuning) noexcept
+{
+    if (tuning == CpuTuning::OFF) {
+        return std::nullopt;
+    }
+
+    const std::string key = cpu_profile_key(model_key, plan.kv_type);
+    if (tuning == CpuTuning::AUTO) {
+        if (std::expected<CpuProfile, CpuTuningError> profile = load_cpu_profile(key)) {
+            return *profile;
+        }
+    }
+
+    spdlog::info("Tuning threads and batch sizes for {}, once per CPU and model", cpu_model_name());
+    const auto t_start = ggml_time_us();
+    std::expected<CpuProfile, CpuTuningError> profile = tune_cpu(model, plan);
+    if (!profile) {
+        spdlog::warn("CPU tuning failed, keeping the default thread settings");
+        return std::nullopt;
+    }
+    spdlog::info("Tuned the CPU configuration in {:.1f} s", (ggml_time_us() - t_start) / 1e6);
+
+    if (auto res = store_cpu_profile(key, *profile); !res) {
+        spdlog::warn("Failed to store the CPU profile, it will be tuned again on the next start");
+    }
+    return *profile;
+}
+
+void apply_cpu_profile(const CpuProfile& profile, llama_context_params& params) noexcept {
+    params.n_threads = profile.n_threads;
+    params.n_threads_batch = profile.n_threads_batch;
+    params.n_batch = profile.n_batch;
+    params.n_ubatch = std::min<u32>(params.n_ubatch, profile.n_ubatch);
+    // a quantized cache keeps the flash attention the plan turned on
+    if (profile.flash_attn) {
+        params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    }
+    else if (params.type_v == GGML_TYPE_F16) {
+        params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+    }
+
+    spdlog::info("CPU profile: {} threads ({} for prompts){}, batch {}, ubatch {}, flash attention {}; "
+        "tuned at {:.0f} prompt / {:.1f} generated tokens/s",
+        params.n_threads, params.n_threads_batch, profile.pin_threads ? ", pinned" : "", params.n_batch,
+        params.n_ubatch, profile.flash_attn ? "on" : "off", profile.prefill_tps, profile.decode_tps);
+}
+
+CpuThreadpools::~CpuThreadpools() noexcept {
+    free();
+}
+
+std::expected<void, CpuTuningError> CpuThreadpools::attach(llama_context* ctx, const CpuProfile& profile) noexcept {
+    detach(ctx);
+    llama_set_n_threads(ctx, profile.n_threads, profile.n_threads_batch);
+    if (!profile.pin_threads) {
+        return {};
+    }
+
+    const ThreadpoolApi api = threadpool_api();
+    if (!api.create || !api.destroy) {
+        return std::unexpected(CpuTuningError::NO_THREADPOOL);
+    }
+
+    // the first n_threads CPUs of cpu_order(): physical cores first, siblings only past them
+    const std::vector<i32> cpus = cpu_order();
+    auto make = [&](i32 n_threads) {
+        ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+        for (size_t i = 0; i < std::min<size_t>(n_threads, cpus.size()); i++) {
+            if (cpus[i] < GGML_MAX_N_THREADS) {
+                params.cpumask[cpus[i]] = true;
+            }
+        }
+        params.strict_cpu = true;
+        return api.create(&params);
+    };
+
+    m_free = api.destroy;
+    m_decode = make(profile.n_threads);
+    if (profile.n_threads_batch != profile.n_threads) {
+        m_batch = make(profile.n_threads_batch);
+    }
+    if (!m_decode || (profile.n_threads_batch != profile.n_threads && !m_batch)) {
+        free();
+        return std::unexpected(CpuTuningError::NO_THREADPOOL);
+    }
+
+    // without a batch threadpool prompts run on the decode one
+    llama_attach_threadpool(ctx, m_decode, m_batch);
+    return {};
+}
+
+void CpuThreadpools::detach(llama_context* ctx) noexcept {
+    if (m_decode) {
+        llama_detach_threadpool(ctx);
+    }
+    free();
+}
+
+void CpuThreadpools::free() noexcept {
+    if (m_free) {
+        if (m_decode) m_free(m_decode);
+        if (m_batch) m_free(m_batch);
+    }
+    m_decode = nullptr;
+    m_batch = nullptr;
+}
@@ -0,0 +1,757 @@
+#include "daemon.hpp"
+#include "startup.hpp"
+#include "state_request.hpp"
+#include "unix_socket.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <string_view>
+
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+constexpr std::string_view METRIC_TURNS = "autosktop_turns_total";
+constexpr std::string_view METRIC_TIME_TO_FIRST_TOKEN = "autosktop_time_to_first_token_seconds";
+constexpr std::string_view METRIC_SESSIONS = "autosktop_sessions";
+constexpr std::string_view METRIC_BATCH_TOKENS = "autosktop_batch_tokens";
+constexpr std::string_view METRIC_BATCH_SEQUENCES = "autosktop_batch_sequences";
+constexpr std::string_view METRIC_GENERATED_TOKENS = "autosktop_generated_tokens_total";
+
+constexpr auto SUMMARY_INTERVAL = std::chrono::seconds(60);
+// how often the engine looks for provider results while nothing else is decoding
+constexpr int PROVIDER_POLL_MS = 1;
+// a prompt line longer than this closes the connection
+constexpr size_t MAX_LINE_BYTES = 64 * 1024;
+// output a client has not read yet; past this it is considered gone
+constexpr size_t MAX_PENDING_OUTPUT_BYTES = 1024 * 1024;
+
+}
+
+std::filesystem::path default_daemon_socket_path() noexcept {
+    return runtime_socket_path("autosktop.sock");
+}
+
+std::filesystem::path default_daemon_metrics_socket_path() noexcept {
+    return runtime_socket_path("daemon-metrics.sock");
+}
+
+DaemonOptions daemon_options_from_env() noexcept {
+    DaemonOptions options { .socket_path = default_daemon_socket_path() };
+
+    if (const char* socket_env = std::getenv("AUTOSKTOP_SOCKET"); socket_env && *socket_env) {
+        options.socket_path = socket_env;
+    }
+
+    // an empty value turns the metrics socket off
+    const char* metrics_socket_env = std::getenv("AUTOSKTOP_METRICS_SOCKET");
+    options.metrics_socket = metrics_socket_env ? metrics_socket_env : default_daemon_metrics_socket_path();
+
+    if (const char* sessions_env = std::getenv("AUTOSKTOP_MAX_SESSIONS"); sessions_env && *sessions_env) {
+        const std::string_view str(sessions_env);
+        u32 n = 0;
+        const auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), n);
+        if (ec == std::errc() && end == str.data() + str.size() && n > 0) {
+            options.max_sessions = std::min(n, MAX_DAEMON_SESSIONS);
+        }
+        else {
+            spdlog::warn("Invalid AUTOSKTOP_MAX_SESSIONS {}, serving {} sessions", sessions_env, options.max_sessions);
+        }
+    }
+
+    return options;
+}
+
+std::expected<void, OrchestratorError> Daemon::init(
+    const OrchestratorOptions& options, const DaemonOptions& daemon_options, PendingStateProviders providers) noexcept
+{
+    llama_log_set([](enum ggml_log_level level, const char* text, void* /*user_data*/) {
+        if (level >= GGML_LOG_LEVEL_WARN) {
+            spdlog::debug("{}", text);
+        }
+    }, nullptr);
+
+    if (options.model_path.empty()) {
+        spdlog::error("Error: Orchestrator path is empty");
+        return std::unexpected(OrchestratorError::MODEL_BAD_PATH);
+    }
+    // checked before the model loads, the socket is only bound once everything else is ready
+    if (unix_socket_in_use(daemon_options.socket_path)) {
+        spdlog::error("A daemon is already serving {}", daemon_options.socket_path.string());
+        return std::unexpected(OrchestratorError::LISTEN_FAILED);
+    }
+    if (!options.draft_model_path.empty()) {
+        spdlog::warn("Speculative decoding is not supported by the daemon, ignoring the draft model");
+    }
+    m_prefetch = prefetch_file(options.model_path);
+
+    m_model = load_orchestrator_model(options);
+    if (m_model == nullptr) {
+        return std::unexpected(OrchestratorError::MODEL_LOAD_FAILED);
+    }
+    if (llama_model_has_encoder(m_model)) {
+        spdlog::error("The daemon needs a decoder-only model");
+        return std::unexpected(OrchestratorError::MODEL_LOAD_FAILED);
+    }
+    m_vocab = llama_model_get_vocab(m_model);
+
+    // tokenized before planning, every sequence has to hold it
+    if (!m_history.init(m_vocab, IDENTITY_MESSAGE)) {
+        return std::unexpected(OrchestratorError::TOKENIZE_FAILED);
+    }
+
+    const u32 max_sessions = std::clamp<u32>(daemon_options.max_sessions, 1, MAX_DAEMON_SESSIONS);
+    // the KV cache of every session counts against the budget
+    const i32 n_gpu_layers = options.cpu_only ? 0 : options.n_gpu_layers;
+    const i32 n_ctx_min = static_cast<i32>(m_history.prefix().size()) + N_PREDICT + MIN_HISTORY_TOKENS;
+    const MemoryPlan plan = plan_memory(options.memory, model_shape(m_model, n_gpu_layers, options.cpu_only),
+        N_CTX, n_ctx_min, N_BATCH, max_sessions);
+    log_memory_plan(plan, options.memory);
+    if (!plan.fits) {
+        return std::unexpected(OrchestratorError::MEMORY_BUDGET_EXCEEDED);
+    }
+    m_projected_rss = plan.total_bytes();
+    m_n_ctx_seq = plan.n_ctx;
+
+    llama_context_params ctx_params = llama_context_default_params();
+    // one cache shared by every sequence, so the system prompt cells copied from sequence 0
+    // are stored once; every session may fill its own m_n_ctx_seq on top of them
+    apply_memory_plan(plan, max_sessions, ctx_params);
+    const std::optional<CpuProfile> cpu_profile = orchestrator_cpu_profile(m_model, options, plan);
+    if (cpu_profile) {
+        apply_cpu_profile(*cpu_profile, ctx_params);
+    }
+    // the shared batch is filled up to N_BATCH whatever batch size the profile was tuned with
+    ctx_params.n_batch = N_BATCH;
+    ctx_params.n_seq_max = max_sessions + 1;
+    ctx_params.kv_unified = true;
+    ctx_params.no_perf = false;
+
+    {
+        StartupPhase phase("context");
+        m_ctx = llama_init_from_model(m_model, ctx_params);
+    }
+    if (m_ctx == nullptr) {
+        spdlog::error("Failed to create llama_context");
+        return std::unexpected(OrchestratorError::CONTEXT_CREATION_FAILED);
+    }
+
+    if (cpu_profile) {
+        if (auto res = m_threadpools.attach(m_ctx, *cpu_profile); !res) {
+            spdlog::warn("Failed to pin the inference threads, running them unpinned");
+        }
+    }
+
+    auto sparams = llama_sampler_chain_default_params();
+    sparams.no_perf = false;
+    m_smpl = llama_sampler_chain_init(sparams);
+    llama_sampler_chain_add(m_smpl, llama_sampler_init_greedy());
+
+    m_batch = llama_batch_init(N_BATCH, 0, 1);
+    for (llama_seq_id seq_id = max_sessions; seq_id >= 1; seq_id--) {
+        m_free_seq_ids.push_back(seq_id);
+    }
+
+    // usually connected long before the model is loaded
+    std::expected<StateProviders, OrchestratorError> state_providers = providers.get();
+    if (!state_providers) {
+        return std::unexpected(state_providers.error());
+    }
+    m_state_providers = std::move(*state_providers);
+    m_json_smpl = make_json_sampler(m_vocab, m_state_providers);
+    m_result_encoding = options.result_encoding;
+    m_model_path = options.model_path;
+    m_kv_type = plan.kv_type;
+    m_flash_attn = ctx_params.flash_attn_type;
+    m_prefix_cache = options.prefix_cache;
+
+    m_prefix_kv.init(m_ctx, 0, N_BATCH);
+
+    init_metrics(daemon_options.metrics_socket);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    m_signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (m_signal_fd < 0) {
+        spdlog::error("Failed to watch for termination signals");
+        return std::unexpected(OrchestratorError::LISTEN_FAILED);
+    }
+
+    m_listener = listen_unix_socket(daemon_options.socket_path, 16);
+    if (m_listener.fd < 0) {
+        return std::unexpected(OrchestratorError::LISTEN_FAILED);
+    }
+
+    spdlog::info("Serving up to {} sessions of {} tokens on {}", max_sessions, m_n_ctx_seq, m_listener.path.string());
+    return {};
+}
+
+Daemon::~Daemon() noexcept {
+    for (const std::unique_ptr<Session>& session : m_sessions) {
+        close_session(*session);
+    }
+
+    close_unix_listener(m_listener);
+    if (m_signal_fd >= 0) close(m_signal_fd);
+
+    if (m_batch.token) {
+        llama_batch_free(m_batch);
+    }
+    llama_sampler_free(m_json_smpl);
+    llama_sampler_free(m_smpl);
+    llama_free(m_ctx);
+    llama_model_free(m_model);
+}
+
+int Daemon::run() noexcept {
+    {
+        StartupPhase phase("warm_up");
+        if (!warm_system_prompt(m_ctx, m_prefix_kv, m_history.prefix(), m_model_path, m_kv_type, m_flash_attn, m_prefix_cache)) {
+            spdlog::warn("Failed to prefill the system prompt, every session will decode it");
+        }
+    }
+    spdlog::info("Resident memory after warm-up: {:.2f} GiB, projected {:.2f} GiB",
+        resident_bytes() / static_cast<double>(1ull << 30), m_projected_rss / static_cast<double>(1ull << 30));
+    spdlog::info("Ready {:.0f} ms after start", startup_elapsed_ms());
+
+    std::vector<pollfd> fds;
+
+    while (true) {
+        fds.clear();
+        fds.push_back({ .fd = m_listener.fd, .events = POLLIN, .revents = 0 });
+        fds.push_back({ .fd = m_signal_fd, .events = POLLIN, .revents = 0 });
+
+        bool decoding = false;
+        bool waiting = false;
+        for (const std::unique_ptr<Session>& session : m_sessions) {
+            const short events = (session->input_closed ? 0 : POLLIN) | (session->out_buffer.empty() ? 0 : POLLOUT);
+            fds.push_back({ .fd = session->fd, .events = events, .revents = 0 });
+            decoding |= session->state == SessionState::PREFILL || session->state == SessionState::DECODE;
+            waiting |= session->state == SessionState::PROVIDER;
+        }
+
+        // sessions with work only get a look at the sockets between decode steps
+        const int timeout = decoding ? 0 : waiting ? PROVIDER_POLL_MS : -1;
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+            spdlog::error("Daemon failed: {}", std::strerror(errno));
+            return 1;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            spdlog::info("Shutting down");
+            return 0;
+        }
+
+        // accepted clients are appended, the indices of the polled ones stay valid
+        const size_t n_polled = fds.size() - 2;
+        if (fds[0].revents & POLLIN) {
+            accept_client();
+        }
+
+        for (size_t i = 0; i < n_polled; i++) {
+            Session& session = *m_sessions[i];
+            const short revents = fds[i + 2].revents;
+            if ((revents & (POLLERR | POLLHUP)) || ((revents & POLLIN) && !read_client(session))) {
+                close_session(session);
+            }
+        }
+
+        while (std::optional<ProviderResult> result = m_provider_results.try_pop()) {
+            on_provider_result(std::move(*result));
+        }
+
+        step();
+
+        for (const std::unique_ptr<Session>& session : m_sessions) {
+            if (session->fd < 0) {
+                continue;
+            }
+            if (!flush_client(*session) || session->out_buffer.size() > MAX_PENDING_OUTPUT_BYTES) {
+                close_session(*session);
+            }
+            else if (session->input_closed && session->state == SessionState::IDLE && session->out_buffer.empty()) {
+                close_session(*session);
+            }
+        }
+
+        const size_t n_sessions = m_sessions.size();
+        std::erase_if(m_sessions, [](const std::unique_ptr<Session>& session) { return session->fd < 0; });
+        if (m_sessions.size() != n_sessions) {
+            m_metrics.set(METRIC_SESSIONS, m_sessions.size());
+        }
+    }
+}
+
+void Daemon::accept_client() noexcept {
+    const int fd = accept4(m_listener.fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+        return;
+    }
+
+    if (m_free_seq_ids.empty()) {
+        constexpr std::string_view busy = "{\"error\":\"too_many_sessions\"}\n";
+        [[maybe_unused]] ssize_t n = ::send(fd, busy.data(), busy.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(fd);
+        spdlog::warn("Refused a client, all {} sessions are in use", m_sessions.size());
+        return;
+    }
+
+    auto session = std::make_unique<Session>();
+    session->id = m_next_session_id++;
+    session->fd = fd;
+
+    const llama_seq_id seq_id = m_free_seq_ids.back();
+    m_free_seq_ids.pop_back();
+    session->kv.init(m_ctx, seq_id, 1);
+
+    // start from the system prompt of sequence 0, sharing its cells
+    llama_memory_seq_cp(llama_get_memory(m_ctx), 0, seq_id, -1, -1);
+    session->kv.assign(m_prefix_kv.tokens());
+    session->history = m_history;
+    session->json_smpl = m_json_smpl ? llama_sampler_clone(m_json_smpl) : nullptr;
+
+    spdlog::info("Session {} connected (sequence {})", session->id, seq_id);
+    m_sessions.push_back(std::move(session));
+    m_metrics.set(METRIC_SESSIONS, m_sessions.size());
+}
+
+bool Daemon::read_client(Session& session) noexcept {
+    char buf[4096];
+    while (true) {
+        const ssize_t n = recv(session.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            // the answer to what was sent so far still goes out
+            session.input_closed = true;
+            break;
+        }
+        session.in_buffer.append(buf, n);
+    }
+
+    size_t start = 0;
+    for (size_t end; (end = session.in_buffer.find('\n', start)) != std::string::npos; start = end + 1) {
+        std::string_view line(session.in_buffer.data() + start, end - start);
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+        if (!line.empty()) {
+            on_prompt(session, std::string(line));
+        }
+    }
+    session.in_buffer.erase(0, start);
+
+    if (session.in_buffer.size() > MAX_LINE_BYTES) {
+        spdlog::warn("Session {} sent a prompt of more than {} bytes", session.id, MAX_LINE_BYTES);
+        return false;
+    }
+    return true;
+}
+
+bool Daemon::flush_client(Session& session) noexcept {
+    size_t sent = 0;
+    while (sent < session.out_buffer.size()) {
+        const ssize_t n = ::send(session.fd, session.out_buffer.data() + sent, session.out_buffer.size() - sent,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0) {
+            return false;
+        }
+        sent += n;
+    }
+
+    session.out_buffer.erase(0, sent);
+    return true;
+}
+
+void Daemon::close_session(Session& session) noexcept {
+    if (session.fd < 0) {
+        return;
+    }
+
+    session.kv.clear();
+    m_free_seq_ids.push_back(session.kv.seq_id());
+    llama_sampler_free(session.json_smpl);
+    session.json_smpl = nullptr;
+
+    close(session.fd);
+    session.fd = -1;
+    // keeps it out of the batch until it is removed
+    session.state = SessionState::IDLE;
+    spdlog::info("Session {} closed", session.id);
+}
+
+void Daemon::send(Session& session, const nlohmann::json& message) noexcept {
+    session.out_buffer += message.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+    session.out_buffer += '\n';
+}
+
+void Daemon::on_prompt(Session& session, std::string prompt) noexcept {
+    // a new prompt supersedes the answer that is being generated
+    if (session.state != SessionState::IDLE) {
+        finish_turn(session, TurnOutcome::CANCELLED);
+    }
+
+    session.turn++;
+    session.n_turn_entries = session.history.entries().size();
+    session.n_commands = 0;
+    session.t_turn_start_us = ggml_time_us();
+    session.first_token = false;
+
+    if (!session.history.append(Message { .role = MessagerRole::User, .content = std::move(prompt) })) {
+        finish_turn(session, TurnOutcome::FAILED);
+        return;
+    }
+
+    begin_generation(session);
+}
+
+void Daemon::begin_generation(Session& session) noexcept {
+    if (!fit_context(session)) {
+        finish_turn(session, TurnOutcome::FAILED);
+        return;
+    }
+
+    // decoded by step(), in chunks shared with the other sessions
+    session.prompt = session.history.prompt();
+    [[maybe_unused]] const size_t n_reuse = session.kv.reuse(session.prompt);
+
+    session.n_decode = 0;
+    session.active_smpl = m_smpl;
+    session.classifier = OutputClassifier();
+    session.text.clear();
+    session.generated.clear();
+    session.state = SessionState::PREFILL;
+}
+
+bool Daemon::fit_context(Session& session) noexcept {
+    const size_t n_budget = m_n_ctx_seq > N_PREDICT ? m_n_ctx_seq - N_PREDICT : 0;
+
+    while (session.history.n_prompt_tokens() > n_budget) {
+        std::optional<ConversationHistory::TokenRange> evicted = session.history.evict_oldest();
+        if (!evicted) {
+            spdlog::warn("Session {}: prompt of {} tokens does not fit in {} tokens",
+                session.id, session.history.n_prompt_tokens(), m_n_ctx_seq);
+            return false;
+        }
+        session.kv.erase(evicted->offset, evicted->n_tokens);
+    }
+
+    return true;
+}
+
+bool Daemon::step() noexcept {
+    m_batch.n_tokens = 0;
+    m_batch_parts.clear();
+
+    auto add = [&](Session& session, std::span<const llama_token> tokens, bool logits) {
+        const size_t pos = session.kv.tokens().size();
+        for (size_t j = 0; j < tokens.size(); j++) {
+            const i32 i = m_batch.n_tokens++;
+            m_batch.token[i] = tokens[j];
+            m_batch.pos[i] = pos + j;
+            m_batch.n_seq_id[i] = 1;
+            m_batch.seq_id[i][0] = session.kv.seq_id();
+            m_batch.logits[i] = logits && j == tokens.size() - 1;
+        }
+        m_batch_parts.push_back(BatchPart {
+            .session = &session,
+            .tokens = tokens,
+            .logits_index = logits ? m_batch.n_tokens - 1 : -1,
+        });
+    };
+
+    // every generating session advances by one token
+    for (const std::unique_ptr<Session>& session : m_sessions) {
+        if (session->state == SessionState::DECODE) {
+            add(*session, std::span(&session->next_token, 1), true);
+        }
+    }
+    const size_t n_generating = m_batch_parts.size();
+
+    // prompts fill the rest of the batch, starting from a different session every step
+    const size_t n_sessions = m_sessions.size();
+    for (size_t k = 0; k < n_sessions && m_batch.n_tokens < N_BATCH; k++) {
+        Session& session = *m_sessions[(m_next_prefill + k) % n_sessions];
+        if (session.state != SessionState::PREFILL) {
+            continue;
+        }
+
+        const std::span<const llama_token> remaining = session.prompt.subspan(session.kv.tokens().size());
+        const size_t n = std::min<size_t>(remaining.size(), N_BATCH - m_batch.n_tokens);
+        add(session, remaining.first(n), n == remaining.size());
+    }
+    m_next_prefill = n_sessions > 0 ? (m_next_prefill + 1) % n_sessions : 0;
+
+    if (m_batch.n_tokens == 0) {
+        return false;
+    }
+
+    if (const i32 ret = llama_decode(m_ctx, m_batch); ret != 0) {
+        spdlog::error("Failed to decode a batch of {} tokens for {} sessions", m_batch.n_tokens, m_batch_parts.size());
+        for (const BatchPart& part : m_batch_parts) {
+            // part of the batch may have made it into the cache
+            llama_memory_seq_rm(llama_get_memory(m_ctx), part.session->kv.seq_id(), part.session->kv.tokens().size(), -1);
+            finish_turn(*part.session, TurnOutcome::FAILED);
+        }
+        return true;
+    }
+
+    m_metrics.observe(METRIC_BATCH_TOKENS, m_batch.n_tokens);
+    m_metrics.observe(METRIC_BATCH_SEQUENCES, m_batch_parts.size());
+    m_metrics.increment(METRIC_GENERATED_TOKENS, {}, n_generating);
+
+    for (const BatchPart& part : m_batch_parts) {
+        Session& session = *part.session;
+        session.kv.append(part.tokens);
+        if (part.logits_index < 0) {
+            continue;
+        }
+
+        if (session.state == SessionState::DECODE) {
+            session.n_decode += 1;
+        }
+        on_token(session, llama_sampler_sample(session.active_smpl, m_ctx, part.logits_index));
+    }
+
+    return true;
+}
+
+void Daemon::on_token(Session& session, llama_token id) noexcept {
+    if (!session.first_token) {
+        m_metrics.observe(METRIC_TIME_TO_FIRST_TOKEN, (ggml_time_us() - session.t_turn_start_us) / 1e6);
+        session.first_token = true;
+    }
+
+    if (session.n_decode >= N_PREDICT || llama_vocab_is_eog(m_vocab, id)) {
+        end_generation(session);
+        return;
+    }
+
+    char buf[128];
+    const int n = llama_token_to_piece(m_vocab, id, buf, sizeof(buf), 0, false);
+    if (n < 0) {
+        spdlog::error("Session {}: failed to convert token to piece", session.id);
+        finish_turn(session, TurnOutcome::FAILED);
+        return;
+    }
+
+    const OutputMode previous_mode = session.classifier.mode();
+    // anything after the closing brace of a JSON command is cut off
+    const std::string_view piece(buf, session.classifier.feed(std::string_view(buf, n)));
+    if (piece.size() == static_cast<size_t>(n)) {
+        session.generated.push_back(id);
+    }
+    // the history keeps the tokens of what is left of the piece, not the ones of the cut text
+    else if (!tokenize_append(m_vocab, piece, session.generated)) {
+        spdlog::error("Session {}: failed to tokenize the end of the answer", session.id);
+        finish_turn(session, TurnOutcome::FAILED);
+        return;
+    }
+    if (!piece.empty()) {
+        send(session, {{"text", piece}});
+    }
+
+    session.text.append(piece);
+
+    if (previous_mode == OutputMode::UNDECIDED && session.classifier.mode() == OutputMode::JSON
+        && session.json_smpl != nullptr && enter_json_mode(session.json_smpl, session.generated)) {
+        session.active_smpl = session.json_smpl;
+    }
+
+    // the command is complete, there is nothing useful left to generate
+    if (session.classifier.complete()) {
+        end_generation(session);
+        return;
+    }
+
+    session.next_token = id;
+    session.state = SessionState::DECODE;
+}
+
+void Daemon::end_generation(Session& session) noexcept {
+    std::expected<std::vector<StateRequest>, StateRequestError> requests = StateRequest::from_json(session.text);
+    session.history.append_generated(std::move(session.text), session.generated);
+
+    // text ends the turn, and so does anything after the last command round
+    if (!requests || session.n_commands == MAX_COMMAND_ROUNDS) {
+        finish_turn(session, TurnOutcome::COMPLETED);
+        return;
+    }
+
+    session.n_commands++;
+    session.state = SessionState::PROVIDER;
+
+    const size_t n = requests->size();
+    struct PendingCommand {
+        ProviderResult command;
+        std::atomic<size_t> n_running { 0 };
+    };
+    auto pending = std::make_shared<PendingCommand>();
+    pending->command = ProviderResult {
+        .session_id = session.id,
+        .turn = session.turn,
+        .requests = std::move(*requests),
+        .generations = std::vector<std::optional<u64>>(n),
+        .results = std::vector<nlohmann::json>(n),
+        .refers_to = {},
+    };
+
+    // state that did not change since an earlier result of this session is not sent again
+    std::vector<StateProvider*> providers(n, nullptr);
+    for (size_t i = 0; i < n; i++) {
+        const StateRequest& req = pending->command.requests[i];
+        const auto provider_it = m_state_providers.find(req.kind);
+        if (provider_it == m_state_providers.end()) {
+            pending->command.results[i] = missing_provider_result(req.kind);
+            continue;
+        }
+
+        const std::optional<u64> generation = provider_it->second->generation(req);
+        if (const std::optional<ResponseCache::Hit> hit = session.responses.lookup(req, generation, session.history)) {
+            pending->command.results[i] = unchanged_result(hit->result_id);
+            pending->command.refers_to.push_back(hit->entry_id);
+            continue;
+        }
+        pending->command.generations[i] = generation;
+        providers[i] = provider_it->second.get();
+    }
+
+    const size_t n_calls = std::ranges::count_if(providers, [](StateProvider* provider) { return provider != nullptr; });
+    if (n_calls == 0) {
+        on_provider_result(std::move(pending->command));
+        return;
+    }
+
+    // provider calls run off the engine thread, the other sessions keep decoding meanwhile;
+    // the requests of one command run at once and the last one to return hands in the results
+    pending->n_running.store(n_calls, std::memory_order_relaxed);
+    for (size_t i = 0; i < n; i++) {
+        if (!providers[i]) continue;
+
+        (void)m_provider_pool.submit([this, pending, provider = providers[i], i] {
+            pending->command.results[i] = provider->processRequest(pending->command.requests[i]);
+            if (pending->n_running.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                m_provider_results.push(std::move(pending->command));
+            }
+        });
+    }
+}
+
+void Daemon::on_provider_result(ProviderResult result) noexcept {
+    const auto it = std::ranges::find_if(m_sessions, [&](const std::unique_ptr<Session>& session) {
+        return session->id == result.session_id;
+    });
+    // the client left or moved on to another prompt
+    if (it == m_sessions.end() || (*it)->fd < 0 || (*it)->turn != result.turn || (*it)->state != SessionState::PROVIDER) {
+        return;
+    }
+
+    Session& session = **it;
+    // fresh results get the id a later unchanged reply will name
+    std::vector<std::optional<u64>> result_ids(result.requests.size());
+    for (size_t i = 0; i < result.requests.size(); i++) {
+        result_ids[i] = session.responses.number(result.results[i], result.generations[i]);
+    }
+
+    const Message message {
+        .role = MessagerRole::System,
+        .content = encode_result(merge_results(std::move(result.results)), m_result_encoding)
+    };
+    if (!session.history.append(message, std::move(result.refers_to))) {
+        finish_turn(session, TurnOutcome::FAILED);
+        return;
+    }
+    for (size_t i = 0; i < result.requests.size(); i++) {
+        if (result_ids[i]) {
+            session.responses.store(
+                result.requests[i], *result.generations[i], *result_ids[i], session.history.entries().back().id);
+        }
+    }
+
+    send(session, {{"text", "\n"}});
+    begin_generation(session);
+}
+
+void Daemon::finish_turn(Session& session, TurnOutcome outcome) noexcept {
+    // an unfinished turn is removed from the history as a whole
+    if (outcome != TurnOutcome::COMPLETED) {
+        session.history.truncate(session.n_turn_entries);
+    }
+
+    const std::string_view label = outcome == TurnOutcome::COMPLETED ? "completed"
+        : outcome == TurnOutcome::CANCELLED ? "cancelled" : "failed";
+    send(session, {{"done", label}});
+    m_metrics.increment(METRIC_TURNS, {{"outcome", std::string(label)}});
+
+    session.state = SessionState::IDLE;
+}
+
+void Daemon::init_metrics(const std::filesystem::path& socket_path) noexcept {
+    m_metrics.add_counter(std::string(METRIC_TURNS), "Answered prompts by outcome");
+    m_metrics.add_histogram(std::string(METRIC_TIME_TO_FIRST_TOKEN), "Time from prompt to the first generated token",
+        {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0});
+    m_metrics.add_gauge(std::string(METRIC_SESSIONS), "Connected clients");
+    m_metrics.add_histogram(std::string(METRIC_BATCH_TOKENS), "Tokens per llama_decode call, every session together",
+        {1, 2, 4, 8, 16, 32, 64, 128, 256, 512});
+    m_metrics.add_histogram(std::string(METRIC_BATCH_SEQUENCES), "Sessions sharing a llama_decode call",
+        {1, 2, 4, 8, 16, 32, 64});
+    m_metrics.add_counter(std::string(METRIC_GENERATED_TOKENS), "Tokens generated for every session together");
+
+    if (socket_path.empty()) {
+        return;
+    }
+
+    const bool started = m_metrics_server.start(m_metrics, MetricsServer::Options {
+        .socket_path = socket_path,
+        .interval = SUMMARY_INTERVAL,
+        .summary = [this, n_tokens_seen = 0.0]() mutable { return metrics_summary(n_tokens_seen); },
+    });
+    if (!started) {
+        spdlog::warn("Metrics will not be served");
+    }
+}
+
+std::string Daemon::metrics_summary(double& n_tokens_seen) const noexcept {
+    const double n_tokens = m_metrics.total(METRIC_GENERATED_TOKENS);
+    if (n_tokens == n_tokens_seen) {
+        return "";
+    }
+    const double n_new = n_tokens - n_tokens_seen;
+    n_tokens_seen = n_tokens;
+
+    return std::format(
+        "{:.0f} sessions, {:.0f} turns, first token p50 {:.2f} s, {:.1f} tokens/s generated, "
+        "p50 {:.0f} sessions and {:.0f} tokens per batch",
+        m_metrics.value(METRIC_SESSIONS),
+        m_metrics.total(METRIC_TURNS),
+        m_metrics.quantile(METRIC_TIME_TO_FIRST_TOKEN, 0.5),
+        n_new / SUMMARY_INTERVAL.count(),
+        m_metrics.quantile(METRIC_BATCH_SEQUENCES, 0.5),
+        m_metrics.quantile(METRIC_BATCH_TOKENS, 0.5));
+}
@@ -0,0 +1,95 @@
+#include "draft_model.hpp"
+#include "orchestrator.hpp"
+
+#include <spdlog/spdlog.h>
+
+std::expected<void, DraftModelError> DraftModel::load(
+    const std::string& path, const llama_vocab* target_vocab, i32 n_gpu_layers, bool cpu_only) noexcept
+{
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = cpu_only ? 0 : n_gpu_layers;
+    ggml_backend_dev_t no_devices[] = { nullptr };
+    if (cpu_only) {
+        model_params.devices = no_devices;
+    }
+    m_model = llama_model_load_from_file(path.c_str(), model_params);
+    if (m_model == nullptr) {
+        spdlog::error("Error: unable to load draft model {}", path);
+        return std::unexpected(DraftModelError::MODEL_LOAD_FAILED);
+    }
+
+    // drafted token ids are fed to the orchestrator model as-is, so both have to share a vocabulary
+    m_vocab = llama_model_get_vocab(m_model);
+    if (llama_vocab_n_tokens(m_vocab) != llama_vocab_n_tokens(target_vocab)
+        || llama_vocab_bos(m_vocab) != llama_vocab_bos(target_vocab)
+        || llama_vocab_eos(m_vocab) != llama_vocab_eos(target_vocab)) {
+        spdlog::error("Draft model {} does not share the vocabulary of the orchestrator model", path);
+        return std::unexpected(DraftModelError::INCOMPATIBLE_VOCAB);
+    }
+
+    return {};
+}
+
+std::expected<void, DraftModelError> DraftModel::init(
+    const MemoryPlan& plan, const std::optional<CpuProfile>& cpu_profile) noexcept
+{
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_batch = N_BATCH;
+    // mirrors the orchestrator context, sized by the memory plan that counts both
+    apply_memory_plan(plan, 1, ctx_params);
+    if (cpu_profile) {
+        // drafting and verifying take turns, so the draft runs on the same number of threads
+        ctx_params.n_threads = cpu_profile->n_threads;
+        ctx_params.n_threads_batch = cpu_profile->n_threads_batch;
+        if (cpu_profile->flash_attn) {
+            ctx_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+        }
+        else if (plan.kv_type == KvCacheType::F16) {
+            ctx_params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        }
+    }
+    m_ctx = llama_init_from_model(m_model, ctx_params);
+    if (m_ctx == nullptr) {
+        spdlog::error("Failed to create draft llama_context");
+        return std::unexpected(DraftModelError::CONTEXT_CREATION_FAILED);
+    }
+
+    m_smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(m_smpl, llama_sampler_init_greedy());
+
+    m_kv.init(m_ctx, 0, llama_n_batch(m_ctx));
+
+    return {};
+}
+
+DraftModel::~DraftModel() noexcept {
+    llama_sampler_free(m_smpl);
+    llama_free(m_ctx);
+    llama_model_free(m_model);
+}
+
+std::expected<void, DraftModelError> DraftModel::propose(
+    std::span<const llama_token> context, llama_token last, i32 n_draft, std::vector<llama_token>& out) noexcept
+{
+    out.clear();
+
+    // the draft cache usually holds the context plus the rejected part of the previous draft
+    if (!m_kv.sync(context, false) || !m_kv.decode({&last, 1})) {
+        return std::unexpected(DraftModelError::EVALUATION_FAILED);
+    }
+
+    for (i32 i = 0; i < n_draft; i++) {
+        const llama_token id = llama_sampler_sample(m_smpl, m_ctx, -1);
+        out.push_back(id);
+
+        if (llama_vocab_is_eog(m_vocab, id) || i + 1 == n_draft) {
+            break;
+        }
+
+        if (!m_kv.decode({&id, 1})) {
+            return std::unexpected(DraftModelError::EVALUATION_FAILED);
+        }
+    }
+
+    return {};
+}
@@ -0,0 +1,390 @@
+#include "intent_router.hpp"
+#include "prefix_cache.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <fstream>
+
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+struct IntentExamples {
+    Intent intent;
+    std::vector<std::string_view> phrasings;
+};
+
+// Phrasings compared against the prompt, in the order of the Intent values. A new phrasing or
+// intent changes the catalog hash and embeds them all again.
+const std::vector<IntentExamples> INTENT_CATALOG = {
+    { Intent::LIST_WINDOWS, {
+        "what windows are open",
+        "which windows do I have open",
+        "list my open windows",
+        "show me all the windows",
+        "what apps are running",
+        "what is open right now",
+    } },
+    { Intent::LIST_WORKSPACES, {
+        "what workspaces do I have",
+        "list my workspaces",
+        "show all workspaces",
+        "how many workspaces are there",
+        "which workspace am I on",
+    } },
+    { Intent::LIST_ACTIVE_WORKSPACE_WINDOWS, {
+        "what is on this workspace",
+        "which windows are on my current workspace",
+        "list the windows on this workspace",
+        "what do I have open on this desktop",
+        "show the windows on the current workspace",
+    } },
+};
+
+// A match must beat every other intent by this much, a prompt halfway between two goes to the model
+constexpr float ROUTER_MARGIN = 0.03f;
+// Examples are a few words long, so is a prompt the router accepts
+constexpr u32 ROUTER_N_CTX = 512;
+
+constexpr u32 EXAMPLES_MAGIC = 0x544e4941; // "AINT"
+constexpr u32 EXAMPLES_VERSION = 1;
+
+struct ExamplesHeader {
+    u32 magic;
+    u32 version;
+    u32 n_examples;
+    u32 n_embd;
+};
+
+u64 catalog_hash() noexcept {
+    u64 hash = fnv1a(&EXAMPLES_VERSION, sizeof(EXAMPLES_VERSION));
+    for (const IntentExamples& examples : INTENT_CATALOG) {
+        hash = fnv1a(&examples.intent, sizeof(examples.intent), hash);
+        for (std::string_view phrasing : examples.phrasings) {
+            // the terminator keeps "ab" "c" apart from "a" "bc"
+            hash = fnv1a(phrasing.data(), phrasing.size() + 1, hash);
+        }
+    }
+    return hash;
+}
+
+std::filesystem::path examples_path(std::string_view model_key) noexcept {
+    const std::filesystem::path dir = cache_dir();
+    return dir.empty() ? dir : dir / std::format("intents-{}-{:016x}.bin", model_key, catalog_hash());
+}
+
+bool read_examples(const std::filesystem::path& path, u32 n_examples, u32 n_embd, std::vector<float>& out) {
+    std::ifstream in(path, std::ios::binary);
+    ExamplesHeader header {};
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return false;
+    }
+    if (header.magic != EXAMPLES_MAGIC || header.version != EXAMPLES_VERSION
+        || header.n_examples != n_examples || header.n_embd != n_embd) {
+        return false;
+    }
+
+    out.resize(static_cast<size_t>(n_examples) * n_embd);
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(out.data()), out.size() * sizeof(float)));
+}
+
+bool write_examples(const std::filesystem::path& path, u32 n_examples, u32 n_embd, std::span<const float> embeddings) {
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+
+    const ExamplesHeader header { EXAMPLES_MAGIC, EXAMPLES_VERSION, n_examples, n_embd };
+    std::filesystem::path tmp_path = path;
+    tmp_path += std::format(".{}.tmp", getpid());
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(embeddings.data()), embeddings.size_bytes());
+        if (!out) {
+            std::filesystem::remove(tmp_path, ec);
+            return false;
+        }
+    }
+
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+std::string count_of(size_t n, std::string_view noun) {
+    return std::format("{} {}{}", n, noun, n == 1 ? "" : "s");
+}
+
+std::string window_line(const nlohmann::json& window) {
+    const std::string title = window.value("title", "");
+    const std::string app_id = window.value("app_id", "");
+    if (title.empty()) {
+        return std::format("- {}", app_id.empty() ? "untitled" : app_id);
+    }
+    return app_id.empty() ? std::format("- {}", title) : std::format("- {} ({})", title, app_id);
+}
+
+std::string window_list(const nlohmann::json& windows, std::string_view where) {
+    if (windows.empty()) {
+        return std::format("No windows are open{}.", where);
+    }
+
+    std::string out = std::format("{} open{}:", count_of(windows.size(), "window"), where);
+    for (const nlohmann::json& window : windows) {
+        out += '\n';
+        out += window_line(window);
+    }
+    return out;
+}
+
+}
+
+StateRequest intent_request(Intent intent) {
+    const auto request = [](StateProviderKind kind, std::string_view action) {
+        return StateRequest {
+            kind, {{"action", action}, {"params", nlohmann::json::object()}}
+        };
+    };
+
+    switch (intent) {
+        case Intent::LIST_WINDOWS: return request(StateProviderKind::WINDOW, "get_open_windows");
+        case Intent::LIST_WORKSPACES: return request(StateProviderKind::WORKSPACE, "get_workspaces");
+        case Intent::LIST_ACTIVE_WORKSPACE_WINDOWS: return request(StateProviderKind::WORKSPACE, "get_active_workspace_windows");
+    };
+
+    return request(StateProviderKind::WINDOW, "get_open_windows");
+}
+
+std::string render_intent_answer(Intent intent, const nlohmann::json& result) {
+    if (!result.value("ok", false)) {
+        return std::format("I could not read the desktop state ({}).", result.value("error", "unknown error"));
+    }
+
+    switch (intent) {
+        case Intent::LIST_WINDOWS:
+            return window_list(result.value("windows", nlohmann::json::array()), "");
+
+        case Intent::LIST_ACTIVE_WORKSPACE_WINDOWS:
+            return window_list(result.value("windows", nlohmann::json::array()), " on the current workspace");
+
+        case Intent::LIST_WORKSPACES: {
+            const nlohmann::json workspaces = result.value("workspaces", nlohmann::json::array());
+            if (workspaces.empty()) {
+                return "The compositor reports no workspaces.";
+            }
+
+            std::string out = std::format("You have {}:", count_of(workspaces.size(), "workspace"));
+            for (const nlohmann::json& workspace : workspaces) {
+                std::string name = workspace.value("name", "");
+                if (name.empty()) {
+                    name = workspace.value("workspace_id", "unnamed");
+                }
+                out += std::format("\n- {}{}: {}", name, workspace.value("active", false) ? " (active)" : "",
+                    count_of(workspace.value("n_windows", 0), "window"));
+            }
+            return out;
+        }
+    };
+
+    return {};
+}
+
+IntentRouter::~IntentRouter() noexcept {
+    llama_free(m_ctx);
+    llama_model_free(m_model);
+}
+
+std::expected<void, IntentRouterError> IntentRouter::init(const std::string& model_path, i32 n_gpu_layers,
+    float threshold, const std::function<bool(const StateRequest&)>& available) noexcept
+{
+    m_threshold = threshold;
+
+    for (const IntentExamples& examples : INTENT_CATALOG) {
+        for (size_t i = 0; i < examples.phrasings.size(); i++) {
+            m_example_intents.push_back(examples.intent);
+        }
+        m_available.push_back(available(intent_request(examples.intent)));
+    }
+    if (std::ranges::find(m_available, true) == m_available.end()) {
+        spdlog::warn("No provider serves an intent the router knows");
+        return std::unexpected(IntentRouterError::NO_INTENTS);
+    }
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = n_gpu_layers;
+    m_model = llama_model_load_from_file(model_path.c_str(), model_params);
+    if (m_model == nullptr) {
+        spdlog::error("Error: unable to load router model {}", model_path);
+        return std::unexpected(IntentRouterError::MODEL_LOAD_FAILED);
+    }
+    m_vocab = llama_model_get_vocab(m_model);
+    m_n_embd = llama_model_n_embd(m_model);
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = ROUTER_N_CTX;
+    // encoder-only models take the whole input in one ubatch
+    ctx_params.n_batch = ROUTER_N_CTX;
+    ctx_params.n_ubatch = ROUTER_N_CTX;
+    ctx_params.embeddings = true;
+    m_ctx = llama_init_from_model(m_model, ctx_params);
+    if (m_ctx == nullptr) {
+        spdlog::error("Failed to create router llama_context");
+        return std::unexpected(IntentRouterError::CONTEXT_CREATION_FAILED);
+    }
+
+    return load_examples(model_path);
+}
+
+std::expected<void, IntentRouterError> IntentRouter::load_examples(const std::string& model_path) noexcept {
+    const u32 n_examples = m_example_intents.size();
+    const std::filesystem::path path = examples_path(model_cache_key(model_path, ""));
+
+    try {
+        if (!path.empty() && read_examples(path, n_examples, m_n_embd, m_embeddings)) {
+            spdlog::debug("Loaded {} intent examples from {}", n_examples, path.string());
+            return {};
+        }
+
+        m_embeddings.assign(static_cast<size_t>(n_examples) * m_n_embd, 0.0f);
+        size_t row = 0;
+        for (const IntentExamples& examples : INTENT_CATALOG) {
+            for (std::string_view phrasing : examples.phrasings) {
+                if (!embed(phrasing, std::span(m_embeddings).subspan(row * m_n_embd, m_n_embd))) {
+                    spdlog::error("Failed to embed the intent example \"{}\"", phrasing);
+                    return std::unexpected(IntentRouterError::EMBEDDING_FAILED);
+                }
+                row++;
+            }
+        }
+
+        if (!path.empty() && !write_examples(path, n_examples, m_n_embd, m_embeddings)) {
+            spdlog::warn("Failed to write the intent cache {}", path.string());
+        }
+    }
+    catch (const std::exception& e) {
+        spdlog::error("Failed to load the intent examples: {}", e.what());
+        return std::unexpected(IntentRouterError::EMBEDDING_FAILED);
+    }
+
+    return {};
+}
+
+bool IntentRouter::embed(std::string_view text, std::span<float> out, i32 max_tokens) noexcept {
+    // the model's own special tokens (e.g. [CLS] ... [SEP]) are part of what it was trained to embed
+    m_tokens.resize(ROUTER_N_CTX);
+    const i32 n_tokens = llama_tokenize(m_vocab, text.data(), text.size(), m_tokens.data(), m_tokens.size(), true, false);
+    if (n_tokens <= 0 || (max_tokens > 0 && n_tokens > max_tokens)) {
+        return false;
+    }
+
+    llama_memory_clear(llama_get_memory(m_ctx), true);
+
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+    for (i32 i = 0; i < n_tokens; i++) {
+        batch.token[i] = m_tokens[i];
+        batch.pos[i] = i;
+        batch.n_seq_id[i] = 1;
+        batch.seq_id[i][0] = 0;
+        batch.logits[i] = true;
+    }
+    batch.n_tokens = n_tokens;
+
+    const bool encoder_only = llama_model_has_encoder(m_model) && !llama_model_has_decoder(m_model);
+    const i32 res = encoder_only ? llama_encode(m_ctx, batch) : llama_decode(m_ctx, batch);
+    llama_batch_free(batch);
+    if (res != 0) {
+        return false;
+    }
+
+    if (llama_pooling_type(m_ctx) == LLAMA_POOLING_TYPE_NONE) {
+        // a model without a pooling layer gets the mean of its token embeddings
+        std::ranges::fill(out, 0.0f);
+        for (i32 i = 0; i < n_tokens; i++) {
+            const float* token_embd = llama_get_embeddings_ith(m_ctx, i);
+            if (token_embd == nullptr) {
+                return false;
+            }
+            for (i32 j = 0; j < m_n_embd; j++) {
+                out[j] += token_embd[j];
+            }
+        }
+    }
+    else {
+        const float* seq_embd = llama_get_embeddings_seq(m_ctx, 0);
+        if (seq_embd == nullptr) {
+            return false;
+        }
+        std::copy_n(seq_embd, m_n_embd, out.begin());
+    }
+
+    // normalized once here, comparing is then a dot product
+    float norm = 0.0f;
+    for (float x : out) {
+        norm += x * x;
+    }
+    norm = std::sqrt(norm);
+    if (norm == 0.0f) {
+        return false;
+    }
+    for (float& x : out) {
+        x /= norm;
+    }
+
+    return true;
+}
+
+std::optional<IntentMatch> IntentRouter::match(std::string_view prompt) noexcept {
+    if (m_ctx == nullptr) {
+        return std::nullopt;
+    }
+
+    std::vector<float> query(m_n_embd);
+    if (!embed(prompt, query, ROUTER_MAX_TOKENS)) {
+        return std::nullopt;
+    }
+
+    // closest example of every intent
+    std::vector<float> best(m_available.size(), -1.0f);
+    for (size_t row = 0; row < m_example_intents.size(); row++) {
+        const float* example = m_embeddings.data() + row * m_n_embd;
+        float similarity = 0.0f;
+        for (i32 j = 0; j < m_n_embd; j++) {
+            similarity += query[j] * example[j];
+        }
+
+        float& intent_best = best[static_cast<size_t>(m_example_intents[row])];
+        intent_best = std::max(intent_best, similarity);
+    }
+
+    // the runner-up counts even if unavailable, a prompt that close to it is ambiguous
+    size_t top = best.size();
+    float runner_up = -1.0f;
+    for (size_t i = 0; i < best.size(); i++) {
+        if (!m_available[i]) {
+            runner_up = std::max(runner_up, best[i]);
+            continue;
+        }
+        if (top == best.size() || best[i] > best[top]) {
+            if (top != best.size()) {
+                runner_up = std::max(runner_up, best[top]);
+            }
+            top = i;
+        }
+        else {
+            runner_up = std::max(runner_up, best[i]);
+        }
+    }
+
+    if (top == best.size() || best[top] < m_threshold || best[top] - runner_up < ROUTER_MARGIN) {
+        spdlog::debug("No intent matched, closest at {:.3f}", top == best.size() ? -1.0f : best[top]);
+        return std::nullopt;
+    }
+
+    return IntentMatch { .intent = static_cast<Intent>(top), .similarity = best[top] };
+}
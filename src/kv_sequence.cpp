@@ -0,0 +1,117 @@
+#include "kv_sequence.hpp"
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+KvSequence::~KvSequence() noexcept {
+    if (m_batch.token) {
+        llama_batch_free(m_batch);
+    }
+}
+
+void KvSequence::init(llama_context* ctx, llama_seq_id seq_id, i32 n_batch) noexcept {
+    if (m_batch.token) {
+        llama_batch_free(m_batch);
+    }
+
+    m_ctx = ctx;
+    m_seq_id = seq_id;
+    m_n_batch = n_batch;
+    m_batch = llama_batch_init(n_batch, 0, 1);
+    m_tokens.clear();
+}
+
+bool KvSequence::sync(std::span<const llama_token> prompt, bool need_logits) noexcept {
+    const size_t n_reuse = reuse(prompt, need_logits);
+    return decode(prompt.subspan(n_reuse));
+}
+
+size_t KvSequence::reuse(std::span<const llama_token> prompt, bool need_logits) noexcept {
+    // find how much of the prompt is already in the KV cache
+    const size_t n_common = std::ranges::mismatch(m_tokens, prompt).in1 - m_tokens.begin();
+    size_t n_reuse = n_common;
+
+    // the last prompt token has to be decoded again to get logits for sampling
+    if (need_logits && n_reuse == prompt.size() && n_reuse > 0) {
+        n_reuse--;
+    }
+
+    // drop everything after the common prefix, i.e. the previous generation and any diverging history
+    truncate(n_reuse);
+
+    spdlog::debug("KV cache (seq {}): reusing {} tokens, decoding {} new tokens", m_seq_id, n_reuse, prompt.size() - n_reuse);
+
+    return n_reuse;
+}
+
+bool KvSequence::decode(std::span<const llama_token> tokens, bool all_logits) noexcept {
+    for (size_t i = 0; i < tokens.size(); i += m_n_batch) {
+        const size_t n = std::min<size_t>(m_n_batch, tokens.size() - i);
+        const bool last_chunk = i + n == tokens.size();
+
+        m_batch.n_tokens = n;
+        for (size_t j = 0; j < n; j++) {
+            m_batch.token[j] = tokens[i + j];
+            m_batch.pos[j] = m_tokens.size() + j;
+            m_batch.n_seq_id[j] = 1;
+            m_batch.seq_id[j][0] = m_seq_id;
+            m_batch.logits[j] = all_logits || (last_chunk && j == n - 1);
+        }
+
+        if (const i32 ret = llama_decode(m_ctx, m_batch); ret != 0) {
+            // an aborted decode may leave part of the batch in the cache
+            llama_memory_seq_rm(llama_get_memory(m_ctx), m_seq_id, m_tokens.size(), -1);
+            if (ret != 2) {
+                spdlog::error("Failed to eval");
+            }
+            return false;
+        }
+
+        m_tokens.insert(m_tokens.end(), tokens.begin() + i, tokens.begin() + i + n);
+        m_n_decoded += n;
+    }
+
+    return true;
+}
+
+void KvSequence::truncate(size_t n_keep) noexcept {
+    if (n_keep >= m_tokens.size()) {
+        return;
+    }
+
+    llama_memory_seq_rm(llama_get_memory(m_ctx), m_seq_id, n_keep, -1);
+    m_tokens.resize(n_keep);
+}
+
+void KvSequence::erase(size_t p0, size_t n) noexcept {
+    const size_t p1 = p0 + n;
+    if (p0 >= m_tokens.size()) {
+        return;
+    }
+
+    llama_memory_t mem = llama_get_memory(m_ctx);
+    if (p1 >= m_tokens.size() || !llama_memory_can_shift(mem)) {
+        // nothing to keep after the range, or the cache cannot move positions: decode the tail again later
+        truncate(p0);
+        return;
+    }
+
+    llama_memory_seq_rm(mem, m_seq_id, p0, p1);
+    llama_memory_seq_add(mem, m_seq_id, p1, -1, -static_cast<llama_pos>(n));
+    m_tokens.erase(m_tokens.begin() + p0, m_tokens.begin() + p1);
+}
+
+void KvSequence::assign(std::span<const llama_token> tokens) noexcept {
+    m_tokens.assign(tokens.begin(), tokens.end());
+}
+
+void KvSequence::append(std::span<const llama_token> tokens) noexcept {
+    m_tokens.insert(m_tokens.end(), tokens.begin(), tokens.end());
+    m_n_decoded += tokens.size();
+}
+
+void KvSequence::clear() noexcept {
+    llama_memory_seq_rm(llama_get_memory(m_ctx), m_seq_id, -1, -1);
+    m_tokens.clear();
+}
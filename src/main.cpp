@@ -1,5 +1,17 @@
 #include "application.hpp"
+#include "console_input.hpp"
 
-int main() {
-    Application app;
+#include <string_view>
+
+#include <spdlog/cfg/env.h>
+
+int main(int argc, char** argv) {
+    // before any thread exists, so Ctrl-C only reaches the console input or the daemon
+    block_termination_signals();
+
+    // e.g. SPDLOG_LEVEL=debug
+    spdlog::cfg::load_env_levels();
+
+    const bool daemon = argc > 1 && std::string_view(argv[1]) == "--daemon";
+    Application app(daemon ? AppMode::DAEMON : AppMode::INTERACTIVE);
 }
@@ -0,0 +1,229 @@
+#include "memory_budget.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <format>
+#include <fstream>
+#include <vector>
+
+#include <unistd.h>
+
+#include <ggml-backend.h>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// libraries, the grammar sampler, the history and everything else that is not the model
+constexpr u64 BASE_OVERHEAD_BYTES = 256ull << 20;
+
+constexpr std::array<i32, 6> CTX_STEPS = { 8192, 6144, 4096, 3072, 2048, 1024 };
+constexpr std::array<i32, 3> UBATCH_STEPS = { 512, 256, 128 };
+
+double gib(u64 bytes) {
+    return bytes / static_cast<double>(1ull << 30);
+}
+
+// Bytes per cached element; q8_0 and q4_0 store blocks of 32 values with an f16 scale
+double kv_element_bytes(KvCacheType type) {
+    switch (type) {
+        case KvCacheType::F16: return 2.0;
+        case KvCacheType::Q8_0: return 34.0 / 32.0;
+        case KvCacheType::Q4_0: return 18.0 / 32.0;
+    }
+    return 2.0;
+}
+
+ggml_type kv_ggml_type(KvCacheType type) {
+    switch (type) {
+        case KvCacheType::F16: return GGML_TYPE_F16;
+        case KvCacheType::Q8_0: return GGML_TYPE_Q8_0;
+        case KvCacheType::Q4_0: return GGML_TYPE_Q4_0;
+    }
+    return GGML_TYPE_F16;
+}
+
+MemoryPlan project(const ModelShape& shape, KvCacheType kv_type, i32 n_ctx, i32 n_ubatch, u32 n_seq) {
+    const double host_fraction = shape.n_layer > 0 ? static_cast<double>(shape.n_layer_host) / shape.n_layer : 1.0;
+    const i32 head_dim = shape.n_head > 0 ? shape.n_embd / shape.n_head : 0;
+    const u64 n_cells = static_cast<u64>(n_ctx) * n_seq;
+
+    // keys and values of every host layer
+    const double kv = 2.0 * shape.n_layer_host * shape.n_head_kv * head_dim * kv_element_bytes(kv_type) * n_cells;
+    // logits and activations of one ubatch; without flash attention the f16 KV cache also
+    // materializes the full attention scores
+    double compute = static_cast<double>(n_ubatch) * (shape.n_vocab + 8.0 * shape.n_embd) * sizeof(float);
+    if (kv_type == KvCacheType::F16) {
+        compute += static_cast<double>(n_ubatch) * n_cells * shape.n_head * sizeof(float);
+    }
+
+    return MemoryPlan {
+        .kv_type = kv_type,
+        .n_ctx = n_ctx,
+        .n_ubatch = n_ubatch,
+        .weights_bytes = static_cast<u64>(shape.weights_bytes * host_fraction),
+        .kv_bytes = static_cast<u64>(kv),
+        .compute_bytes = static_cast<u64>(compute),
+    };
+}
+
+// The plan of the orchestrator model plus a draft model whose context mirrors it
+MemoryPlan project(const ModelShape& shape, const std::optional<ModelShape>& draft, KvCacheType kv_type, i32 n_ctx,
+    i32 n_ubatch, u32 n_seq)
+{
+    MemoryPlan plan = project(shape, kv_type, n_ctx, n_ubatch, n_seq);
+    if (draft) {
+        const MemoryPlan draft_plan = project(*draft, kv_type, n_ctx, n_ubatch, n_seq);
+        plan.weights_bytes += draft_plan.weights_bytes;
+        plan.kv_bytes += draft_plan.kv_bytes;
+        plan.compute_bytes += draft_plan.compute_bytes;
+    }
+    return plan;
+}
+
+}
+
+std::optional<KvCacheType> kv_cache_type_from_string(std::string_view str) noexcept {
+    if (str == "f16") return KvCacheType::F16;
+    if (str == "q8_0") return KvCacheType::Q8_0;
+    if (str == "q4_0") return KvCacheType::Q4_0;
+    return std::nullopt;
+}
+
+std::string_view kv_cache_type_to_string(KvCacheType type) noexcept {
+    switch (type) {
+        case KvCacheType::F16: return "f16";
+        case KvCacheType::Q8_0: return "q8_0";
+        case KvCacheType::Q4_0: return "q4_0";
+    }
+
+    return "INVALID_KV_CACHE_TYPE";
+}
+
+std::optional<u64> parse_byte_size(std::string_view str) noexcept {
+    u64 value = 0;
+    const auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+    if (ec != std::errc() || end == str.data()) {
+        return std::nullopt;
+    }
+
+    const std::string_view suffix(end, str.data() + str.size());
+    if (suffix.empty()) return value;
+    if (suffix == "K" || suffix == "k") return value << 10;
+    if (suffix == "M" || suffix == "m") return value << 20;
+    if (suffix == "G" || suffix == "g") return value << 30;
+    return std::nullopt;
+}
+
+u64 MemoryPlan::total_bytes() const noexcept {
+    return weights_bytes + kv_bytes + compute_bytes + BASE_OVERHEAD_BYTES;
+}
+
+i32 host_layers(i32 n_layer, i32 n_gpu_layers, bool cpu_only) noexcept {
+    bool has_gpu = false;
+    for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+        has_gpu |= ggml_backend_dev_type(ggml_backend_dev_get(i)) == GGML_BACKEND_DEVICE_TYPE_GPU;
+    }
+
+    if (cpu_only || !has_gpu) {
+        return n_layer;
+    }
+    return std::max(0, n_layer - n_gpu_layers);
+}
+
+ModelShape model_shape(const llama_model* model, i32 n_gpu_layers, bool cpu_only) noexcept {
+    const i32 n_layer = llama_model_n_layer(model);
+    return ModelShape {
+        .weights_bytes = llama_model_size(model),
+        .n_layer = n_layer,
+        .n_head = llama_model_n_head(model),
+        .n_head_kv = llama_model_n_head_kv(model),
+        .n_embd = llama_model_n_embd(model),
+        .n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model)),
+        .n_ctx_train = llama_model_n_ctx_train(model),
+        .n_layer_host = host_layers(n_layer, n_gpu_layers, cpu_only),
+    };
+}
+
+bool plan_mlock(const MemoryBudget& budget, u64 file_bytes, bool weights_on_host) noexcept {
+    return budget.max_rss_bytes > 0 && weights_on_host && file_bytes + BASE_OVERHEAD_BYTES < budget.max_rss_bytes;
+}
+
+MemoryPlan plan_memory(const MemoryBudget& budget, const ModelShape& shape, i32 n_ctx_max, i32 n_ctx_min, i32 n_batch,
+    u32 n_seq, const std::optional<ModelShape>& draft) noexcept
+{
+    n_ctx_max = std::min(n_ctx_max, shape.n_ctx_train);
+    if (budget.max_ctx > 0) {
+        n_ctx_max = std::min(n_ctx_max, budget.max_ctx);
+    }
+    // a context that cannot hold the system prompt and one generation is of no use at any size
+    n_ctx_max = std::max(n_ctx_max, n_ctx_min);
+    n_batch = std::min(n_batch, UBATCH_STEPS.front());
+
+    // without a budget the defaults are kept: full context, f16 cache, ubatch as large as a batch
+    if (budget.max_rss_bytes == 0) {
+        return project(shape, draft, budget.kv_type.value_or(KvCacheType::F16), n_ctx_max, n_batch, n_seq);
+    }
+
+    std::vector<std::vector<KvCacheType>> passes = { { KvCacheType::F16, KvCacheType::Q8_0 }, { KvCacheType::Q4_0 } };
+    if (budget.kv_type) {
+        passes = { { *budget.kv_type } };
+    }
+
+    for (const std::vector<KvCacheType>& types : passes) {
+        for (const i32 step : CTX_STEPS) {
+            // the largest step is the cap itself, so a cap between steps is still tried
+            const i32 n_ctx = std::max(std::min(step, n_ctx_max), n_ctx_min);
+            for (KvCacheType kv_type : types) {
+                for (const i32 n_ubatch : UBATCH_STEPS) {
+                    if (n_ubatch > n_batch) continue;
+
+                    const MemoryPlan plan = project(shape, draft, kv_type, n_ctx, n_ubatch, n_seq);
+                    if (plan.total_bytes() <= budget.max_rss_bytes) {
+                        return plan;
+                    }
+                }
+            }
+        }
+    }
+
+    // nothing fits, not even the smallest usable context
+    MemoryPlan plan = project(shape, draft, passes.back().back(), n_ctx_min, UBATCH_STEPS.back(), n_seq);
+    plan.fits = false;
+    return plan;
+}
+
+void apply_memory_plan(const MemoryPlan& plan, u32 n_seq, llama_context_params& params) noexcept {
+    params.n_ctx = static_cast<u32>(plan.n_ctx) * n_seq;
+    params.n_ubatch = static_cast<u32>(plan.n_ubatch);
+    params.type_k = kv_ggml_type(plan.kv_type);
+    params.type_v = kv_ggml_type(plan.kv_type);
+    // a quantized V cache is only supported by the flash attention kernels
+    if (plan.kv_type != KvCacheType::F16) {
+        params.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    }
+}
+
+void log_memory_plan(const MemoryPlan& plan, const MemoryBudget& budget) noexcept {
+    const std::string budget_str = budget.max_rss_bytes > 0 ? std::format("{:.1f} GiB", gib(budget.max_rss_bytes)) : "none";
+    spdlog::info("Memory plan: {} KV cache, {} tokens of context, ubatch {}; projected {:.2f} GiB resident "
+        "(weights {:.2f}, KV {:.2f}, compute {:.2f}), budget {}",
+        kv_cache_type_to_string(plan.kv_type), plan.n_ctx, plan.n_ubatch, gib(plan.total_bytes()),
+        gib(plan.weights_bytes), gib(plan.kv_bytes), gib(plan.compute_bytes), budget_str);
+
+    if (!plan.fits) {
+        spdlog::error("The model does not fit the memory budget of {}, even with the {} tokens of context the system "
+            "prompt and one answer need; raise AUTOSKTOP_MEMORY_BUDGET", budget_str, plan.n_ctx);
+    }
+}
+
+u64 resident_bytes() noexcept {
+    std::ifstream statm("/proc/self/statm");
+    u64 size = 0;
+    u64 resident = 0;
+    if (!(statm >> size >> resident)) {
+        return 0;
+    }
+    return resident * static_cast<u64>(sysconf(_SC_PAGESIZE));
+}
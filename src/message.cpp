@@ -0,0 +1,31 @@
+#include "message.hpp"
+
+std::string_view messager_role_to_string(MessagerRole role) noexcept {
+    switch (role) {
+        case MessagerRole::System: return "system";
+        case MessagerRole::User: return "user";
+        case MessagerRole::Assistant: return "assistant";
+    };
+
+    return "INVALID_ROLE";
+}
+
+std::string message_header(MessagerRole role) noexcept {
+    std::string out;
+
+    out += MESSAGE_HEADER_START;
+    out += messager_role_to_string(role);
+    out += MESSAGE_HEADER_END;
+    out += '\n';
+
+    return out;
+}
+
+std::string Message::to_string() const noexcept {
+    std::string out = message_header(role);
+
+    out += content;
+    out += MESSAGE_EOT;
+
+    return out;
+}
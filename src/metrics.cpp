@@ -0,0 +1,187 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <format>
+
+#include <spdlog/spdlog.h>
+
+static std::string render_labels(const MetricLabels& labels) {
+    std::string out;
+    for (const auto& [key, value] : labels) {
+        out += out.empty() ? "" : ",";
+        out += key;
+        out += "=\"";
+        for (char c : value) {
+            switch (c) {
+                case '\\': out += "\\\\"; break;
+                case '"': out += "\\\""; break;
+                case '\n': out += "\\n"; break;
+                default: out += c; break;
+            }
+        }
+        out += '"';
+    }
+    return out;
+}
+
+// A metric line with `extra` appended to the labels of the series, as the le of a bucket
+static std::string sample_name(std::string_view name, std::string_view labels, std::string_view extra = "") {
+    if (labels.empty() && extra.empty()) {
+        return std::string(name);
+    }
+    return std::format("{}{{{}{}{}}}", name, labels, !labels.empty() && !extra.empty() ? "," : "", extra);
+}
+
+void Metrics::add_counter(std::string name, std::string help) noexcept {
+    std::lock_guard lock(m_mutex);
+    m_families.try_emplace(std::move(name), Family { .type = MetricType::COUNTER, .help = std::move(help) });
+}
+
+void Metrics::add_gauge(std::string name, std::string help) noexcept {
+    std::lock_guard lock(m_mutex);
+    m_families.try_emplace(std::move(name), Family { .type = MetricType::GAUGE, .help = std::move(help) });
+}
+
+void Metrics::add_histogram(std::string name, std::string help, std::vector<double> bounds) noexcept {
+    std::lock_guard lock(m_mutex);
+    m_families.try_emplace(std::move(name), Family {
+        .type = MetricType::HISTOGRAM,
+        .help = std::move(help),
+        .bounds = std::move(bounds),
+    });
+}
+
+Metrics::Series* Metrics::series(std::string_view name, MetricType type, const MetricLabels& labels) noexcept {
+    auto it = m_families.find(name);
+    if (it == m_families.end() || it->second.type != type) {
+        spdlog::debug("Metric {} is not registered with this type", name);
+        return nullptr;
+    }
+
+    Family& family = it->second;
+    auto [series_it, inserted] = family.series.try_emplace(render_labels(labels));
+    if (inserted && type == MetricType::HISTOGRAM) {
+        series_it->second.buckets.resize(family.bounds.size() + 1);
+    }
+    return &series_it->second;
+}
+
+void Metrics::increment(std::string_view name, const MetricLabels& labels, double n) noexcept {
+    std::lock_guard lock(m_mutex);
+    if (Series* s = series(name, MetricType::COUNTER, labels)) {
+        s->value += n;
+    }
+}
+
+void Metrics::set(std::string_view name, double value, const MetricLabels& labels) noexcept {
+    std::lock_guard lock(m_mutex);
+    if (Series* s = series(name, MetricType::GAUGE, labels)) {
+        s->value = value;
+    }
+}
+
+void Metrics::observe(std::string_view name, double value, const MetricLabels& labels) noexcept {
+    std::lock_guard lock(m_mutex);
+    Series* s = series(name, MetricType::HISTOGRAM, labels);
+    if (s == nullptr) {
+        return;
+    }
+
+    const std::vector<double>& bounds = m_families.find(name)->second.bounds;
+    const size_t bucket = std::ranges::lower_bound(bounds, value) - bounds.begin();
+    s->buckets[bucket]++;
+    s->value += value;
+    s->count++;
+}
+
+double Metrics::quantile(std::string_view name, double q) const noexcept {
+    std::lock_guard lock(m_mutex);
+    auto it = m_families.find(name);
+    if (it == m_families.end() || it->second.type != MetricType::HISTOGRAM) {
+        return 0.0;
+    }
+
+    const Family& family = it->second;
+    std::vector<u64> buckets(family.bounds.size() + 1);
+    u64 count = 0;
+    for (const auto& [_, s] : family.series) {
+        for (size_t i = 0; i < buckets.size(); i++) {
+            buckets[i] += s.buckets[i];
+        }
+        count += s.count;
+    }
+    if (count == 0) {
+        return 0.0;
+    }
+
+    // same estimate as Prometheus' histogram_quantile: linear within the bucket holding the rank
+    const double rank = q * count;
+    u64 below = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        if (below + buckets[i] >= rank && buckets[i] > 0) {
+            // the +Inf bucket has no upper bound, report the highest finite one
+            if (i == family.bounds.size()) {
+                return family.bounds.empty() ? 0.0 : family.bounds.back();
+            }
+            const double lower = i == 0 ? 0.0 : family.bounds[i - 1];
+            return lower + (family.bounds[i] - lower) * (rank - below) / buckets[i];
+        }
+        below += buckets[i];
+    }
+
+    return family.bounds.empty() ? 0.0 : family.bounds.back();
+}
+
+double Metrics::total(std::string_view name) const noexcept {
+    std::lock_guard lock(m_mutex);
+    auto it = m_families.find(name);
+    if (it == m_families.end()) {
+        return 0.0;
+    }
+
+    double total = 0.0;
+    for (const auto& [_, s] : it->second.series) {
+        total += it->second.type == MetricType::HISTOGRAM ? s.count : s.value;
+    }
+    return total;
+}
+
+double Metrics::value(std::string_view name, const MetricLabels& labels) const noexcept {
+    std::lock_guard lock(m_mutex);
+    auto it = m_families.find(name);
+    if (it == m_families.end()) {
+        return 0.0;
+    }
+
+    auto series_it = it->second.series.find(render_labels(labels));
+    return series_it == it->second.series.end() ? 0.0 : series_it->second.value;
+}
+
+std::string Metrics::render() const {
+    std::lock_guard lock(m_mutex);
+
+    std::string out;
+    for (const auto& [name, family] : m_families) {
+        const std::string_view type = family.type == MetricType::COUNTER ? "counter"
+            : family.type == MetricType::GAUGE ? "gauge" : "histogram";
+        out += std::format("# HELP {} {}\n# TYPE {} {}\n", name, family.help, name, type);
+
+        for (const auto& [labels, s] : family.series) {
+            if (family.type != MetricType::HISTOGRAM) {
+                out += std::format("{} {}\n", sample_name(name, labels), s.value);
+                continue;
+            }
+
+            u64 cumulative = 0;
+            for (size_t i = 0; i < s.buckets.size(); i++) {
+                cumulative += s.buckets[i];
+                const std::string le = i < family.bounds.size() ? std::format("{}", family.bounds[i]) : "+Inf";
+                out += std::format("{} {}\n", sample_name(name + "_bucket", labels, std::format("le=\"{}\"", le)), cumulative);
+            }
+            out += std::format("{} {}\n", sample_name(name + "_sum", labels), s.value);
+            out += std::format("{} {}\n", sample_name(name + "_count", labels), s.count);
+        }
+    }
+
+    return out;
+}
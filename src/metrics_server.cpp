@@ -0,0 +1,129 @@
+#include "metrics_server.hpp"
+#include "int_types.hpp"
+#include "unix_socket.hpp"
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <string_view>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+// how long a client gets to send its request before it is treated as a bare connection
+constexpr int REQUEST_TIMEOUT_MS = 100;
+
+std::filesystem::path default_metrics_socket_path() noexcept {
+    return runtime_socket_path("metrics.sock");
+}
+
+MetricsServer::~MetricsServer() noexcept {
+    stop();
+}
+
+bool MetricsServer::start(const Metrics& metrics, Options options) noexcept {
+    m_metrics = &metrics;
+    m_options = std::move(options);
+
+    m_listener = listen_unix_socket(m_options.socket_path, 8);
+    m_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_listener.fd < 0 || m_wake_fd < 0) {
+        stop();
+        return false;
+    }
+
+    spdlog::debug("Serving metrics on {}", m_options.socket_path.string());
+    m_thread = std::jthread([this] { run(); });
+    return true;
+}
+
+void MetricsServer::stop() noexcept {
+    if (m_thread.joinable()) {
+        const u64 one = 1;
+        [[maybe_unused]] ssize_t n = write(m_wake_fd, &one, sizeof(one));
+        m_thread.join();
+    }
+
+    close_unix_listener(m_listener);
+    if (m_wake_fd >= 0) {
+        close(m_wake_fd);
+        m_wake_fd = -1;
+    }
+}
+
+void MetricsServer::run() noexcept {
+    using clock = std::chrono::steady_clock;
+    clock::time_point next_summary = clock::now() + m_options.interval;
+
+    while (true) {
+        const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(next_summary - clock::now());
+        std::array<pollfd, 2> fds {{
+            { .fd = m_listener.fd, .events = POLLIN, .revents = 0 },
+            { .fd = m_wake_fd, .events = POLLIN, .revents = 0 },
+        }};
+
+        const int n = poll(fds.data(), fds.size(), std::max<i64>(timeout.count(), 0));
+        if (n < 0 && errno != EINTR) {
+            spdlog::error("Metrics server failed: {}", std::strerror(errno));
+            return;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            return;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            const int client_fd = accept4(m_listener.fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client_fd >= 0) {
+                serve(client_fd);
+                close(client_fd);
+            }
+        }
+
+        if (clock::now() >= next_summary) {
+            if (m_options.summary) {
+                if (const std::string summary = m_options.summary(); !summary.empty()) {
+                    spdlog::info("{}", summary);
+                }
+            }
+            next_summary = clock::now() + m_options.interval;
+        }
+    }
+}
+
+void MetricsServer::serve(int client_fd) const noexcept {
+    // only the first bytes matter, an HTTP request line starts with its method
+    std::array<char, 512> request;
+    ssize_t n_request = 0;
+    pollfd pfd { .fd = client_fd, .events = POLLIN, .revents = 0 };
+    if (poll(&pfd, 1, REQUEST_TIMEOUT_MS) > 0) {
+        n_request = recv(client_fd, request.data(), request.size(), MSG_DONTWAIT);
+    }
+    const bool http = n_request > 0 && std::string_view(request.data(), n_request).starts_with("GET ");
+
+    const std::string body = m_metrics->render();
+    std::string response;
+    if (http) {
+        response = std::format(
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\nConnection: close\r\n\r\n",
+            body.size());
+    }
+    response += body;
+
+    size_t sent = 0;
+    while (sent < response.size()) {
+        const ssize_t n = send(client_fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        sent += n;
+    }
+}
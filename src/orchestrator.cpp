@@ -1,11 +1,17 @@
 #include "orchestrator.hpp"
 #include "llama.h"
+#include "output_classifier.hpp"
+#include "prefix_cache.hpp"
+#include "request_grammar.hpp"
+#include "startup.hpp"
 #include "state_request.hpp"
 #include "window_state_provider.hpp"
+#include "workspace_state_provider.hpp"
 
 #include <expected>
+#include <filesystem>
+#include <format>
 #include <print>
-#include <iostream>
 
 #include <spdlog/spdlog.h>
 #include <nlohmann/json.hpp>
@@ -16,191 +22,761 @@ static void llama_log_callback(enum ggml_log_level level, const char* text, [[ma
     }
 }
 
-std::expected<void, OrchestratorError> Orchestrator::init() noexcept {
-    llama_log_set(llama_log_callback, this);
+namespace {
+
+constexpr std::string_view METRIC_TURNS = "autosktop_turns_total";
+constexpr std::string_view METRIC_TURN_DURATION = "autosktop_turn_duration_seconds";
+constexpr std::string_view METRIC_TIME_TO_FIRST_TOKEN = "autosktop_time_to_first_token_seconds";
+constexpr std::string_view METRIC_PREFILL_SPEED = "autosktop_prefill_tokens_per_second";
+constexpr std::string_view METRIC_DECODE_SPEED = "autosktop_decode_tokens_per_second";
+constexpr std::string_view METRIC_KV_TOKENS = "autosktop_kv_cache_tokens";
+constexpr std::string_view METRIC_KV_CAPACITY = "autosktop_kv_cache_capacity_tokens";
+constexpr std::string_view METRIC_PROVIDER_DURATION = "autosktop_provider_call_duration_seconds";
+constexpr std::string_view METRIC_COMMANDS = "autosktop_commands_total";
+constexpr std::string_view METRIC_ROUTED_TURNS = "autosktop_routed_turns_total";
+
+}
+
+const Message IDENTITY_MESSAGE = Message {
+    .role = MessagerRole::System,
+    .content = SYSTEM_PROMPT
+};
+
+OrchestratorOptions orchestrator_options_from_env() noexcept {
+    OrchestratorOptions options;
 
     const char* orchestrator_path_env = std::getenv("ORCHESTRATOR_MODEL_PATH");
-    std::string orchestrator_path = orchestrator_path_env ? orchestrator_path_env : DEFAULT_ORCHESTRATOR_PATH;
-    if (orchestrator_path.empty()) {
-        spdlog::error("Error: Orchestrator path is empty");
-        return std::unexpected(OrchestratorError::MODEL_BAD_PATH);
+    options.model_path = orchestrator_path_env ? orchestrator_path_env : DEFAULT_ORCHESTRATOR_PATH;
+
+    if (const char* draft_path_env = std::getenv("ORCHESTRATOR_DRAFT_MODEL_PATH"); draft_path_env) {
+        options.draft_model_path = draft_path_env;
     }
 
-    ggml_backend_load_all();
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = N_GPU_LAYERS;
-    model = llama_model_load_from_file(orchestrator_path.c_str(), model_params);
-    if (model == nullptr) {
-        spdlog::error("Error: unable to load model {}", orchestrator_path);
-        return std::unexpected(OrchestratorError::MODEL_LOAD_FAILED);
+    if (const char* router_path_env = std::getenv("AUTOSKTOP_ROUTER_MODEL_PATH"); router_path_env) {
+        options.router_model_path = router_path_env;
+    }
+
+    if (const char* threshold_env = std::getenv("AUTOSKTOP_ROUTER_THRESHOLD"); threshold_env && *threshold_env) {
+        char* end = nullptr;
+        const float threshold = std::strtof(threshold_env, &end);
+        if (*end == '\0' && threshold > 0.0f && threshold <= 1.0f) {
+            options.router_threshold = threshold;
+        }
+        else {
+            spdlog::warn("Invalid router threshold {}, using {}", threshold_env, options.router_threshold);
+        }
+    }
+
+    // an empty value turns the metrics socket off
+    const char* metrics_socket_env = std::getenv("AUTOSKTOP_METRICS_SOCKET");
+    options.metrics_socket = metrics_socket_env ? metrics_socket_env : default_metrics_socket_path();
+
+    if (const char* encoding_env = std::getenv("ORCHESTRATOR_RESULT_ENCODING"); encoding_env && *encoding_env) {
+        if (const auto encoding = result_encoding_from_string(encoding_env)) {
+            options.result_encoding = *encoding;
+        }
+        else {
+            spdlog::warn("Unknown result encoding {}, using {}", encoding_env, result_encoding_to_string(options.result_encoding));
+        }
+    }
+
+    if (const char* tune_env = std::getenv("AUTOSKTOP_CPU_TUNE"); tune_env && *tune_env) {
+        if (const std::optional<CpuTuning> tuning = cpu_tuning_from_string(tune_env)) {
+            options.cpu_tuning = *tuning;
+        }
+        else {
+            spdlog::warn("Unknown CPU tuning mode {}, using {}", tune_env, cpu_tuning_to_string(options.cpu_tuning));
+        }
+    }
+
+    if (const char* gpu_layers_env = std::getenv("ORCHESTRATOR_GPU_LAYERS"); gpu_layers_env && *gpu_layers_env) {
+        options.n_gpu_layers = std::atoi(gpu_layers_env);
+    }
+
+    if (const char* budget_env = std::getenv("AUTOSKTOP_MEMORY_BUDGET"); budget_env && *budget_env) {
+        if (const std::optional<u64> budget = parse_byte_size(budget_env)) {
+            options.memory.max_rss_bytes = *budget;
+        }
+        else {
+            spdlog::warn("Invalid memory budget {}, running without one", budget_env);
+        }
+    }
+
+    if (const char* kv_type_env = std::getenv("ORCHESTRATOR_KV_CACHE_TYPE"); kv_type_env && *kv_type_env) {
+        if (const std::optional<KvCacheType> kv_type = kv_cache_type_from_string(kv_type_env)) {
+            options.memory.kv_type = *kv_type;
+        }
+        else {
+            spdlog::warn("Unknown KV cache type {}, letting the memory budget pick one", kv_type_env);
+        }
+    }
+
+    if (const char* max_ctx_env = std::getenv("ORCHESTRATOR_MAX_CTX"); max_ctx_env && *max_ctx_env) {
+        options.memory.max_ctx = std::max(0, std::atoi(max_ctx_env));
     }
 
+    return options;
+}
+
+std::expected<StateProviders, OrchestratorError> init_state_providers() noexcept {
     auto window_state_provider = std::make_unique<WindowStateProvider>();
     if (!window_state_provider->init()) {
         spdlog::error("Failed to initialize window state provider");
         return std::unexpected(OrchestratorError::STATE_PROVIDER_ERROR);
     }
-    m_state_providers.insert({StateProviderKind::WINDOW, std::move(window_state_provider)});
 
+    // workspaces are optional, they ride on the window provider's connection
+    auto workspace_state_provider = std::make_unique<WorkspaceStateProvider>(*window_state_provider);
+    const bool has_workspaces = workspace_state_provider->init().has_value();
+
+    StateProviders providers;
+    providers.insert({StateProviderKind::WINDOW, std::move(window_state_provider)});
+    if (has_workspaces) {
+        providers.insert({StateProviderKind::WORKSPACE, std::move(workspace_state_provider)});
+    }
+    return providers;
+}
+
+PendingStateProviders init_state_providers_async() noexcept {
+    return std::async(std::launch::async, [] {
+        StartupPhase phase("providers");
+        return init_state_providers();
+    });
+}
+
+llama_model* load_orchestrator_model(const OrchestratorOptions& options) noexcept {
+    {
+        StartupPhase phase("backends");
+        ggml_backend_load_all();
+    }
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = options.cpu_only ? 0 : options.n_gpu_layers;
+    // an empty device list keeps llama.cpp from placing anything on a GPU
+    ggml_backend_dev_t no_devices[] = { nullptr };
+    if (options.cpu_only) {
+        model_params.devices = no_devices;
+    }
+
+    // weights that fit the budget are locked so other workloads cannot page them out; ones
+    // that do not stay evictable. The layer count is not known yet, a partial offload counts
+    // as off the host.
+    std::error_code ec;
+    const u64 file_bytes = std::filesystem::file_size(options.model_path, ec);
+    const bool weights_on_host = host_layers(1, model_params.n_gpu_layers, options.cpu_only) > 0;
+    model_params.use_mlock = !ec && plan_mlock(options.memory, file_bytes, weights_on_host);
+    if (model_params.use_mlock) {
+        spdlog::info("Locking the weights in memory");
+    }
+
+    StartupPhase phase("model_load");
+    llama_model* model = llama_model_load_from_file(options.model_path.c_str(), model_params);
+    if (model == nullptr) {
+        spdlog::error("Error: unable to load model {}", options.model_path);
+    }
+    return model;
+}
+
+std::string orchestrator_model_key(const std::string& model_path) noexcept {
+    const std::string_view known_sha256 = model_path == DEFAULT_ORCHESTRATOR_PATH ? DEFAULT_ORCHESTRATOR_SHA256 : "";
+    return model_cache_key(model_path, known_sha256);
+}
+
+std::optional<CpuProfile> orchestrator_cpu_profile(
+    llama_model* model, const OrchestratorOptions& options, const MemoryPlan& plan) noexcept
+{
+    // with layers on a GPU the CPU threads are mostly waiting on it
+    const i32 n_layer = llama_model_n_layer(model);
+    if (host_layers(n_layer, options.n_gpu_layers, options.cpu_only) != n_layer) {
+        return std::nullopt;
+    }
+
+    StartupPhase phase("cpu_profile");
+    return cpu_profile(model, orchestrator_model_key(options.model_path), plan, options.cpu_tuning);
+}
+
+std::expected<void, OrchestratorError> Orchestrator::init() noexcept {
+    // the compositor connection does not wait for the multi-GB model, nor the other way around
+    return init(orchestrator_options_from_env(), init_state_providers_async());
+}
+
+std::expected<void, OrchestratorError> Orchestrator::init(const OrchestratorOptions& options, StateProviders providers) noexcept {
+    std::promise<std::expected<StateProviders, OrchestratorError>> ready;
+    ready.set_value(std::move(providers));
+    return init(options, ready.get_future());
+}
+
+std::expected<void, OrchestratorError> Orchestrator::init(
+    const OrchestratorOptions& options, PendingStateProviders providers) noexcept
+{
+    llama_log_set(llama_log_callback, this);
+
+    if (options.model_path.empty()) {
+        spdlog::error("Error: Orchestrator path is empty");
+        return std::unexpected(OrchestratorError::MODEL_BAD_PATH);
+    }
+
+    if (!m_output) {
+        m_output = [](std::string_view text) {
+            std::print("{}", text);
+            std::fflush(stdout);
+        };
+    }
+
+    if (options.shared_model) {
+        m_shared_model = options.shared_model;
+        model = m_shared_model.get();
+    }
+    else {
+        m_prefetch = prefetch_file(options.model_path);
+        model = load_orchestrator_model(options);
+    }
+    if (model == nullptr) {
+        return std::unexpected(OrchestratorError::MODEL_LOAD_FAILED);
+    }
     vocab = llama_model_get_vocab(model);
-    while (true) {
-        std::print("> ");
-        std::string input;
-        std::getline(std::cin, input);
 
-        process_prompt(input);
+    // tokenized before planning, the context has to hold it
+    if (!m_history.init(vocab, IDENTITY_MESSAGE)) {
+        return std::unexpected(OrchestratorError::TOKENIZE_FAILED);
+    }
+
+    const i32 n_gpu_layers = options.cpu_only ? 0 : options.n_gpu_layers;
+    // loaded before planning, its weights and KV cache share the budget
+    std::optional<ModelShape> draft_shape;
+    if (!options.draft_model_path.empty()) {
+        StartupPhase phase("draft_model");
+        m_draft = std::make_unique<DraftModel>();
+        if (m_draft->load(options.draft_model_path, vocab, options.n_gpu_layers, options.cpu_only)) {
+            draft_shape = model_shape(m_draft->model(), n_gpu_layers, options.cpu_only);
+        }
+        else {
+            spdlog::warn("Speculative decoding disabled, continuing without a draft model");
+            m_draft.reset();
+        }
+    }
+
+    // the system prompt, a generation with the draft verified past its end, and some conversation
+    const i32 n_ctx_min = static_cast<i32>(m_history.prefix().size()) + N_PREDICT + (m_draft ? N_DRAFT + 1 : 0)
+        + MIN_HISTORY_TOKENS;
+    const MemoryPlan plan = plan_memory(options.memory, model_shape(model, n_gpu_layers, options.cpu_only),
+        N_CTX, n_ctx_min, N_BATCH, 1, draft_shape);
+    log_memory_plan(plan, options.memory);
+    if (!plan.fits) {
+        return std::unexpected(OrchestratorError::MEMORY_BUDGET_EXCEEDED);
+    }
+    m_projected_rss = plan.total_bytes();
+
+    llama_context_params ctx_params = llama_context_default_params();
+    // n_batch is the maximum number of tokens that can be processed in a single call to llama_decode
+    ctx_params.n_batch = N_BATCH;
+    // n_ctx is the context size, fixed for the lifetime of the session and never above what the
+    // model was trained on; it, the ubatch and the KV cache type come from the memory plan
+    apply_memory_plan(plan, 1, ctx_params);
+    const std::optional<CpuProfile> cpu_profile = orchestrator_cpu_profile(model, options, plan);
+    if (cpu_profile) {
+        apply_cpu_profile(*cpu_profile, ctx_params);
     }
+    // enable performance counters
+    ctx_params.no_perf = false;
+
+    {
+        StartupPhase phase("context");
+        ctx = llama_init_from_model(model, ctx_params);
+    }
+    if (ctx == nullptr) {
+        spdlog::error("Failed to create llama_context");
+        return std::unexpected(OrchestratorError::CONTEXT_CREATION_FAILED);
+    }
+
+    auto sparams = llama_sampler_chain_default_params();
+    sparams.no_perf = false;
+    smpl = llama_sampler_chain_init(sparams);
+
+    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+
+    if (cpu_profile) {
+        if (auto res = m_threadpools.attach(ctx, *cpu_profile); !res) {
+            spdlog::warn("Failed to pin the inference threads, running them unpinned");
+        }
+    }
+
+    m_kv.init(ctx, 0, llama_n_batch(ctx));
+    init_metrics(options.metrics_socket);
+
+    // lets cancel() interrupt a long prefill, not just stop between tokens
+    llama_set_abort_callback(ctx, [](void* data) {
+        return static_cast<Orchestrator*>(data)->m_cancel.load(std::memory_order_relaxed);
+    }, this);
+
+    m_result_encoding = options.result_encoding;
+    m_model_path = options.model_path;
+    m_kv_type = plan.kv_type;
+    m_flash_attn = ctx_params.flash_attn_type;
+    m_prefix_cache = options.prefix_cache;
+
+    if (m_draft && !m_draft->init(plan, cpu_profile)) {
+        spdlog::warn("Speculative decoding disabled, continuing without a draft model");
+        m_draft.reset();
+    }
+
+    // usually connected long before the model is loaded
+    std::expected<StateProviders, OrchestratorError> state_providers = providers.get();
+    if (!state_providers) {
+        return std::unexpected(state_providers.error());
+    }
+    m_state_providers = std::move(*state_providers);
+    m_json_smpl = make_json_sampler(vocab, m_state_providers);
+
+    // needs the providers, only the intents one of them serves are matched
+    if (!options.router_model_path.empty()) {
+        StartupPhase phase("router");
+        m_router = std::make_unique<IntentRouter>();
+        const auto available = [this](const StateRequest& req) {
+            const auto it = m_state_providers.find(req.kind);
+            if (it == m_state_providers.end()) {
+                return false;
+            }
+            const std::vector<ActionSchema> actions = it->second->actions();
+            return std::ranges::find(actions, req.action(), &ActionSchema::name) != actions.end();
+        };
+        const i32 router_gpu_layers = options.cpu_only ? 0 : options.n_gpu_layers;
+        if (!m_router->init(options.router_model_path, router_gpu_layers, options.router_threshold, available)) {
+            spdlog::warn("Intent routing disabled, every prompt goes to the model");
+            m_router.reset();
+        }
+    }
+
+    return {};
+}
+
+void Orchestrator::warm_up() noexcept {
+    if (m_warm) {
+        return;
+    }
+    m_warm = true;
+
+    if (llama_model_has_encoder(model)) {
+        return;
+    }
+
+    {
+        StartupPhase phase("warm_up");
+        if (!warm_system_prompt(ctx, m_kv, m_history.prefix(), m_model_path, m_kv_type, m_flash_attn, m_prefix_cache)) {
+            spdlog::warn("Failed to prefill the system prompt, it will be decoded with the first turn");
+        }
+    }
+
+    // the first decode faulted in the weights, so this is close to the steady state
+    spdlog::info("Resident memory after warm-up: {:.2f} GiB, projected {:.2f} GiB",
+        resident_bytes() / static_cast<double>(1ull << 30), m_projected_rss / static_cast<double>(1ull << 30));
 }
 
 Orchestrator::~Orchestrator() noexcept {
+    llama_sampler_free(m_json_smpl);
     llama_sampler_free(smpl);
     llama_free(ctx);
-    llama_model_free(model);
+    if (!m_shared_model) {
+        llama_model_free(model);
+    }
 }
 
-static std::string_view messager_role_to_string(MessagerRole role) noexcept {
-    switch (role) {
-        case MessagerRole::System: return "system";
-        case MessagerRole::User: return "user";
-        case MessagerRole::Assistant: return "assistant";
-    };
+void Orchestrator::new_conversation() noexcept {
+    // the cache is synced down to the system prompt by the next generation
+    m_history.truncate(0);
+    m_responses.clear();
+}
 
-    return "INVALID_ROLE";
+int Orchestrator::process_prompt(const std::string& user_prompt) {
+    return answer(user_prompt) == TurnOutcome::FAILED ? 1 : 0;
 }
 
-static constexpr std::string_view MESSAGE_HEADER_START = "<|start_header_id|>";
-static constexpr std::string_view MESSAGE_HEADER_END = "<|end_header_id|>";
-static constexpr std::string_view MESSAGE_EOT = "<|eot_id|>";
-static constexpr std::string_view BEGIN_OF_TEXT = "<|begin_of_text|>";
+Orchestrator::TurnOutcome Orchestrator::answer(const std::string& user_prompt) {
+    warm_up();
+    m_turn_start_us = ggml_time_us();
+    m_turn_first_token = false;
 
-std::string Message::to_string() const noexcept {
-    std::string out;
+    const TurnOutcome outcome = run_turn(user_prompt);
 
-    out += MESSAGE_HEADER_START;
-    out += messager_role_to_string(role);
-    out += MESSAGE_HEADER_END;
-    out += '\n';
-    out += content;
-    out += MESSAGE_EOT;
+    const std::string_view outcome_label = outcome == TurnOutcome::COMPLETED ? "completed"
+        : outcome == TurnOutcome::CANCELLED ? "cancelled" : "failed";
+    m_metrics.increment(METRIC_TURNS, {{"outcome", std::string(outcome_label)}});
+    if (outcome == TurnOutcome::COMPLETED) {
+        m_metrics.observe(METRIC_TURN_DURATION, (ggml_time_us() - m_turn_start_us) / 1e6);
+    }
 
-    return out;
+    return outcome;
 }
 
-const Message IDENTITY_MESSAGE = Message {
-    .role = MessagerRole::System,
-    .content = SYSTEM_PROMPT
-};
+Orchestrator::TurnOutcome Orchestrator::run_turn(const std::string& user_prompt) {
+    // a cancelled turn is removed from the history as a whole
+    const size_t n_entries = m_history.entries().size();
 
-std::string Orchestrator::build_history() noexcept {
-    std::string out;
+    if (!m_history.append(Message { .role = MessagerRole::User, .content = user_prompt })) {
+        return TurnOutcome::FAILED;
+    }
 
-    out += BEGIN_OF_TEXT;
-    out += '\n';
-    out += IDENTITY_MESSAGE.to_string();
+    if (m_router && run_routed(user_prompt)) {
+        return TurnOutcome::COMPLETED;
+    }
 
-    for (Message message : m_history) {
-        out += message.to_string();
+    // every command is run and answered by another generation, until the model replies in text
+    for (u32 n_commands = 0;; n_commands++) {
+        std::expected<std::string, LLMError> llm_out = run_llm();
+        if (!llm_out && llm_out.error() == LLMError::CANCELLED) {
+            m_history.truncate(n_entries);
+            m_output(" [cancelled]\n");
+            return TurnOutcome::CANCELLED;
+        }
+        if (!llm_out) {
+            spdlog::error("Error occurred while running LLM, exiting.");
+            return TurnOutcome::FAILED;
+        }
+
+        // determine if the LLM output is a state-fetch instruction
+        // for now, any valid json is considered a state-fetch instruction
+        // this should probably be fixed for security purposes
+        std::expected<std::vector<StateRequest>, StateRequestError> requests = StateRequest::from_json(*llm_out);
+        // text answers are not commands, only output that opens an object or array counts towards the parse rate
+        if (const size_t first = llm_out->find_first_not_of(" \t\n"); first != std::string::npos
+            && ((*llm_out)[first] == '{' || (*llm_out)[first] == '[')) {
+            m_metrics.increment(METRIC_COMMANDS, {{"result", requests ? "parsed" : "invalid"}});
+        }
+        if (!requests) {
+            spdlog::debug("Assitant output is not a valid JSON command. Continuing.");
+            break;
+        }
+        if (n_commands == MAX_COMMAND_ROUNDS) {
+            spdlog::warn("Still issuing commands after {} rounds, ending the turn", MAX_COMMAND_ROUNDS);
+            break;
+        }
+
+        if (!run_command(*requests)) {
+            return TurnOutcome::FAILED;
+        }
+        m_output("\n");
     }
 
-    // open the assistant turn
-    out += MESSAGE_HEADER_START;
-    out += messager_role_to_string(MessagerRole::Assistant);
-    out += MESSAGE_HEADER_END;
-    out += '\n';
+    m_output("\n");
 
-    return out;
+    return TurnOutcome::COMPLETED;
 }
 
-int Orchestrator::process_prompt(const std::string& user_prompt) {
-    m_history.push_back(Message {
-        .role = MessagerRole::User,
-        .content = user_prompt
-    });
+bool Orchestrator::run_routed(const std::string& user_prompt) {
+    const std::optional<IntentMatch> match = m_router->match(user_prompt);
+    if (!match) {
+        return false;
+    }
 
-    std::expected<std::string, LLMError> llm_out = run_llm();
-    if (!llm_out) {
-        spdlog::error("Error occurred while running LLM, exiting.");
-        return 1;
+    const StateRequest req = intent_request(match->intent);
+    const auto provider_it = m_state_providers.find(req.kind);
+    if (provider_it == m_state_providers.end()) {
+        return false;
+    }
+    spdlog::debug("Routed the prompt to {} {} at similarity {:.3f}",
+        state_provider_kind_to_string(req.kind), req.action(), match->similarity);
+
+    StateProvider* provider = provider_it->second.get();
+    const std::optional<u64> generation = provider->generation(req);
+    const std::optional<ResponseCache::Hit> unchanged = m_responses.lookup(req, generation, m_history);
+
+    const auto t_provider_start = ggml_time_us();
+    nlohmann::json out = provider->processRequest(req);
+    m_metrics.observe(METRIC_PROVIDER_DURATION, (ggml_time_us() - t_provider_start) / 1e6, {
+        {"kind", std::string(state_provider_kind_to_string(req.kind))},
+        {"action", std::string(req.action())},
+    });
+    const std::string answer = render_intent_answer(match->intent, out);
+    const std::optional<u64> result_id = unchanged ? std::nullopt : m_responses.number(out, generation);
+
+    // written as if the model had asked for it, so later turns can build on the result
+    const size_t n_entries = m_history.entries().size();
+    const Message command { .role = MessagerRole::Assistant, .content = req.to_json().dump() };
+    const Message result {
+        .role = MessagerRole::System,
+        .content = encode_result(unchanged ? unchanged_result(unchanged->result_id) : out, m_result_encoding)
+    };
+    std::vector<u64> refers_to;
+    if (unchanged) {
+        refers_to.push_back(unchanged->entry_id);
+    }
+    if (!m_history.append(command) || !m_history.append(result, std::move(refers_to))) {
+        m_history.truncate(n_entries);
+        return false;
+    }
+    if (result_id) {
+        m_responses.store(req, *generation, *result_id, m_history.entries().back().id);
+    }
+    if (!m_history.append(Message { .role = MessagerRole::Assistant, .content = answer })) {
+        m_history.truncate(n_entries);
+        return false;
     }
 
-    // determine if the LLM output is a state-fetch instruction
-    // for now, any valid json is considered a state-fetch instruction
-    // this should probably be fixed for security purposes
-    std::expected<StateRequest, StateRequestError> req = StateRequest::from_json(*llm_out);
-    if (req) {
-        StateProviderKind kind = (*req).kind;
-        std::unique_ptr<StateProvider>& provider = m_state_providers[kind];
-        nlohmann::json out = provider->processRequest(*req);
+    m_output(answer);
+    m_output("\n");
+    m_metrics.increment(METRIC_ROUTED_TURNS);
 
-        m_history.push_back(Message {
-            .role = MessagerRole::System,
-            .content = out.dump(4)
+    return true;
+}
+
+bool Orchestrator::run_command(std::span<const StateRequest> requests) {
+    std::vector<nlohmann::json> results(requests.size());
+    // read before the requests run, a change while they do makes the results look stale
+    std::vector<std::optional<u64>> generations(requests.size());
+    std::vector<std::future<nlohmann::json>> calls(requests.size());
+    // earlier results the unchanged ones stand for, kept in the history as long as this one
+    std::vector<u64> refers_to;
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        const StateRequest& req = requests[i];
+        const auto provider_it = m_state_providers.find(req.kind);
+        if (provider_it == m_state_providers.end()) {
+            spdlog::warn("No {} state provider is registered", state_provider_kind_to_string(req.kind));
+            results[i] = missing_provider_result(req.kind);
+            continue;
+        }
+
+        StateProvider* provider = provider_it->second.get();
+        const std::optional<u64> generation = provider->generation(req);
+        if (const std::optional<ResponseCache::Hit> hit = m_responses.lookup(req, generation, m_history)) {
+            spdlog::debug("{} state unchanged since result {}", state_provider_kind_to_string(req.kind), hit->result_id);
+            results[i] = unchanged_result(hit->result_id);
+            refers_to.push_back(hit->entry_id);
+            continue;
+        }
+        generations[i] = generation;
+
+        // the requests of one command do not depend on each other and run at once
+        calls[i] = m_provider_pool.submit([this, provider, &req] {
+            const auto t_provider_start = ggml_time_us();
+            nlohmann::json out = provider->processRequest(req);
+
+            const std::string_view action = req.action();
+            m_metrics.observe(METRIC_PROVIDER_DURATION, (ggml_time_us() - t_provider_start) / 1e6, {
+                {"kind", std::string(state_provider_kind_to_string(req.kind))},
+                {"action", action.empty() ? "unknown" : std::string(action)},
+            });
+            return out;
         });
+    }
 
-        std::println();
+    // fresh results get the id a later unchanged reply will name
+    std::vector<std::optional<u64>> result_ids(requests.size());
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (calls[i].valid()) {
+            results[i] = calls[i].get();
+            result_ids[i] = m_responses.number(results[i], generations[i]);
+        }
+    }
 
-        std::expected<std::string, LLMError> llm_response = run_llm();
-        if (!llm_response) {
-            spdlog::error("Error occurred while running LLM, exiting.");
-            return 1;
+    const Message message {
+        .role = MessagerRole::System,
+        .content = encode_result(merge_results(std::move(results)), m_result_encoding)
+    };
+    if (!m_history.append(message, std::move(refers_to))) {
+        return false;
+    }
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (result_ids[i]) {
+            m_responses.store(requests[i], *generations[i], *result_ids[i], m_history.entries().back().id);
         }
     }
-    else {
-        spdlog::debug("Assitant output is not a valid JSON command. Continuing.");
+
+    return true;
+}
+
+void Orchestrator::init_metrics(const std::filesystem::path& socket_path) noexcept {
+    m_metrics.add_counter(std::string(METRIC_TURNS), "Answered prompts by outcome");
+    m_metrics.add_histogram(std::string(METRIC_TURN_DURATION), "Time from prompt to complete answer, provider calls included",
+        {0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0});
+    m_metrics.add_histogram(std::string(METRIC_TIME_TO_FIRST_TOKEN), "Time from prompt to the first generated token",
+        {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0});
+    m_metrics.add_histogram(std::string(METRIC_PREFILL_SPEED), "Prompt tokens evaluated per second, per generation",
+        {50, 100, 250, 500, 1000, 2500, 5000, 10000});
+    m_metrics.add_histogram(std::string(METRIC_DECODE_SPEED), "Generated tokens per second, per generation",
+        {5, 10, 20, 40, 80, 160, 320});
+    m_metrics.add_histogram(std::string(METRIC_KV_TOKENS), "Tokens held in the KV cache after a generation",
+        {256, 512, 1024, 2048, 4096, 8192, 16384});
+    m_metrics.add_gauge(std::string(METRIC_KV_CAPACITY), "Size of the context in tokens");
+    m_metrics.add_histogram(std::string(METRIC_PROVIDER_DURATION), "State provider request latency",
+        {0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0});
+    m_metrics.add_counter(std::string(METRIC_COMMANDS), "JSON commands emitted by the model, by whether they parsed");
+    m_metrics.add_counter(std::string(METRIC_ROUTED_TURNS), "Prompts the intent router answered without the model");
+
+    m_metrics.set(METRIC_KV_CAPACITY, llama_n_ctx(ctx));
+
+    if (socket_path.empty()) {
+        return;
     }
 
-    std::println();
+    const bool started = m_metrics_server.start(m_metrics, MetricsServer::Options {
+        .socket_path = socket_path,
+        .interval = std::chrono::seconds(60),
+        .summary = [this, n_turns_seen = 0.0]() mutable { return metrics_summary(n_turns_seen); },
+    });
+    if (!started) {
+        spdlog::warn("Metrics will not be served");
+    }
+}
 
-    return 0;
+std::string Orchestrator::metrics_summary(double& n_turns_seen) const noexcept {
+    const double n_turns = m_metrics.total(METRIC_TURNS);
+    if (n_turns == n_turns_seen) {
+        return "";
+    }
+    n_turns_seen = n_turns;
+
+    return std::format(
+        "{:.0f} turns ({:.0f} cancelled, {:.0f} failed), turn p50 {:.2f} s p95 {:.2f} s, first token p50 {:.2f} s, "
+        "prefill p50 {:.0f} tokens/s, decode p50 {:.1f} tokens/s, KV p95 {:.0f}/{:.0f} tokens, {:.0f}/{:.0f} commands invalid",
+        n_turns,
+        m_metrics.value(METRIC_TURNS, {{"outcome", "cancelled"}}),
+        m_metrics.value(METRIC_TURNS, {{"outcome", "failed"}}),
+        m_metrics.quantile(METRIC_TURN_DURATION, 0.5),
+        m_metrics.quantile(METRIC_TURN_DURATION, 0.95),
+        m_metrics.quantile(METRIC_TIME_TO_FIRST_TOKEN, 0.5),
+        m_metrics.quantile(METRIC_PREFILL_SPEED, 0.5),
+        m_metrics.quantile(METRIC_DECODE_SPEED, 0.5),
+        m_metrics.quantile(METRIC_KV_TOKENS, 0.95),
+        m_metrics.value(METRIC_KV_CAPACITY),
+        m_metrics.value(METRIC_COMMANDS, {{"result", "invalid"}}),
+        m_metrics.total(METRIC_COMMANDS));
 }
 
-std::expected<std::string, Orchestrator::LLMError> Orchestrator::run_llm() noexcept {
-    std::string full_prompt = build_history();
+nlohmann::json missing_provider_result(StateProviderKind kind) {
+    return {
+        {"ok", false},
+        {"error", "no_provider"},
+        {"request_kind", state_provider_kind_to_string(kind)},
+    };
+}
 
-    // tokenize the prompt
-    // find the number of tokens in the prompt
-    const i32 n_prompt = -llama_tokenize(vocab, full_prompt.c_str(), full_prompt.size(), nullptr, 0, false, true);
-    // allocate space for the tokens and tokenize the prompt
-    std::vector<llama_token> prompt_tokens(n_prompt);
-    if (llama_tokenize(vocab, full_prompt.c_str(), full_prompt.size(), prompt_tokens.data(), prompt_tokens.size(), false, true) < 0) {
-        spdlog::error("Failed to tokenize the prompt - {}", full_prompt);
-        return std::unexpected(LLMError::TOKENIZE_FAILED);
+nlohmann::json merge_results(std::vector<nlohmann::json> results) {
+    if (results.size() == 1) {
+        return std::move(results.front());
     }
+    return {{"results", std::move(results)}};
+}
 
-    llama_context_params ctx_params = llama_context_default_params();
-    // n_ctx is the context size
-    ctx_params.n_ctx = n_prompt + N_PREDICT - 1;
-    // n_batch is the maximum number of tokens that can be processed in a single call to llama_decode
-    ctx_params.n_batch = n_prompt;
-    // enable performance counters
-    ctx_params.no_perf = false;
+llama_sampler* make_json_sampler(const llama_vocab* vocab, const StateProviders& providers) noexcept {
+    std::vector<ProviderSchema> schemas;
+    for (const auto& [kind, provider] : providers) {
+        schemas.push_back(ProviderSchema { .kind = kind, .actions = provider->actions() });
+    }
 
-    ctx = llama_init_from_model(model, ctx_params);
-    if (ctx == nullptr) {
-        spdlog::error("Failed to create llama_context");
-        return std::unexpected(LLMError::CONTEXT_CREATION_FAILED);
+    const std::string grammar = build_request_grammar(schemas);
+    llama_sampler* grammar_smpl = llama_sampler_init_grammar(vocab, grammar.c_str(), "root");
+    if (grammar_smpl == nullptr) {
+        spdlog::warn("Failed to parse the JSON command grammar, JSON output will not be constrained");
+        spdlog::debug("{}", grammar);
+        return nullptr;
     }
 
     auto sparams = llama_sampler_chain_default_params();
     sparams.no_perf = false;
-    smpl = llama_sampler_chain_init(sparams);
+    llama_sampler* json_smpl = llama_sampler_chain_init(sparams);
 
-    llama_sampler_chain_add(smpl, llama_sampler_init_greedy());
+    llama_sampler_chain_add(json_smpl, grammar_smpl);
+    llama_sampler_chain_add(json_smpl, llama_sampler_init_greedy());
+    return json_smpl;
+}
 
-    // print the prompt token-by-token
-    for (auto id : prompt_tokens) {
-        char buf[128];
-        int n = llama_token_to_piece(vocab, id, buf, sizeof(buf), 0, true);
-        if (n < 0) {
-            std::println("Failed to convert token to piece");
-            return std::unexpected(LLMError::TOKEN_TO_PIECE_CONVERSION_FAILED);
+bool warm_system_prompt(llama_context* ctx, KvSequence& kv, std::span<const llama_token> prefix,
+    const std::string& model_path, KvCacheType kv_type, llama_flash_attn_type flash_attn, bool use_cache) noexcept
+{
+    PrefixCache prefix_cache;
+    const auto t_start = ggml_time_us();
+    const bool cache_ok = use_cache
+        && prefix_cache.init(orchestrator_model_key(model_path), kv_type, flash_attn, prefix).has_value();
+    if (cache_ok && prefix_cache.restore(ctx, prefix)) {
+        kv.assign(prefix);
+        spdlog::debug("Restored {} system prompt tokens from {} in {:.1f} ms",
+            prefix.size(), prefix_cache.path().string(), (ggml_time_us() - t_start) / 1000.0f);
+
+        // nothing has run the graph yet: decoding the last token again allocates the compute
+        // buffers and faults in the weights now rather than in the first turn
+        if (prefix.empty()) {
+            return true;
         }
+        const llama_token last = prefix.back();
+        kv.truncate(prefix.size() - 1);
+        return kv.decode(std::span(&last, 1));
     }
 
-    // prepare a batch for the prompt
-    llama_batch batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
+    kv.clear();
+    if (!kv.decode(prefix)) {
+        return false;
+    }
+    spdlog::debug("Prefilled {} system prompt tokens in {:.1f} ms", prefix.size(), (ggml_time_us() - t_start) / 1000.0f);
+
+    if (cache_ok) {
+        if (auto res = prefix_cache.store(ctx, prefix); !res) {
+            spdlog::warn("Failed to write the system prompt cache {}", prefix_cache.path().string());
+        }
+    }
+
+    return true;
+}
+
+bool enter_json_mode(llama_sampler* json_smpl, std::span<const llama_token> generated) noexcept {
+    llama_sampler_reset(json_smpl);
+
+    // replay what was sampled unconstrained so far, the grammar rejects it if the object
+    // was opened in a way the schema does not allow
+    try {
+        for (llama_token token : generated) {
+            llama_sampler_accept(json_smpl, token);
+        }
+    }
+    catch (const std::exception& e) {
+        spdlog::debug("Model output does not match the JSON command grammar: {}", e.what());
+        return false;
+    }
+
+    return true;
+}
+
+std::expected<void, Orchestrator::LLMError> Orchestrator::fit_context() noexcept {
+    // room for a full generation, plus a draft that may be verified past its end
+    const size_t n_reserved = N_PREDICT + (m_draft ? N_DRAFT + 1 : 0);
+    const size_t n_budget = llama_n_ctx(ctx) > n_reserved ? llama_n_ctx(ctx) - n_reserved : 0;
+
+    while (m_history.n_prompt_tokens() > n_budget) {
+        std::optional<ConversationHistory::TokenRange> evicted = m_history.evict_oldest();
+        if (!evicted) {
+            spdlog::error("Prompt of {} tokens does not fit in a context of {} tokens",
+                m_history.n_prompt_tokens(), llama_n_ctx(ctx));
+            return std::unexpected(LLMError::CONTEXT_OVERFLOW);
+        }
+
+        spdlog::debug("Evicted {} tokens at position {} from the context", evicted->n_tokens, evicted->offset);
+        m_kv.erase(evicted->offset, evicted->n_tokens);
+        if (m_draft) {
+            m_draft->erase(evicted->offset, evicted->n_tokens);
+        }
+    }
+
+    return {};
+}
+
+std::expected<std::string, Orchestrator::LLMError> Orchestrator::run_llm() noexcept {
+    if (auto res = fit_context(); !res) {
+        return std::unexpected(res.error());
+    }
+
+    // every message is tokenized once when it enters the history, this is just a view
+    std::span<const llama_token> prompt_tokens = m_history.prompt();
+    const i32 n_prompt = prompt_tokens.size();
+
+    llama_sampler_reset(smpl);
+
+    const auto t_prefill_start = ggml_time_us();
+    const u64 n_decoded_before = m_kv.n_decoded();
 
     if (llama_model_has_encoder(model)) {
+        // encoder-decoder models re-encode the whole prompt, there is no prefix to reuse
+        m_kv.clear();
+
+        llama_batch batch = llama_batch_get_one(const_cast<llama_token*>(prompt_tokens.data()), n_prompt);
         if (llama_encode(ctx, batch)) {
             std::println("Failed to eval");
             return std::unexpected(LLMError::EVALUATION_FAILED);
@@ -211,56 +787,167 @@ std::expected<std::string, Orchestrator::LLMError> Orchestrator::run_llm() noexc
             decoder_start_token_id = llama_vocab_bos(vocab);
         }
 
-        batch = llama_batch_get_one(&decoder_start_token_id, 1);
+        if (!m_kv.decode({&decoder_start_token_id, 1})) {
+            return std::unexpected(LLMError::EVALUATION_FAILED);
+        }
+    }
+    else if (!m_kv.sync(prompt_tokens)) {
+        return std::unexpected(decode_error());
     }
 
     const auto t_main_start = ggml_time_us();
+    const u64 n_prefill = m_kv.n_decoded() - n_decoded_before;
+    m_llm_stats.n_prefill += n_prefill;
+    m_llm_stats.t_prefill_us += t_main_start - t_prefill_start;
+    if (n_prefill > 0 && t_main_start > t_prefill_start) {
+        m_metrics.observe(METRIC_PREFILL_SPEED, n_prefill / ((t_main_start - t_prefill_start) / 1e6));
+    }
     int n_decode = 0;
-    llama_token new_token_id;
     std::string assistant_text;
+    std::vector<llama_token> generated_tokens;
+
+    // the active sampler, switched to the grammar-constrained one once the model starts a JSON object
+    llama_sampler* active_smpl = smpl;
+    OutputClassifier classifier;
+    bool piece_failed = false;
+
+    // Records a sampled token as part of the answer.
+    // Returns false once generation is over: end of generation or a complete JSON command.
+    auto accept_token = [&](llama_token id) -> bool {
+        if (llama_vocab_is_eog(vocab, id)) {
+            return false;
+        }
 
-    for (int n_pos = 0; n_pos + batch.n_tokens < n_prompt + N_PREDICT; ) {
-        // evaluate the current batch with the transformer model
-        if (llama_decode(ctx, batch)) {
-            spdlog::error("Failed to eval");
-            return std::unexpected(LLMError::EVALUATION_FAILED);
+        char buf[128];
+        int n = llama_token_to_piece(vocab, id, buf, sizeof(buf), 0, false);
+        if (n < 0) {
+            spdlog::error("Failed to convert token to piece");
+            piece_failed = true;
+            return false;
         }
 
-        n_pos += batch.n_tokens;
+        const OutputMode previous_mode = classifier.mode();
+        // anything after the closing brace of a JSON command is cut off
+        std::string_view piece(buf, classifier.feed(std::string_view(buf, n)));
+        if (piece.size() == static_cast<size_t>(n)) {
+            generated_tokens.push_back(id);
+        }
+        // the history keeps the tokens of what is left of the piece, not the ones of the cut text
+        else if (!tokenize_append(vocab, piece, generated_tokens)) {
+            spdlog::error("Failed to tokenize the end of the answer");
+            piece_failed = true;
+            return false;
+        }
+        m_output(piece);
 
-        // sample the next token
-        {
-            new_token_id = llama_sampler_sample(smpl, ctx, -1);
+        assistant_text.append(piece);
 
-            // is it an end of generation?
-            if (llama_vocab_is_eog(vocab, new_token_id)) {
-                break;
+        if (previous_mode == OutputMode::UNDECIDED && classifier.mode() == OutputMode::JSON
+            && m_json_smpl != nullptr && enter_json_mode(m_json_smpl, generated_tokens)) {
+            active_smpl = m_json_smpl;
+        }
+
+        // the command is complete, there is nothing useful left to generate
+        return !classifier.complete();
+    };
+
+    // sample the first token from the prompt logits
+    llama_token new_token_id = llama_sampler_sample(active_smpl, ctx, -1);
+    if (!m_turn_first_token) {
+        m_metrics.observe(METRIC_TIME_TO_FIRST_TOKEN, (ggml_time_us() - m_turn_start_us) / 1e6);
+        m_turn_first_token = true;
+    }
+
+    if (m_draft) {
+        std::vector<llama_token> draft;
+        std::vector<llama_token> verify;
+        int n_drafted = 0;
+        int n_accepted = 0;
+
+        while (n_decode < N_PREDICT && accept_token(new_token_id)) {
+            if (m_cancel.load(std::memory_order_relaxed)) {
+                return std::unexpected(LLMError::CANCELLED);
             }
 
-            char buf[128];
-            int n = llama_token_to_piece(vocab, new_token_id, buf, sizeof(buf), 0, false);
-            if (n < 0) {
-                fprintf(stderr, "%s: error: failed to convert token to piece\n", __func__);
-                return std::unexpected(LLMError::TOKEN_TO_PIECE_CONVERSION_FAILED);
+            // new_token_id is accepted but not decoded yet, the draft continues after it
+            const i32 n_draft = std::min(N_DRAFT, N_PREDICT - n_decode - 1);
+            if (n_draft <= 0 || !m_draft->propose(m_kv.tokens(), new_token_id, n_draft, draft)) {
+                draft.clear();
             }
 
-            std::string_view piece(buf, n);
-            std::print("{}", piece);
-            std::fflush(stdout);
+            // evaluate the sampled token and the whole draft in one batch
+            const size_t n_base = m_kv.tokens().size();
+            verify.assign(1, new_token_id);
+            verify.insert(verify.end(), draft.begin(), draft.end());
+            if (!m_kv.decode(verify, true)) {
+                return std::unexpected(decode_error());
+            }
+            n_decode += 1;
+            n_drafted += draft.size();
+
+            // batch index i holds the logits after verify[i]; with greedy sampling a drafted
+            // token is kept exactly when the orchestrator model would have sampled it too
+            size_t n_kept = 1;
+            bool done = false;
+            for (size_t i = 0; ; i++) {
+                new_token_id = llama_sampler_sample(active_smpl, ctx, i);
+                if (i == draft.size() || new_token_id != draft[i]) {
+                    break;
+                }
+
+                if (!accept_token(new_token_id)) {
+                    // a completed JSON command keeps its closing token, an end of generation is dropped
+                    n_kept += classifier.complete() ? 1 : 0;
+                    done = true;
+                    break;
+                }
+                n_kept += 1;
+                n_decode += 1;
+                n_accepted += 1;
+            }
 
-            assistant_text.append(piece);
+            // forget the rejected part of the draft
+            m_kv.truncate(n_base + n_kept);
+
+            if (done) {
+                break;
+            }
+        }
 
-            // prepare the next batch with the sampled token
-            batch = llama_batch_get_one(&new_token_id, 1);
+        spdlog::debug("Draft acceptance: {}/{} tokens", n_accepted, n_drafted);
+    }
+    else {
+        while (n_decode < N_PREDICT && accept_token(new_token_id)) {
+            if (m_cancel.load(std::memory_order_relaxed)) {
+                return std::unexpected(LLMError::CANCELLED);
+            }
 
+            // evaluate the sampled token with the transformer model
+            if (!m_kv.decode({&new_token_id, 1})) {
+                return std::unexpected(decode_error());
+            }
             n_decode += 1;
+
+            new_token_id = llama_sampler_sample(active_smpl, ctx, -1);
         }
     }
 
-    m_history.push_back(Message {
-        .role = MessagerRole::Assistant,
-        .content = assistant_text
-    });
+    if (piece_failed) {
+        return std::unexpected(LLMError::TOKEN_TO_PIECE_CONVERSION_FAILED);
+    }
+
+    const auto t_main_end = ggml_time_us();
+    const float t_decode = (t_main_end - t_main_start) / 1000000.0f;
+    m_llm_stats.n_decode += n_decode;
+    m_llm_stats.t_decode_us += t_main_end - t_main_start;
+    if (n_decode > 0 && t_main_end > t_main_start) {
+        m_metrics.observe(METRIC_DECODE_SPEED, n_decode / t_decode);
+    }
+    m_metrics.observe(METRIC_KV_TOKENS, m_kv.tokens().size());
+    spdlog::debug("Decoded {} tokens in {:.2f} s ({:.1f} tokens/s, {})",
+        n_decode, t_decode, n_decode / t_decode, m_draft ? "speculative" : "greedy");
+
+    m_history.append_generated(assistant_text, generated_tokens);
 
     return assistant_text;
 }
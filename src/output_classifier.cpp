@@ -0,0 +1,59 @@
+#include "output_classifier.hpp"
+
+size_t OutputClassifier::feed(std::string_view piece) noexcept {
+    if (m_mode == OutputMode::TEXT) {
+        return piece.size();
+    }
+    if (m_complete) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < piece.size(); i++) {
+        const char c = piece[i];
+
+        if (m_mode == OutputMode::UNDECIDED) {
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                continue;
+            }
+            if (c != '{' && c != '[') {
+                m_mode = OutputMode::TEXT;
+                return piece.size();
+            }
+            m_mode = OutputMode::JSON;
+        }
+
+        if (m_in_string) {
+            if (m_escape) {
+                m_escape = false;
+            }
+            else if (c == '\\') {
+                m_escape = true;
+            }
+            else if (c == '"') {
+                m_in_string = false;
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '"':
+                m_in_string = true;
+                break;
+            case '{':
+            case '[':
+                m_depth++;
+                break;
+            case '}':
+            case ']':
+                if (m_depth > 0 && --m_depth == 0) {
+                    m_complete = true;
+                    return i + 1;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    return piece.size();
+}
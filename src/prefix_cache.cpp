@@ -0,0 +1,196 @@
+#include "prefix_cache.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+constexpr u32 CACHE_MAGIC = 0x564b5041; // "APKV"
+constexpr u32 CACHE_VERSION = 1;
+
+struct CacheHeader {
+    u32 magic;
+    u32 version;
+    u32 n_tokens;
+    u32 reserved;
+    u64 state_size;
+};
+
+// Read-only private mapping of a whole file, unmapped on destruction
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path& path) noexcept {
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                madvise(addr, st.st_size, MADV_WILLNEED);
+                m_data = static_cast<const u8*>(addr);
+                m_size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile() noexcept {
+        if (m_data) munmap(const_cast<u8*>(m_data), m_size);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    [[nodiscard]] const u8* data() const noexcept { return m_data; }
+    [[nodiscard]] size_t size() const noexcept { return m_size; }
+
+private:
+    const u8* m_data { nullptr };
+    size_t m_size { 0 };
+};
+
+} // namespace
+
+u64 fnv1a(const void* data, size_t size, u64 hash) noexcept {
+    const auto* bytes = static_cast<const u8*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+std::filesystem::path cache_dir() noexcept {
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        return std::filesystem::path(xdg) / "autosktop";
+    }
+    if (const char* home = std::getenv("HOME"); home && *home) {
+        return std::filesystem::path(home) / ".cache" / "autosktop";
+    }
+    return {};
+}
+
+std::string model_cache_key(const std::string& model_path, std::string_view known_sha256) noexcept {
+    if (!known_sha256.empty()) {
+        return std::string(known_sha256.substr(0, 16));
+    }
+
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(model_path, ec);
+    const auto mtime = std::filesystem::last_write_time(model_path, ec).time_since_epoch().count();
+
+    u64 hash = fnv1a(model_path.data(), model_path.size());
+    hash = fnv1a(&size, sizeof(size), hash);
+    hash = fnv1a(&mtime, sizeof(mtime), hash);
+    return std::format("{:016x}", hash);
+}
+
+std::expected<void, PrefixCacheError> PrefixCache::init(std::string_view model_key, KvCacheType kv_type,
+    llama_flash_attn_type flash_attn, std::span<const llama_token> prefix) noexcept
+{
+    const std::filesystem::path dir = cache_dir();
+    if (dir.empty()) {
+        return std::unexpected(PrefixCacheError::NO_CACHE_DIR);
+    }
+
+    // the state of a quantized or flash attention cache is laid out differently
+    const std::string_view fa = flash_attn == LLAMA_FLASH_ATTN_TYPE_ENABLED ? "fa"
+        : flash_attn == LLAMA_FLASH_ATTN_TYPE_DISABLED ? "nofa" : "autofa";
+    const u64 prompt_hash = fnv1a(prefix.data(), prefix.size_bytes());
+    m_path = dir / std::format("prefix-{}-{}-{}-{:016x}.kv", model_key, kv_cache_type_to_string(kv_type), fa, prompt_hash);
+
+    return {};
+}
+
+std::expected<void, PrefixCacheError> PrefixCache::restore(
+    llama_context* ctx, std::span<const llama_token> prefix) const noexcept
+{
+    if (m_path.empty()) {
+        return std::unexpected(PrefixCacheError::NO_CACHE_DIR);
+    }
+
+    MappedFile file(m_path);
+    if (!file.data()) {
+        return std::unexpected(PrefixCacheError::NOT_FOUND);
+    }
+
+    CacheHeader header {};
+    if (file.size() < sizeof(header)) {
+        return std::unexpected(PrefixCacheError::MISMATCH);
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    const size_t tokens_size = prefix.size_bytes();
+    if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.n_tokens != prefix.size()
+        || file.size() != sizeof(header) + tokens_size + header.state_size
+        || std::memcmp(file.data() + sizeof(header), prefix.data(), tokens_size) != 0) {
+        return std::unexpected(PrefixCacheError::MISMATCH);
+    }
+
+    const u8* state = file.data() + sizeof(header) + tokens_size;
+    if (llama_state_seq_set_data(ctx, state, header.state_size, 0) != header.state_size) {
+        // a partially restored sequence is unusable
+        llama_memory_seq_rm(llama_get_memory(ctx), 0, -1, -1);
+        return std::unexpected(PrefixCacheError::STATE_REJECTED);
+    }
+
+    return {};
+}
+
+std::expected<void, PrefixCacheError> PrefixCache::store(
+    llama_context* ctx, std::span<const llama_token> prefix) const noexcept
+{
+    if (m_path.empty()) {
+        return std::unexpected(PrefixCacheError::NO_CACHE_DIR);
+    }
+
+    std::vector<u8> state(llama_state_seq_get_size(ctx, 0));
+    const size_t n_state = llama_state_seq_get_data(ctx, state.data(), state.size(), 0);
+    if (n_state == 0) {
+        return std::unexpected(PrefixCacheError::STATE_REJECTED);
+    }
+
+    const CacheHeader header {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .n_tokens = static_cast<u32>(prefix.size()),
+        .reserved = 0,
+        .state_size = n_state
+    };
+
+    std::error_code ec;
+    std::filesystem::create_directories(m_path.parent_path(), ec);
+
+    // write to a temporary file first so a concurrent reader never maps a partial cache
+    std::filesystem::path tmp_path = m_path;
+    tmp_path += std::format(".{}.tmp", getpid());
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(prefix.data()), prefix.size_bytes());
+        out.write(reinterpret_cast<const char*>(state.data()), n_state);
+        if (!out) {
+            std::filesystem::remove(tmp_path, ec);
+            return std::unexpected(PrefixCacheError::IO_ERROR);
+        }
+    }
+
+    std::filesystem::rename(tmp_path, m_path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_path, ec);
+        return std::unexpected(PrefixCacheError::IO_ERROR);
+    }
+
+    return {};
+}
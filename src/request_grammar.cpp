@@ -0,0 +1,72 @@
+#include "request_grammar.hpp"
+
+#include <format>
+
+// GBNF rule names only allow letters, digits and dashes
+static std::string rule_name(std::string_view a, std::string_view b) {
+    std::string out;
+    for (char c : a) out += (c == '_') ? '-' : c;
+    out += '-';
+    for (char c : b) out += (c == '_') ? '-' : c;
+    return out;
+}
+
+// A GBNF literal matching the JSON string `value`
+static std::string json_key(std::string_view value) {
+    return std::format(R"("\"{}\"")", value);
+}
+
+std::string build_request_grammar(const std::vector<ProviderSchema>& providers) noexcept {
+    std::string grammar;
+    std::string requests;
+
+    for (const ProviderSchema& provider : providers) {
+        const std::string_view kind = state_provider_kind_to_string(provider.kind);
+        const std::string request_rule = rule_name(kind, "request");
+        const std::string args_rule = rule_name(kind, "args");
+
+        requests += requests.empty() ? "" : " | ";
+        requests += request_rule;
+
+        grammar += std::format(
+            R"({} ::= "{{" ws {} ws ":" ws {} ws "," ws {} ws ":" ws {} ws "}}")" "\n",
+            request_rule, json_key("request_kind"), json_key(kind), json_key("args"), args_rule);
+
+        std::string actions;
+        for (const ActionSchema& action : provider.actions) {
+            const std::string action_rule = rule_name(kind, "action-" + action.name);
+            actions += actions.empty() ? "" : " | ";
+            actions += action_rule;
+
+            std::string params;
+            for (const std::string& param : action.params) {
+                params += params.empty() ? "" : R"( ws "," ws )";
+                params += std::format(R"({} ws ":" ws string)", json_key(param));
+            }
+            for (const std::string& param : action.list_params) {
+                params += params.empty() ? "" : R"( ws "," ws )";
+                params += std::format(R"({} ws ":" ws string-list)", json_key(param));
+            }
+
+            // parameterless actions may omit "params" or send an empty object
+            const std::string params_member = params.empty()
+                ? std::format(R"(( "," ws {} ws ":" ws "{{" ws "}}" ws )?)", json_key("params"))
+                : std::format(R"("," ws {} ws ":" ws "{{" ws {} ws "}}" ws)", json_key("params"), params);
+
+            grammar += std::format(
+                R"({} ::= "{{" ws {} ws ":" ws {} ws {} "}}")" "\n",
+                action_rule, json_key("action"), json_key(action.name), params_member);
+        }
+
+        grammar += std::format("{} ::= {}\n", args_rule, actions.empty() ? R"("{" ws "}")" : actions);
+    }
+
+    grammar += std::format("request ::= {}\n", requests.empty() ? R"("{" ws "}")" : requests);
+    grammar += std::format(R"(request-list ::= "[" ws request ( ws "," ws request ){{0,{}}} ws "]")" "\n", MAX_STATE_REQUESTS - 1);
+    grammar += "root ::= [ \\t\\n]* (request | request-list)\n";
+    grammar += R"(string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" (["\\/bfnrt] | "u" [0-9a-fA-F]{4}) )* "\"")" "\n";
+    grammar += R"(string-list ::= "[" ws ( string ( ws "," ws string )* ws )? "]")" "\n";
+    grammar += R"(ws ::= | " " | "\n" [ \t]{0,20})" "\n";
+
+    return grammar;
+}
@@ -0,0 +1,54 @@
+#include "response_cache.hpp"
+
+#include <format>
+
+std::string ResponseCache::key(const StateRequest& req) {
+    // objects keep their keys sorted, so the dump does not depend on the order they were written in
+    return std::format("{}:{}", state_provider_kind_to_string(req.kind), req.args.dump());
+}
+
+std::optional<ResponseCache::Hit> ResponseCache::lookup(
+    const StateRequest& req, std::optional<u64> generation, const ConversationHistory& history) noexcept
+{
+    if (!generation) {
+        return std::nullopt;
+    }
+
+    const auto it = m_results.find(key(req));
+    if (it == m_results.end()) {
+        return std::nullopt;
+    }
+
+    // the state changed, or the result was evicted or cancelled along with its turn
+    if (it->second.generation != *generation || !history.contains(it->second.entry_id)) {
+        m_results.erase(it);
+        return std::nullopt;
+    }
+
+    return Hit { .result_id = it->second.result_id, .entry_id = it->second.entry_id };
+}
+
+std::optional<u64> ResponseCache::number(nlohmann::json& result, std::optional<u64> generation) {
+    if (!generation || !result.is_object()) {
+        return std::nullopt;
+    }
+
+    const u64 result_id = m_next_result_id++;
+    result["result_id"] = result_id;
+    return result_id;
+}
+
+void ResponseCache::store(const StateRequest& req, u64 generation, u64 result_id, u64 entry_id) {
+    m_results.insert_or_assign(key(req), CachedResult {
+        .generation = generation,
+        .result_id = result_id,
+        .entry_id = entry_id,
+    });
+}
+
+nlohmann::json unchanged_result(u64 result_id) {
+    return {
+        {"ok", true},
+        {"unchanged_since_result", result_id},
+    };
+}
@@ -0,0 +1,134 @@
+#include "result_encoding.hpp"
+
+#include <format>
+
+std::optional<ResultEncoding> result_encoding_from_string(std::string_view str) noexcept {
+    if (str == "pretty") {
+        return std::make_optional(ResultEncoding::PRETTY);
+    }
+    if (str == "minified") {
+        return std::make_optional(ResultEncoding::MINIFIED);
+    }
+    if (str == "table") {
+        return std::make_optional(ResultEncoding::TABLE);
+    }
+
+    return std::nullopt;
+}
+
+std::string_view result_encoding_to_string(ResultEncoding encoding) noexcept {
+    switch (encoding) {
+        case ResultEncoding::PRETTY: return "pretty";
+        case ResultEncoding::MINIFIED: return "minified";
+        case ResultEncoding::TABLE: return "table";
+    };
+
+    return "INVALID_ENCODING";
+}
+
+// Scalars are written bare, with the characters that delimit the table escaped
+static void append_scalar(std::string& out, const nlohmann::json& value) {
+    if (!value.is_string()) {
+        out += value.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+        return;
+    }
+
+    for (char c : value.get_ref<const std::string&>()) {
+        switch (c) {
+            case '|': out += "\\|"; break;
+            case '\n': out += "\\n"; break;
+            case '\\': out += "\\\\"; break;
+            default: out += c; break;
+        }
+    }
+}
+
+// A non-empty array of objects that all have the same keys and only scalar values
+static bool is_table(const nlohmann::json& value) {
+    if (!value.is_array() || value.empty() || !value.front().is_object()) {
+        return false;
+    }
+
+    const nlohmann::json& first = value.front();
+    for (const nlohmann::json& row : value) {
+        if (!row.is_object() || row.size() != first.size()) {
+            return false;
+        }
+        for (const auto& [key, cell] : row.items()) {
+            if (!first.contains(key) || cell.is_structured()) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void append_table(std::string& out, std::string_view name, const nlohmann::json& rows) {
+    out += std::format("{}[{}]{{", name, rows.size());
+    bool first_column = true;
+    for (const auto& [key, _] : rows.front().items()) {
+        out += first_column ? "" : ",";
+        out += key;
+        first_column = false;
+    }
+    out += "}:\n";
+
+    for (const nlohmann::json& row : rows) {
+        bool first_cell = true;
+        // nlohmann::json keeps object keys sorted, so every row iterates in header order
+        for (const auto& [_, cell] : row.items()) {
+            out += first_cell ? "" : "|";
+            append_scalar(out, cell);
+            first_cell = false;
+        }
+        out += '\n';
+    }
+}
+
+static std::string encode_table(const nlohmann::json& result) {
+    if (!result.is_object()) {
+        return result.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+    }
+
+    std::string scalars;
+    std::string tables;
+    for (const auto& [key, value] : result.items()) {
+        if (is_table(value)) {
+            append_table(tables, key, value);
+            continue;
+        }
+
+        scalars += scalars.empty() ? "" : " ";
+        scalars += key;
+        scalars += '=';
+        if (value.is_structured()) {
+            scalars += value.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+        }
+        else {
+            append_scalar(scalars, value);
+        }
+    }
+
+    if (!scalars.empty() && !tables.empty()) {
+        scalars += '\n';
+    }
+    scalars += tables;
+    if (scalars.ends_with('\n')) {
+        scalars.pop_back();
+    }
+    return scalars;
+}
+
+std::string encode_result(const nlohmann::json& result, ResultEncoding encoding) noexcept {
+    // strings that are not valid UTF-8 are replaced instead of throwing
+    constexpr auto error_handler = nlohmann::json::error_handler_t::replace;
+
+    switch (encoding) {
+        case ResultEncoding::PRETTY: return result.dump(4, ' ', false, error_handler);
+        case ResultEncoding::MINIFIED: return result.dump(-1, ' ', false, error_handler);
+        case ResultEncoding::TABLE: return encode_table(result);
+    };
+
+    return result.dump(-1, ' ', false, error_handler);
+}
@@ -0,0 +1,46 @@
+#include "startup.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+
+// initialized before main runs, close enough to the process start
+const std::chrono::steady_clock::time_point PROCESS_START = std::chrono::steady_clock::now();
+
+}
+
+double startup_elapsed_ms() noexcept {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - PROCESS_START).count();
+}
+
+StartupPhase::~StartupPhase() noexcept {
+    const double t_end_ms = startup_elapsed_ms();
+    spdlog::info("Startup: {} took {:.0f} ms ({:.0f} to {:.0f} ms)",
+        m_name, t_end_ms - m_t_begin_ms, m_t_begin_ms, t_end_ms);
+}
+
+std::future<void> prefetch_file(const std::filesystem::path& path) noexcept {
+    return std::async(std::launch::async, [path] {
+        StartupPhase phase("prefetch");
+
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            spdlog::debug("Could not open {} to prefetch it: {}", path.string(), std::strerror(errno));
+            return;
+        }
+
+        // the readahead madvise(MADV_WILLNEED) starts on a file mapping, without owning one;
+        // the loader's mapping then finds the pages cached
+        if (const int err = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED); err != 0) {
+            spdlog::debug("Could not prefetch {}: {}", path.string(), std::strerror(err));
+        }
+        close(fd);
+    });
+}
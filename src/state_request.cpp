@@ -8,30 +8,80 @@ std::optional<StateProviderKind> state_provider_kind_from_string(std::string_vie
     if (str == "window") {
         return std::make_optional(StateProviderKind::WINDOW);
     }
+    if (str == "workspace") {
+        return std::make_optional(StateProviderKind::WORKSPACE);
+    }
 
     return std::nullopt;
 }
 
-std::expected<StateRequest, StateRequestError> StateRequest::from_json(std::string_view str) noexcept {
-    std::optional<StateProviderKind> kind;
-    nlohmann::json args;
+std::string_view state_provider_kind_to_string(StateProviderKind kind) noexcept {
+    switch (kind) {
+        case StateProviderKind::WINDOW: return "window";
+        case StateProviderKind::WORKSPACE: return "workspace";
+    };
 
-    try {
-        nlohmann::json obj = nlohmann::json::parse(str);
+    return "INVALID_KIND";
+}
+
+static std::expected<StateRequest, StateRequestError> request_from_json(const nlohmann::json& obj) {
+    if (!obj.is_object()) {
+        return std::unexpected(StateRequestError::INVALID);
+    }
+
+    std::string kind_str = obj.at("request_kind").get<std::string>();
+    std::optional<StateProviderKind> kind = state_provider_kind_from_string(kind_str);
+    if (!kind) {
+        return std::unexpected(StateRequestError::INVALID);
+    }
+
+    return StateRequest {
+        *kind, obj.at("args")
+    };
+}
+
+std::expected<std::vector<StateRequest>, StateRequestError> StateRequest::from_json(std::string_view str) noexcept {
+    std::vector<StateRequest> requests;
 
-        std::string kind_str = obj["request_kind"].get<std::string>();
-        kind = state_provider_kind_from_string(kind_str);
-        if (!kind) {
+    try {
+        nlohmann::json command = nlohmann::json::parse(str);
+        if (!command.is_array()) {
+            command = nlohmann::json::array({ std::move(command) });
+        }
+        if (command.empty() || command.size() > MAX_STATE_REQUESTS) {
             return std::unexpected(StateRequestError::INVALID);
         }
 
-        args = obj["args"];
+        for (const nlohmann::json& obj : command) {
+            std::expected<StateRequest, StateRequestError> req = request_from_json(obj);
+            if (!req) {
+                return std::unexpected(req.error());
+            }
+            requests.push_back(std::move(*req));
+        }
     }
     catch (const nlohmann::json::exception& err) {
         return std::unexpected(StateRequestError::INVALID);
     }
 
-    return StateRequest {
-        *kind, std::move(args)
+    return requests;
+}
+
+std::string_view StateRequest::action() const noexcept {
+    if (!args.is_object()) {
+        return {};
+    }
+
+    const auto it = args.find("action");
+    if (it == args.end() || !it->is_string()) {
+        return {};
+    }
+    return it->get_ref<const std::string&>();
+}
+
+nlohmann::json StateRequest::to_json() const {
+    return {
+        {"request_kind", state_provider_kind_to_string(kind)},
+        {"args", args},
     };
 }
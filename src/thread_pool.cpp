@@ -0,0 +1,17 @@
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(u32 n_threads) noexcept {
+    m_workers.reserve(n_threads);
+    for (u32 i = 0; i < n_threads; i++) {
+        m_workers.emplace_back([this] {
+            while (std::optional<std::function<void()>> task = m_tasks.pop()) {
+                (*task)();
+            }
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() noexcept {
+    // workers finish the queued tasks, then exit and are joined
+    m_tasks.close();
+}
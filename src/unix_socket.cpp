@@ -0,0 +1,103 @@
+#include "unix_socket.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+std::filesystem::path runtime_socket_path(std::string_view name) noexcept {
+    const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir == nullptr || *runtime_dir == '\0') {
+        return {};
+    }
+    return std::filesystem::path(runtime_dir) / "autosktop" / name;
+}
+
+// Whether a process accepts connections on `addr`. Connecting to a socket nobody listens on
+// any more is refused, which is what a crashed run leaves behind.
+static bool socket_in_use(const sockaddr_un& addr) noexcept {
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    const bool in_use = connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0
+        || (errno != ECONNREFUSED && errno != ENOENT);
+    close(fd);
+    return in_use;
+}
+
+bool unix_socket_in_use(const std::filesystem::path& path) noexcept {
+    sockaddr_un addr { .sun_family = AF_UNIX, .sun_path = {} };
+    const std::string path_str = path.string();
+    if (path_str.empty() || path_str.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    std::memcpy(addr.sun_path, path_str.c_str(), path_str.size() + 1);
+
+    struct stat st {};
+    return lstat(path_str.c_str(), &st) == 0 && S_ISSOCK(st.st_mode) && socket_in_use(addr);
+}
+
+UnixListener listen_unix_socket(const std::filesystem::path& path, int backlog) noexcept {
+    sockaddr_un addr { .sun_family = AF_UNIX, .sun_path = {} };
+    const std::string path_str = path.string();
+    if (path_str.empty() || path_str.size() >= sizeof(addr.sun_path)) {
+        spdlog::error("Invalid socket path {}", path_str);
+        return {};
+    }
+    std::memcpy(addr.sun_path, path_str.c_str(), path_str.size() + 1);
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+
+    // a stale socket left behind by a previous run would make bind fail; anything else is kept
+    struct stat st {};
+    if (lstat(path_str.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            spdlog::error("Failed to listen on {}: not a socket", path_str);
+            return {};
+        }
+        if (socket_in_use(addr)) {
+            spdlog::error("Failed to listen on {}: another process is listening on it", path_str);
+            return {};
+        }
+        std::filesystem::remove(path, ec);
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0
+        || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+        || chmod(path_str.c_str(), 0600) < 0
+        || lstat(path_str.c_str(), &st) < 0
+        || listen(fd, backlog) < 0) {
+        spdlog::error("Failed to listen on {}: {}", path_str, std::strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return {};
+    }
+
+    return UnixListener { .fd = fd, .path = path, .dev = st.st_dev, .ino = st.st_ino };
+}
+
+void close_unix_listener(UnixListener& listener) noexcept {
+    if (listener.fd < 0) {
+        return;
+    }
+    close(listener.fd);
+    listener.fd = -1;
+
+    // another instance may have replaced a file it took for stale, that one stays
+    struct stat st {};
+    if (lstat(listener.path.c_str(), &st) == 0 && st.st_dev == listener.dev && st.st_ino == listener.ino) {
+        std::error_code ec;
+        std::filesystem::remove(listener.path, ec);
+    }
+}
@@ -0,0 +1,8 @@
+#include <wayland-client.h>
+
+// The cosmic toplevel protocols still reference the deprecated cosmic workspace protocol in
+// events and requests that are never used here. It is not vendored, so its interface is
+// declared empty to satisfy the generated code.
+extern "C" const wl_interface zcosmic_workspace_handle_v1_interface = {
+    "zcosmic_workspace_handle_v1", 1, 0, nullptr, 0, nullptr,
+};
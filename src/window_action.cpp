@@ -0,0 +1,25 @@
+#include "window_action.hpp"
+
+std::optional<WindowActionKind> window_action_from_command(std::string_view name) noexcept {
+    for (const WindowActionCommand& command : WINDOW_ACTION_COMMANDS) {
+        if (command.name == name) {
+            return command.kind;
+        }
+    }
+
+    return std::nullopt;
+}
+
+std::string_view window_action_status_to_string(WindowActionStatus status) noexcept {
+    switch (status) {
+        case WindowActionStatus::PENDING: return "pending";
+        case WindowActionStatus::DONE: return "done";
+        case WindowActionStatus::NOT_FOUND: return "not_found";
+        case WindowActionStatus::WORKSPACE_NOT_FOUND: return "workspace_not_found";
+        case WindowActionStatus::UNSUPPORTED: return "unsupported";
+        case WindowActionStatus::WINDOW_CLOSED: return "window_closed";
+        case WindowActionStatus::TIMED_OUT: return "timed_out";
+    }
+
+    return "INVALID_STATUS";
+}
@@ -4,10 +4,52 @@
 #include "state_provider.hpp"
 #include "state_request.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
 #include <spdlog/spdlog.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <wayland-client-core.h>
 #include <wayland-client-protocol.h>
 
+namespace {
+
+using CosmicCapability = zcosmic_toplevel_manager_v1_zcosmic_toplelevel_management_capabilities_v1;
+
+bool has_state(u32 states, zcosmic_toplevel_handle_v1_state state) {
+    return states & (1u << state);
+}
+
+// Whether the state reported for a window already reflects `kind`. Closing is only ever
+// confirmed by the closed event.
+bool in_effect(WindowActionKind kind, u32 states, std::span<ext_workspace_handle_v1* const> workspaces,
+    ext_workspace_handle_v1* target)
+{
+    switch (kind) {
+        case WindowActionKind::CLOSE: return false;
+        case WindowActionKind::ACTIVATE: return has_state(states, ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED);
+        case WindowActionKind::MINIMIZE: return has_state(states, ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED);
+        case WindowActionKind::UNMINIMIZE: return !has_state(states, ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED);
+        case WindowActionKind::MAXIMIZE: return has_state(states, ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED);
+        case WindowActionKind::UNMAXIMIZE: return !has_state(states, ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED);
+        case WindowActionKind::FULLSCREEN: return has_state(states, ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_FULLSCREEN);
+        case WindowActionKind::UNFULLSCREEN: return !has_state(states, ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_FULLSCREEN);
+        case WindowActionKind::STICK: return has_state(states, ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_STICKY);
+        case WindowActionKind::UNSTICK: return !has_state(states, ZCOSMIC_TOPLEVEL_HANDLE_V1_STATE_STICKY);
+        case WindowActionKind::MOVE_TO_WORKSPACE: return std::ranges::find(workspaces, target) != workspaces.end();
+    }
+
+    return false;
+}
+
+}
+
 std::expected<void, StateProviderError> WindowStateProvider::init() noexcept {
     spdlog::debug("Connecting to Wayland display");
     m_display = wl_display_connect(nullptr);
@@ -25,14 +67,146 @@ std::expected<void, StateProviderError> WindowStateProvider::init() noexcept {
         return std::unexpected(WindowStateProviderError::WL_UNSUPPORTED_COMPOSITOR);
     }
 
+    if (m_cosmic_manager) {
+        zcosmic_toplevel_manager_v1_add_listener(m_cosmic_manager, &COSMIC_MANAGER_LISTENER, this);
+    }
+    if (m_cosmic_info) {
+        zcosmic_toplevel_info_v1_add_listener(m_cosmic_info, &COSMIC_INFO_LISTENER, this);
+    }
+    else {
+        spdlog::info("Compositor does not support zcosmic_toplevel_info_v1 version 2, windows are read-only");
+    }
+    if (m_workspace_manager) {
+        ext_workspace_manager_v1_add_listener(m_workspace_manager, &WORKSPACE_MANAGER_LISTENER, this);
+    }
+
     ext_foreign_toplevel_list_v1_add_listener(m_ext_list, &EXT_LIST_LISTENER, this);
     wl_display_roundtrip(m_display);
+    if (m_cosmic_info) {
+        // state of the cosmic handles requested for the initial toplevels
+        wl_display_roundtrip(m_display);
+    }
+    m_tracks_workspaces.store(m_workspace_manager != nullptr, std::memory_order_release);
+
+    // from here on events are only read by the event thread
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    m_action_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_epoll_fd < 0 || m_stop_fd < 0 || m_action_fd < 0) {
+        spdlog::error("Could not create the Wayland event loop");
+        return std::unexpected(WindowStateProviderError::EVENT_LOOP_ERROR);
+    }
+
+    epoll_event display_event { .events = EPOLLIN, .data = { .fd = wl_display_get_fd(m_display) } };
+    epoll_event stop_event { .events = EPOLLIN, .data = { .fd = m_stop_fd } };
+    epoll_event action_event { .events = EPOLLIN, .data = { .fd = m_action_fd } };
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, wl_display_get_fd(m_display), &display_event) < 0
+        || epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_stop_fd, &stop_event) < 0
+        || epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_action_fd, &action_event) < 0) {
+        spdlog::error("Could not watch the Wayland display");
+        return std::unexpected(WindowStateProviderError::EVENT_LOOP_ERROR);
+    }
+
+    m_event_thread = std::jthread([this] { event_loop(); });
 
     return {};
 }
 
 WindowStateProvider::~WindowStateProvider() noexcept {
-    wl_display_disconnect(m_display);
+    if (m_event_thread.joinable()) {
+        const u64 one = 1;
+        [[maybe_unused]] ssize_t n = write(m_stop_fd, &one, sizeof(one));
+        m_event_thread.join();
+    }
+
+    if (m_epoll_fd >= 0) close(m_epoll_fd);
+    if (m_stop_fd >= 0) close(m_stop_fd);
+    if (m_action_fd >= 0) close(m_action_fd);
+
+    if (m_display) {
+        wl_display_disconnect(m_display);
+    }
+}
+
+void WindowStateProvider::event_loop() noexcept {
+    const int display_fd = wl_display_get_fd(m_display);
+
+    // nothing will confirm the actions that are still waiting once the loop is gone
+    auto stop_actions = [this] {
+        m_action_queue.close();
+        while (std::optional<std::unique_ptr<ActionBatch>> batch = m_action_queue.try_pop()) {
+            m_action_batches.push_back(std::move(*batch));
+        }
+        expire_batches(std::chrono::steady_clock::now(), true);
+    };
+
+    while (true) {
+        // prepare_read fails while events are queued, those have to be dispatched first
+        while (wl_display_prepare_read(m_display) != 0) {
+            wl_display_dispatch_pending(m_display);
+        }
+        wl_display_flush(m_display);
+
+        // wake up for the earliest action deadline
+        int timeout = -1;
+        if (!m_action_batches.empty()) {
+            auto deadline = m_action_batches.front()->deadline;
+            for (const std::unique_ptr<ActionBatch>& batch : m_action_batches) {
+                deadline = std::min(deadline, batch->deadline);
+            }
+            const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            timeout = std::max<i64>(remaining.count(), 0);
+        }
+
+        std::array<epoll_event, 3> events;
+        const int n = epoll_wait(m_epoll_fd, events.data(), events.size(), timeout);
+        if (n < 0) {
+            wl_display_cancel_read(m_display);
+            if (errno == EINTR) continue;
+            spdlog::error("Wayland event loop failed: {}", std::strerror(errno));
+            stop_actions();
+            return;
+        }
+
+        bool readable = false;
+        bool actions_queued = false;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == m_stop_fd) {
+                wl_display_cancel_read(m_display);
+                stop_actions();
+                return;
+            }
+            readable |= events[i].data.fd == display_fd;
+            actions_queued |= events[i].data.fd == m_action_fd;
+        }
+
+        if (!readable) {
+            wl_display_cancel_read(m_display);
+        }
+        else if (wl_display_read_events(m_display) < 0) {
+            spdlog::error("Lost the Wayland connection: {}", std::strerror(wl_display_get_error(m_display)));
+            stop_actions();
+            return;
+        }
+        wl_display_dispatch_pending(m_display);
+
+        if (actions_queued) {
+            u64 n_signals;
+            [[maybe_unused]] ssize_t n_read = read(m_action_fd, &n_signals, sizeof(n_signals));
+            while (std::optional<std::unique_ptr<ActionBatch>> batch = m_action_queue.try_pop()) {
+                send_batch(std::move(*batch));
+            }
+        }
+        expire_batches(std::chrono::steady_clock::now(), false);
+    }
+}
+
+nlohmann::json window_info_to_json(const WindowView& window) {
+    return {
+        {"window_id", window.window_id},
+        {"title",     window.title},
+        {"app_id",    window.app_id},
+    };
 }
 
 nlohmann::json WindowStateProvider::processRequest(StateRequest req) noexcept {
@@ -65,15 +239,12 @@ nlohmann::json WindowStateProvider::processRequest(StateRequest req) noexcept {
                 : nlohmann::json::object();
 
         if (action == "get_open_windows") {
-            const auto windows = get_open_windows();
-
             nlohmann::json arr = nlohmann::json::array();
-            for (const auto& w : windows) {
-                arr.push_back({
-                    {"window_id", w.window_id},
-                    {"title",     w.title},
-                    {"app_id",    w.app_id},
-                });
+            {
+                const WindowSnapshot windows = snapshot();
+                for (size_t i = 0; i < windows.size(); i++) {
+                    arr.push_back(window_info_to_json(windows[i]));
+                }
             }
 
             out["ok"] = true;
@@ -90,10 +261,16 @@ nlohmann::json WindowStateProvider::processRequest(StateRequest req) noexcept {
                 return out;
             }
 
-            const std::string window_id = params["window_id"].get<std::string>();
-            const auto info = get_window_state(window_id);
+            const std::string& window_id = params["window_id"].get_ref<const std::string&>();
+            std::optional<nlohmann::json> window;
+            {
+                const WindowSnapshot windows = snapshot();
+                if (const auto view = windows.find(window_id)) {
+                    window = window_info_to_json(*view);
+                }
+            }
 
-            if (!info) {
+            if (!window) {
                 out["ok"] = false;
                 out["action"] = action;
                 out["error"] = "not_found";
@@ -103,11 +280,62 @@ nlohmann::json WindowStateProvider::processRequest(StateRequest req) noexcept {
 
             out["ok"] = true;
             out["action"] = action;
-            out["window"] = {
-                {"window_id", info->window_id},
-                {"title",     info->title},
-                {"app_id",    info->app_id},
-            };
+            out["window"] = std::move(*window);
+            return out;
+        }
+
+        if (const std::optional<WindowActionKind> kind = window_action_from_command(action)) {
+            std::vector<std::string> window_ids;
+            if (*kind == WindowActionKind::ACTIVATE) {
+                if (!params.contains("window_id") || !params["window_id"].is_string()) {
+                    out["ok"] = false;
+                    out["action"] = action;
+                    out["error"] = "missing_or_invalid_window_id";
+                    return out;
+                }
+                window_ids.push_back(params["window_id"].get<std::string>());
+            }
+            else {
+                const bool valid = params.contains("window_ids") && params["window_ids"].is_array()
+                    && std::ranges::all_of(params["window_ids"], [](const nlohmann::json& id) { return id.is_string(); });
+                if (!valid) {
+                    out["ok"] = false;
+                    out["action"] = action;
+                    out["error"] = "missing_or_invalid_window_ids";
+                    return out;
+                }
+                window_ids = params["window_ids"].get<std::vector<std::string>>();
+            }
+
+            std::string workspace;
+            if (*kind == WindowActionKind::MOVE_TO_WORKSPACE) {
+                if (!params.contains("workspace_id") || !params["workspace_id"].is_string()) {
+                    out["ok"] = false;
+                    out["action"] = action;
+                    out["error"] = "missing_or_invalid_workspace_id";
+                    return out;
+                }
+                workspace = params["workspace_id"].get<std::string>();
+            }
+
+            std::vector<WindowAction> actions;
+            actions.reserve(window_ids.size());
+            for (const std::string& window_id : window_ids) {
+                actions.push_back(WindowAction { .kind = *kind, .window_id = window_id, .workspace = workspace });
+            }
+            const std::vector<WindowActionStatus> statuses = apply(std::move(actions));
+
+            nlohmann::json results = nlohmann::json::array();
+            for (size_t i = 0; i < window_ids.size(); i++) {
+                results.push_back({
+                    {"window_id", window_ids[i]},
+                    {"status", window_action_status_to_string(statuses[i])},
+                });
+            }
+
+            out["ok"] = std::ranges::all_of(statuses, [](WindowActionStatus status) { return status == WindowActionStatus::DONE; });
+            out["action"] = action;
+            out["results"] = std::move(results);
             return out;
         }
 
@@ -125,16 +353,283 @@ nlohmann::json WindowStateProvider::processRequest(StateRequest req) noexcept {
     }
 }
 
+std::optional<u64> WindowStateProvider::generation(const StateRequest& req) const noexcept {
+    const std::string_view action = req.action();
+    if (action == "get_open_windows" || action == "get_window_state") {
+        return generation();
+    }
+    return std::nullopt;
+}
+
+void WindowStateProvider::replace_windows(std::span<const WindowInfo> windows) {
+    std::unique_lock lock(m_mutex);
+
+    m_windows.clear();
+    m_workspace_index.clear();
+    for (const WindowInfo& info : windows) {
+        [[maybe_unused]] WindowKey key = m_windows.insert(info);
+    }
+    m_generation.fetch_add(1, std::memory_order_release);
+}
+
+std::vector<WindowActionStatus> WindowStateProvider::apply(
+    std::vector<WindowAction> actions, std::chrono::milliseconds timeout) noexcept
+{
+    const size_t n = actions.size();
+    if (n == 0) {
+        return {};
+    }
+
+    auto batch = std::make_unique<ActionBatch>(ActionBatch {
+        .actions = std::move(actions),
+        .deadline = std::chrono::steady_clock::now() + timeout,
+    });
+    std::future<std::vector<WindowActionStatus>> done = batch->done.get_future();
+
+    // requests are only sent from the event thread, which owns the toplevel objects
+    if (!m_event_thread.joinable() || !m_action_queue.push(std::move(batch))) {
+        return std::vector(n, WindowActionStatus::UNSUPPORTED);
+    }
+    const u64 one = 1;
+    [[maybe_unused]] ssize_t n_written = write(m_action_fd, &one, sizeof(one));
+
+    // the event thread times the batch out itself, this only guards against it being stuck
+    if (done.wait_for(timeout + std::chrono::seconds(1)) != std::future_status::ready) {
+        return std::vector(n, WindowActionStatus::TIMED_OUT);
+    }
+    return done.get();
+}
+
+bool WindowStateProvider::supports(WindowActionKind kind) const noexcept {
+    if (!m_cosmic_manager || !m_cosmic_info) {
+        return false;
+    }
+
+    const u32 capabilities = m_cosmic_capabilities.load(std::memory_order_relaxed);
+    auto has = [&](CosmicCapability capability) { return (capabilities & (1u << capability)) != 0; };
+
+    switch (kind) {
+        case WindowActionKind::CLOSE:
+            return has(ZCOSMIC_TOPLEVEL_MANAGER_V1_ZCOSMIC_TOPLELEVEL_MANAGEMENT_CAPABILITIES_V1_CLOSE);
+        case WindowActionKind::ACTIVATE:
+            return m_seat && has(ZCOSMIC_TOPLEVEL_MANAGER_V1_ZCOSMIC_TOPLELEVEL_MANAGEMENT_CAPABILITIES_V1_ACTIVATE);
+        case WindowActionKind::MINIMIZE:
+        case WindowActionKind::UNMINIMIZE:
+            return has(ZCOSMIC_TOPLEVEL_MANAGER_V1_ZCOSMIC_TOPLELEVEL_MANAGEMENT_CAPABILITIES_V1_MINIMIZE);
+        case WindowActionKind::MAXIMIZE:
+        case WindowActionKind::UNMAXIMIZE:
+            return has(ZCOSMIC_TOPLEVEL_MANAGER_V1_ZCOSMIC_TOPLELEVEL_MANAGEMENT_CAPABILITIES_V1_MAXIMIZE);
+        case WindowActionKind::FULLSCREEN:
+        case WindowActionKind::UNFULLSCREEN:
+            return has(ZCOSMIC_TOPLEVEL_MANAGER_V1_ZCOSMIC_TOPLELEVEL_MANAGEMENT_CAPABILITIES_V1_FULLSCREEN);
+        case WindowActionKind::STICK:
+        case WindowActionKind::UNSTICK:
+            return has(ZCOSMIC_TOPLEVEL_MANAGER_V1_ZCOSMIC_TOPLELEVEL_MANAGEMENT_CAPABILITIES_V1_STICKY);
+        case WindowActionKind::MOVE_TO_WORKSPACE:
+            return m_tracks_workspaces.load(std::memory_order_acquire)
+                && has(ZCOSMIC_TOPLEVEL_MANAGER_V1_ZCOSMIC_TOPLELEVEL_MANAGEMENT_CAPABILITIES_V1_MOVE_TO_EXT_WORKSPACE);
+    }
+
+    return false;
+}
+
+void WindowStateProvider::send_batch(std::unique_ptr<ActionBatch> batch) noexcept {
+    const size_t n = batch->actions.size();
+    batch->status.assign(n, WindowActionStatus::PENDING);
+    batch->targets.assign(n, nullptr);
+    batch->workspaces.assign(n, nullptr);
+
+    // a single pass over the windows resolves every target
+    std::unordered_map<std::string_view, std::vector<size_t>> wanted;
+    for (size_t i = 0; i < n; i++) {
+        wanted[batch->actions[i].window_id].push_back(i);
+    }
+    for (const std::unique_ptr<Toplevel>& toplevel : m_toplevels) {
+        // windows nobody has seen yet, before their first done event, cannot be targeted
+        if (!toplevel->key) continue;
+        if (const auto it = wanted.find(toplevel->pending.window_id); it != wanted.end()) {
+            for (size_t i : it->second) {
+                batch->targets[i] = toplevel.get();
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        const WindowAction& action = batch->actions[i];
+        const Toplevel* toplevel = batch->targets[i];
+        WindowActionStatus& status = batch->status[i];
+
+        if (!toplevel) {
+            status = WindowActionStatus::NOT_FOUND;
+            continue;
+        }
+        if (!toplevel->cosmic || !supports(action.kind)) {
+            status = WindowActionStatus::UNSUPPORTED;
+            continue;
+        }
+
+        if (action.kind == WindowActionKind::MOVE_TO_WORKSPACE) {
+            const auto workspace = std::ranges::find_if(m_workspaces, [&](const std::unique_ptr<Workspace>& w) {
+                return !w->removed && (w->pending.workspace_id == action.workspace || w->pending.name == action.workspace);
+            });
+            if (workspace == m_workspaces.end()) {
+                status = WindowActionStatus::WORKSPACE_NOT_FOUND;
+                continue;
+            }
+            batch->workspaces[i] = (*workspace)->handle;
+        }
+
+        const CosmicState& state = toplevel->cosmic_state;
+        if (in_effect(action.kind, state.states, state.workspaces, batch->workspaces[i])) {
+            status = WindowActionStatus::DONE;
+            continue;
+        }
+
+        zcosmic_toplevel_handle_v1* handle = toplevel->cosmic;
+        switch (action.kind) {
+            case WindowActionKind::CLOSE: zcosmic_toplevel_manager_v1_close(m_cosmic_manager, handle); break;
+            case WindowActionKind::ACTIVATE: zcosmic_toplevel_manager_v1_activate(m_cosmic_manager, handle, m_seat); break;
+            case WindowActionKind::MINIMIZE: zcosmic_toplevel_manager_v1_set_minimized(m_cosmic_manager, handle); break;
+            case WindowActionKind::UNMINIMIZE: zcosmic_toplevel_manager_v1_unset_minimized(m_cosmic_manager, handle); break;
+            case WindowActionKind::MAXIMIZE: zcosmic_toplevel_manager_v1_set_maximized(m_cosmic_manager, handle); break;
+            case WindowActionKind::UNMAXIMIZE: zcosmic_toplevel_manager_v1_unset_maximized(m_cosmic_manager, handle); break;
+            // on the output the window is on, or one the compositor picks
+            case WindowActionKind::FULLSCREEN: zcosmic_toplevel_manager_v1_set_fullscreen(m_cosmic_manager, handle, state.output); break;
+            case WindowActionKind::UNFULLSCREEN: zcosmic_toplevel_manager_v1_unset_fullscreen(m_cosmic_manager, handle); break;
+            case WindowActionKind::STICK: zcosmic_toplevel_manager_v1_set_sticky(m_cosmic_manager, handle); break;
+            case WindowActionKind::UNSTICK: zcosmic_toplevel_manager_v1_unset_sticky(m_cosmic_manager, handle); break;
+            case WindowActionKind::MOVE_TO_WORKSPACE: {
+                // the request needs an output, the one the window is on or any other
+                wl_output* output = state.output ? state.output : m_outputs.empty() ? nullptr : m_outputs.front();
+                if (!output) {
+                    status = WindowActionStatus::UNSUPPORTED;
+                    continue;
+                }
+                zcosmic_toplevel_manager_v1_move_to_ext_workspace(m_cosmic_manager, handle, batch->workspaces[i], output);
+                break;
+            }
+        }
+        batch->n_pending++;
+    }
+
+    // every request of the batch goes out together
+    wl_display_flush(m_display);
+    spdlog::debug("Sent {} window actions, {} already settled", batch->n_pending, n - batch->n_pending);
+
+    m_action_batches.push_back(std::move(batch));
+    finish_batches();
+}
+
+void WindowStateProvider::settle_actions(const Toplevel& toplevel, bool closed) noexcept {
+    for (const std::unique_ptr<ActionBatch>& batch : m_action_batches) {
+        for (size_t i = 0; i < batch->actions.size(); i++) {
+            if (batch->status[i] != WindowActionStatus::PENDING || batch->targets[i] != &toplevel) {
+                continue;
+            }
+
+            const WindowActionKind kind = batch->actions[i].kind;
+            if (closed) {
+                batch->status[i] = kind == WindowActionKind::CLOSE ? WindowActionStatus::DONE : WindowActionStatus::WINDOW_CLOSED;
+            }
+            else if (in_effect(kind, toplevel.cosmic_state.states, toplevel.cosmic_state.workspaces, batch->workspaces[i])) {
+                batch->status[i] = WindowActionStatus::DONE;
+            }
+            else {
+                continue;
+            }
+            batch->n_pending--;
+        }
+    }
+
+    finish_batches();
+}
+
+void WindowStateProvider::expire_batches(std::chrono::steady_clock::time_point now, bool all) noexcept {
+    for (const std::unique_ptr<ActionBatch>& batch : m_action_batches) {
+        if (!all && now < batch->deadline) {
+            continue;
+        }
+
+        for (WindowActionStatus& status : batch->status) {
+            if (status == WindowActionStatus::PENDING) {
+                status = WindowActionStatus::TIMED_OUT;
+            }
+        }
+        batch->n_pending = 0;
+    }
+
+    finish_batches();
+}
+
+void WindowStateProvider::finish_batches() noexcept {
+    std::erase_if(m_action_batches, [](const std::unique_ptr<ActionBatch>& batch) {
+        if (batch->n_pending > 0) {
+            return false;
+        }
+        batch->done.set_value(std::move(batch->status));
+        return true;
+    });
+}
+
+std::vector<ActionSchema> WindowStateProvider::actions() const noexcept {
+    std::vector<ActionSchema> actions = {
+        ActionSchema { .name = "get_open_windows", .params = {} },
+        ActionSchema { .name = "get_window_state", .params = { "window_id" } },
+    };
+
+    // only what the compositor can do, so the model is not offered dead ends
+    for (const WindowActionCommand& command : WINDOW_ACTION_COMMANDS) {
+        if (!supports(command.kind)) {
+            continue;
+        }
+
+        if (command.kind == WindowActionKind::ACTIVATE) {
+            actions.push_back(ActionSchema { .name = std::string(command.name), .params = { "window_id" } });
+        }
+        else if (command.kind == WindowActionKind::MOVE_TO_WORKSPACE) {
+            actions.push_back(ActionSchema {
+                .name = std::string(command.name), .params = { "workspace_id" }, .list_params = { "window_ids" } });
+        }
+        else {
+            actions.push_back(ActionSchema { .name = std::string(command.name), .params = {}, .list_params = { "window_ids" } });
+        }
+    }
+
+    return actions;
+}
+
 void WindowStateProvider::on_registry_global(
     void* data, wl_registry* registry, u32 name, const char* interface, u32 version)
 {
     auto* self = static_cast<WindowStateProvider*>(data);
 
-    if (std::string_view(interface) == "ext_foreign_toplevel_list_v1") {
+    const std::string_view iface(interface);
+    if (iface == "ext_foreign_toplevel_list_v1") {
         const u32 v = std::min<u32>(version, 1);
         self->m_ext_list = static_cast<ext_foreign_toplevel_list_v1*>(
             wl_registry_bind(registry, name, &ext_foreign_toplevel_list_v1_interface, v));
     }
+    // get_cosmic_toplevel, which maps ext handles to cosmic ones, needs version 2
+    else if (iface == "zcosmic_toplevel_info_v1" && version >= 2) {
+        const u32 v = std::min<u32>(version, 3);
+        self->m_cosmic_info = static_cast<zcosmic_toplevel_info_v1*>(
+            wl_registry_bind(registry, name, &zcosmic_toplevel_info_v1_interface, v));
+    }
+    else if (iface == "zcosmic_toplevel_manager_v1") {
+        const u32 v = std::min<u32>(version, 4);
+        self->m_cosmic_manager = static_cast<zcosmic_toplevel_manager_v1*>(
+            wl_registry_bind(registry, name, &zcosmic_toplevel_manager_v1_interface, v));
+    }
+    else if (iface == "ext_workspace_manager_v1") {
+        self->m_workspace_manager = static_cast<ext_workspace_manager_v1*>(
+            wl_registry_bind(registry, name, &ext_workspace_manager_v1_interface, 1));
+    }
+    else if (iface == "wl_seat" && !self->m_seat) {
+        self->m_seat = static_cast<wl_seat*>(wl_registry_bind(registry, name, &wl_seat_interface, 1));
+    }
+    else if (iface == "wl_output") {
+        self->m_outputs.push_back(static_cast<wl_output*>(wl_registry_bind(registry, name, &wl_output_interface, 1)));
+    }
 }
 
 void WindowStateProvider::on_registry_global_remove(void* /*data*/, wl_registry* /*registry*/, uint32_t /*name*/) {}
@@ -146,13 +641,17 @@ void WindowStateProvider::on_list_toplevel(
 {
     auto* self = static_cast<WindowStateProvider*>(data);
 
-    CachedWindow cw;
-    cw.ext_handle = handle;
-
-    auto [it, inserted] = self->m_by_handle.emplace(handle, std::move(cw));
-    if (!inserted) return;
-
-    ext_foreign_toplevel_handle_v1_add_listener(handle, &EXT_HANDLE_LISTENER, self);
+    auto toplevel = std::make_unique<Toplevel>(Toplevel {
+        .self = self,
+        .handle = handle,
+        .index = self->m_toplevels.size(),
+    });
+    ext_foreign_toplevel_handle_v1_add_listener(handle, &EXT_HANDLE_LISTENER, toplevel.get());
+    if (self->m_cosmic_info) {
+        toplevel->cosmic = zcosmic_toplevel_info_v1_get_cosmic_toplevel(self->m_cosmic_info, handle);
+        zcosmic_toplevel_handle_v1_add_listener(toplevel->cosmic, &COSMIC_HANDLE_LISTENER, toplevel.get());
+    }
+    self->m_toplevels.push_back(std::move(toplevel));
 }
 
 void WindowStateProvider::on_list_finished(
@@ -162,91 +661,365 @@ void WindowStateProvider::on_list_finished(
     self->m_initial_done = true;
 }
 
-// ext_foreign_toplevel_handle_v1 callbacks
+// ext_foreign_toplevel_handle_v1 callbacks, data is the handle's Toplevel
 
 void WindowStateProvider::on_handle_identifier(
-    void* data, ext_foreign_toplevel_handle_v1* handle, const char* id)
+    void* data, ext_foreign_toplevel_handle_v1* /*handle*/, const char* id)
 {
-    auto* self = static_cast<WindowStateProvider*>(data);
-    auto it = self->m_by_handle.find(handle);
-    if (it == self->m_by_handle.end()) return;
+    static_cast<Toplevel*>(data)->pending.window_id = id ? id : "";
+}
+
+void WindowStateProvider::on_handle_title(
+    void* data, ext_foreign_toplevel_handle_v1* /*handle*/, const char* title)
+{
+    static_cast<Toplevel*>(data)->pending.title = title ? title : "";
+}
+
+void WindowStateProvider::on_handle_app_id(
+    void* data, ext_foreign_toplevel_handle_v1* /*handle*/, const char* app_id)
+{
+    static_cast<Toplevel*>(data)->pending.app_id = app_id ? app_id : "";
+}
+
+void WindowStateProvider::on_handle_done(
+    void* data, ext_foreign_toplevel_handle_v1* /*handle*/)
+{
+    auto* toplevel = static_cast<Toplevel*>(data);
+    WindowStateProvider* self = toplevel->self;
+
+    {
+        std::unique_lock lock(self->m_mutex);
 
-    it->second.info.window_id = id ? id : "";
-    if (!it->second.info.window_id.empty()) {
-        self->m_handle_by_id[it->second.info.window_id] = handle;
+        // the compositor sends atomic updates, they only become visible on done
+        if (toplevel->key) {
+            self->m_windows.update(*toplevel->key, toplevel->pending);
+        }
+        else {
+            toplevel->key = self->m_windows.insert(toplevel->pending);
+        }
+        self->index_workspaces(*toplevel);
+        self->m_generation.fetch_add(1, std::memory_order_release);
     }
+
+    // cosmic state is applied with this done event too
+    self->settle_actions(*toplevel, false);
 }
 
-void WindowStateProvider::on_handle_title(
-    void* data, ext_foreign_toplevel_handle_v1* handle, const char* title)
+void WindowStateProvider::on_handle_closed(
+    void* data, ext_foreign_toplevel_handle_v1* handle)
 {
-    auto* self = static_cast<WindowStateProvider*>(data);
-    auto it = self->m_by_handle.find(handle);
-    if (it == self->m_by_handle.end()) return;
+    auto* toplevel = static_cast<Toplevel*>(data);
+    WindowStateProvider* self = toplevel->self;
+
+    if (toplevel->key) {
+        std::unique_lock lock(self->m_mutex);
+        // leaves every workspace before the key goes stale
+        toplevel->cosmic_state.workspaces.clear();
+        self->index_workspaces(*toplevel);
+        self->m_windows.erase(*toplevel->key);
+        self->m_generation.fetch_add(1, std::memory_order_release);
+    }
 
-    it->second.info.title = title ? title : "";
+    self->settle_actions(*toplevel, true);
+
+    if (toplevel->cosmic) {
+        zcosmic_toplevel_handle_v1_destroy(toplevel->cosmic);
+    }
+    ext_foreign_toplevel_handle_v1_destroy(handle);
+
+    // swap-remove, toplevel is freed here
+    auto& toplevels = self->m_toplevels;
+    const size_t index = toplevel->index;
+    if (index + 1 != toplevels.size()) {
+        toplevels[index] = std::move(toplevels.back());
+        toplevels[index]->index = index;
+    }
+    toplevels.pop_back();
 }
 
-void WindowStateProvider::on_handle_app_id(
-    void* data, ext_foreign_toplevel_handle_v1* handle, const char* app_id)
+// zcosmic_toplevel_manager_v1 callbacks
+
+void WindowStateProvider::on_manager_capabilities(
+    void* data, zcosmic_toplevel_manager_v1* /*manager*/, wl_array* capabilities)
 {
     auto* self = static_cast<WindowStateProvider*>(data);
-    auto it = self->m_by_handle.find(handle);
-    if (it == self->m_by_handle.end()) return;
 
-    it->second.info.app_id = app_id ? app_id : "";
+    u32 bits = 0;
+    u32* capability;
+    wl_array_for_each(capability, capabilities) {
+        if (*capability < 32) {
+            bits |= 1u << *capability;
+        }
+    }
+    self->m_cosmic_capabilities.store(bits, std::memory_order_relaxed);
 }
 
-void WindowStateProvider::on_handle_done(
-    void* data, ext_foreign_toplevel_handle_v1* handle)
+// zcosmic_toplevel_info_v1 callbacks
+
+void WindowStateProvider::on_cosmic_info_toplevel(
+    void* /*data*/, zcosmic_toplevel_info_v1* /*info*/, zcosmic_toplevel_handle_v1* /*toplevel*/) {}
+
+void WindowStateProvider::on_cosmic_info_finished(
+    void* /*data*/, zcosmic_toplevel_info_v1* /*info*/) {}
+
+void WindowStateProvider::on_cosmic_info_done(
+    void* /*data*/, zcosmic_toplevel_info_v1* /*info*/) {}
+
+// zcosmic_toplevel_handle_v1 callbacks, data is the handle's Toplevel
+
+void WindowStateProvider::on_cosmic_closed(void* /*data*/, zcosmic_toplevel_handle_v1* /*handle*/) {}
+
+void WindowStateProvider::on_cosmic_done(void* /*data*/, zcosmic_toplevel_handle_v1* /*handle*/) {}
+
+void WindowStateProvider::on_cosmic_title(
+    void* /*data*/, zcosmic_toplevel_handle_v1* /*handle*/, const char* /*title*/) {}
+
+void WindowStateProvider::on_cosmic_app_id(
+    void* /*data*/, zcosmic_toplevel_handle_v1* /*handle*/, const char* /*app_id*/) {}
+
+void WindowStateProvider::on_cosmic_output_enter(
+    void* data, zcosmic_toplevel_handle_v1* /*handle*/, wl_output* output)
+{
+    static_cast<Toplevel*>(data)->cosmic_state.output = output;
+}
+
+void WindowStateProvider::on_cosmic_output_leave(
+    void* data, zcosmic_toplevel_handle_v1* /*handle*/, wl_output* output)
+{
+    CosmicState& state = static_cast<Toplevel*>(data)->cosmic_state;
+    if (state.output == output) {
+        state.output = nullptr;
+    }
+}
+
+void WindowStateProvider::on_cosmic_workspace_enter(
+    void* /*data*/, zcosmic_toplevel_handle_v1* /*handle*/, zcosmic_workspace_handle_v1* /*workspace*/) {}
+
+void WindowStateProvider::on_cosmic_workspace_leave(
+    void* /*data*/, zcosmic_toplevel_handle_v1* /*handle*/, zcosmic_workspace_handle_v1* /*workspace*/) {}
+
+void WindowStateProvider::on_cosmic_state(
+    void* data, zcosmic_toplevel_handle_v1* /*handle*/, wl_array* state)
+{
+    u32 bits = 0;
+    u32* entry;
+    wl_array_for_each(entry, state) {
+        if (*entry < 32) {
+            bits |= 1u << *entry;
+        }
+    }
+    static_cast<Toplevel*>(data)->cosmic_state.states = bits;
+}
+
+void WindowStateProvider::on_cosmic_geometry(
+    void* /*data*/, zcosmic_toplevel_handle_v1* /*handle*/, wl_output* /*output*/,
+    i32 /*x*/, i32 /*y*/, i32 /*width*/, i32 /*height*/) {}
+
+void WindowStateProvider::on_cosmic_ext_workspace_enter(
+    void* data, zcosmic_toplevel_handle_v1* /*handle*/, ext_workspace_handle_v1* workspace)
+{
+    std::vector<ext_workspace_handle_v1*>& workspaces = static_cast<Toplevel*>(data)->cosmic_state.workspaces;
+    if (std::ranges::find(workspaces, workspace) == workspaces.end()) {
+        workspaces.push_back(workspace);
+    }
+}
+
+void WindowStateProvider::on_cosmic_ext_workspace_leave(
+    void* data, zcosmic_toplevel_handle_v1* /*handle*/, ext_workspace_handle_v1* workspace)
+{
+    std::erase(static_cast<Toplevel*>(data)->cosmic_state.workspaces, workspace);
+}
+
+// ext_workspace_manager_v1 callbacks
+
+void WindowStateProvider::on_workspace_manager_group(
+    void* data, ext_workspace_manager_v1* /*manager*/, ext_workspace_group_handle_v1* handle)
 {
     auto* self = static_cast<WindowStateProvider*>(data);
-    auto it = self->m_by_handle.find(handle);
-    if (it == self->m_by_handle.end()) return;
 
-    it->second.seen_done = true;
+    auto group = std::make_unique<WorkspaceGroup>(WorkspaceGroup {
+        .self = self,
+        .handle = handle,
+        .id = self->m_next_group_id++,
+    });
+    ext_workspace_group_handle_v1_add_listener(handle, &WORKSPACE_GROUP_LISTENER, group.get());
+    self->m_workspace_groups.push_back(std::move(group));
 }
 
-void WindowStateProvider::on_handle_closed(
-    void* data, ext_foreign_toplevel_handle_v1* handle)
+void WindowStateProvider::on_workspace_manager_workspace(
+    void* data, ext_workspace_manager_v1* /*manager*/, ext_workspace_handle_v1* handle)
 {
     auto* self = static_cast<WindowStateProvider*>(data);
-    auto it = self->m_by_handle.find(handle);
-    if (it == self->m_by_handle.end()) return;
 
-    if (!it->second.info.window_id.empty()) {
-        self->m_handle_by_id.erase(it->second.info.window_id);
+    WorkspaceSlot slot;
+    {
+        std::unique_lock lock(self->m_mutex);
+        slot = self->m_workspace_index.add();
     }
-    self->m_by_handle.erase(it);
 
-    ext_foreign_toplevel_handle_v1_destroy(handle);
+    auto workspace = std::make_unique<Workspace>(Workspace {
+        .self = self,
+        .handle = handle,
+        .slot = slot,
+        .index = self->m_workspaces.size(),
+    });
+    ext_workspace_handle_v1_add_listener(handle, &WORKSPACE_LISTENER, workspace.get());
+    self->m_workspaces.push_back(std::move(workspace));
+}
+
+void WindowStateProvider::on_workspace_manager_done(void* data, ext_workspace_manager_v1* /*manager*/) {
+    // the compositor sends atomic updates, they only become visible on done
+    static_cast<WindowStateProvider*>(data)->apply_workspaces();
+}
+
+void WindowStateProvider::on_workspace_manager_finished(void* data, ext_workspace_manager_v1* manager) {
+    auto* self = static_cast<WindowStateProvider*>(data);
+    self->m_workspace_manager = nullptr;
+    self->m_tracks_workspaces.store(false, std::memory_order_release);
+    // the cached workspaces stop being updated, drop the answers built from them
+    self->m_generation.fetch_add(1, std::memory_order_release);
+    ext_workspace_manager_v1_destroy(manager);
 }
 
-void WindowStateProvider::pump_events() noexcept {
-    if (!m_display) return;
-    wl_display_dispatch_pending(m_display);
-    // wl_display_roundtrip(m_display);
+// ext_workspace_group_handle_v1 callbacks
+
+void WindowStateProvider::on_group_capabilities(
+    void* /*data*/, ext_workspace_group_handle_v1* /*group*/, u32 /*capabilities*/) {}
+
+void WindowStateProvider::on_group_output_enter(
+    void* /*data*/, ext_workspace_group_handle_v1* /*group*/, wl_output* /*output*/) {}
+
+void WindowStateProvider::on_group_output_leave(
+    void* /*data*/, ext_workspace_group_handle_v1* /*group*/, wl_output* /*output*/) {}
+
+void WindowStateProvider::on_group_workspace_enter(
+    void* data, ext_workspace_group_handle_v1* /*group*/, ext_workspace_handle_v1* handle)
+{
+    auto* workspace = static_cast<Workspace*>(ext_workspace_handle_v1_get_user_data(handle));
+    workspace->pending.group = static_cast<WorkspaceGroup*>(data)->id;
+    workspace->changed = true;
 }
 
-std::vector<WindowInfo> WindowStateProvider::get_open_windows() noexcept {
-    pump_events();
+void WindowStateProvider::on_group_workspace_leave(
+    void* /*data*/, ext_workspace_group_handle_v1* /*group*/, ext_workspace_handle_v1* /*workspace*/) {}
+
+void WindowStateProvider::on_group_removed(void* data, ext_workspace_group_handle_v1* handle) {
+    auto* group = static_cast<WorkspaceGroup*>(data);
+    ext_workspace_group_handle_v1_destroy(handle);
 
-    std::vector<WindowInfo> out;
-    out.reserve(m_by_handle.size());
-    for (auto& [_, cw] : m_by_handle) {
-        out.push_back(cw.info);
+    // groups are few and rarely removed, no need for an index
+    std::erase_if(group->self->m_workspace_groups, [&](const std::unique_ptr<WorkspaceGroup>& g) { return g.get() == group; });
+}
+
+// ext_workspace_handle_v1 callbacks, data is the handle's Workspace
+
+void WindowStateProvider::on_workspace_id(void* data, ext_workspace_handle_v1* /*handle*/, const char* id) {
+    auto* workspace = static_cast<Workspace*>(data);
+    workspace->pending.workspace_id = id ? id : "";
+    workspace->changed = true;
+}
+
+void WindowStateProvider::on_workspace_name(void* data, ext_workspace_handle_v1* /*handle*/, const char* name) {
+    auto* workspace = static_cast<Workspace*>(data);
+    workspace->pending.name = name ? name : "";
+    workspace->changed = true;
+}
+
+void WindowStateProvider::on_workspace_coordinates(
+    void* data, ext_workspace_handle_v1* /*handle*/, wl_array* coordinates)
+{
+    auto* workspace = static_cast<Workspace*>(data);
+    workspace->pending.coordinates.clear();
+    u32* coordinate;
+    wl_array_for_each(coordinate, coordinates) {
+        workspace->pending.coordinates.push_back(*coordinate);
+    }
+    workspace->changed = true;
+}
+
+void WindowStateProvider::on_workspace_state(void* data, ext_workspace_handle_v1* /*handle*/, u32 state) {
+    auto* workspace = static_cast<Workspace*>(data);
+    workspace->pending.state = state;
+    workspace->changed = true;
+}
+
+void WindowStateProvider::on_workspace_capabilities(
+    void* /*data*/, ext_workspace_handle_v1* /*handle*/, u32 /*capabilities*/) {}
+
+void WindowStateProvider::on_workspace_removed(void* data, ext_workspace_handle_v1* /*handle*/) {
+    // destroyed by the next done event, which applies the removal
+    static_cast<Workspace*>(data)->removed = true;
+}
+
+void WindowStateProvider::index_workspaces(Toplevel& toplevel) {
+    const WindowKey key = *toplevel.key;
+    const std::vector<ext_workspace_handle_v1*>& current = toplevel.cosmic_state.workspaces;
+    std::vector<ext_workspace_handle_v1*>& indexed = toplevel.indexed_workspaces;
+
+    auto slot_of = [](ext_workspace_handle_v1* handle) {
+        return static_cast<Workspace*>(ext_workspace_handle_v1_get_user_data(handle))->slot;
+    };
+
+    // a window is on one workspace or a few, these scans stay tiny
+    for (ext_workspace_handle_v1* handle : indexed) {
+        if (std::ranges::find(current, handle) == current.end()) {
+            m_workspace_index.leave(slot_of(handle), key);
+        }
+    }
+    for (ext_workspace_handle_v1* handle : current) {
+        if (std::ranges::find(indexed, handle) == indexed.end()) {
+            m_workspace_index.enter(slot_of(handle), key);
+        }
     }
-    return out;
+    indexed = current;
 }
 
-std::optional<WindowInfo> WindowStateProvider::get_window_state(std::string_view window_id) noexcept {
-    pump_events();
+void WindowStateProvider::apply_workspaces() {
+    bool any_removed = false;
+    {
+        std::unique_lock lock(m_mutex);
+
+        for (const std::unique_ptr<Workspace>& workspace : m_workspaces) {
+            if (workspace->removed) {
+                m_workspace_index.remove(workspace->slot);
+                any_removed = true;
+            }
+            else if (workspace->changed) {
+                WorkspaceInfo info = workspace->pending;
+                // the id is optional, the name is always sent
+                if (info.workspace_id.empty()) {
+                    info.workspace_id = info.name;
+                }
+                m_workspace_index.update(workspace->slot, info);
+                workspace->changed = false;
+            }
+        }
+        m_generation.fetch_add(1, std::memory_order_release);
+    }
+
+    if (!any_removed) {
+        return;
+    }
 
-    auto it_handle = m_handle_by_id.find(std::string(window_id));
-    if (it_handle == m_handle_by_id.end()) return std::nullopt;
+    // the index forgot them already, only the windows still refer to their handles
+    for (size_t i = 0; i < m_workspaces.size();) {
+        Workspace& workspace = *m_workspaces[i];
+        if (!workspace.removed) {
+            i++;
+            continue;
+        }
 
-    auto it = m_by_handle.find(it_handle->second);
-    if (it == m_by_handle.end()) return std::nullopt;
+        for (const std::unique_ptr<Toplevel>& toplevel : m_toplevels) {
+            std::erase(toplevel->cosmic_state.workspaces, workspace.handle);
+            std::erase(toplevel->indexed_workspaces, workspace.handle);
+        }
+        ext_workspace_handle_v1_destroy(workspace.handle);
 
-    return it->second.info;
+        // swap-remove, workspace is freed here
+        if (i + 1 != m_workspaces.size()) {
+            m_workspaces[i] = std::move(m_workspaces.back());
+            m_workspaces[i]->index = i;
+        }
+        m_workspaces.pop_back();
+    }
 }
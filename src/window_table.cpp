@@ -0,0 +1,155 @@
+#include "window_table.hpp"
+
+u32 StringInterner::intern(std::string_view str) {
+    if (auto it = m_ids.find(str); it != m_ids.end()) {
+        m_entries[it->second].refs++;
+        return it->second;
+    }
+
+    u32 id;
+    if (!m_free.empty()) {
+        id = m_free.back();
+        m_free.pop_back();
+        m_entries[id].str.assign(str);
+    }
+    else {
+        id = static_cast<u32>(m_entries.size());
+        m_entries.push_back(Entry { .str = std::string(str) });
+    }
+
+    m_entries[id].refs = 1;
+    m_ids.emplace(m_entries[id].str, id);
+    return id;
+}
+
+void StringInterner::release(u32 id) noexcept {
+    Entry& entry = m_entries[id];
+    if (--entry.refs > 0) {
+        return;
+    }
+
+    // the key views the entry, remove it before the string goes away
+    m_ids.erase(entry.str);
+    // the capacity is kept for the next string taking this id
+    entry.str.clear();
+    m_free.push_back(id);
+}
+
+void WindowTable::index_id(u32 slot) {
+    const std::string& window_id = m_slots[slot].window_id;
+    // identifiers are unique per toplevel, a window without one is only reachable by key
+    if (window_id.empty()) {
+        return;
+    }
+
+    // a duplicate takes over the entry, whose key must then view the new slot's string
+    m_slot_by_id.erase(window_id);
+    m_slot_by_id.emplace(window_id, slot);
+}
+
+void WindowTable::unindex_id(u32 slot) noexcept {
+    auto it = m_slot_by_id.find(m_slots[slot].window_id);
+    if (it != m_slot_by_id.end() && it->second == slot) {
+        m_slot_by_id.erase(it);
+    }
+}
+
+WindowKey WindowTable::insert(const WindowInfo& info) {
+    u32 slot;
+    if (!m_free_slots.empty()) {
+        slot = m_free_slots.back();
+        m_free_slots.pop_back();
+    }
+    else {
+        slot = static_cast<u32>(m_slots.size());
+        m_slots.push_back(Slot { .window_id = {}, .row = 0, .generation = 0 });
+    }
+
+    // a reused slot keeps the capacity of its previous identifier
+    m_slots[slot].window_id.assign(info.window_id);
+    m_slots[slot].row = static_cast<u32>(m_rows.size());
+    index_id(slot);
+
+    m_rows.push_back(Row {
+        .title = m_strings.intern(info.title),
+        .app_id = m_strings.intern(info.app_id),
+        .slot = slot,
+    });
+
+    return WindowKey { .slot = slot, .generation = m_slots[slot].generation };
+}
+
+bool WindowTable::update(WindowKey key, const WindowInfo& info) {
+    if (!valid(key)) {
+        return false;
+    }
+    Slot& slot = m_slots[key.slot];
+    Row& row = m_rows[slot.row];
+
+    if (slot.window_id != info.window_id) {
+        unindex_id(key.slot);
+        slot.window_id.assign(info.window_id);
+        index_id(key.slot);
+    }
+
+    // interning the new string first keeps it alive when old and new are the same
+    if (m_strings.get(row.title) != info.title) {
+        const u32 title = m_strings.intern(info.title);
+        m_strings.release(row.title);
+        row.title = title;
+    }
+    if (m_strings.get(row.app_id) != info.app_id) {
+        const u32 app_id = m_strings.intern(info.app_id);
+        m_strings.release(row.app_id);
+        row.app_id = app_id;
+    }
+
+    return true;
+}
+
+bool WindowTable::erase(WindowKey key) noexcept {
+    if (!valid(key)) {
+        return false;
+    }
+
+    const u32 index = m_slots[key.slot].row;
+    const Row& row = m_rows[index];
+
+    unindex_id(key.slot);
+    m_strings.release(row.title);
+    m_strings.release(row.app_id);
+
+    // fill the hole with the last row and point its slot at the new position
+    if (index + 1 != m_rows.size()) {
+        m_rows[index] = m_rows.back();
+        m_slots[m_rows[index].slot].row = index;
+    }
+    m_rows.pop_back();
+
+    m_slots[key.slot].window_id.clear();
+    m_slots[key.slot].generation++;
+    m_free_slots.push_back(key.slot);
+    return true;
+}
+
+void WindowTable::clear() noexcept {
+    while (!m_rows.empty()) {
+        const u32 slot = m_rows.back().slot;
+        erase(WindowKey { .slot = slot, .generation = m_slots[slot].generation });
+    }
+}
+
+std::optional<WindowView> WindowTable::find(std::string_view window_id) const noexcept {
+    auto it = m_slot_by_id.find(window_id);
+    if (it == m_slot_by_id.end()) {
+        return std::nullopt;
+    }
+    return view(m_rows[m_slots[it->second].row]);
+}
+
+std::optional<WindowView> WindowTable::get(WindowKey key) const noexcept {
+    if (!valid(key)) {
+        return std::nullopt;
+    }
+    return view(m_rows[m_slots[key.slot].row]);
+}
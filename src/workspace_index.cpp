@@ -0,0 +1,96 @@
+#include "workspace_index.hpp"
+
+#include <ext-workspace-v1-client-protocol.h>
+
+WorkspaceSlot WorkspaceIndex::add() {
+    WorkspaceSlot slot;
+    if (!m_free.empty()) {
+        slot = m_free.back();
+        m_free.pop_back();
+    }
+    else {
+        slot = static_cast<WorkspaceSlot>(m_entries.size());
+        m_entries.emplace_back();
+    }
+
+    return slot;
+}
+
+void WorkspaceIndex::update(WorkspaceSlot slot, const WorkspaceInfo& info) {
+    m_entries[slot].info = info;
+    m_entries[slot].announced = true;
+}
+
+void WorkspaceIndex::remove(WorkspaceSlot slot) noexcept {
+    Entry& entry = m_entries[slot];
+    for (WindowKey window : entry.windows) {
+        m_positions.erase(membership(slot, window));
+    }
+
+    // the capacity of the window list is kept for the next workspace taking this slot
+    entry.windows.clear();
+    entry.info = {};
+    entry.announced = false;
+    m_free.push_back(slot);
+}
+
+void WorkspaceIndex::enter(WorkspaceSlot slot, WindowKey window) {
+    std::vector<WindowKey>& windows = m_entries[slot].windows;
+    if (m_positions.try_emplace(membership(slot, window), static_cast<u32>(windows.size())).second) {
+        windows.push_back(window);
+    }
+}
+
+void WorkspaceIndex::leave(WorkspaceSlot slot, WindowKey window) noexcept {
+    auto it = m_positions.find(membership(slot, window));
+    if (it == m_positions.end()) {
+        return;
+    }
+
+    std::vector<WindowKey>& windows = m_entries[slot].windows;
+    const u32 position = it->second;
+    m_positions.erase(it);
+
+    // the last window takes the hole
+    if (position + 1 != windows.size()) {
+        windows[position] = windows.back();
+        m_positions[membership(slot, windows[position])] = position;
+    }
+    windows.pop_back();
+}
+
+void WorkspaceIndex::clear() noexcept {
+    m_entries.clear();
+    m_free.clear();
+    m_positions.clear();
+}
+
+std::vector<WorkspaceSlot> WorkspaceIndex::workspaces() const {
+    std::vector<WorkspaceSlot> out;
+    for (WorkspaceSlot slot = 0; slot < m_entries.size(); slot++) {
+        if (m_entries[slot].announced) {
+            out.push_back(slot);
+        }
+    }
+    return out;
+}
+
+std::optional<WorkspaceSlot> WorkspaceIndex::find(std::string_view workspace) const noexcept {
+    std::optional<WorkspaceSlot> by_name;
+    for (WorkspaceSlot slot = 0; slot < m_entries.size(); slot++) {
+        const Entry& entry = m_entries[slot];
+        if (!entry.announced) continue;
+
+        if (entry.info.workspace_id == workspace) {
+            return slot;
+        }
+        if (!by_name && entry.info.name == workspace) {
+            by_name = slot;
+        }
+    }
+    return by_name;
+}
+
+bool WorkspaceIndex::active(WorkspaceSlot slot) const noexcept {
+    return (m_entries[slot].info.state & EXT_WORKSPACE_HANDLE_V1_STATE_ACTIVE) != 0;
+}
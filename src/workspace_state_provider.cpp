@@ -0,0 +1,193 @@
+#include "workspace_state_provider.hpp"
+
+#include <algorithm>
+#include <tuple>
+#include <unordered_set>
+
+#include <spdlog/spdlog.h>
+
+#include <ext-workspace-v1-client-protocol.h>
+
+namespace {
+
+// Workspaces list their window count rather than their windows, so the model asks for the
+// windows of the one workspace it cares about instead of receiving every window twice
+nlohmann::json workspace_to_json(const WorkspaceIndex& index, WorkspaceSlot slot) {
+    const WorkspaceInfo& info = index.info(slot);
+    nlohmann::json out = {
+        {"workspace_id", info.workspace_id},
+        {"name",         info.name},
+        {"active",       index.active(slot)},
+        {"n_windows",    index.windows(slot).size()},
+    };
+
+    // rarely set, left out unless they are
+    if (info.state & EXT_WORKSPACE_HANDLE_V1_STATE_URGENT) {
+        out["urgent"] = true;
+    }
+    if (info.state & EXT_WORKSPACE_HANDLE_V1_STATE_HIDDEN) {
+        out["hidden"] = true;
+    }
+    return out;
+}
+
+}
+
+std::expected<void, StateProviderError> WorkspaceStateProvider::init() noexcept {
+    if (!m_windows.tracks_workspaces()) {
+        spdlog::info("Compositor does not support ext_workspace_manager_v1");
+        return std::unexpected(WorkspaceStateProviderError::WL_UNSUPPORTED_COMPOSITOR);
+    }
+
+    return {};
+}
+
+nlohmann::json WorkspaceStateProvider::processRequest(StateRequest req) noexcept {
+    nlohmann::json out;
+
+    if (req.kind != StateProviderKind::WORKSPACE) {
+        out["ok"] = false;
+        out["error"] = "wrong_provider_kind";
+        return out;
+    }
+
+    // the compositor can finish ext-workspace-v1 at any time, the cache is stale from then on
+    if (!m_windows.tracks_workspaces()) {
+        out["ok"] = false;
+        out["error"] = "workspaces_unavailable";
+        return out;
+    }
+
+    try {
+        if (!req.args.is_object()) {
+            out["ok"] = false;
+            out["error"] = "args_not_object";
+            return out;
+        }
+
+        if (!req.args.contains("action") || !req.args["action"].is_string()) {
+            out["ok"] = false;
+            out["error"] = "missing_or_invalid_action";
+            return out;
+        }
+
+        const std::string action = req.args["action"].get<std::string>();
+
+        const nlohmann::json params =
+            (req.args.contains("params") && req.args["params"].is_object())
+                ? req.args["params"]
+                : nlohmann::json::object();
+
+        if (action == "get_workspaces") {
+            nlohmann::json arr = nlohmann::json::array();
+            {
+                const WindowSnapshot snapshot = m_windows.snapshot();
+                const WorkspaceIndex& index = snapshot.workspaces();
+
+                // in the order the compositor lays them out
+                std::vector<WorkspaceSlot> slots = index.workspaces();
+                std::ranges::sort(slots, {}, [&](WorkspaceSlot slot) {
+                    return std::tie(index.info(slot).group, index.info(slot).coordinates);
+                });
+                for (WorkspaceSlot slot : slots) {
+                    arr.push_back(workspace_to_json(index, slot));
+                }
+            }
+
+            out["ok"] = true;
+            out["action"] = action;
+            out["workspaces"] = std::move(arr);
+            return out;
+        }
+
+        if (action == "get_workspace_windows") {
+            if (!params.contains("workspace_id") || !params["workspace_id"].is_string()) {
+                out["ok"] = false;
+                out["action"] = action;
+                out["error"] = "missing_or_invalid_workspace_id";
+                return out;
+            }
+
+            const std::string& workspace_id = params["workspace_id"].get_ref<const std::string&>();
+            std::optional<nlohmann::json> windows;
+            {
+                const WindowSnapshot snapshot = m_windows.snapshot();
+                if (const std::optional<WorkspaceSlot> slot = snapshot.workspaces().find(workspace_id)) {
+                    windows = nlohmann::json::array();
+                    for (WindowKey key : snapshot.workspaces().windows(*slot)) {
+                        if (const std::optional<WindowView> window = snapshot.get(key)) {
+                            windows->push_back(window_info_to_json(*window));
+                        }
+                    }
+                }
+            }
+
+            if (!windows) {
+                out["ok"] = false;
+                out["action"] = action;
+                out["error"] = "not_found";
+                out["workspace_id"] = workspace_id;
+                return out;
+            }
+
+            out["ok"] = true;
+            out["action"] = action;
+            out["workspace_id"] = workspace_id;
+            out["windows"] = std::move(*windows);
+            return out;
+        }
+
+        if (action == "get_active_workspace_windows") {
+            nlohmann::json workspaces = nlohmann::json::array();
+            nlohmann::json windows = nlohmann::json::array();
+            {
+                const WindowSnapshot snapshot = m_windows.snapshot();
+                const WorkspaceIndex& index = snapshot.workspaces();
+
+                // one workspace is active per output, sticky windows are on several of them
+                std::unordered_set<u32> seen;
+                for (WorkspaceSlot slot : index.workspaces()) {
+                    if (!index.active(slot)) continue;
+
+                    workspaces.push_back(index.info(slot).workspace_id);
+                    for (WindowKey key : index.windows(slot)) {
+                        if (!seen.insert(key.slot).second) continue;
+                        if (const std::optional<WindowView> window = snapshot.get(key)) {
+                            windows.push_back(window_info_to_json(*window));
+                        }
+                    }
+                }
+            }
+
+            out["ok"] = true;
+            out["action"] = action;
+            out["workspaces"] = std::move(workspaces);
+            out["windows"] = std::move(windows);
+            return out;
+        }
+
+        // Unknown action
+        out["ok"] = false;
+        out["error"] = "unknown_action";
+        out["action"] = action;
+        return out;
+    }
+    catch (const std::exception& e) {
+        spdlog::error("WorkspaceStateProvider::processRequest error: {}", e.what());
+        out["ok"] = false;
+        out["error"] = "exception";
+        return out;
+    }
+}
+
+std::vector<ActionSchema> WorkspaceStateProvider::actions() const noexcept {
+    return {
+        ActionSchema { .name = "get_workspaces", .params = {} },
+        ActionSchema { .name = "get_workspace_windows", .params = { "workspace_id" } },
+        ActionSchema { .name = "get_active_workspace_windows", .params = {} },
+    };
+}
+
+std::optional<u64> WorkspaceStateProvider::generation(const StateRequest& /*req*/) const noexcept {
+    return m_windows.generation();
+}